@@ -0,0 +1,89 @@
+#include "adaptive_poll.h"
+#include <math.h>
+
+
+
+bool common_adaptive_init(adaptive_config_t *cfg, adaptive_budget_t *budget, uint32_t base_reads_per_day, int64_t now_ms) {
+    if (cfg->abs_threshold_w <= 0) {
+        cfg->abs_threshold_w = ADAPTIVE_DEFAULT_ABS_THRESHOLD_W;
+    }
+    if (cfg->rel_threshold <= 0) {
+        cfg->rel_threshold = ADAPTIVE_DEFAULT_REL_THRESHOLD;
+    }
+    if (cfg->alpha <= 0 || cfg->alpha > 1) {
+        cfg->alpha = ADAPTIVE_DEFAULT_ALPHA;
+    }
+
+    budget->tokens = 0;
+    budget->tokens_per_ms = 0;
+    budget->capacity = 0;
+    budget->last_ms = now_ms;
+    budget->denied = 0;
+    if (cfg->min_interval_ms <= 0 || cfg->reads_per_day <= base_reads_per_day) {
+        cfg->min_interval_ms = 0;
+        return false;
+    }
+
+    budget->tokens_per_ms = (double)(cfg->reads_per_day - base_reads_per_day) / 86400000.0;
+    budget->capacity = budget->tokens_per_ms * ADAPTIVE_BURST_SECONDS * 1000.0;
+    budget->tokens = budget->capacity; // allow a burst right after boot
+    return true;
+}
+
+
+void common_adaptive_state_init(adaptive_state_t *state, int floor_interval_ms) {
+    state->interval_ms = floor_interval_ms;
+    state->level_w = 0;
+    state->initialized = false;
+}
+
+
+static bool budget_take(adaptive_budget_t *budget, int64_t now_ms) {
+    budget->tokens += (now_ms - budget->last_ms) * budget->tokens_per_ms;
+    if (budget->tokens > budget->capacity) {
+        budget->tokens = budget->capacity;
+    }
+    budget->last_ms = now_ms;
+    if (budget->tokens < 1.0) {
+        budget->denied++;
+        return false;
+    }
+    budget->tokens -= 1.0;
+    return true;
+}
+
+
+int common_adaptive_next_interval(const adaptive_config_t *cfg, adaptive_state_t *state, adaptive_budget_t *budget,
+                                  int floor_interval_ms, float power_w, int64_t now_ms) {
+    if (cfg->min_interval_ms <= 0 || cfg->min_interval_ms >= floor_interval_ms) {
+        return floor_interval_ms;
+    }
+
+    if (!state->initialized) {
+        state->level_w = power_w;
+        state->interval_ms = floor_interval_ms;
+        state->initialized = true;
+    } else {
+        float deviation = fabsf(power_w - state->level_w);
+        float threshold = fmaxf(cfg->abs_threshold_w, cfg->rel_threshold * fabsf(state->level_w));
+        if (deviation > threshold) {
+            // change point: follow the new level closely
+            state->level_w = power_w;
+            state->interval_ms = cfg->min_interval_ms;
+        } else {
+            state->level_w += cfg->alpha * (power_w - state->level_w);
+            state->interval_ms *= 2;
+        }
+    }
+
+    if (state->interval_ms >= floor_interval_ms) {
+        state->interval_ms = floor_interval_ms;
+    } else if (state->interval_ms < cfg->min_interval_ms) {
+        state->interval_ms = cfg->min_interval_ms;
+    }
+
+    if (state->interval_ms < floor_interval_ms && !budget_take(budget, now_ms)) {
+        return floor_interval_ms;
+    }
+    return state->interval_ms;
+}
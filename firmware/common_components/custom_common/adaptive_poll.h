@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Adaptive read/publish interval of a sensor, driven by the active power:
+//  - the power is compared against a smoothed level (EWMA), a deviation above
+//    max(abs_threshold_w, rel_threshold * level) is a change point: the level restarts at the new
+//    value and the interval drops to min_interval_ms
+//  - while the power stays within the threshold the interval doubles up to the slow floor
+//    (publish_interval_ms of the sensor)
+//  - every read earlier than the floor costs one token of a budget shared by all sensors, the
+//    budget refills with reads_per_day minus the reads of the fixed schedule, so reads (and
+//    messages) per day never exceed reads_per_day. Without tokens sensors fall back to the floor
+// No platform dependencies, time is passed in by the caller.
+
+#define ADAPTIVE_DEFAULT_ABS_THRESHOLD_W  20.0f
+#define ADAPTIVE_DEFAULT_REL_THRESHOLD    0.05f
+#define ADAPTIVE_DEFAULT_ALPHA            0.3f
+#define ADAPTIVE_BURST_SECONDS            3600    // budget can be saved up for this long
+
+typedef struct {
+    int min_interval_ms;            // fastest interval, 0 = adaptive mode off
+    uint32_t reads_per_day;         // budget of all sensors including the fixed schedule
+    float abs_threshold_w;          // 0 = ADAPTIVE_DEFAULT_ABS_THRESHOLD_W
+    float rel_threshold;            // 0 = ADAPTIVE_DEFAULT_REL_THRESHOLD
+    float alpha;                    // EWMA weight of a new sample, 0 = ADAPTIVE_DEFAULT_ALPHA
+} adaptive_config_t;
+
+// state of one sensor
+typedef struct {
+    int interval_ms;
+    float level_w;
+    bool initialized;
+} adaptive_state_t;
+
+// budget shared by all sensors
+typedef struct {
+    double tokens;
+    double capacity;
+    double tokens_per_ms;
+    int64_t last_ms;
+    uint32_t denied;                // accelerated reads refused due to empty budget
+} adaptive_budget_t;
+
+// Fill in defaults, returns false (adaptive mode off) when the budget does not even cover the
+// fixed schedule, base_reads_per_day = sum of 86400000 / publish_interval_ms of all sensors
+bool common_adaptive_init(adaptive_config_t *cfg, adaptive_budget_t *budget, uint32_t base_reads_per_day, int64_t now_ms);
+
+void common_adaptive_state_init(adaptive_state_t *state, int floor_interval_ms);
+
+// Feed a new power sample, returns interval until the next read (min_interval_ms..floor_interval_ms)
+int common_adaptive_next_interval(const adaptive_config_t *cfg, adaptive_state_t *state, adaptive_budget_t *budget,
+                                  int floor_interval_ms, float power_w, int64_t now_ms);
@@ -0,0 +1,242 @@
+#include "bus_capture.h"
+#include <string.h>
+
+
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (v >> (8 * i)) & 0xFF;
+    }
+}
+
+
+static void put_le64(uint8_t *p, int64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = ((uint64_t)v >> (8 * i)) & 0xFF;
+    }
+}
+
+
+static uint16_t get_le16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static int64_t get_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return (int64_t)v;
+}
+
+
+
+//=====================================================================
+// Decoder
+
+uint32_t common_capture_gap_us(uint32_t baud) {
+    return (uint32_t)(CAPTURE_GAP_CHARS_X2 * 10 * 1000000LL / (2LL * baud));
+}
+
+
+void common_capture_init(capture_decoder_t *d, uint8_t channel, uint32_t baud, uint32_t gap_us,
+                         capture_frame_cb_t cb, void *ctx) {
+    memset(d, 0, sizeof(*d));
+    d->baud = baud;
+    d->gap_us = gap_us > 0 ? gap_us : common_capture_gap_us(baud);
+    d->bit_ns = 1000000000LL / baud;
+    d->cb = cb;
+    d->ctx = ctx;
+    d->level = 1;
+    d->frame.channel = channel;
+}
+
+
+// middle of a bit of the current byte: 0 = start bit, 1..8 = data, 9 = stop bit
+static int64_t sample_time(const capture_decoder_t *d, int bit) {
+    return d->byte_start_us + (2 * bit + 1) * d->bit_ns / 2000;
+}
+
+
+static int level_at(const capture_decoder_t *d, int64_t t_us) {
+    int level = 0; // start bit
+    for (int e = 0; e < d->edge_count && d->edge_us[e] <= t_us; e++) {
+        level = d->edge_level[e];
+    }
+    return level;
+}
+
+
+static void emit_frame(capture_decoder_t *d) {
+    if (d->frame.count == 0) {
+        return;
+    }
+    if (d->lost) {
+        d->frame.flags |= CAPTURE_FRAME_AFTER_LOSS;
+        d->lost = false;
+    }
+    d->cb(&d->frame, d->ctx);
+    d->frame.count = 0;
+    d->frame.flags = 0;
+}
+
+
+static void finish_byte(capture_decoder_t *d) {
+    uint8_t value = 0;
+    for (int b = 0; b < 8; b++) {
+        if (level_at(d, sample_time(d, b + 1))) {
+            value |= 1 << b;
+        }
+    }
+    bool framing_error = level_at(d, sample_time(d, 9)) == 0;
+
+    if (d->frame.count == CAPTURE_MAX_FRAME) {
+        d->frame.flags |= CAPTURE_FRAME_TRUNCATED;
+        emit_frame(d);
+    }
+    if (d->frame.count == 0) {
+        d->frame.start_us = d->byte_start_us;
+    }
+    capture_byte_t *byte = &d->frame.bytes[d->frame.count++];
+    byte->value = value;
+    byte->flags = framing_error ? CAPTURE_BYTE_FRAMING_ERROR : 0;
+    byte->offset_us = (uint32_t)(d->byte_start_us - d->frame.start_us);
+
+    d->in_byte = false;
+    d->last_byte_end_us = d->byte_start_us + 10 * d->bit_ns / 1000;
+}
+
+
+void common_capture_edge(capture_decoder_t *d, int64_t t_us, int level) {
+    if (d->in_byte && t_us >= sample_time(d, 9)) {
+        finish_byte(d);
+    }
+    if (!d->in_byte) {
+        if (level == 0 && d->level == 1) {
+            // start bit, after a silence longer than the gap it belongs to a new frame
+            if (d->frame.count > 0 && t_us - d->last_byte_end_us > d->gap_us) {
+                emit_frame(d);
+            }
+            d->in_byte = true;
+            d->byte_start_us = t_us;
+            d->edge_count = 0;
+        }
+    } else if (d->edge_count < (int)(sizeof(d->edge_us) / sizeof(d->edge_us[0]))) {
+        d->edge_us[d->edge_count] = t_us;
+        d->edge_level[d->edge_count++] = level;
+    }
+    d->level = level;
+}
+
+
+void common_capture_idle(capture_decoder_t *d, int64_t now_us) {
+    if (d->in_byte && now_us >= sample_time(d, 9)) {
+        finish_byte(d);
+    }
+    if (!d->in_byte && d->frame.count > 0 && now_us - d->last_byte_end_us > d->gap_us) {
+        emit_frame(d);
+    }
+}
+
+
+void common_capture_lost(capture_decoder_t *d) {
+    d->in_byte = false;
+    emit_frame(d);
+    d->lost = true;
+    d->level = 1; // unknown, wait for the next falling edge
+}
+
+
+
+//=====================================================================
+// Stream format
+
+size_t common_capture_encode_header(uint8_t *buf, uint32_t baud, uint32_t gap_us) {
+    memcpy(buf, CAPTURE_MAGIC, 8);
+    put_le32(&buf[8], baud);
+    put_le32(&buf[12], gap_us);
+    return CAPTURE_HEADER_SIZE;
+}
+
+
+static void encode_record_header(uint8_t *buf, uint8_t type, uint8_t channel, uint8_t flags, uint16_t count, int64_t t_us) {
+    buf[0] = type;
+    buf[1] = channel;
+    buf[2] = flags;
+    buf[3] = 0;
+    put_le16(&buf[4], count);
+    put_le16(&buf[6], 0);
+    put_le64(&buf[8], t_us);
+}
+
+
+size_t common_capture_encode_frame(uint8_t *buf, const capture_frame_t *frame) {
+    encode_record_header(buf, CAPTURE_RECORD_FRAME, frame->channel, frame->flags, frame->count, frame->start_us);
+    uint8_t *p = &buf[CAPTURE_RECORD_HEADER_SIZE];
+    for (int i = 0; i < frame->count; i++) {
+        p[0] = frame->bytes[i].value;
+        p[1] = frame->bytes[i].flags;
+        put_le32(&p[2], frame->bytes[i].offset_us);
+        p += CAPTURE_BYTE_SIZE;
+    }
+    return p - buf;
+}
+
+
+size_t common_capture_encode_lost(uint8_t *buf, uint8_t channel, uint32_t lost_edges, int64_t t_us) {
+    encode_record_header(buf, CAPTURE_RECORD_LOST, channel, 0, lost_edges > UINT16_MAX ? UINT16_MAX : lost_edges, t_us);
+    return CAPTURE_RECORD_HEADER_SIZE;
+}
+
+
+bool common_capture_parse_header(const uint8_t *buf, uint32_t *baud, uint32_t *gap_us) {
+    if (memcmp(buf, CAPTURE_MAGIC, 8) != 0) {
+        return false;
+    }
+    *baud = get_le32(&buf[8]);
+    *gap_us = get_le32(&buf[12]);
+    return *baud > 0;
+}
+
+
+size_t common_capture_record_size(const uint8_t *buf) {
+    switch (buf[0]) {
+        case CAPTURE_RECORD_FRAME: return CAPTURE_RECORD_HEADER_SIZE + get_le16(&buf[4]) * CAPTURE_BYTE_SIZE;
+        case CAPTURE_RECORD_LOST:  return CAPTURE_RECORD_HEADER_SIZE;
+        default:                   return 0;
+    }
+}
+
+
+int common_capture_parse_record(const uint8_t *buf, size_t len, capture_frame_t *frame) {
+    size_t size = len >= CAPTURE_RECORD_HEADER_SIZE ? common_capture_record_size(buf) : 0;
+    if (size == 0 || size > len || get_le16(&buf[4]) > (buf[0] == CAPTURE_RECORD_FRAME ? CAPTURE_MAX_FRAME : UINT16_MAX)) {
+        return 0;
+    }
+    frame->channel = buf[1];
+    frame->flags = buf[2];
+    frame->count = get_le16(&buf[4]);
+    frame->start_us = get_le64(&buf[8]);
+    if (buf[0] == CAPTURE_RECORD_FRAME) {
+        const uint8_t *p = &buf[CAPTURE_RECORD_HEADER_SIZE];
+        for (int i = 0; i < frame->count; i++) {
+            frame->bytes[i].value = p[0];
+            frame->bytes[i].flags = p[1];
+            frame->bytes[i].offset_us = get_le32(&p[2]);
+            p += CAPTURE_BYTE_SIZE;
+        }
+    }
+    return buf[0];
+}
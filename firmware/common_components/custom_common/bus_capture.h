@@ -0,0 +1,97 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Decoder and file format of a passive bus capture (see bus_sniffer.h), shared with the host
+// tool tools/bus-capture. No platform dependencies.
+//
+// The input are the edges of a listen-only line with their time in us. Bytes are decoded as
+// 8N1, LSB first, idle high: a falling edge on the idle line is a start bit, every bit is sampled
+// in its middle. A low stop bit is a framing error (collision, break, wrong baud rate).
+// Bytes are grouped into frames: a silence of more than gap_us (Modbus RTU: 3.5 character times)
+// between the end of a byte and the next start bit starts a new frame.
+//
+// Stream / file format (little endian):
+//   header   u8[8] CAPTURE_MAGIC, u32 baud, u32 gap_us
+//   record   u8 type, u8 channel, u8 flags, u8 reserved, u16 byte count, u16 reserved, i64 start (us uptime)
+//            CAPTURE_RECORD_FRAME: count x (u8 value, u8 byte flags, u32 start of the byte in us after the frame start)
+//            CAPTURE_RECORD_LOST:  no bytes, count = number of lost edges (buffer overflow) before start
+
+#define CAPTURE_MAGIC               "PZCAP01"      // 8 bytes incl. terminating 0
+#define CAPTURE_HEADER_SIZE         16
+#define CAPTURE_RECORD_HEADER_SIZE  16
+#define CAPTURE_BYTE_SIZE           6
+#define CAPTURE_MAX_FRAME           256
+#define CAPTURE_MAX_RECORD_SIZE     (CAPTURE_RECORD_HEADER_SIZE + CAPTURE_MAX_FRAME * CAPTURE_BYTE_SIZE)
+#define CAPTURE_GAP_CHARS_X2        7               // 3.5 characters
+
+#define CAPTURE_RECORD_FRAME        1
+#define CAPTURE_RECORD_LOST         2
+
+#define CAPTURE_BYTE_FRAMING_ERROR  0x01            // stop bit low
+#define CAPTURE_FRAME_TRUNCATED     0x01            // more than CAPTURE_MAX_FRAME bytes without gap
+#define CAPTURE_FRAME_AFTER_LOSS    0x02            // edges were lost before this frame
+
+typedef struct {
+    uint8_t value;
+    uint8_t flags;                  // CAPTURE_BYTE_*
+    uint32_t offset_us;             // start bit after the frame start
+} capture_byte_t;
+
+typedef struct {
+    uint8_t channel;
+    uint8_t flags;                  // CAPTURE_FRAME_*
+    uint16_t count;
+    int64_t start_us;               // start bit of the first byte
+    capture_byte_t bytes[CAPTURE_MAX_FRAME];
+} capture_frame_t;
+
+typedef void (*capture_frame_cb_t)(const capture_frame_t *frame, void *ctx);
+
+// Decoder state of one line
+typedef struct {
+    uint32_t baud;
+    uint32_t gap_us;
+    int64_t bit_ns;
+    capture_frame_cb_t cb;
+    void *ctx;
+
+    int level;                      // line level after the last edge
+    bool in_byte;
+    int64_t byte_start_us;
+    int64_t edge_us[10];            // edges within the current byte (after the start bit)
+    uint8_t edge_level[10];
+    int edge_count;
+    int64_t last_byte_end_us;
+    bool lost;                      // edges lost since the last frame
+    capture_frame_t frame;
+} capture_decoder_t;
+
+// gap_us 0 = 3.5 character times at the baud rate
+void common_capture_init(capture_decoder_t *d, uint8_t channel, uint32_t baud, uint32_t gap_us,
+                         capture_frame_cb_t cb, void *ctx);
+
+// Edge of the line at t_us, level after the edge (0/1)
+void common_capture_edge(capture_decoder_t *d, int64_t t_us, int level);
+
+// No edge until now_us: completes a pending byte and a frame once the gap has passed
+void common_capture_idle(capture_decoder_t *d, int64_t now_us);
+
+// Edges were lost (buffer overflow), the current byte is dropped and the next frame is flagged
+void common_capture_lost(capture_decoder_t *d);
+
+// Default frame gap of the baud rate
+uint32_t common_capture_gap_us(uint32_t baud);
+
+// Encoding, returns the length (buf must hold CAPTURE_HEADER_SIZE / CAPTURE_MAX_RECORD_SIZE)
+size_t common_capture_encode_header(uint8_t *buf, uint32_t baud, uint32_t gap_us);
+size_t common_capture_encode_frame(uint8_t *buf, const capture_frame_t *frame);
+size_t common_capture_encode_lost(uint8_t *buf, uint8_t channel, uint32_t lost_edges, int64_t t_us);
+
+// Decoding (host tool), false on an invalid header / record
+bool common_capture_parse_header(const uint8_t *buf, uint32_t *baud, uint32_t *gap_us);
+// Length of the record starting at buf from its header (at least CAPTURE_RECORD_HEADER_SIZE bytes)
+size_t common_capture_record_size(const uint8_t *buf);
+// Record of type CAPTURE_RECORD_FRAME or CAPTURE_RECORD_LOST (count = lost edges), returns the type, 0 = invalid
+int common_capture_parse_record(const uint8_t *buf, size_t len, capture_frame_t *frame);
@@ -0,0 +1,165 @@
+#include "bus_model.h"
+#include "pzem_bus.h"
+#include <math.h>
+
+#define TAG "common_busmodel"
+
+
+
+uint32_t common_busmodel_transaction_us(const ModbusSensor *sensor, uint16_t request_bytes, uint16_t response_bytes, bool reconfig) {
+    const double char_us = (BUS_BITS_PER_CHAR - 1 + common_sensor_profile(sensor)->stop_bits) * 1e6 / PZ_BAUD_RATE;
+    double us = (request_bytes + response_bytes) * char_us
+              + 2 * 3.5 * char_us
+              + BUS_TURNAROUND_US;
+    if (reconfig) {
+        us += BUS_RECONFIG_US;
+    }
+    if (sensor->use_rs485) {
+        us += RS485_GAP_MS * 1000;
+    }
+    return (uint32_t)us;
+}
+
+
+uint32_t common_busmodel_read_us(const ModbusSensor *sensor, uint16_t count, bool reconfig) {
+    // request: addr, fc, reg(2), count(2), crc(2) / response: addr, fc, byte count, data, crc(2)
+    return common_busmodel_transaction_us(sensor, 8, 5 + 2 * count, reconfig);
+}
+
+
+uint32_t common_busmodel_plan_us(const ModbusSensor *sensor, uint16_t fields, bool reconfig) {
+    pzem_plan_t plan;
+    if (!PzemCompilePlan(common_sensor_profile(sensor), fields, sensor->modbus_addr, &plan)) {
+        return 0;
+    }
+    uint32_t us = 0;
+    for (int i = 0; i < plan.read_count; i++) {
+        us += common_busmodel_read_us(sensor, plan.reads[i].count, reconfig);
+    }
+    return us;
+}
+
+
+bool common_busmodel_needs_reconfig(const ModbusSensor *sensors, int count) {
+    for (int i = 1; i < count; i++) {
+        if (sensors[i].tx_pin != sensors[0].tx_pin ||
+            sensors[i].rx_pin != sensors[0].rx_pin ||
+            sensors[i].use_rs485 != sensors[0].use_rs485 ||
+            sensors[i].rs485_dir_pin != sensors[0].rs485_dir_pin ||
+            common_sensor_profile(&sensors[i])->stop_bits != common_sensor_profile(&sensors[0])->stop_bits) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static double total_demand(const ModbusSensor *sensors, int count, const int *intervals_ms, bool reconfig, double fixed) {
+    double total = fixed;
+    for (int i = 0; i < count; i++) {
+        total += common_busmodel_plan_us(&sensors[i], PZ_ALL_FIELDS, reconfig) / (intervals_ms[i] * 1000.0);
+    }
+    return total;
+}
+
+
+// utilization of the reads that are not stretched
+static double fixed_demand(const ModbusSensor *sensors, int count, bool reconfig, const bus_fixed_demand_t *demand) {
+    static const bus_fixed_demand_t none = { 0 };
+    if (demand == NULL) {
+        demand = &none;
+    }
+    double fixed = 0;
+    // extra reads (adaptive intervals) are limited by their own budget
+    if (count > 0 && demand->extra_reads_per_day > 0) {
+        double avg_us = 0;
+        for (int i = 0; i < count; i++) {
+            avg_us += common_busmodel_plan_us(&sensors[i], PZ_ALL_FIELDS, reconfig);
+        }
+        fixed = demand->extra_reads_per_day * (avg_us / count) / 86400e6;
+    }
+    for (int i = 0; i < count; i++) {
+        const ModbusSensor *sensor = &sensors[i];
+        // fast lanes (partial reads)
+        if (sensor->fast_interval_ms > 0 && sensor->fast_plan.fields != 0) {
+            fixed += common_busmodel_plan_us(sensor, sensor->fast_plan.fields, reconfig) / (sensor->fast_interval_ms * 1000.0);
+        }
+        // alarm checks read the alarm register when the last sample is older than the check interval
+        if (demand->alarm_interval_ms > 0 && sensor->alarm_threshold_w != 0 &&
+            (common_sensor_profile(sensor)->caps & PZ_CAP_POWER_ALARM)) {
+            fixed += common_busmodel_plan_us(sensor, PZ_FIELD_BIT(PZ_FIELD_ALARM), reconfig) / (demand->alarm_interval_ms * 1000.0);
+        }
+        if (demand->live_interval_ms > 0) {
+            fixed += common_busmodel_plan_us(sensor, PZ_ALL_FIELDS, reconfig) / (demand->live_interval_ms * 1000.0);
+        }
+        // gateway FC04 requests share one refresh per max age
+        if (demand->gateway_max_age_ms > 0) {
+            fixed += common_busmodel_plan_us(sensor, PZ_ALL_FIELDS, reconfig) / (demand->gateway_max_age_ms * 1000.0);
+        }
+    }
+    if (demand->gateway_max_age_ms > 0) {
+        fixed += BUS_GATEWAY_RESERVE;
+    }
+    return fixed;
+}
+
+
+bus_admission_t common_busmodel_admit(const ModbusSensor *sensors, int count, int *intervals_ms,
+                                      float max_utilization, const bus_fixed_demand_t *demand,
+                                      float *utilization, float *fixed_utilization) {
+    bool reconfig = common_busmodel_needs_reconfig(sensors, count);
+    bus_admission_t result = BUS_ADMIT_OK;
+    const double fixed = fixed_demand(sensors, count, reconfig, demand);
+
+    const sensor_priority_t classes[] = { SENSOR_PRIO_LOW, SENSOR_PRIO_NORMAL, SENSOR_PRIO_HIGH };
+    for (int c = 0; c < 3; c++) {
+        double total = total_demand(sensors, count, intervals_ms, reconfig, fixed);
+        if (total <= max_utilization) {
+            break;
+        }
+
+        double class_demand = 0;
+        for (int i = 0; i < count; i++) {
+            if (sensors[i].priority == classes[c]) {
+                class_demand += common_busmodel_plan_us(&sensors[i], PZ_ALL_FIELDS, reconfig) / (intervals_ms[i] * 1000.0);
+            }
+        }
+        if (class_demand == 0) {
+            continue;
+        }
+
+        double available = max_utilization - (total - class_demand);
+        double factor = available > 0 ? class_demand / available : BUS_MAX_STRETCH;
+        if (classes[c] == SENSOR_PRIO_HIGH) {
+            result = BUS_ADMIT_REJECTED;
+        } else {
+            result = BUS_ADMIT_DEGRADED;
+            if (factor > BUS_MAX_STRETCH) {
+                factor = BUS_MAX_STRETCH;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            if (sensors[i].priority == classes[c]) {
+                intervals_ms[i] = (int)ceil(intervals_ms[i] * factor);
+            }
+        }
+    }
+
+    if (utilization != NULL) {
+        *utilization = total_demand(sensors, count, intervals_ms, reconfig, fixed);
+    }
+    if (fixed_utilization != NULL) {
+        *fixed_utilization = fixed;
+    }
+    return result;
+}
+
+
+const char *common_busmodel_admission_str(bus_admission_t admission) {
+    switch (admission) {
+        case BUS_ADMIT_OK:       return "ok";
+        case BUS_ADMIT_DEGRADED: return "degraded";
+        case BUS_ADMIT_REJECTED: return "rejected";
+    }
+    return "unknown";
+}
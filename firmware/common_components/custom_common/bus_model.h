@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "config_types.h"
+
+// Bus time model of the shared 9600 baud bus and admission control of the sensor intervals.
+//
+// One transaction takes
+//   (request + response bytes) * char time            10 bit per char (8N1), 11 for 8N2 device types
+// + 2 * 3.5 char times                                 silent interval before each frame (Modbus RTU)
+// + BUS_TURNAROUND_US                                  response latency of the module
+// + BUS_RECONFIG_US when the UART is re-initialized    (sensors with different pins)
+// + RS485_GAP_MS on RS485                              enforced gap after the previous transaction
+//
+// The demand of a sensor is transaction time / interval, the sum over all sensors is the planned
+// utilization. When it exceeds the admission limit the intervals are stretched class by class,
+// starting with SENSOR_PRIO_LOW, up to BUS_MAX_STRETCH times the configured interval. If the high
+// priority sensors alone still do not fit, the configuration is rejected (the intervals are
+// stretched anyway so the node keeps working, degraded).
+// Reads besides the publish schedule are fixed demand that is not stretched: the adaptive budget,
+// the fast lanes, the alarm checks, the live view (planned as if a viewer was always connected)
+// and the Modbus TCP gateway.
+
+#define BUS_BITS_PER_CHAR     10
+#define BUS_TURNAROUND_US     20000   // PZEM answers within ~10-20 ms, compare with measured read durations
+#define BUS_RECONFIG_US       1000    // uart driver re-install when switching pins
+#define BUS_MAX_STRETCH       10      // lower classes are slowed down at most this much
+#define BUS_GATEWAY_RESERVE   0.05f   // Modbus TCP FC03/FC06 requests passed through to the bus
+
+typedef enum {
+    BUS_ADMIT_OK = 0,                 // fits as configured
+    BUS_ADMIT_DEGRADED,               // lower priority intervals stretched
+    BUS_ADMIT_REJECTED,               // high priority sensors do not fit, all intervals stretched
+} bus_admission_t;
+
+// Demand on the bus besides the publish schedule of the sensors
+typedef struct {
+    uint32_t extra_reads_per_day;     // full reads spread over all sensors (adaptive budget)
+    int alarm_interval_ms;            // alarm register of sensors with alarm_threshold_w (power_alarm.h), 0 = no checks
+    int live_interval_ms;             // all sensors while a live viewer is connected (live_stream.h), 0 = no live view
+    int gateway_max_age_ms;           // Modbus TCP FC04 refresh of a sensor at most this often (modbus_gateway.h), 0 = no gateway
+} bus_fixed_demand_t;
+
+// Modeled duration of one transaction with the sensor in us
+uint32_t common_busmodel_transaction_us(const ModbusSensor *sensor, uint16_t request_bytes, uint16_t response_bytes, bool reconfig);
+
+// Modeled duration of reading count registers (FC03/FC04) in us
+uint32_t common_busmodel_read_us(const ModbusSensor *sensor, uint16_t count, bool reconfig);
+
+// Modeled duration of reading the values fields (PZ_FIELD_BIT) with the read plan of the device
+// profile of the sensor in us, 0 if the type measures none of them
+uint32_t common_busmodel_plan_us(const ModbusSensor *sensor, uint16_t fields, bool reconfig);
+
+// True if sensors use different pins (or framing), so the UART is re-initialized for every transaction
+bool common_busmodel_needs_reconfig(const ModbusSensor *sensors, int count);
+
+// Fit the sensor intervals into the bus: intervals_ms holds the requested interval (> 0) of every sensor
+// and receives the admitted interval. Planned utilization after admission is stored in utilization
+// (may be NULL), the part of it that is fixed demand (fast lanes and demand, may be NULL) in
+// fixed_utilization (may be NULL).
+bus_admission_t common_busmodel_admit(const ModbusSensor *sensors, int count, int *intervals_ms,
+                                      float max_utilization, const bus_fixed_demand_t *demand,
+                                      float *utilization, float *fixed_utilization);
+
+const char *common_busmodel_admission_str(bus_admission_t admission);
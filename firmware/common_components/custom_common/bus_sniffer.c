@@ -0,0 +1,223 @@
+#include "bus_sniffer.h"
+#include "bus_capture.h"
+#include "pzem004tv3.h"
+#include "task_layout.h"
+#include "memory_budget.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "soc/gpio_periph.h"
+#include "soc/io_mux_reg.h"
+
+#define TAG "common_sniffer"
+
+// edge as seen by the interrupt, time truncated to 32 bit (extended by the task)
+typedef struct {
+    uint32_t t_us;
+    uint8_t channel;
+    uint8_t level;
+} edge_t;
+
+static sniffer_config_t s_cfg;
+static bool s_started = false;
+
+static edge_t s_ring[SNIFFER_EDGE_RING];
+static volatile uint32_t s_head = 0;        // written by the interrupt
+static volatile uint32_t s_tail = 0;        // written by the task
+static volatile uint32_t s_lost = 0;
+static volatile bool s_active = false;      // client connected
+
+static capture_decoder_t s_decoders[SNIFFER_MAX_CHANNELS];
+static uint8_t s_record[CAPTURE_MAX_RECORD_SIZE];
+static int s_client_fd = -1;
+static sniffer_stats_t s_stats;
+
+static StackType_t s_task_stack[SNIFFER_TASK_STACK];
+static StaticTask_t s_task_buffer;
+
+
+
+static void IRAM_ATTR edge_isr(void *arg) {
+    uint32_t t = (uint32_t)esp_timer_get_time();
+    int channel = (int)(intptr_t)arg;
+    if (!s_active) {
+        return;
+    }
+    uint32_t head = s_head;
+    if (head - s_tail >= SNIFFER_EDGE_RING) {
+        s_lost++;
+        return;
+    }
+    edge_t *edge = &s_ring[head % SNIFFER_EDGE_RING];
+    edge->t_us = t;
+    edge->channel = channel;
+    edge->level = gpio_get_level(s_cfg.pins[channel]);
+    s_head = head + 1;
+}
+
+
+static bool send_all(const uint8_t *data, size_t len) {
+    while (len > 0 && s_client_fd >= 0) {
+        int n = send(s_client_fd, data, len, 0);
+        if (n <= 0) {
+            ESP_LOGW(TAG, "client gone (errno %d)", errno);
+            close(s_client_fd);
+            s_client_fd = -1;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return s_client_fd >= 0;
+}
+
+
+static void frame_cb(const capture_frame_t *frame, void *ctx) {
+    s_stats.frames++;
+    s_stats.bytes += frame->count;
+    for (int i = 0; i < frame->count; i++) {
+        s_stats.framing_errors += (frame->bytes[i].flags & CAPTURE_BYTE_FRAMING_ERROR) != 0;
+    }
+    send_all(s_record, common_capture_encode_frame(s_record, frame));
+}
+
+
+static bool client_closed(void) {
+    uint8_t dummy;
+    int n = recv(s_client_fd, &dummy, 1, MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+
+// feed the edges of the ring to the decoders until the client is gone
+static void capture(void) {
+    const uint32_t gap_us = common_capture_gap_us(s_cfg.baud);
+    for (int c = 0; c < SNIFFER_MAX_CHANNELS; c++) {
+        common_capture_init(&s_decoders[c], c, s_cfg.baud, gap_us, frame_cb, NULL);
+    }
+    common_capture_encode_header(s_record, s_cfg.baud, gap_us);
+    if (!send_all(s_record, CAPTURE_HEADER_SIZE)) {
+        return;
+    }
+
+    uint32_t lost_seen = s_lost;
+    s_tail = s_head;
+    s_active = true;
+    s_stats.client = true;
+    while (s_client_fd >= 0) {
+        // time before the head: edges not taken in this round are younger than now
+        int64_t now = esp_timer_get_time();
+        uint32_t head = s_head;
+        while (s_tail != head && s_client_fd >= 0) {
+            const edge_t *edge = &s_ring[s_tail % SNIFFER_EDGE_RING];
+            // edges are within a few ms of now, the signed difference extends them to 64 bit
+            int64_t t = now + (int32_t)(edge->t_us - (uint32_t)now);
+            common_capture_edge(&s_decoders[edge->channel], t, edge->level);
+            s_tail++;
+        }
+
+        uint32_t lost = s_lost;
+        if (lost != lost_seen) {
+            s_stats.lost_edges += lost - lost_seen;
+            for (int c = 0; c < SNIFFER_MAX_CHANNELS; c++) {
+                if (s_cfg.pins[c] != GPIO_NUM_NC) {
+                    common_capture_lost(&s_decoders[c]);
+                    send_all(s_record, common_capture_encode_lost(s_record, c, lost - lost_seen, now));
+                }
+            }
+            lost_seen = lost;
+        }
+        for (int c = 0; c < SNIFFER_MAX_CHANNELS; c++) {
+            common_capture_idle(&s_decoders[c], now);
+        }
+
+        if (s_client_fd >= 0 && client_closed()) {
+            close(s_client_fd);
+            s_client_fd = -1;
+        }
+        vTaskDelay(pdMS_TO_TICKS(SNIFFER_POLL_MS));
+    }
+    s_active = false;
+    s_stats.client = false;
+}
+
+
+static void sniffer_task(void *arg) {
+    // interrupt is installed from here, so it runs on the measurement core
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "gpio isr service failed: %s", esp_err_to_name(err));
+        vTaskDelete(NULL);
+    }
+    for (int c = 0; c < SNIFFER_MAX_CHANNELS; c++) {
+        if (s_cfg.pins[c] == GPIO_NUM_NC) {
+            continue;
+        }
+        // the pad may be routed to the UART (TX, RX): gpio_config() would make it a plain GPIO
+        // and cut the signal, only the input buffer is enabled (needed to see the TX level)
+        PIN_INPUT_ENABLE(GPIO_PIN_MUX_REG[s_cfg.pins[c]]);
+        gpio_set_intr_type(s_cfg.pins[c], GPIO_INTR_ANYEDGE);
+        gpio_isr_handler_add(s_cfg.pins[c], edge_isr, (void *)(intptr_t)c);
+        gpio_intr_enable(s_cfg.pins[c]);
+    }
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_fd < 0) {
+        ESP_LOGE(TAG, "failed to create socket (errno %d)", errno);
+        vTaskDelete(NULL);
+    }
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(s_cfg.tcp_port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 1) != 0) {
+        ESP_LOGE(TAG, "failed to listen on port %d (errno %d)", s_cfg.tcp_port, errno);
+        close(listen_fd);
+        vTaskDelete(NULL);
+    }
+    ESP_LOGI(TAG, "bus sniffer listening on port %d (pins %d, %d)", s_cfg.tcp_port, s_cfg.pins[0], s_cfg.pins[1]);
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+        ESP_LOGW(TAG, "capture started");
+        s_client_fd = fd;
+        capture();
+        ESP_LOGW(TAG, "capture stopped: %u frames, %u bytes, %u framing errors, %u lost edges",
+                 (unsigned)s_stats.frames, (unsigned)s_stats.bytes, (unsigned)s_stats.framing_errors, (unsigned)s_stats.lost_edges);
+    }
+}
+
+
+void common_sniffer_start(const sniffer_config_t *config) {
+    s_cfg = *config;
+    if (s_cfg.baud == 0) {
+        s_cfg.baud = PZ_BAUD_RATE;
+    }
+    if (s_cfg.tcp_port == 0) {
+        s_cfg.tcp_port = SNIFFER_TCP_PORT;
+    }
+    s_started = true;
+    xTaskCreateStaticPinnedToCore(sniffer_task, "BusSniffer", SNIFFER_TASK_STACK, NULL, SNIFFER_TASK_PRIO,
+                                  s_task_stack, &s_task_buffer, TASK_CORE_MEASUREMENT);
+    common_membudget_register("sniffer", sizeof(s_task_stack) + sizeof(s_task_buffer) + sizeof(s_ring)
+                              + sizeof(s_decoders) + sizeof(s_record), 0);
+}
+
+
+bool common_sniffer_get_stats(sniffer_stats_t *stats) {
+    if (!s_started) {
+        return false;
+    }
+    *stats = s_stats;
+    return true;
+}
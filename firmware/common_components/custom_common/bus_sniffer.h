@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "driver/gpio.h"
+
+// Passive capture of the sensor bus, nothing is ever driven. The edges of up to
+// SNIFFER_MAX_CHANNELS input pins are timestamped in the GPIO interrupt (us, esp_timer), decoded
+// to bytes and frames by gaps (bus_capture.h) and streamed to one TCP client:
+//   tools/build/bus-capture/bus-capture -c <node> -w capture.bin     (or: nc <node> 7021 > capture.bin)
+// Channel 0 is meant for the TX line (requests), channel 1 for the RX line (responses), so the
+// turnaround of the modules, answers of the wrong address and collisions (framing errors) become
+// visible. The pins may be the UART pins of the bus (the level is read in parallel to the UART, the
+// pad routing is left untouched, only the input buffer is enabled) or spare pins wired to the lines,
+// on RS485 e.g. a second transceiver with the receiver always enabled.
+// Edges are only captured while a client is connected.
+
+#define SNIFFER_MAX_CHANNELS  2
+#define SNIFFER_TCP_PORT      7021
+#define SNIFFER_EDGE_RING     1024      // edges between interrupt and task, ~100 bytes at up to 10 edges per byte
+#define SNIFFER_POLL_MS       5
+
+typedef struct {
+    gpio_num_t pins[SNIFFER_MAX_CHANNELS];  // GPIO_NUM_NC = channel unused
+    uint32_t baud;                          // 0 = PZ_BAUD_RATE
+    uint16_t tcp_port;                      // 0 = SNIFFER_TCP_PORT
+} sniffer_config_t;
+
+typedef struct {
+    uint32_t frames;
+    uint32_t bytes;
+    uint32_t framing_errors;
+    uint32_t lost_edges;                    // ring overflow
+    bool client;                            // capture running
+} sniffer_stats_t;
+
+// Starts the capture task (measurement core, so the interrupt is not delayed by WiFi), config is copied
+void common_sniffer_start(const sniffer_config_t *config);
+
+// Returns false when the sniffer is not started
+bool common_sniffer_get_stats(sniffer_stats_t *stats);
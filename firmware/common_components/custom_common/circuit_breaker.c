@@ -0,0 +1,86 @@
+#include "circuit_breaker.h"
+
+
+
+void common_breaker_default_config(breaker_config_t *cfg) {
+    cfg->base_backoff_ms = BREAKER_DEFAULT_BASE_BACKOFF_MS;
+    cfg->max_backoff_ms = BREAKER_DEFAULT_MAX_BACKOFF_MS;
+    cfg->failure_threshold = BREAKER_DEFAULT_FAILURE_THRESHOLD;
+    cfg->open_ms = BREAKER_DEFAULT_OPEN_MS;
+    cfg->max_open_ms = BREAKER_DEFAULT_MAX_OPEN_MS;
+}
+
+
+void common_breaker_init(breaker_t *b, const breaker_config_t *cfg) {
+    b->state = BREAKER_CLOSED;
+    b->consecutive_failures = 0;
+    b->next_attempt_ms = 0;
+    b->open_ms = cfg->open_ms;
+    b->trips = 0;
+}
+
+
+bool common_breaker_allow(breaker_t *b, int64_t now_ms) {
+    if (now_ms < b->next_attempt_ms) {
+        return false;
+    }
+    if (b->state == BREAKER_OPEN) {
+        b->state = BREAKER_HALF_OPEN;
+    }
+    return true;
+}
+
+
+void common_breaker_success(breaker_t *b, const breaker_config_t *cfg) {
+    b->state = BREAKER_CLOSED;
+    b->consecutive_failures = 0;
+    b->next_attempt_ms = 0;
+    b->open_ms = cfg->open_ms;
+}
+
+
+// 50..100% of delay_ms, spreads retries of sensors that failed together
+static int64_t jitter(int64_t delay_ms, uint32_t random) {
+    int64_t half = delay_ms / 2;
+    return half + (half > 0 ? random % (half + 1) : 0);
+}
+
+
+void common_breaker_failure(breaker_t *b, const breaker_config_t *cfg, int64_t now_ms, uint32_t random) {
+    b->consecutive_failures++;
+
+    if (b->state == BREAKER_HALF_OPEN) {
+        // probe failed: stay away longer
+        b->open_ms *= 2;
+        if (b->open_ms > cfg->max_open_ms) {
+            b->open_ms = cfg->max_open_ms;
+        }
+        b->state = BREAKER_OPEN;
+        b->next_attempt_ms = now_ms + jitter(b->open_ms, random);
+        return;
+    }
+
+    if (b->consecutive_failures >= (uint32_t)cfg->failure_threshold) {
+        b->state = BREAKER_OPEN;
+        b->trips++;
+        b->open_ms = cfg->open_ms;
+        b->next_attempt_ms = now_ms + jitter(b->open_ms, random);
+        return;
+    }
+
+    int64_t backoff = (int64_t)cfg->base_backoff_ms << (b->consecutive_failures - 1);
+    if (backoff > cfg->max_backoff_ms) {
+        backoff = cfg->max_backoff_ms;
+    }
+    b->next_attempt_ms = now_ms + jitter(backoff, random);
+}
+
+
+const char *common_breaker_state_str(breaker_state_t state) {
+    switch (state) {
+        case BREAKER_CLOSED:    return "closed";
+        case BREAKER_HALF_OPEN: return "half_open";
+        case BREAKER_OPEN:      return "open";
+    }
+    return "unknown";
+}
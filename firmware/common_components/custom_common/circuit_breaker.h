@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Per sensor protection of the bus against dead devices:
+//  - closed: reads are allowed, after a failure the next attempt is delayed by an exponential
+//    backoff (base_backoff_ms doubling up to max_backoff_ms) with jitter (50..100% of the backoff)
+//  - open: after failure_threshold consecutive failures the sensor is not read at all until
+//    open_ms have passed, every failed probe doubles that time up to max_open_ms
+//  - half open: a single probe read is allowed, success closes the breaker, failure opens it again
+// No platform dependencies, time and randomness are passed in by the caller.
+
+#define BREAKER_DEFAULT_BASE_BACKOFF_MS   2000
+#define BREAKER_DEFAULT_MAX_BACKOFF_MS    30000
+#define BREAKER_DEFAULT_FAILURE_THRESHOLD 5
+#define BREAKER_DEFAULT_OPEN_MS           60000
+#define BREAKER_DEFAULT_MAX_OPEN_MS       900000
+
+typedef enum {
+    BREAKER_CLOSED = 0,
+    BREAKER_HALF_OPEN,
+    BREAKER_OPEN,
+} breaker_state_t;
+
+typedef struct {
+    int base_backoff_ms;
+    int max_backoff_ms;
+    int failure_threshold;
+    int open_ms;
+    int max_open_ms;
+} breaker_config_t;
+
+typedef struct {
+    breaker_state_t state;
+    uint32_t consecutive_failures;
+    int64_t next_attempt_ms;        // no read before this time
+    int open_ms;                    // current open time
+    uint32_t trips;                 // transitions closed -> open
+} breaker_t;
+
+// Config with all BREAKER_DEFAULT_* values
+void common_breaker_default_config(breaker_config_t *cfg);
+
+void common_breaker_init(breaker_t *b, const breaker_config_t *cfg);
+
+// May the sensor be read now? Switches an open breaker to half open when its time is over
+bool common_breaker_allow(breaker_t *b, int64_t now_ms);
+
+void common_breaker_success(breaker_t *b, const breaker_config_t *cfg);
+
+// random: any 32 bit random value, used for the jitter
+void common_breaker_failure(breaker_t *b, const breaker_config_t *cfg, int64_t now_ms, uint32_t random);
+
+const char *common_breaker_state_str(breaker_state_t state);
@@ -1,14 +1,44 @@
 #pragma once
 #include "driver/gpio.h"
+#include "pzem_profile.h"
 
-// Shared sensor config struct for a single PZEM-004T
+// Scheduling class of a sensor: due sensors are served in this order, when the bus is
+// oversubscribed the intervals of lower classes are stretched first (see bus_model.h)
+typedef enum {
+    SENSOR_PRIO_LOW = -1,           // e.g. inverters, 60 s
+    SENSOR_PRIO_NORMAL = 0,         // default
+    SENSOR_PRIO_HIGH = 1,           // e.g. grid import, 1 s
+} sensor_priority_t;
+
+// Values read in the fast lane of a sensor (partial read, compiled with the device profile into
+// the fewest registers, e.g. power only: 9 instead of 25 bytes reply), all other values keep the
+// ones of the last full read
+typedef struct {
+    uint16_t fields;                // PZ_FIELD_BIT() of the values, 0 = no fast lane
+} read_plan_t;
+
+#define READ_PLAN_POWER             { .fields = PZ_FIELD_BIT(PZ_FIELD_POWER) }                              // active power
+#define READ_PLAN_CURRENT_POWER     { .fields = PZ_FIELD_BIT(PZ_FIELD_CURRENT) | PZ_FIELD_BIT(PZ_FIELD_POWER) } // current + active power
+
+// Shared sensor config struct for a single PZEM module
 typedef struct {
     const char *name;               // Human-readable sensor name (for logs)
     uint8_t modbus_addr;            // Modbus slave ID
+    pzem_profile_id_t profile;      // Device type (register map, framing, commands), default PZEM_PROFILE_004T
     gpio_num_t tx_pin;              // UART TX (may be shared)
     gpio_num_t rx_pin;              // UART RX (unique per sensor)
     bool use_rs485;                 // Enable RS485 mode instead of normal TTL
     gpio_num_t rs485_dir_pin;             // RS485 DIR pin to control half-duplex
     const char *mqtt_topic_prefix;  // MQTT topic prefix to publish data under
     int publish_interval_ms;        // How often to read + publish
+    uint16_t alarm_threshold_w;     // Power alarm threshold programmed into the module, 0 = no alarm
+    sensor_priority_t priority;     // Scheduling class, default SENSOR_PRIO_NORMAL
+    read_plan_t fast_plan;          // Values read and published every fast_interval_ms, full reads stay at publish_interval_ms
+    int fast_interval_ms;           // Interval of the fast lane, 0 = no fast lane
 } ModbusSensor;
+
+// Profile of the device type of a sensor, PZEM-004T for an unknown type
+static inline const pzem_profile_t *common_sensor_profile(const ModbusSensor *sensor) {
+    const pzem_profile_t *profile = PzemProfile(sensor->profile);
+    return profile != NULL ? profile : PzemProfile(PZEM_PROFILE_004T);
+}
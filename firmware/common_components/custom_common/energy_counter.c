@@ -0,0 +1,121 @@
+#include "energy_counter.h"
+#include <string.h>
+
+
+
+// floor(a / b) * b, also for negative a
+static int64_t align_down(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    if (a % b != 0 && a < 0) {
+        q--;
+    }
+    return q * b;
+}
+
+
+void common_energy_init(energy_counter_t *c, int max_power_w, int interval_ms) {
+    memset(c, 0, sizeof(*c));
+    c->max_power_w = max_power_w > 0 ? max_power_w : ENERGY_DEFAULT_MAX_POWER_W;
+    c->interval_ms = interval_ms > 0 ? interval_ms : 0;
+}
+
+
+energy_event_t common_energy_update(energy_counter_t *c, uint32_t raw_wh, int64_t time_ms, bool clock_valid) {
+    energy_event_t event;
+    uint64_t delta = 0;
+    if (!c->have_raw) {
+        event = ENERGY_FIRST;
+    } else if (raw_wh >= c->last_raw_wh) {
+        delta = raw_wh - c->last_raw_wh;
+        event = ENERGY_COUNTED;
+    } else if (c->last_raw_wh + ENERGY_ROLLOVER_MARGIN_WH >= ENERGY_ROLLOVER_WH && raw_wh < ENERGY_ROLLOVER_MARGIN_WH) {
+        delta = (c->last_raw_wh < ENERGY_ROLLOVER_WH ? ENERGY_ROLLOVER_WH - c->last_raw_wh : 0) + raw_wh;
+        event = ENERGY_ROLLOVER;
+    } else {
+        delta = raw_wh;
+        event = ENERGY_RESET;
+    }
+
+    // the step has to fit the time since the last update (unknown after a time jump)
+    const bool time_known = c->have_time && time_ms >= c->last_ms;
+    if (event != ENERGY_FIRST && time_known) {
+        double max_wh = (double)c->max_power_w * (time_ms - c->last_ms) / 3600000.0 + ENERGY_SLACK_WH;
+        if ((double)delta > max_wh) {
+            delta = 0;
+            event = ENERGY_REJECTED;
+        }
+    }
+    switch (event) {
+        case ENERGY_ROLLOVER: c->rollovers++; break;
+        case ENERGY_RESET:    c->resets++; break;
+        case ENERGY_REJECTED: c->rejected++; break;
+        default: break;
+    }
+
+    const uint64_t before_wh = c->total_wh;
+    c->total_wh += delta;
+    c->last_raw_wh = raw_wh;
+    c->have_raw = true;
+
+    if (c->interval_ms > 0 && !clock_valid) {
+        c->interval_end_ms = 0; // nothing to align to, restarts with the first valid time
+    } else if (c->interval_ms > 0) {
+        if (c->interval_end_ms == 0 || !time_known ||
+            (time_ms - c->interval_end_ms) / c->interval_ms >= ENERGY_MAX_CATCHUP) {
+            // (re)start within the interval of time_ms
+            c->interval_end_ms = align_down(time_ms, c->interval_ms) + c->interval_ms;
+            c->interval_start_wh = c->total_wh;
+            c->interval_complete = false;
+            c->prev_ms = time_ms;
+            c->prev_total_wh = c->total_wh;
+        } else {
+            c->prev_ms = c->last_ms;
+            c->prev_total_wh = before_wh;
+        }
+    }
+    c->last_ms = time_ms;
+    c->have_time = true;
+    return event;
+}
+
+
+bool common_energy_next_interval(energy_counter_t *c, energy_interval_t *out) {
+    if (c->interval_ms <= 0 || c->interval_end_ms == 0 || !c->have_time || c->interval_end_ms > c->last_ms) {
+        return false;
+    }
+    const int64_t end = c->interval_end_ms;
+    double end_wh;
+    if (end <= c->prev_ms) {
+        end_wh = c->prev_total_wh;
+    } else {
+        // linear between the updates around the boundary
+        end_wh = c->prev_total_wh + (double)(c->total_wh - c->prev_total_wh) * (end - c->prev_ms) / (c->last_ms - c->prev_ms);
+    }
+    out->start_ms = end - c->interval_ms;
+    out->end_ms = end;
+    out->wh = end_wh - c->interval_start_wh;
+    out->total_wh = end_wh;
+    out->complete = c->interval_complete;
+
+    c->interval_start_wh = end_wh;
+    c->interval_end_ms = end + c->interval_ms;
+    c->interval_complete = true;
+    return true;
+}
+
+
+void common_energy_time_lost(energy_counter_t *c) {
+    c->have_time = false;
+}
+
+
+const char *common_energy_event_str(energy_event_t event) {
+    switch (event) {
+        case ENERGY_FIRST:    return "first";
+        case ENERGY_COUNTED:  return "counted";
+        case ENERGY_ROLLOVER: return "rollover";
+        case ENERGY_RESET:    return "reset";
+        case ENERGY_REJECTED: return "rejected";
+        default:              return "unknown";
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Monotonic 64 bit energy counter of a sensor, fed with the 32 bit Wh register of the PZEM
+// (PzemFieldRaw(..., PZ_FIELD_ENERGY), which the driver only decodes as float kWh):
+//  - an increase of the register is counted
+//  - a decrease from close to ENERGY_ROLLOVER_WH to a small value is a rollover of the module,
+//    the rest up to the rollover plus the new value is counted
+//  - any other decrease is a reset (PzResetEnergy, RESET_ENERGY_OF_ALL_MODULES) or a replaced
+//    module, the new value is counted as energy since the reset
+//  - a step larger than max_power_w can explain for the time since the last update is not counted,
+//    the register value becomes the new baseline (e.g. a replaced module with its own history)
+// Billing intervals: the energy per interval of interval_ms, aligned to multiples of interval_ms
+// in the time base of the caller (quarter hours of the wall clock). Intervals are only tracked while
+// the caller says the time is the wall clock (clock_valid), the first update with a valid clock
+// starts a new, incomplete interval aligned to it. The counter at an interval boundary is
+// interpolated between the updates before and after it, so the read interval does not shift
+// energy between intervals.
+// No platform dependencies, time is passed in by the caller.
+
+#define ENERGY_ROLLOVER_WH          10000000u   // 9999.99 kWh + resolution: the register starts over at 0
+#define ENERGY_ROLLOVER_MARGIN_WH   100000u     // distance to the rollover (both sides) to call a decrease a rollover
+#define ENERGY_DEFAULT_MAX_POWER_W  26000       // 100 A * 260 V, upper end of the PZEM-004T range
+#define ENERGY_SLACK_WH             10          // register resolution and timing jitter of the plausibility check
+#define ENERGY_MAX_CATCHUP          96          // more pending interval boundaries are a time jump, not a gap
+
+typedef enum {
+    ENERGY_FIRST = 0,                   // baseline, nothing counted
+    ENERGY_COUNTED,
+    ENERGY_ROLLOVER,
+    ENERGY_RESET,
+    ENERGY_REJECTED,                    // implausible step, new baseline
+} energy_event_t;
+
+typedef struct {
+    uint64_t total_wh;                  // monotonic counter
+    uint32_t last_raw_wh;               // register at the last update
+    bool have_raw;
+    bool have_time;                     // last_ms is in the current time base
+    int64_t last_ms;
+    int max_power_w;
+    uint32_t rollovers;
+    uint32_t resets;
+    uint32_t rejected;
+
+    // billing interval
+    int interval_ms;                    // 0 = no intervals
+    int64_t interval_end_ms;            // end of the open interval, 0 = not started
+    double interval_start_wh;           // counter at the start of the open interval (interpolated)
+    bool interval_complete;             // the open interval was tracked from its start
+    int64_t prev_ms;                    // update before last_ms, for the interpolation
+    uint64_t prev_total_wh;
+} energy_counter_t;
+
+// A closed billing interval
+typedef struct {
+    int64_t start_ms;
+    int64_t end_ms;
+    double wh;                          // energy in the interval
+    double total_wh;                    // counter at end_ms
+    bool complete;                      // false: tracking started within the interval (boot, time jump)
+} energy_interval_t;
+
+// max_power_w 0 = ENERGY_DEFAULT_MAX_POWER_W, interval_ms 0 = no billing intervals
+void common_energy_init(energy_counter_t *c, int max_power_w, int interval_ms);
+
+// Feed the register value read at time_ms, then take the closed intervals with
+// common_energy_next_interval() until it returns false (before the next update).
+// clock_valid false: time_ms is not the wall clock yet (no SNTP sync), energy is counted but the
+// open interval is dropped
+energy_event_t common_energy_update(energy_counter_t *c, uint32_t raw_wh, int64_t time_ms, bool clock_valid);
+
+// Next closed billing interval, false when the open interval has not ended yet
+bool common_energy_next_interval(energy_counter_t *c, energy_interval_t *out);
+
+// The time base changed (e.g. power cycle without wall clock): no plausibility check for the next
+// update and the open interval starts over, the counter itself is kept
+void common_energy_time_lost(energy_counter_t *c);
+
+const char *common_energy_event_str(energy_event_t event);
@@ -0,0 +1,213 @@
+#include "energy_store.h"
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "time_sync.h"
+#include "nvs.h"
+
+#define TAG "common_energy"
+
+#define NVS_NAMESPACE "energy"
+#define ENERGY_MAGIC  0x454E4731        // "ENG1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                      // sizeof(energy_blob_t), a changed layout starts fresh
+    energy_counter_t counter;
+} energy_blob_t;
+
+typedef struct {
+    energy_info_t info;
+    bool initialized;
+    char key[16];                       // NVS key of the topic prefix
+    int64_t next_save_ms;               // uptime
+    energy_interval_t pending[ENERGY_PENDING_MAX];
+    int pending_head;
+    int pending_count;
+} energy_slot_t;
+
+static energy_slot_t s_slots[ENERGY_MAX_SENSORS];
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+// the counter belongs to the metering point, not to the module: key from the topic prefix (FNV-1a)
+static void make_key(char *key, size_t size, const ModbusSensor *sensor) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = sensor->mqtt_topic_prefix; c && *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    snprintf(key, size, "p%08lx", (unsigned long)hash);
+}
+
+
+static bool load_counter(const char *key, energy_counter_t *counter) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    energy_blob_t blob;
+    size_t len = sizeof(blob);
+    bool ok = nvs_get_blob(nvs, key, &blob, &len) == ESP_OK && len == sizeof(blob) &&
+              blob.magic == ENERGY_MAGIC && blob.size == sizeof(blob);
+    nvs_close(nvs);
+    if (ok) {
+        *counter = blob.counter;
+    }
+    return ok;
+}
+
+
+static void save_counter(energy_slot_t *slot, const energy_counter_t *counter) {
+    const energy_blob_t blob = { .magic = ENERGY_MAGIC, .size = sizeof(blob), .counter = *counter };
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, slot->key, &blob, sizeof(blob));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    portENTER_CRITICAL(&s_lock);
+    if (err == ESP_OK) {
+        slot->info.nvs_writes++;
+    } else {
+        slot->info.nvs_errors++;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Saving counter %s failed: %s", slot->key, esp_err_to_name(err));
+    }
+}
+
+
+// queue a closed interval, the oldest is dropped when the queue is full (lock held)
+static void push_interval(energy_slot_t *slot, const energy_interval_t *interval) {
+    if (slot->pending_count == ENERGY_PENDING_MAX) {
+        slot->pending_head = (slot->pending_head + 1) % ENERGY_PENDING_MAX;
+        slot->pending_count--;
+        slot->info.intervals_dropped++;
+    }
+    slot->pending[(slot->pending_head + slot->pending_count) % ENERGY_PENDING_MAX] = *interval;
+    slot->pending_count++;
+    slot->info.last_interval = *interval;
+    slot->info.intervals++;
+}
+
+
+
+void common_energy_store_init(int sensor_index, const ModbusSensor *sensor, int interval_ms) {
+    if (sensor_index < 0 || sensor_index >= ENERGY_MAX_SENSORS) {
+        return;
+    }
+    energy_slot_t *slot = &s_slots[sensor_index];
+    energy_counter_t counter;
+    char key[sizeof(slot->key)];
+    make_key(key, sizeof(key), sensor);
+
+    const int max_power_w = (int)common_sensor_profile(sensor)->max_power_w;
+    common_energy_init(&counter, max_power_w, interval_ms);
+    bool restored = load_counter(key, &counter);
+    if (restored) {
+        counter.max_power_w = max_power_w; // the module type may have changed
+        if (counter.interval_ms != interval_ms) {
+            // changed billing interval: keep the counter, the intervals start over
+            counter.interval_ms = interval_ms;
+            counter.interval_end_ms = 0;
+        }
+        if (esp_reset_reason() == ESP_RST_POWERON) {
+            common_energy_time_lost(&counter); // system time started over
+        }
+        ESP_LOGI(TAG, "[%s] Energy counter %llu Wh restored (register %lu Wh)", sensor->name,
+                 (unsigned long long)counter.total_wh, (unsigned long)counter.last_raw_wh);
+    }
+
+    portENTER_CRITICAL(&s_lock);
+    memset(slot, 0, sizeof(*slot));
+    memcpy(slot->key, key, sizeof(slot->key));
+    slot->info.counter = counter;
+    slot->info.restored = restored;
+    slot->initialized = true;
+    portEXIT_CRITICAL(&s_lock);
+}
+
+
+energy_event_t common_energy_store_update(int sensor_index, uint32_t raw_wh, int64_t time_ms) {
+    if (sensor_index < 0 || sensor_index >= ENERGY_MAX_SENSORS || !s_slots[sensor_index].initialized) {
+        return ENERGY_FIRST;
+    }
+    energy_slot_t *slot = &s_slots[sensor_index];
+    const int64_t now = esp_timer_get_time() / 1000;
+    const bool clock_valid = common_time_valid();
+
+    portENTER_CRITICAL(&s_lock);
+    energy_counter_t *counter = &slot->info.counter;
+    energy_event_t event = common_energy_update(counter, raw_wh, time_ms, clock_valid);
+    bool closed = false;
+    energy_interval_t interval;
+    while (common_energy_next_interval(counter, &interval)) {
+        push_interval(slot, &interval);
+        closed = true;
+    }
+    const bool save = event != ENERGY_COUNTED || (closed && now >= slot->next_save_ms);
+    const energy_counter_t copy = *counter;
+    portEXIT_CRITICAL(&s_lock);
+
+    if (save) {
+        save_counter(slot, &copy);
+        slot->next_save_ms = now + ENERGY_NVS_MIN_INTERVAL_MS;
+    }
+    return event;
+}
+
+
+bool common_energy_store_peek(int sensor_index, energy_interval_t *out) {
+    if (sensor_index < 0 || sensor_index >= ENERGY_MAX_SENSORS) {
+        return false;
+    }
+    energy_slot_t *slot = &s_slots[sensor_index];
+    portENTER_CRITICAL(&s_lock);
+    bool ok = slot->pending_count > 0;
+    if (ok) {
+        *out = slot->pending[slot->pending_head];
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return ok;
+}
+
+
+void common_energy_store_pop(int sensor_index) {
+    if (sensor_index < 0 || sensor_index >= ENERGY_MAX_SENSORS) {
+        return;
+    }
+    energy_slot_t *slot = &s_slots[sensor_index];
+    portENTER_CRITICAL(&s_lock);
+    if (slot->pending_count > 0) {
+        slot->pending_head = (slot->pending_head + 1) % ENERGY_PENDING_MAX;
+        slot->pending_count--;
+    }
+    portEXIT_CRITICAL(&s_lock);
+}
+
+
+bool common_energy_store_get(int sensor_index, energy_info_t *info) {
+    if (sensor_index < 0 || sensor_index >= ENERGY_MAX_SENSORS) {
+        return false;
+    }
+    portENTER_CRITICAL(&s_lock);
+    bool ok = s_slots[sensor_index].initialized;
+    if (ok) {
+        *info = s_slots[sensor_index].info;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return ok;
+}
+
+
+size_t common_energy_store_static_bytes(void) {
+    return sizeof(s_slots);
+}
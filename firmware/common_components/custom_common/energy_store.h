@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "config_types.h"
+#include "energy_counter.h"
+
+// Energy counters (energy_counter.h) of all sensors, kept in NVS per topic prefix so the total of
+// a metering point survives restarts, module resets and module replacement. The counter is written
+// when a billing interval closes (at most every ENERGY_NVS_MIN_INTERVAL_MS) and after a reset,
+// rollover or rejected step. Counter and register are always written together, energy counted by
+// the module while the node was down is added with the first read after the boot.
+// Closed intervals wait in a small queue until they are published (MQTT outage), the oldest are
+// dropped when it is full. The queue is not persisted.
+
+#define ENERGY_MAX_SENSORS          8
+#define ENERGY_PENDING_MAX          8           // 2 h of quarter hours
+#define ENERGY_NVS_MIN_INTERVAL_MS  (15 * 60 * 1000)
+
+typedef struct {
+    energy_counter_t counter;
+    bool restored;                          // counter loaded from NVS at boot
+    energy_interval_t last_interval;        // last closed interval, end_ms 0 = none yet
+    uint32_t intervals;                     // closed since boot
+    uint32_t intervals_dropped;             // not published, queue full
+    uint32_t nvs_writes;
+    uint32_t nvs_errors;
+} energy_info_t;
+
+// Load the counter of a sensor (publish task, before the first update), interval_ms 0 = no billing
+// intervals. After a power cycle the system time starts over, the time of the counter is dropped
+void common_energy_store_init(int sensor_index, const ModbusSensor *sensor, int interval_ms);
+
+// Count a new sample (energy register in Wh, system time), queues closed intervals and writes NVS when due.
+// Billing intervals are only tracked while the system time is set (time_sync.h)
+energy_event_t common_energy_store_update(int sensor_index, uint32_t raw_wh, int64_t time_ms);
+
+// Oldest closed interval not published yet, remove it with common_energy_store_pop() once sent
+bool common_energy_store_peek(int sensor_index, energy_interval_t *out);
+void common_energy_store_pop(int sensor_index);
+
+// Copy counter and statistics (e.g. for metrics), false for an invalid index or before init
+bool common_energy_store_get(int sensor_index, energy_info_t *info);
+
+// RAM of the counters and queues (memory budget of the publish task)
+size_t common_energy_store_static_bytes(void);
@@ -0,0 +1,244 @@
+#include "history_buffer.h"
+#include "memory_budget.h"
+#include "mqtt_helper.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define TAG "common_history"
+
+
+static history_block_t s_pool[HISTORY_POOL_BLOCKS];
+static history_ring_t s_rings[HISTORY_MAX_SENSORS];
+static const ModbusSensor *s_sensors[HISTORY_MAX_SENSORS];
+static int s_ring_count = 0;
+static SemaphoreHandle_t s_lock = NULL;
+static StaticSemaphore_t s_lock_buffer;
+
+// request received on <prefix>/history/get, answered message by message by the publish task
+typedef struct {
+    bool active;
+    uint32_t id;                // changes with every request, a newer one replaces the answer in progress
+    int64_t from_ms;
+    int64_t to_ms;
+    history_cursor_t cursor;
+} history_request_t;
+
+static history_request_t s_requests[HISTORY_MAX_SENSORS];
+static int s_request_sensor = 0;        // round robin between sensors with a request
+static portMUX_TYPE s_request_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+//==========================
+//===== public functions ===
+//==========================
+void common_history_init(const ModbusSensor *sensors, int sensor_count) {
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutexStatic(&s_lock_buffer);
+    }
+    if (sensor_count > HISTORY_MAX_SENSORS) {
+        ESP_LOGE(TAG, "%d sensors configured but history supports only %d, ignoring the rest", sensor_count, HISTORY_MAX_SENSORS);
+        sensor_count = HISTORY_MAX_SENSORS;
+    }
+    if (sensor_count <= 0) {
+        return;
+    }
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    // split pool evenly between configured sensors
+    const int blocks_per_sensor = HISTORY_POOL_BLOCKS / sensor_count;
+    for (int i = 0; i < sensor_count; i++) {
+        s_sensors[i] = &sensors[i];
+        common_history_ring_init(&s_rings[i], &s_pool[i * blocks_per_sensor], blocks_per_sensor);
+    }
+    s_ring_count = sensor_count;
+    common_membudget_register("history", sizeof(s_pool) + sizeof(s_rings) + sizeof(s_sensors) + sizeof(s_requests), 0);
+    xSemaphoreGive(s_lock);
+
+    ESP_LOGI(TAG, "history initialized: %d sensors, %d blocks of %d bytes each",
+             sensor_count, blocks_per_sensor, HISTORY_BLOCK_SIZE);
+}
+
+
+void common_history_append(int sensor_index, int64_t timestamp_ms, const _current_values_t *values, const uint16_t *regs) {
+    if (sensor_index < 0 || sensor_index >= s_ring_count) {
+        return;
+    }
+
+    // convert to register units, the energy comes straight from the register: the float kWh value
+    // keeps only ~7 significant digits and loses single Wh of a large counter
+    history_sample_t s = {
+        .timestamp_ms = timestamp_ms,
+        .values = {
+            [HISTORY_FIELD_VOLTAGE]   = lroundf(values->voltage * 10.0f),
+            [HISTORY_FIELD_CURRENT]   = lroundf(values->current * 1000.0f),
+            [HISTORY_FIELD_POWER]     = lroundf(values->power * 10.0f),
+            [HISTORY_FIELD_ENERGY]    = (int32_t)PzemFieldRaw(common_sensor_profile(s_sensors[sensor_index]), regs, PZ_FIELD_ENERGY),
+            [HISTORY_FIELD_FREQUENCY] = lroundf(values->frequency * 10.0f),
+            [HISTORY_FIELD_PF]        = lroundf(values->pf * 100.0f),
+        }
+    };
+
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    common_history_ring_append(&s_rings[sensor_index], &s);
+    xSemaphoreGive(s_lock);
+}
+
+
+int common_history_dump_next(int sensor_index, int64_t from_ms, int64_t to_ms, history_cursor_t *cursor, history_dump_cb_t cb, void *ctx) {
+    if (sensor_index < 0 || sensor_index >= s_ring_count || cursor->done) {
+        return 0;
+    }
+    uint8_t msg[HISTORY_MSG_HEADER_SIZE + HISTORY_BLOCK_SIZE];
+    const int64_t now = esp_timer_get_time() / 1000;
+    uint32_t seq = 0;
+
+    // send blocks oldest first
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+    size_t len = common_history_ring_message(&s_rings[sensor_index], from_ms, to_ms, cursor->last_seq,
+                                             cursor->index, now, msg, &seq);
+    xSemaphoreGive(s_lock);
+
+    if (len == 0) {
+        // terminating message without data
+        len = common_history_final_message(cursor->index, now, msg);
+        if (!cb(msg, len, ctx)) {
+            return -1;
+        }
+        cursor->index++;
+        cursor->done = true;
+        return 0;
+    }
+
+    if (!cb(msg, len, ctx)) {
+        return -1;
+    }
+    cursor->last_seq = seq;
+    cursor->index++;
+    return 1;
+}
+
+
+int common_history_dump(int sensor_index, int64_t from_ms, int64_t to_ms, history_dump_cb_t cb, void *ctx) {
+    if (sensor_index < 0 || sensor_index >= s_ring_count) {
+        return 0;
+    }
+    history_cursor_t cursor = {0};
+    int result;
+    while ((result = common_history_dump_next(sensor_index, from_ms, to_ms, &cursor, cb, ctx)) > 0) {
+    }
+    // messages passed to the callback, incl. a failed one
+    return result < 0 ? cursor.index + 1 : cursor.index;
+}
+
+
+
+//============================
+//===== MQTT integration =====
+//============================
+typedef struct {
+    esp_mqtt_client_handle_t client;
+    const char *topic;
+} publish_ctx_t;
+
+static bool publish_message(const uint8_t *msg, size_t len, void *arg) {
+    publish_ctx_t *ctx = (publish_ctx_t *)arg;
+    return common_mqtt_publish(ctx->client, ctx->topic, (const char *)msg, len, 1, 0) >= 0;
+}
+
+
+void common_history_subscribe(esp_mqtt_client_handle_t client) {
+    char topic[128];
+    for (int i = 0; i < s_ring_count; i++) {
+        snprintf(topic, sizeof(topic), "%s/history/get", s_sensors[i]->mqtt_topic_prefix);
+        esp_mqtt_client_subscribe(client, topic, 1);
+        ESP_LOGI(TAG, "subscribed to '%s'", topic);
+    }
+}
+
+
+bool common_history_handle_request(const char *topic, int topic_len, const char *data, int data_len) {
+    char expected[128];
+    for (int i = 0; i < s_ring_count; i++) {
+        int len = snprintf(expected, sizeof(expected), "%s/history/get", s_sensors[i]->mqtt_topic_prefix);
+        if (len != topic_len || strncmp(topic, expected, topic_len) != 0) {
+            continue;
+        }
+
+        // parse requested range
+        char request[48] = {0};
+        memcpy(request, data, data_len < (int)sizeof(request) - 1 ? data_len : (int)sizeof(request) - 1);
+        int64_t now = esp_timer_get_time() / 1000;
+        int64_t from_ms = INT64_MIN;
+        int64_t to_ms = INT64_MAX;
+        long long a, b;
+        if (sscanf(request, "%lld-%lld", &a, &b) == 2) {
+            from_ms = a;
+            to_ms = b;
+        } else if (sscanf(request, "%lld", &a) == 1) {
+            from_ms = now - a * 1000;
+        }
+
+        // answered by the publish task, the MQTT task has to keep handling keepalive and PUBACKs
+        portENTER_CRITICAL(&s_request_lock);
+        bool replaced = s_requests[i].active;
+        s_requests[i].active = true;
+        s_requests[i].id++;
+        s_requests[i].from_ms = from_ms;
+        s_requests[i].to_ms = to_ms;
+        memset(&s_requests[i].cursor, 0, sizeof(s_requests[i].cursor));
+        portEXIT_CRITICAL(&s_request_lock);
+        ESP_LOGI(TAG, "[%s] history request '%s' queued%s", s_sensors[i]->name, request,
+                 replaced ? ", replaces the unfinished one" : "");
+        return true;
+    }
+    return false;
+}
+
+
+bool common_history_request_pending(void) {
+    bool pending = false;
+    portENTER_CRITICAL(&s_request_lock);
+    for (int i = 0; i < s_ring_count; i++) {
+        pending |= s_requests[i].active;
+    }
+    portEXIT_CRITICAL(&s_request_lock);
+    return pending;
+}
+
+
+bool common_history_send_next(esp_mqtt_client_handle_t client) {
+    for (int n = 0; n < s_ring_count; n++) {
+        int i = (s_request_sensor + n) % s_ring_count;
+        portENTER_CRITICAL(&s_request_lock);
+        history_request_t request = s_requests[i];
+        portEXIT_CRITICAL(&s_request_lock);
+        if (!request.active) {
+            continue;
+        }
+        s_request_sensor = i + 1;
+
+        char topic[128];
+        snprintf(topic, sizeof(topic), "%s/history/data", s_sensors[i]->mqtt_topic_prefix);
+        publish_ctx_t ctx = { .client = client, .topic = topic };
+        int result = common_history_dump_next(i, request.from_ms, request.to_ms, &request.cursor, publish_message, &ctx);
+
+        portENTER_CRITICAL(&s_request_lock);
+        // unless a new request arrived meanwhile
+        if (s_requests[i].id == request.id) {
+            s_requests[i].cursor = request.cursor;
+            s_requests[i].active = result != 0;
+        }
+        portEXIT_CRITICAL(&s_request_lock);
+        if (result == 0) {
+            ESP_LOGI(TAG, "[%s] history request answered with %u messages", s_sensors[i]->name, request.cursor.index);
+        }
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "config_types.h"
+#include "mqtt_client.h"
+#include "pzem004tv3.h"
+#include "history_codec.h"
+
+// Compressed in-RAM history of recent samples for each configured sensor.
+//
+// A fixed pool of blocks is split evenly between the configured sensors, each sensor
+// uses its blocks as a ring (oldest block is overwritten when full).
+// Samples are stored in register units (integers) and encoded per block as:
+//   - first sample:  timestamp in block header, every value as zigzag varint (absolute)
+//   - next samples:  zigzag varint of timestamp delta-of-delta (ms),
+//                    then zigzag varint of the delta to the previous value for every field
+// Slowly changing registers therefore mostly need 1 byte per field.
+//
+// Retrieval via MQTT (answered by the publish task, one message every PMON_BACKLOG_INTERVAL_MS):
+//   request  topic: <mqtt_topic_prefix>/history/get
+//            payload: "<seconds>"        -> last n seconds
+//                     "<from_ms>-<to_ms>" -> range in device uptime (ms)
+//                     empty              -> everything available
+//   response topic: <mqtt_topic_prefix>/history/data
+//            one message per block (binary, little endian):
+//              u8  version (HISTORY_FORMAT_VERSION)
+//              u8  flags   (HISTORY_FLAG_LAST set on the final message of a response)
+//              u16 sample count in block
+//              u16 length of encoded data
+//              u16 message index within this response
+//              i64 device uptime (ms) when the response was sent (to map to wall clock)
+//              i64 timestamp (ms uptime) of the first sample in block
+//              ... encoded data
+//            the final message has no data (sample count 0) and only marks the end
+//
+// Backlog after an MQTT outage (sent by the publish task, rate limited, after the latest values):
+//   topic: <mqtt_topic_prefix>/history/backlog, same messages as a response covering the outage
+
+// Total size of the pool shared between all sensors (blocks of HISTORY_BLOCK_SIZE, history_codec.h),
+// override via compile definitions
+#ifndef HISTORY_POOL_BLOCKS
+#define HISTORY_POOL_BLOCKS 96  // 48 KiB -> roughly 100 min @1s with one sensor, ~13 h @30s with 3 sensors
+#endif
+#ifndef HISTORY_MAX_SENSORS
+#define HISTORY_MAX_SENSORS 8
+#endif
+
+// called once per encoded message, return false to abort the dump
+typedef bool (*history_dump_cb_t)(const uint8_t *msg, size_t len, void *ctx);
+
+// Position of a dump that is sent message by message
+typedef struct {
+    uint32_t last_seq;          // sequence number of the last block sent
+    uint16_t index;             // messages sent
+    bool done;                  // final message sent
+} history_cursor_t;
+
+
+// Assign history storage to the configured sensors, call before MQTT is started
+void common_history_init(const ModbusSensor *sensors, int sensor_count);
+
+// Convert decoded values to register units and append them to the history of a sensor, the energy
+// is taken from the raw input registers (regs, map of the device profile) to keep every Wh
+void common_history_append(int sensor_index, int64_t timestamp_ms, const _current_values_t *values, const uint16_t *regs);
+
+// Encode all blocks of a sensor overlapping [from_ms, to_ms] and pass each message to the callback
+// returns number of messages passed to the callback
+int common_history_dump(int sensor_index, int64_t from_ms, int64_t to_ms, history_dump_cb_t cb, void *ctx);
+
+// Pass the next message of a dump to the callback, cursor zero-initialized for the first message.
+// Returns 1 when a block was sent, 0 when the final message was sent (or the dump is done),
+// -1 when the callback failed (the cursor is not advanced, the same message is sent next time)
+int common_history_dump_next(int sensor_index, int64_t from_ms, int64_t to_ms, history_cursor_t *cursor, history_dump_cb_t cb, void *ctx);
+
+// MQTT integration (called from mqtt_helper)
+void common_history_subscribe(esp_mqtt_client_handle_t client);
+
+// Queue a request received on <prefix>/history/get, returns false when the topic is no request.
+// A new request of a sensor replaces the one still being answered
+bool common_history_handle_request(const char *topic, int topic_len, const char *data, int data_len);
+
+// Requests queued and not answered completely
+bool common_history_request_pending(void);
+
+// Send the next message of a queued request (round robin between sensors), called by the publish
+// task rate limited like the backlog. A failed publish is repeated next time.
+// Returns false when no request is pending
+bool common_history_send_next(esp_mqtt_client_handle_t client);
@@ -0,0 +1,152 @@
+#include "history_codec.h"
+#include <string.h>
+
+
+
+//==============================
+//===== encoding functions =====
+//==============================
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static size_t put_varint(uint8_t *buf, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    return n;
+}
+
+static void put_le16(uint8_t *buf, uint16_t v) {
+    buf[0] = v & 0xFF;
+    buf[1] = (v >> 8) & 0xFF;
+}
+
+static void put_le64(uint8_t *buf, int64_t v) {
+    for (int i = 0; i < 8; i++) {
+        buf[i] = ((uint64_t)v >> (8 * i)) & 0xFF;
+    }
+}
+
+
+// reset head block of ring to a new, empty block (overwrites oldest data)
+static void start_block(history_ring_t *ring) {
+    history_block_t *blk = &ring->blocks[ring->head];
+    if (blk->seq != 0) {
+        ring->head = (ring->head + 1) % ring->block_count;
+        blk = &ring->blocks[ring->head];
+    }
+    blk->seq = ring->next_seq++;
+    blk->count = 0;
+    blk->used = 0;
+    ring->prev_delta_ms = 0;
+}
+
+
+// encode sample relative to encoder state of ring, returns encoded length
+static size_t encode_sample(const history_ring_t *ring, bool first, const history_sample_t *s, uint8_t *out) {
+    size_t n = 0;
+    if (first) {
+        // timestamp is stored in block header
+        for (int f = 0; f < HISTORY_FIELD_COUNT; f++) {
+            n += put_varint(out + n, zigzag(s->values[f]));
+        }
+    } else {
+        int64_t delta = s->timestamp_ms - ring->prev_ms;
+        n += put_varint(out + n, zigzag(delta - ring->prev_delta_ms));
+        for (int f = 0; f < HISTORY_FIELD_COUNT; f++) {
+            n += put_varint(out + n, zigzag((int64_t)s->values[f] - ring->prev_values[f]));
+        }
+    }
+    return n;
+}
+
+
+
+//==========================
+//===== public functions ===
+//==========================
+void common_history_ring_init(history_ring_t *ring, history_block_t *blocks, int block_count) {
+    memset(ring, 0, sizeof(*ring));
+    memset(blocks, 0, block_count * sizeof(history_block_t));
+    ring->blocks = blocks;
+    ring->block_count = block_count;
+    ring->next_seq = 1;
+}
+
+
+void common_history_ring_append(history_ring_t *ring, const history_sample_t *s) {
+    if (ring->block_count <= 0) {
+        return;
+    }
+    uint8_t encoded[HISTORY_MAX_ENCODED_SAMPLE_SIZE];
+    history_block_t *blk = &ring->blocks[ring->head];
+    bool first = (blk->seq == 0 || blk->count == 0);
+    if (blk->seq == 0) {
+        start_block(ring);
+        blk = &ring->blocks[ring->head];
+    }
+    size_t len = encode_sample(ring, first, s, encoded);
+
+    // does not fit anymore -> continue in next block, starting with a full sample
+    if (blk->used + len > HISTORY_BLOCK_SIZE) {
+        start_block(ring);
+        blk = &ring->blocks[ring->head];
+        first = true;
+        len = encode_sample(ring, first, s, encoded);
+    }
+
+    memcpy(&blk->data[blk->used], encoded, len);
+    blk->used += len;
+    blk->count++;
+    if (first) {
+        blk->first_ms = s->timestamp_ms;
+    } else {
+        ring->prev_delta_ms = s->timestamp_ms - ring->prev_ms;
+    }
+    blk->last_ms = s->timestamp_ms;
+    ring->prev_ms = s->timestamp_ms;
+    memcpy(ring->prev_values, s->values, sizeof(ring->prev_values));
+}
+
+
+size_t common_history_ring_message(const history_ring_t *ring, int64_t from_ms, int64_t to_ms, uint32_t after_seq,
+                                   uint16_t index, int64_t sent_ms, uint8_t *msg, uint32_t *seq) {
+    // looked up by sequence number each time, so blocks overwritten while a dump is sent
+    // are skipped instead of sent twice
+    const history_block_t *next = NULL;
+    for (int b = 0; b < ring->block_count; b++) {
+        const history_block_t *blk = &ring->blocks[b];
+        if (blk->seq > after_seq && blk->count > 0
+            && blk->first_ms <= to_ms && blk->last_ms >= from_ms
+            && (next == NULL || blk->seq < next->seq)) {
+            next = blk;
+        }
+    }
+    if (next == NULL) {
+        return 0;
+    }
+    *seq = next->seq;
+    msg[0] = HISTORY_FORMAT_VERSION;
+    msg[1] = 0;
+    put_le16(&msg[2], next->count);
+    put_le16(&msg[4], next->used);
+    put_le16(&msg[6], index);
+    put_le64(&msg[8], sent_ms);
+    put_le64(&msg[16], next->first_ms);
+    memcpy(&msg[HISTORY_MSG_HEADER_SIZE], next->data, next->used);
+    return HISTORY_MSG_HEADER_SIZE + next->used;
+}
+
+
+size_t common_history_final_message(uint16_t index, int64_t sent_ms, uint8_t *msg) {
+    memset(msg, 0, HISTORY_MSG_HEADER_SIZE);
+    msg[0] = HISTORY_FORMAT_VERSION;
+    msg[1] = HISTORY_FLAG_LAST;
+    put_le16(&msg[6], index);
+    put_le64(&msg[8], sent_ms);
+    return HISTORY_MSG_HEADER_SIZE;
+}
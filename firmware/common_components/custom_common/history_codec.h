@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Block encoding of the sample history (format in history_buffer.h): the blocks of a sensor are
+// used as a ring, samples are appended delta encoded to the head block and a block is formatted
+// as one history message.
+// No platform dependencies and not thread safe, history_buffer.c holds its lock around the calls.
+
+// override via compile definitions
+#ifndef HISTORY_BLOCK_SIZE
+#define HISTORY_BLOCK_SIZE 512
+#endif
+
+#define HISTORY_FORMAT_VERSION 1
+#define HISTORY_FLAG_LAST      0x01
+#define HISTORY_MSG_HEADER_SIZE 24
+
+// worst case encoded sample: timestamp + all fields as 64/32 bit zigzag varint
+#define HISTORY_MAX_ENCODED_SAMPLE_SIZE (10 + HISTORY_FIELD_COUNT * 5)
+
+// fields stored per sample, in this order
+typedef enum {
+    HISTORY_FIELD_VOLTAGE = 0,  // 0.1 V
+    HISTORY_FIELD_CURRENT,      // 0.001 A
+    HISTORY_FIELD_POWER,        // 0.1 W
+    HISTORY_FIELD_ENERGY,       // 1 Wh
+    HISTORY_FIELD_FREQUENCY,    // 0.1 Hz
+    HISTORY_FIELD_PF,           // 0.01
+    HISTORY_FIELD_COUNT
+} history_field_t;
+
+// Single sample in register units
+typedef struct {
+    int64_t timestamp_ms;       // device uptime in ms
+    int32_t values[HISTORY_FIELD_COUNT];
+} history_sample_t;
+
+typedef struct {
+    uint32_t seq;               // monotonic block number, 0 = unused
+    uint16_t count;             // samples in block
+    uint16_t used;              // bytes of data used
+    int64_t first_ms;
+    int64_t last_ms;
+    uint8_t data[HISTORY_BLOCK_SIZE];
+} history_block_t;
+
+typedef struct {
+    history_block_t *blocks;    // storage of the ring (caller owned)
+    int block_count;
+    int head;                   // block currently written to
+    uint32_t next_seq;
+    // encoder state of the head block
+    int64_t prev_ms;
+    int64_t prev_delta_ms;
+    int32_t prev_values[HISTORY_FIELD_COUNT];
+} history_ring_t;
+
+
+// Use block_count blocks as an empty ring
+void common_history_ring_init(history_ring_t *ring, history_block_t *blocks, int block_count);
+
+// Append a sample, the oldest block is overwritten when the ring is full
+void common_history_ring_append(history_ring_t *ring, const history_sample_t *sample);
+
+// Format the oldest block after sequence number after_seq overlapping [from_ms, to_ms] as message
+// number index into msg (HISTORY_MSG_HEADER_SIZE + HISTORY_BLOCK_SIZE bytes), sent_ms is the
+// uptime in the header. Returns the message length and the sequence number of the block in seq,
+// 0 when there is no such block
+size_t common_history_ring_message(const history_ring_t *ring, int64_t from_ms, int64_t to_ms, uint32_t after_seq,
+                                   uint16_t index, int64_t sent_ms, uint8_t *msg, uint32_t *seq);
+
+// Format the final message of a response (no data) into msg, returns HISTORY_MSG_HEADER_SIZE
+size_t common_history_final_message(uint16_t index, int64_t sent_ms, uint8_t *msg);
@@ -0,0 +1,59 @@
+#include "http_helper.h"
+#include "metrics.h"
+#include "task_layout.h"
+#include "memory_budget.h"
+#include "esp_log.h"
+
+#define TAG "common_http"
+
+
+// the http server handles one request at a time, so a single static buffer serves all scrapes
+static char s_metrics_buf[METRICS_BUFFER_SIZE];
+
+
+
+static bool send_chunk(metrics_writer_t *w, const char *buf, size_t len) {
+    return httpd_resp_send_chunk((httpd_req_t *)w->ctx, buf, len) == ESP_OK;
+}
+
+
+static esp_err_t metrics_get_handler(httpd_req_t *req) {
+    metrics_writer_t writer;
+    common_metrics_writer_init(&writer, s_metrics_buf, sizeof(s_metrics_buf), send_chunk, req);
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    if (!common_metrics_render(&writer)) {
+        // headers are already sent, just drop the connection
+        ESP_LOGW(TAG, "metrics scrape aborted");
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+
+
+httpd_handle_t common_http_start(uint16_t port) {
+    size_t heap_mark = common_membudget_heap_mark();
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = port;
+    config.lru_purge_enable = true;
+    config.core_id = TASK_CORE_NETWORK;
+    config.task_priority = HTTPD_TASK_PRIO;
+
+    httpd_handle_t server = NULL;
+    if (httpd_start(&server, &config) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start http server on port %u", port);
+        return NULL;
+    }
+
+    httpd_uri_t metrics = {
+        .uri = "/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_get_handler,
+    };
+    httpd_register_uri_handler(server, &metrics);
+    common_membudget_register("http", sizeof(s_metrics_buf) + common_metrics_static_bytes(), heap_mark);
+
+    ESP_LOGI(TAG, "http server listening on port %u", port);
+    return server;
+}
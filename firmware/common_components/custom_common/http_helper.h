@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+#include "esp_http_server.h"
+
+// Starts the http server with GET /metrics (Prometheus text format, see metrics.h),
+// returns server handle for registering further handlers or NULL on error
+httpd_handle_t common_http_start(uint16_t port);
@@ -0,0 +1,234 @@
+#include "live_stream.h"
+#include "sample_cache.h"
+#include "task_layout.h"
+#include "memory_budget.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define TAG "common_live"
+
+// wait at most this long for the http server to send a frame
+#define LIVE_SEND_TIMEOUT_MS 2000
+
+
+static httpd_handle_t s_server = NULL;
+static uint32_t s_interval_ms;
+static TaskHandle_t s_task = NULL;
+static StackType_t s_task_stack[LIVE_TASK_STACK];
+static StaticTask_t s_task_buffer;
+
+// socket fds of connected viewers, only modified by the http server task
+static int s_clients[LIVE_MAX_CLIENTS];
+static int s_client_count = 0;
+static portMUX_TYPE s_client_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// frame is built by the live task and sent by the http server task, s_sent signals completion,
+// after a send timeout it is not touched again before s_sent was given
+static uint8_t s_frame[LIVE_HEADER_SIZE + CACHE_MAX_SENSORS * LIVE_ENTRY_SIZE];
+static size_t s_frame_len = 0;
+static SemaphoreHandle_t s_sent;
+static StaticSemaphore_t s_sent_buffer;
+
+// ignored messages from viewers are received into this buffer
+static uint8_t s_rx_buf[64];
+
+
+
+//=========================
+//===== clients ===========
+//=========================
+static int client_count(void) {
+    int count;
+    portENTER_CRITICAL(&s_client_lock);
+    count = s_client_count;
+    portEXIT_CRITICAL(&s_client_lock);
+    return count;
+}
+
+
+static bool add_client(int fd) {
+    bool added = false;
+    portENTER_CRITICAL(&s_client_lock);
+    for (int c = 0; c < s_client_count; c++) {
+        if (s_clients[c] == fd) {
+            // fd of a closed viewer reused before its removal
+            added = true;
+        }
+    }
+    if (!added && s_client_count < LIVE_MAX_CLIENTS) {
+        s_clients[s_client_count++] = fd;
+        added = true;
+    }
+    portEXIT_CRITICAL(&s_client_lock);
+    return added;
+}
+
+
+static void remove_client(int index) {
+    portENTER_CRITICAL(&s_client_lock);
+    s_clients[index] = s_clients[--s_client_count];
+    portEXIT_CRITICAL(&s_client_lock);
+}
+
+
+
+//=========================
+//===== frames ============
+//=========================
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v & 0xFFFF);
+    put_u16(p + 2, v >> 16);
+}
+
+
+// sample all sensors (bus is only used when no sample younger than the interval exists) and build frame
+static void build_frame(uint16_t frame_seq) {
+    int count = common_cache_sensor_count();
+    uint8_t *p = s_frame + LIVE_HEADER_SIZE;
+
+    for (int i = 0; i < count; i++) {
+        pmon_sample_t sample;
+        const ModbusSensor *sensor = common_cache_get_sensor(i);
+        const pzem_profile_t *profile = common_sensor_profile(sensor);
+        uint8_t flags = sensor->profile < PZEM_PROFILE_COUNT ? (uint8_t)(sensor->profile << 4) : 0;
+        bool fresh = common_cache_get(i, s_interval_ms, &sample);
+        if (fresh || common_cache_peek(i, &sample)) {
+            flags |= LIVE_FLAG_VALID;
+            if (fresh) {
+                flags |= LIVE_FLAG_FRESH;
+            }
+            if (PzemFieldRaw(profile, sample.regs, PZ_FIELD_ALARM) != 0) {
+                flags |= LIVE_FLAG_ALARM;
+            }
+        } else {
+            memset(&sample, 0, sizeof(sample));
+        }
+
+        int64_t age_ms = (flags & LIVE_FLAG_VALID) ? esp_timer_get_time() / 1000 - sample.time_ms : 0xFFFF;
+        p[0] = i;
+        p[1] = flags;
+        put_u16(p + 2, age_ms > 0xFFFF ? 0xFFFF : (uint16_t)age_ms);
+        for (int r = 0; r < PZ_REGISTER_COUNT; r++) {
+            put_u16(p + 4 + 2 * r, sample.regs[r]);
+        }
+        p += LIVE_ENTRY_SIZE;
+    }
+
+    s_frame[0] = LIVE_FRAME_VERSION;
+    s_frame[1] = count;
+    put_u16(s_frame + 2, frame_seq);
+    put_u32(s_frame + 4, (uint32_t)(esp_timer_get_time() / 1000));
+    s_frame_len = p - s_frame;
+}
+
+
+// runs in the http server task, the only task that writes to the sockets
+static void send_frame_work(void *arg) {
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = s_frame,
+        .len = s_frame_len,
+    };
+    for (int c = s_client_count - 1; c >= 0; c--) {
+        int fd = s_clients[c];
+        if (httpd_ws_get_fd_info(s_server, fd) != HTTPD_WS_CLIENT_WEBSOCKET ||
+            httpd_ws_send_frame_async(s_server, fd, &frame) != ESP_OK) {
+            ESP_LOGI(TAG, "viewer fd=%d disconnected", fd);
+            remove_client(c);
+        }
+    }
+    xSemaphoreGive(s_sent);
+}
+
+
+static void live_task(void *arg) {
+    uint16_t frame_seq = 0;
+    bool in_flight = false;             // s_frame is still queued or being sent by the http server
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1) {
+        if (client_count() == 0) {
+            // no viewer: sleep until the handler registers one
+            ESP_LOGI(TAG, "no viewers, live sampling stopped");
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            ESP_LOGI(TAG, "live sampling started (%lu ms)", (unsigned long)s_interval_ms);
+            last_wake = xTaskGetTickCount();
+            continue;
+        }
+
+        if (in_flight) {
+            if (xSemaphoreTake(s_sent, 0) != pdTRUE) {
+                // the previous frame is still sent (slow viewer), skip this one
+                vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(s_interval_ms));
+                continue;
+            }
+            in_flight = false;
+        }
+
+        build_frame(frame_seq++);
+        if (httpd_queue_work(s_server, send_frame_work, NULL) == ESP_OK &&
+            xSemaphoreTake(s_sent, pdMS_TO_TICKS(LIVE_SEND_TIMEOUT_MS)) != pdTRUE) {
+            ESP_LOGW(TAG, "frame %u not sent within %d ms, skipping frames until it is", (unsigned)(uint16_t)(frame_seq - 1), LIVE_SEND_TIMEOUT_MS);
+            in_flight = true;
+        }
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(s_interval_ms));
+    }
+}
+
+
+
+//=========================
+//===== handler ===========
+//=========================
+static esp_err_t live_ws_handler(httpd_req_t *req) {
+    if (req->method == HTTP_GET) {
+        // handshake done
+        int fd = httpd_req_to_sockfd(req);
+        if (!add_client(fd)) {
+            ESP_LOGW(TAG, "max %d viewers, rejecting fd=%d", LIVE_MAX_CLIENTS, fd);
+            return ESP_FAIL;
+        }
+        ESP_LOGI(TAG, "viewer fd=%d connected", fd);
+        xTaskNotifyGive(s_task);
+        return ESP_OK;
+    }
+
+    // drain and ignore messages from the viewer
+    httpd_ws_frame_t frame = { .payload = s_rx_buf };
+    return httpd_ws_recv_frame(req, &frame, sizeof(s_rx_buf));
+}
+
+
+
+void common_live_start(httpd_handle_t server, uint32_t interval_ms) {
+    if (server == NULL) {
+        ESP_LOGE(TAG, "no http server, live stream disabled");
+        return;
+    }
+    size_t heap_mark = common_membudget_heap_mark();
+    s_server = server;
+    s_interval_ms = interval_ms;
+    s_sent = xSemaphoreCreateBinaryStatic(&s_sent_buffer);
+    s_task = xTaskCreateStaticPinnedToCore(live_task, "LiveStream", LIVE_TASK_STACK, NULL, LIVE_TASK_PRIO,
+                                           s_task_stack, &s_task_buffer, TASK_CORE_MEASUREMENT);
+
+    httpd_uri_t live = {
+        .uri = "/live",
+        .method = HTTP_GET,
+        .handler = live_ws_handler,
+        .is_websocket = true,
+    };
+    httpd_register_uri_handler(server, &live);
+    common_membudget_register("live", sizeof(s_task_stack) + sizeof(s_task_buffer) + sizeof(s_frame) + sizeof(s_rx_buf), heap_mark);
+}
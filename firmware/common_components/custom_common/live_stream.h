@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include "esp_http_server.h"
+
+// WebSocket live view (GET /live on the http server, see http_helper.h) for dashboards.
+// While at least one viewer is connected all sensors are sampled every interval_ms and sent as one
+// binary frame, without viewers the task sleeps and the normal publish schedule is unaffected.
+// Messages from the viewer are ignored.
+//
+// Frame layout (all values little endian):
+//   header, 8 bytes
+//     u8  version             LIVE_FRAME_VERSION
+//     u8  count               number of sensor entries
+//     u16 frame_seq           incremented with every frame, detects lost frames
+//     u32 time_ms             uptime of the node (low 32 bits)
+//   count x sensor entry, 24 bytes
+//     u8  index               sensor index in the node config
+//     u8  flags               LIVE_FLAG_*
+//     u16 age_ms              age of the sample (saturates at 65535)
+//     u16 regs[10]            raw input registers 0x0000-0x0009 of the PZEM, zero if no sample
+//                             or not read, layout by device type (LIVE_FLAG_PROFILE):
+//                             PZEM-004T/-016: voltage 0.1 V, current 1 mA (lo,hi), power 0.1 W (lo,hi),
+//                                             energy 1 Wh (lo,hi), frequency 0.1 Hz, pf 0.01, alarm
+//                             PZEM-017:       voltage 0.01 V, current 0.01 A, power 0.1 W (lo,hi),
+//                                             energy 1 Wh (lo,hi), high/low voltage alarm, 0, 0
+
+#define LIVE_FRAME_VERSION    1
+#define LIVE_HEADER_SIZE      8
+#define LIVE_ENTRY_SIZE       24
+#define LIVE_MAX_CLIENTS      4
+
+#define LIVE_FLAG_VALID       0x01    // regs contain a sample
+#define LIVE_FLAG_FRESH       0x02    // sample was taken for this frame (read did not fail)
+#define LIVE_FLAG_ALARM       0x04    // power alarm of the module active
+#define LIVE_FLAG_PROFILE(flags)  (((flags) >> 4) & 0x03)    // pzem_profile_id_t of the module
+
+// Register /live on the server and start the sampling task, sample cache has to be initialized already
+void common_live_start(httpd_handle_t server, uint32_t interval_ms);
@@ -0,0 +1,118 @@
+#include "memory_budget.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define TAG "common_membudget"
+
+static membudget_entry_t s_entries[MEMBUDGET_MAX_COMPONENTS];
+static int s_count = 0;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static bool s_sealed = false;
+static uint32_t s_baseline_free = 0;
+static uint32_t s_baseline_min_free = 0;
+static int32_t s_last_warned_drift = 0;
+static esp_timer_handle_t s_check_timer = NULL;
+
+
+
+size_t common_membudget_heap_mark(void) {
+    return esp_get_free_heap_size();
+}
+
+
+void common_membudget_register(const char *component, size_t static_bytes, size_t heap_mark) {
+    int32_t heap = heap_mark > 0 ? (int32_t)heap_mark - (int32_t)esp_get_free_heap_size() : 0;
+
+    portENTER_CRITICAL(&s_lock);
+    int i = 0;
+    while (i < s_count && strcmp(s_entries[i].component, component) != 0) {
+        i++;
+    }
+    if (i == s_count && s_count < MEMBUDGET_MAX_COMPONENTS) {
+        s_entries[i] = (membudget_entry_t){ .component = component };
+        s_count++;
+    }
+    if (i < s_count) {
+        s_entries[i].static_bytes += static_bytes;
+        s_entries[i].heap_bytes += heap;
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    if (i == MEMBUDGET_MAX_COMPONENTS) {
+        ESP_LOGE(TAG, "too many components, %s not registered", component);
+    }
+}
+
+
+int32_t common_membudget_heap_drift(void) {
+    if (!s_sealed) {
+        return 0;
+    }
+    return (int32_t)s_baseline_free - (int32_t)esp_get_free_heap_size();
+}
+
+
+int32_t common_membudget_max_heap_drift(void) {
+    if (!s_sealed) {
+        return 0;
+    }
+    return (int32_t)s_baseline_min_free - (int32_t)esp_get_minimum_free_heap_size();
+}
+
+
+bool common_membudget_get(int index, membudget_entry_t *entry) {
+    bool ok = false;
+    portENTER_CRITICAL(&s_lock);
+    if (index >= 0 && index < s_count) {
+        *entry = s_entries[index];
+        ok = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return ok;
+}
+
+
+// periodic drift check, logs when the heap use grows beyond the last warning
+static void check_drift(void *arg) {
+    int32_t drift = common_membudget_heap_drift();
+    if (drift > MEMBUDGET_DRIFT_WARN_BYTES && drift > s_last_warned_drift + MEMBUDGET_DRIFT_WARN_BYTES) {
+        ESP_LOGW(TAG, "heap use grew by %ld bytes since boot (free %lu, minimum %lu)", (long)drift,
+                 (unsigned long)esp_get_free_heap_size(), (unsigned long)esp_get_minimum_free_heap_size());
+        s_last_warned_drift = drift;
+    }
+}
+
+
+void common_membudget_seal(void) {
+    uint32_t total_static = 0;
+    int32_t total_heap = 0;
+    ESP_LOGI(TAG, "memory budget:   static     heap");
+    for (int i = 0; i < s_count; i++) {
+        ESP_LOGI(TAG, "  %-12s %8lu %8ld", s_entries[i].component,
+                 (unsigned long)s_entries[i].static_bytes, (long)s_entries[i].heap_bytes);
+        total_static += s_entries[i].static_bytes;
+        total_heap += s_entries[i].heap_bytes;
+    }
+    ESP_LOGI(TAG, "  %-12s %8lu %8ld", "total", (unsigned long)total_static, (long)total_heap);
+
+#if STATIC_MEMORY_MODE
+    if (s_check_timer == NULL) {
+        const esp_timer_create_args_t args = {
+            .callback = check_drift,
+            .name = "membudget",
+        };
+        esp_timer_create(&args, &s_check_timer);
+        esp_timer_start_periodic(s_check_timer, MEMBUDGET_CHECK_INTERVAL_MS * 1000ULL);
+    }
+#endif
+
+    // after the timer, it is part of the boot allocations
+    s_baseline_free = esp_get_free_heap_size();
+    s_baseline_min_free = esp_get_minimum_free_heap_size();
+    s_sealed = true;
+    ESP_LOGI(TAG, "free heap after boot %lu bytes (minimum %lu)", (unsigned long)s_baseline_free, (unsigned long)s_baseline_min_free);
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "history_codec.h"
+
+// Memory budget of the node: every component registers its static state and the heap it took
+// while starting, after boot the free heap is the baseline and any drift is reported.
+//
+// Static memory mode: all sensor state, buffers, queues and task stacks of the application are
+// static, the UART driver is installed once with an RX buffer sized to Modbus frames, esp-mqtt uses
+// fixed buffers and a bounded outbox. The remaining heap users after boot are WiFi/lwIP and the
+// esp-mqtt outbox (up to MQTT_OUTBOX_LIMIT_BYTES), so the heap stays flat on long running nodes.
+#ifndef STATIC_MEMORY_MODE
+#define STATIC_MEMORY_MODE 1
+#endif
+
+#define MQTT_BUFFER_SIZE             1024     // in and out buffer of esp-mqtt, largest message is a history reply
+
+// QoS1 messages waiting for PUBACK. History answers and backlog are paced by the publish task (one
+// message every PMON_BACKLOG_INTERVAL_MS), the outbox holds MQTT_OUTBOX_HISTORY_MESSAGES of them
+// (~3 s without PUBACK) on top of the value publishes. A history message that does not fit is sent
+// again later, a value publish that does not fit is dropped (kept in the history)
+#define MQTT_OUTBOX_HISTORY_MESSAGES 16
+#define MQTT_OUTBOX_HISTORY_MSG_BYTES (HISTORY_MSG_HEADER_SIZE + HISTORY_BLOCK_SIZE + 64)  // + topic and MQTT header
+#define MQTT_OUTBOX_VALUE_BYTES      4096     // ~50 value publishes
+#define MQTT_OUTBOX_LIMIT_BYTES      (MQTT_OUTBOX_HISTORY_MESSAGES * MQTT_OUTBOX_HISTORY_MSG_BYTES + MQTT_OUTBOX_VALUE_BYTES)
+
+#define MEMBUDGET_MAX_COMPONENTS     16
+#define MEMBUDGET_CHECK_INTERVAL_MS  60000    // heap drift check (static memory mode)
+#define MEMBUDGET_DRIFT_WARN_BYTES   4096     // drift above this is logged as warning
+
+typedef struct {
+    const char *component;
+    uint32_t static_bytes;          // statically allocated state incl. task stacks
+    int32_t heap_bytes;             // heap taken while starting (approximate, other tasks run meanwhile)
+} membudget_entry_t;
+
+// Free heap before starting a component, pass it to common_membudget_register afterwards
+size_t common_membudget_heap_mark(void);
+
+// Register a component, heap_mark: value of common_membudget_heap_mark before starting it, 0 = no heap
+// Registering the same component again adds to its entry
+void common_membudget_register(const char *component, size_t static_bytes, size_t heap_mark);
+
+// End of boot: logs the budget and takes the free heap as baseline for the drift
+void common_membudget_seal(void);
+
+// Copy entry, returns false for an invalid index
+bool common_membudget_get(int index, membudget_entry_t *entry);
+
+// Heap used since common_membudget_seal (baseline free - current free), 0 before
+int32_t common_membudget_heap_drift(void);
+
+// Growth of the heap low water mark since common_membudget_seal (peaks, e.g. outbox filled while offline)
+int32_t common_membudget_max_heap_drift(void);
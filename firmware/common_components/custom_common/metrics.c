@@ -0,0 +1,582 @@
+#include "metrics.h"
+#include "sample_cache.h"
+#include "modbus_gateway.h"
+#include "powermon_task.h"
+#include "pzem_bus.h"
+#include "memory_budget.h"
+#include "mqtt_helper.h"
+#include "wifi_helper.h"
+#include "bus_sniffer.h"
+#include "warm_restart.h"
+#include "energy_store.h"
+#include "task_stats.h"
+#include "power_save.h"
+#include "time_sync.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_wifi.h"
+
+#define TAG "common_metrics"
+
+#define LABEL_MAX 96
+
+
+// Snapshot of all sensors, taken once per scrape so every family shows the same sample.
+// Rendering is not reentrant, the http server runs all handlers in a single task
+static pmon_sample_t s_samples[CACHE_MAX_SENSORS];
+static bool s_valid[CACHE_MAX_SENSORS];
+static pmon_health_t s_health[CACHE_MAX_SENSORS];
+static char s_labels[CACHE_MAX_SENSORS][LABEL_MAX];
+static const pzem_profile_t *s_profiles[CACHE_MAX_SENSORS];
+static energy_info_t s_energy[CACHE_MAX_SENSORS];
+static task_stats_t s_tasks;
+
+
+
+//=========================
+//===== writer ============
+//=========================
+void common_metrics_writer_init(metrics_writer_t *w, char *buf, size_t size, metrics_flush_cb_t flush, void *ctx) {
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->failed = false;
+    w->flush = flush;
+    w->ctx = ctx;
+}
+
+
+static bool flush_buffer(metrics_writer_t *w) {
+    if (!w->failed && w->len > 0 && !w->flush(w, w->buf, w->len)) {
+        w->failed = true;
+    }
+    w->len = 0;
+    return !w->failed;
+}
+
+
+void common_metrics_printf(metrics_writer_t *w, const char *fmt, ...) {
+    if (w->failed) {
+        return;
+    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(w->buf + w->len, w->size - w->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            w->failed = true;
+            return;
+        }
+        if ((size_t)n < w->size - w->len) {
+            w->len += n;
+            return;
+        }
+        // does not fit: send what we have and retry in the empty buffer
+        if (w->len == 0 || !flush_buffer(w)) {
+            w->failed = true;
+            return;
+        }
+    }
+}
+
+
+void common_metrics_family(metrics_writer_t *w, const char *name, const char *type, const char *help) {
+    common_metrics_printf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+void common_metrics_value(metrics_writer_t *w, const char *name, const char *labels, double value) {
+    if (labels != NULL && labels[0] != '\0') {
+        common_metrics_printf(w, "%s{%s} %.10g\n", name, labels, value);
+    } else {
+        common_metrics_printf(w, "%s %.10g\n", name, value);
+    }
+}
+
+
+void common_metrics_escape(char *out, size_t size, const char *value) {
+    size_t o = 0;
+    for (const char *c = value; *c != '\0' && o + 2 < size; c++) {
+        if (*c == '\\' || *c == '"') {
+            out[o++] = '\\';
+            out[o++] = *c;
+        } else if (*c == '\n') {
+            out[o++] = '\\';
+            out[o++] = 'n';
+        } else {
+            out[o++] = *c;
+        }
+    }
+    out[o] = '\0';
+}
+
+
+
+//=========================
+//===== sensors ===========
+//=========================
+size_t common_metrics_static_bytes(void) {
+    return sizeof(s_samples) + sizeof(s_valid) + sizeof(s_health) + sizeof(s_labels) + sizeof(s_profiles) + sizeof(s_energy)
+           + sizeof(s_tasks) + common_task_stats_static_bytes();
+}
+
+
+static int snapshot_sensors(void) {
+    int count = common_cache_sensor_count();
+    for (int i = 0; i < count; i++) {
+        const ModbusSensor *sensor = common_cache_get_sensor(i);
+        char name[LABEL_MAX - 24];
+        common_metrics_escape(name, sizeof(name), sensor->name);
+        snprintf(s_labels[i], LABEL_MAX, "sensor=\"%s\",addr=\"%u\"", name, sensor->modbus_addr);
+        s_profiles[i] = common_sensor_profile(sensor);
+        s_valid[i] = common_cache_peek(i, &s_samples[i]);
+        common_cache_get_health(i, &s_health[i]);
+    }
+    return count;
+}
+
+
+// one family with the raw register based value of every sensor that has a sample and whose
+// device type measures the value (energy in Wh, the resolution of the register)
+static void render_sample_family(metrics_writer_t *w, int count, const char *name, const char *type,
+                                 const char *help, pzem_field_t field) {
+    common_metrics_family(w, name, type, help);
+    for (int i = 0; i < count; i++) {
+        if (!s_valid[i] || !(PzemProfileFields(s_profiles[i]) & PZ_FIELD_BIT(field))) {
+            continue;
+        }
+        double value = field == PZ_FIELD_ENERGY ? PzemFieldRaw(s_profiles[i], s_samples[i].regs, field)
+                                                : PzemFieldValue(s_profiles[i], s_samples[i].regs, field);
+        common_metrics_value(w, name, s_labels[i], value);
+    }
+}
+
+
+static void render_sensors(metrics_writer_t *w) {
+    int count = snapshot_sensors();
+    int64_t now_ms = esp_timer_get_time() / 1000;
+
+    render_sample_family(w, count, "powermon_voltage_volts", "gauge", "RMS voltage", PZ_FIELD_VOLTAGE);
+    render_sample_family(w, count, "powermon_current_amperes", "gauge", "RMS current", PZ_FIELD_CURRENT);
+    render_sample_family(w, count, "powermon_power_watts", "gauge", "Active power", PZ_FIELD_POWER);
+    render_sample_family(w, count, "powermon_energy_watt_hours_total", "counter", "Active energy counter of the module", PZ_FIELD_ENERGY);
+    render_sample_family(w, count, "powermon_frequency_hertz", "gauge", "Line frequency", PZ_FIELD_FREQUENCY);
+    render_sample_family(w, count, "powermon_power_factor", "gauge", "Power factor", PZ_FIELD_PF);
+    render_sample_family(w, count, "powermon_alarm", "gauge", "Power alarm of the module active", PZ_FIELD_ALARM);
+
+    // age of the values that are not in the fast lane (a fast lane read refreshes only some registers)
+    common_metrics_family(w, "powermon_sample_age_seconds", "gauge", "Age of the latest full read");
+    for (int i = 0; i < count; i++) {
+        if (s_valid[i]) {
+            common_metrics_value(w, "powermon_sample_age_seconds", s_labels[i], (now_ms - s_samples[i].full_time_ms) / 1000.0);
+        }
+    }
+
+    common_metrics_family(w, "powermon_samples_total", "counter", "Samples taken");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_samples_total", s_labels[i], s_valid[i] ? s_samples[i].seq : 0);
+    }
+
+    common_metrics_family(w, "powermon_reads_total", "counter", "Bus reads by result");
+    for (int i = 0; i < count; i++) {
+        common_metrics_printf(w, "powermon_reads_total{%s,result=\"ok\"} %u\n", s_labels[i], (unsigned)s_health[i].reads_ok);
+        common_metrics_printf(w, "powermon_reads_total{%s,result=\"failed\"} %u\n", s_labels[i], (unsigned)s_health[i].reads_failed);
+        common_metrics_printf(w, "powermon_reads_total{%s,result=\"zero\"} %u\n", s_labels[i], (unsigned)s_health[i].reads_zero);
+    }
+
+    common_metrics_family(w, "powermon_partial_reads_total", "counter", "Successful fast lane reads of a register range (included in ok reads)");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_partial_reads_total", s_labels[i], s_health[i].reads_partial);
+    }
+
+    common_metrics_family(w, "powermon_last_read_duration_seconds", "gauge", "Duration of the last bus transaction");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_last_read_duration_seconds", s_labels[i], s_health[i].last_duration_us / 1e6);
+    }
+
+    common_metrics_family(w, "powermon_interval_seconds", "gauge", "Read interval: configured, after bus admission and currently used");
+    for (int i = 0; i < count; i++) {
+        pmon_schedule_info_t sched;
+        if (common_pmon_get_schedule(i, &sched)) {
+            common_metrics_printf(w, "powermon_interval_seconds{%s,kind=\"configured\"} %.3f\n", s_labels[i], sched.configured_interval_ms / 1000.0);
+            common_metrics_printf(w, "powermon_interval_seconds{%s,kind=\"admitted\"} %.3f\n", s_labels[i], sched.admitted_interval_ms / 1000.0);
+            common_metrics_printf(w, "powermon_interval_seconds{%s,kind=\"current\"} %.3f\n", s_labels[i], sched.current_interval_ms / 1000.0);
+            if (sched.fast_interval_ms > 0) {
+                common_metrics_printf(w, "powermon_interval_seconds{%s,kind=\"fast\"} %.3f\n", s_labels[i], sched.fast_interval_ms / 1000.0);
+            }
+        }
+    }
+
+    common_metrics_family(w, "powermon_modeled_read_duration_seconds", "gauge", "Bus time of one read according to the bus model");
+    for (int i = 0; i < count; i++) {
+        pmon_schedule_info_t sched;
+        if (common_pmon_get_schedule(i, &sched)) {
+            common_metrics_value(w, "powermon_modeled_read_duration_seconds", s_labels[i], sched.modeled_read_us / 1e6);
+        }
+    }
+
+    common_metrics_family(w, "powermon_modeled_fast_read_duration_seconds", "gauge", "Bus time of one fast lane read according to the bus model");
+    for (int i = 0; i < count; i++) {
+        pmon_schedule_info_t sched;
+        if (common_pmon_get_schedule(i, &sched) && sched.fast_interval_ms > 0) {
+            common_metrics_value(w, "powermon_modeled_fast_read_duration_seconds", s_labels[i], sched.modeled_fast_read_us / 1e6);
+        }
+    }
+
+    common_metrics_family(w, "powermon_priority", "gauge", "Scheduling class (-1 low, 0 normal, 1 high)");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_priority", s_labels[i], common_cache_get_sensor(i)->priority);
+    }
+
+    common_metrics_family(w, "powermon_breaker_state", "gauge", "Circuit breaker of the sensor (0 closed, 1 half open, 2 open)");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_breaker_state", s_labels[i], s_health[i].breaker_state);
+    }
+
+    common_metrics_family(w, "powermon_breaker_trips_total", "counter", "Circuit breaker transitions from closed to open");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_breaker_trips_total", s_labels[i], s_health[i].breaker_trips);
+    }
+
+    common_metrics_family(w, "powermon_reads_skipped_total", "counter", "Reads refused by backoff or open circuit breaker");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_reads_skipped_total", s_labels[i], s_health[i].reads_skipped);
+    }
+
+    common_metrics_family(w, "powermon_up", "gauge", "Last read of the sensor succeeded");
+    for (int i = 0; i < count; i++) {
+        common_metrics_value(w, "powermon_up", s_labels[i], s_health[i].last_ok_ms != 0 && s_health[i].consecutive_failures == 0);
+    }
+}
+
+
+
+//=========================
+//===== system ============
+//=========================
+// summary (sum/count) plus last and max of an outage duration, base: name without unit
+static void render_outage(metrics_writer_t *w, const char *base, const char *help, const wifi_outage_t *outage) {
+    char name[64];
+    char metric[80];
+    snprintf(name, sizeof(name), "%s_seconds", base);
+    common_metrics_family(w, name, "summary", help);
+    snprintf(metric, sizeof(metric), "%s_sum", name);
+    common_metrics_value(w, metric, NULL, outage->sum_ms / 1e3);
+    snprintf(metric, sizeof(metric), "%s_count", name);
+    common_metrics_value(w, metric, NULL, outage->count);
+    snprintf(name, sizeof(name), "%s_last_seconds", base);
+    common_metrics_family(w, name, "gauge", "Duration of the last outage");
+    common_metrics_value(w, name, NULL, outage->last_ms / 1e3);
+    snprintf(name, sizeof(name), "%s_max_seconds", base);
+    common_metrics_family(w, name, "gauge", "Longest outage since boot");
+    common_metrics_value(w, name, NULL, outage->max_ms / 1e3);
+}
+
+
+static void render_system(metrics_writer_t *w) {
+    common_metrics_family(w, "powermon_uptime_seconds", "gauge", "Time since boot");
+    common_metrics_value(w, "powermon_uptime_seconds", NULL, esp_timer_get_time() / 1e6);
+
+    common_metrics_family(w, "powermon_reset_reason", "gauge", "Reason of the last reset (esp_reset_reason_t)");
+    common_metrics_value(w, "powermon_reset_reason", NULL, esp_reset_reason());
+
+    warm_stats_t warm;
+    common_warm_get_stats(&warm);
+    common_metrics_family(w, "powermon_warm_restart_source", "gauge", "State restored at boot from: 0 = nothing (cold start), 1 = RTC memory, 2 = NVS snapshot");
+    common_metrics_value(w, "powermon_warm_restart_source", NULL, warm.source);
+    common_metrics_family(w, "powermon_warm_restarts", "gauge", "Resets with a valid RTC checkpoint since the last power cycle");
+    common_metrics_value(w, "powermon_warm_restarts", NULL, warm.restarts);
+    common_metrics_family(w, "powermon_warm_restored_sensors", "gauge", "Sensors whose state was restored at boot");
+    common_metrics_value(w, "powermon_warm_restored_sensors", NULL, warm.restored_sensors);
+    common_metrics_family(w, "powermon_warm_snapshots_total", "counter", "NVS snapshots of the warm restart state by result");
+    common_metrics_printf(w, "powermon_warm_snapshots_total{result=\"ok\"} %u\n", (unsigned)warm.snapshots);
+    common_metrics_printf(w, "powermon_warm_snapshots_total{result=\"error\"} %u\n", (unsigned)warm.snapshot_errors);
+
+    common_metrics_family(w, "powermon_heap_free_bytes", "gauge", "Free heap");
+    common_metrics_value(w, "powermon_heap_free_bytes", NULL, esp_get_free_heap_size());
+
+    common_metrics_family(w, "powermon_heap_min_free_bytes", "gauge", "Lowest free heap since boot");
+    common_metrics_value(w, "powermon_heap_min_free_bytes", NULL, esp_get_minimum_free_heap_size());
+
+    common_metrics_family(w, "powermon_heap_largest_free_block_bytes", "gauge", "Largest free heap block");
+    common_metrics_value(w, "powermon_heap_largest_free_block_bytes", NULL, heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+    common_metrics_family(w, "powermon_heap_drift_bytes", "gauge", "Heap used since end of boot (should stay around 0)");
+    common_metrics_value(w, "powermon_heap_drift_bytes", NULL, common_membudget_heap_drift());
+    common_metrics_family(w, "powermon_heap_max_drift_bytes", "gauge", "Growth of the heap low water mark since end of boot");
+    common_metrics_value(w, "powermon_heap_max_drift_bytes", NULL, common_membudget_max_heap_drift());
+
+    membudget_entry_t entry;
+    char labels[48];
+    common_metrics_family(w, "powermon_memory_static_bytes", "gauge", "Statically allocated memory by component");
+    for (int i = 0; common_membudget_get(i, &entry); i++) {
+        snprintf(labels, sizeof(labels), "component=\"%s\"", entry.component);
+        common_metrics_value(w, "powermon_memory_static_bytes", labels, entry.static_bytes);
+    }
+    common_metrics_family(w, "powermon_memory_heap_bytes", "gauge", "Heap taken at start by component");
+    for (int i = 0; common_membudget_get(i, &entry); i++) {
+        snprintf(labels, sizeof(labels), "component=\"%s\"", entry.component);
+        common_metrics_value(w, "powermon_memory_heap_bytes", labels, entry.heap_bytes);
+    }
+
+    wifi_stats_t ws;
+    common_wifi_get_stats(&ws);
+    common_metrics_family(w, "powermon_wifi_connected", "gauge", "WiFi connected with IP");
+    common_metrics_value(w, "powermon_wifi_connected", NULL, ws.connected);
+    common_metrics_family(w, "powermon_wifi_disconnects_total", "counter", "WiFi connection losses");
+    common_metrics_value(w, "powermon_wifi_disconnects_total", NULL, ws.disconnects);
+    common_metrics_family(w, "powermon_wifi_last_disconnect_reason", "gauge", "Reason code of the last WiFi disconnect (wifi_err_reason_t)");
+    common_metrics_value(w, "powermon_wifi_last_disconnect_reason", NULL, ws.last_reason);
+    common_metrics_family(w, "powermon_wifi_connect_attempts_total", "counter", "WiFi connect attempts that succeeded without scan or used a full scan");
+    common_metrics_printf(w, "powermon_wifi_connect_attempts_total{kind=\"fast_success\"} %u\n", (unsigned)ws.fast_connects);
+    common_metrics_printf(w, "powermon_wifi_connect_attempts_total{kind=\"full_scan\"} %u\n", (unsigned)ws.full_scans);
+    render_outage(w, "powermon_wifi_outage_to_ip", "From WiFi disconnect to IP", &ws.to_ip);
+    render_outage(w, "powermon_wifi_outage_to_mqtt", "From WiFi disconnect to MQTT connected", &ws.to_mqtt);
+
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+        common_metrics_family(w, "powermon_wifi_rssi_dbm", "gauge", "Signal strength of the access point");
+        common_metrics_value(w, "powermon_wifi_rssi_dbm", NULL, ap.rssi);
+        common_metrics_family(w, "powermon_wifi_channel", "gauge", "WiFi channel");
+        common_metrics_value(w, "powermon_wifi_channel", NULL, ap.primary);
+    }
+}
+
+
+static void render_bus(metrics_writer_t *w) {
+    bus_stats_t st;
+    common_bus_get_stats(&st);
+    float planned;
+    bus_admission_t admission = common_pmon_get_admission(&planned);
+
+    common_metrics_family(w, "powermon_bus_utilization_ratio", "gauge", "Measured share of time the bus was held (last window)");
+    common_metrics_value(w, "powermon_bus_utilization_ratio", NULL, st.utilization);
+    common_metrics_family(w, "powermon_bus_planned_utilization_ratio", "gauge", "Bus utilization planned by admission control");
+    common_metrics_value(w, "powermon_bus_planned_utilization_ratio", NULL, planned);
+    common_metrics_family(w, "powermon_bus_admission", "gauge", "Result of the bus admission control");
+    common_metrics_printf(w, "powermon_bus_admission{result=\"%s\"} 1\n", common_busmodel_admission_str(admission));
+    common_metrics_family(w, "powermon_bus_busy_seconds_total", "counter", "Time the bus was held");
+    common_metrics_value(w, "powermon_bus_busy_seconds_total", NULL, st.busy_us / 1e6);
+    common_metrics_family(w, "powermon_bus_transactions_total", "counter", "Bus transactions");
+    common_metrics_value(w, "powermon_bus_transactions_total", NULL, st.transactions);
+    common_metrics_family(w, "powermon_bus_wait_seconds_total", "counter", "Time spent waiting for the bus");
+    common_metrics_value(w, "powermon_bus_wait_seconds_total", NULL, st.wait_us / 1e6);
+    common_metrics_family(w, "powermon_bus_max_wait_seconds", "gauge", "Longest wait for the bus");
+    common_metrics_value(w, "powermon_bus_max_wait_seconds", NULL, st.max_wait_us / 1e6);
+}
+
+
+static void render_lateness(metrics_writer_t *w) {
+    static const int bounds_ms[PMON_LATENESS_BUCKETS] = { PMON_LATENESS_BOUNDS_MS };
+    pmon_lateness_t lt;
+    common_pmon_get_lateness(&lt);
+
+    common_metrics_family(w, "powermon_poll_start_lateness_seconds", "histogram", "Start of a sensor read after it was due");
+    uint32_t cumulative = 0;
+    for (int b = 0; b < PMON_LATENESS_BUCKETS; b++) {
+        cumulative += lt.buckets[b];
+        common_metrics_printf(w, "powermon_poll_start_lateness_seconds_bucket{le=\"%g\"} %u\n", bounds_ms[b] / 1e3, (unsigned)cumulative);
+    }
+    common_metrics_printf(w, "powermon_poll_start_lateness_seconds_bucket{le=\"+Inf\"} %u\n", (unsigned)lt.count);
+    common_metrics_value(w, "powermon_poll_start_lateness_seconds_sum", NULL, lt.sum_us / 1e6);
+    common_metrics_value(w, "powermon_poll_start_lateness_seconds_count", NULL, lt.count);
+    common_metrics_family(w, "powermon_poll_start_lateness_max_seconds", "gauge", "Largest poll start lateness since boot");
+    common_metrics_value(w, "powermon_poll_start_lateness_max_seconds", NULL, lt.max_us / 1e6);
+}
+
+
+static void render_mqtt(metrics_writer_t *w) {
+    static const int bounds_ms[MQTT_ACK_BUCKETS] = { MQTT_ACK_BOUNDS_MS };
+    mqtt_publish_stats_t st;
+    common_mqtt_get_publish_stats(&st);
+
+    common_metrics_family(w, "powermon_mqtt_publishes_total", "counter", "MQTT publishes by outcome");
+    common_metrics_printf(w, "powermon_mqtt_publishes_total{result=\"accepted\"} %u\n", (unsigned)st.published);
+    common_metrics_printf(w, "powermon_mqtt_publishes_total{result=\"failed\"} %u\n", (unsigned)st.failed);
+    common_metrics_family(w, "powermon_mqtt_publish_ack_seconds", "histogram", "Time from a QoS 1 publish to the ack of the broker");
+    uint32_t cumulative = 0;
+    for (int b = 0; b < MQTT_ACK_BUCKETS; b++) {
+        cumulative += st.buckets[b];
+        common_metrics_printf(w, "powermon_mqtt_publish_ack_seconds_bucket{le=\"%g\"} %u\n", bounds_ms[b] / 1e3, (unsigned)cumulative);
+    }
+    common_metrics_printf(w, "powermon_mqtt_publish_ack_seconds_bucket{le=\"+Inf\"} %u\n", (unsigned)st.acked);
+    common_metrics_value(w, "powermon_mqtt_publish_ack_seconds_sum", NULL, st.sum_us / 1e6);
+    common_metrics_value(w, "powermon_mqtt_publish_ack_seconds_count", NULL, st.acked);
+    common_metrics_family(w, "powermon_mqtt_publish_ack_max_seconds", "gauge", "Longest publish ack time since boot");
+    common_metrics_value(w, "powermon_mqtt_publish_ack_max_seconds", NULL, st.max_us / 1e6);
+    common_metrics_family(w, "powermon_mqtt_in_flight", "gauge", "Publishes waiting for the ack of the broker");
+    common_metrics_value(w, "powermon_mqtt_in_flight", NULL, st.in_flight);
+    common_metrics_family(w, "powermon_mqtt_acks_lost_total", "counter", "Publishes without ack within the outbox expiry");
+    common_metrics_value(w, "powermon_mqtt_acks_lost_total", NULL, st.lost);
+    pmon_backlog_stats_t bl;
+    common_pmon_get_backlog_stats(&bl);
+    common_metrics_family(w, "powermon_mqtt_deferred_samples_total", "counter", "Samples not published while MQTT was down (sent later as backlog)");
+    common_metrics_value(w, "powermon_mqtt_deferred_samples_total", NULL, bl.deferred);
+    common_metrics_family(w, "powermon_mqtt_reconnect_flushes_total", "counter", "Reconnects with publish of the latest values");
+    common_metrics_value(w, "powermon_mqtt_reconnect_flushes_total", NULL, bl.reconnects);
+    common_metrics_family(w, "powermon_mqtt_backlog_messages_total", "counter", "History messages sent as backlog after an outage");
+    common_metrics_value(w, "powermon_mqtt_backlog_messages_total", NULL, bl.backlog_messages);
+    common_metrics_family(w, "powermon_mqtt_backlog_pending_sensors", "gauge", "Sensors with backlog still to send");
+    common_metrics_value(w, "powermon_mqtt_backlog_pending_sensors", NULL, bl.backlog_pending);
+    common_metrics_family(w, "powermon_mqtt_publishes_untracked_total", "counter", "Publishes not measured because the in-flight table was full");
+    common_metrics_value(w, "powermon_mqtt_publishes_untracked_total", NULL, st.untracked);
+}
+
+
+static void render_gateway(metrics_writer_t *w) {
+    MbGatewayStats_t st;
+    if (!common_mbgw_get_stats(&st)) {
+        return;
+    }
+    common_metrics_family(w, "powermon_mbgw_requests_total", "counter", "Modbus TCP requests by outcome");
+    common_metrics_printf(w, "powermon_mbgw_requests_total{result=\"received\"} %u\n", (unsigned)st.requests);
+    common_metrics_printf(w, "powermon_mbgw_requests_total{result=\"cache_hit\"} %u\n", (unsigned)st.cache_hits);
+    common_metrics_printf(w, "powermon_mbgw_requests_total{result=\"coalesced\"} %u\n", (unsigned)st.coalesced);
+    common_metrics_printf(w, "powermon_mbgw_requests_total{result=\"write\"} %u\n", (unsigned)st.writes);
+    common_metrics_printf(w, "powermon_mbgw_requests_total{result=\"write_rejected\"} %u\n", (unsigned)st.writes_rejected);
+    common_metrics_family(w, "powermon_mbgw_bus_transactions_total", "counter", "Bus transactions started by the Modbus TCP gateway");
+    common_metrics_printf(w, "powermon_mbgw_bus_transactions_total{kind=\"refresh\"} %u\n", (unsigned)st.cache_refreshes);
+    common_metrics_printf(w, "powermon_mbgw_bus_transactions_total{kind=\"direct\"} %u\n", (unsigned)st.bus_transactions);
+    common_metrics_family(w, "powermon_mbgw_bus_errors_total", "counter", "Failed bus transactions of the Modbus TCP gateway");
+    common_metrics_value(w, "powermon_mbgw_bus_errors_total", NULL, st.bus_errors);
+}
+
+
+// monotonic counters of energy_store.h, labels of the sensor snapshot of render_sensors
+static void render_energy(metrics_writer_t *w) {
+    int count = common_cache_sensor_count();
+    const energy_info_t *info = s_energy;
+    bool valid[CACHE_MAX_SENSORS];
+    for (int i = 0; i < count; i++) {
+        valid[i] = common_energy_store_get(i, &s_energy[i]) && s_energy[i].counter.have_raw;
+    }
+
+    common_metrics_family(w, "powermon_energy_counter_watt_hours_total", "counter",
+                          "Monotonic energy counter, continues across module resets, rollovers and replacements");
+    for (int i = 0; i < count; i++) {
+        if (valid[i]) {
+            common_metrics_value(w, "powermon_energy_counter_watt_hours_total", s_labels[i], (double)info[i].counter.total_wh);
+        }
+    }
+
+    common_metrics_family(w, "powermon_energy_register_events_total", "counter", "Decreases and implausible steps of the energy register");
+    for (int i = 0; i < count; i++) {
+        if (valid[i]) {
+            common_metrics_printf(w, "powermon_energy_register_events_total{%s,event=\"rollover\"} %u\n", s_labels[i], (unsigned)info[i].counter.rollovers);
+            common_metrics_printf(w, "powermon_energy_register_events_total{%s,event=\"reset\"} %u\n", s_labels[i], (unsigned)info[i].counter.resets);
+            common_metrics_printf(w, "powermon_energy_register_events_total{%s,event=\"rejected\"} %u\n", s_labels[i], (unsigned)info[i].counter.rejected);
+        }
+    }
+
+    common_metrics_family(w, "powermon_energy_interval_watt_hours", "gauge", "Energy of the last closed billing interval");
+    for (int i = 0; i < count; i++) {
+        if (valid[i] && info[i].last_interval.end_ms != 0) {
+            common_metrics_value(w, "powermon_energy_interval_watt_hours", s_labels[i], info[i].last_interval.wh);
+        }
+    }
+
+    common_metrics_family(w, "powermon_energy_intervals_dropped_total", "counter", "Billing intervals dropped before they were published");
+    for (int i = 0; i < count; i++) {
+        if (valid[i]) {
+            common_metrics_value(w, "powermon_energy_intervals_dropped_total", s_labels[i], info[i].intervals_dropped);
+        }
+    }
+
+    common_metrics_family(w, "powermon_energy_nvs_writes_total", "counter", "Energy counter writes to NVS");
+    for (int i = 0; i < count; i++) {
+        if (valid[i]) {
+            common_metrics_printf(w, "powermon_energy_nvs_writes_total{%s,result=\"ok\"} %u\n", s_labels[i], (unsigned)info[i].nvs_writes);
+            common_metrics_printf(w, "powermon_energy_nvs_writes_total{%s,result=\"error\"} %u\n", s_labels[i], (unsigned)info[i].nvs_errors);
+        }
+    }
+
+    time_stats_t ts;
+    common_time_get_stats(&ts);
+    common_metrics_family(w, "powermon_time_synced", "gauge", "System time is the wall clock (billing intervals are tracked)");
+    common_metrics_value(w, "powermon_time_synced", NULL, ts.valid);
+    common_metrics_family(w, "powermon_time_syncs_total", "counter", "SNTP time updates");
+    common_metrics_value(w, "powermon_time_syncs_total", NULL, ts.syncs);
+}
+
+
+static void render_sniffer(metrics_writer_t *w) {
+    sniffer_stats_t st;
+    if (!common_sniffer_get_stats(&st)) {
+        return;
+    }
+    common_metrics_family(w, "powermon_sniffer_capturing", "gauge", "Bus capture client connected");
+    common_metrics_value(w, "powermon_sniffer_capturing", NULL, st.client);
+    common_metrics_family(w, "powermon_sniffer_frames_total", "counter", "Frames captured on the bus");
+    common_metrics_value(w, "powermon_sniffer_frames_total", NULL, st.frames);
+    common_metrics_family(w, "powermon_sniffer_bytes_total", "counter", "Bytes captured on the bus");
+    common_metrics_value(w, "powermon_sniffer_bytes_total", NULL, st.bytes);
+    common_metrics_family(w, "powermon_sniffer_framing_errors_total", "counter", "Captured bytes with a low stop bit");
+    common_metrics_value(w, "powermon_sniffer_framing_errors_total", NULL, st.framing_errors);
+    common_metrics_family(w, "powermon_sniffer_lost_edges_total", "counter", "Edges dropped because the capture ring was full");
+    common_metrics_value(w, "powermon_sniffer_lost_edges_total", NULL, st.lost_edges);
+}
+
+
+
+static void render_cpu(metrics_writer_t *w) {
+    char labels[64];
+    if (common_task_stats_snapshot(&s_tasks)) {
+        common_metrics_family(w, "powermon_cpu_idle_seconds_total", "counter", "Run time of the idle task of a core (incl. light sleep)");
+        for (int c = 0; c < TASK_STATS_CORES; c++) {
+            snprintf(labels, sizeof(labels), "core=\"%d\"", c);
+            common_metrics_value(w, "powermon_cpu_idle_seconds_total", labels, s_tasks.idle_us[c] / 1e6);
+        }
+        common_metrics_family(w, "powermon_task_cpu_seconds_total", "counter", "Run time of a task");
+        for (int i = 0; i < s_tasks.count; i++) {
+            char name[configMAX_TASK_NAME_LEN * 2];
+            common_metrics_escape(name, sizeof(name), s_tasks.tasks[i].name);
+            if (s_tasks.tasks[i].core < 0) {
+                snprintf(labels, sizeof(labels), "task=\"%s\",core=\"any\"", name);
+            } else {
+                snprintf(labels, sizeof(labels), "task=\"%s\",core=\"%d\"", name, s_tasks.tasks[i].core);
+            }
+            common_metrics_value(w, "powermon_task_cpu_seconds_total", labels, s_tasks.tasks[i].run_time_us / 1e6);
+        }
+        common_metrics_family(w, "powermon_task_stack_free_bytes", "gauge", "Lowest free stack of a task since its start");
+        for (int i = 0; i < s_tasks.count; i++) {
+            char name[configMAX_TASK_NAME_LEN * 2];
+            common_metrics_escape(name, sizeof(name), s_tasks.tasks[i].name);
+            snprintf(labels, sizeof(labels), "task=\"%s\"", name);
+            common_metrics_value(w, "powermon_task_stack_free_bytes", labels, s_tasks.tasks[i].stack_free_bytes);
+        }
+    }
+
+    power_stats_t ps;
+    common_power_get_stats(&ps);
+    common_metrics_family(w, "powermon_power_save_enabled", "gauge", "Frequency scaling and automatic light sleep active");
+    common_metrics_value(w, "powermon_power_save_enabled", NULL, ps.enabled);
+    if (ps.enabled) {
+        common_metrics_family(w, "powermon_cpu_frequency_mhz", "gauge", "CPU clock range of frequency scaling");
+        common_metrics_printf(w, "powermon_cpu_frequency_mhz{bound=\"min\"} %d\n", ps.cpu_freq_min_mhz);
+        common_metrics_printf(w, "powermon_cpu_frequency_mhz{bound=\"max\"} %d\n", ps.cpu_freq_max_mhz);
+        common_metrics_family(w, "powermon_light_sleep_seconds_total", "counter", "Time spent in light sleep");
+        common_metrics_value(w, "powermon_light_sleep_seconds_total", NULL, ps.light_sleep_us / 1e6);
+        common_metrics_family(w, "powermon_light_sleeps_total", "counter", "Light sleep periods entered");
+        common_metrics_value(w, "powermon_light_sleeps_total", NULL, ps.light_sleeps);
+    }
+}
+
+
+
+bool common_metrics_render(metrics_writer_t *w) {
+    render_sensors(w);
+    render_energy(w);
+    render_bus(w);
+    render_lateness(w);
+    render_mqtt(w);
+    render_gateway(w);
+    render_sniffer(w);
+    render_cpu(w);
+    render_system(w);
+    return flush_buffer(w);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Prometheus text exposition of the latest samples, sensor health and system state.
+// Rendering only reads already collected data (sample_cache.h peek, statistics of the other
+// modules), a scrape never starts a bus transaction.
+// Output is formatted into a fixed buffer that is handed to a flush callback whenever the next
+// line does not fit anymore, e.g. one HTTP chunk per flush (see http_helper.h).
+
+#define METRICS_BUFFER_SIZE 1024    // also the max length of a single line
+
+typedef struct metrics_writer metrics_writer_t;
+
+// Send len bytes of buf, return false to abort rendering
+typedef bool (*metrics_flush_cb_t)(metrics_writer_t *w, const char *buf, size_t len);
+
+struct metrics_writer {
+    char *buf;
+    size_t size;
+    size_t len;
+    bool failed;                    // flush failed or line too long, remaining output is dropped
+    metrics_flush_cb_t flush;
+    void *ctx;                      // for the flush callback
+};
+
+// Prepare writer for a buffer
+void common_metrics_writer_init(metrics_writer_t *w, char *buf, size_t size, metrics_flush_cb_t flush, void *ctx);
+
+// Append formatted text, flushes buffer first when the text does not fit anymore
+void common_metrics_printf(metrics_writer_t *w, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Append "# HELP" and "# TYPE" lines of a metric family
+void common_metrics_family(metrics_writer_t *w, const char *name, const char *type, const char *help);
+
+// Append a sample line with optional label set, e.g. ("powermon_voltage_volts", "sensor=\"L1\"", 230.1)
+void common_metrics_value(metrics_writer_t *w, const char *name, const char *labels, double value);
+
+// Escape a label value (backslash, double quote, newline), result is truncated to size
+void common_metrics_escape(char *out, size_t size, const char *value);
+
+// Render all metrics and flush the remaining output, returns false if a flush failed
+bool common_metrics_render(metrics_writer_t *w);
+
+// Size of the static snapshot of the sensors used while rendering (memory budget)
+size_t common_metrics_static_bytes(void);
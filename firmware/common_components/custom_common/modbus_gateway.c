@@ -0,0 +1,437 @@
+#include "modbus_gateway.h"
+#include "pzem_bus.h"
+#include "pzem004tv3.h"
+#include "sample_cache.h"
+#include "task_layout.h"
+#include "memory_budget.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_log.h"
+
+#define TAG "common_mbgw"
+
+#define MBAP_HEADER_SIZE    7
+#define MB_MAX_ADU_SIZE     260
+#define MB_MAX_PENDING      16      // read requests collected per round
+#define SELECT_TIMEOUT_MS   100
+
+// modbus exception codes
+#define MB_EX_ILLEGAL_FUNCTION      0x01
+#define MB_EX_ILLEGAL_ADDRESS       0x02
+#define MB_EX_ILLEGAL_VALUE         0x03
+#define MB_EX_DEVICE_BUSY           0x06
+#define MB_EX_GATEWAY_PATH          0x0A
+#define MB_EX_GATEWAY_NO_RESPONSE   0x0B
+
+
+typedef struct {
+    int fd;                         // -1 = slot free
+    uint32_t generation;            // incremented on close, detects stale queued requests
+    size_t rx_len;
+    uint8_t rx[MB_MAX_ADU_SIZE];
+} mbgw_client_t;
+
+typedef struct {
+    int client;
+    uint32_t generation;
+    uint16_t transaction_id;
+    uint8_t unit;
+    uint8_t function;
+    uint16_t addr;
+    uint16_t value;                 // register count for reads, value for writes
+    int sensor_index;
+    bool done;
+} mbgw_request_t;
+
+static MbGatewayConfig_t s_cfg;
+static mbgw_client_t s_clients[MBGW_MAX_CLIENTS];
+static mbgw_request_t s_pending[MB_MAX_PENDING];
+static int s_pending_count = 0;
+static mbgw_request_t s_write_queue[MBGW_MAX_WRITE_QUEUE];
+static int s_write_head = 0;
+static int s_write_count = 0;
+static MbGatewayStats_t s_stats;
+static bool s_started = false;
+static StackType_t s_task_stack[MBGW_TASK_STACK];
+static StaticTask_t s_task_buffer;
+
+
+
+bool common_mbgw_get_stats(MbGatewayStats_t *stats) {
+    *stats = s_stats;
+    return s_started;
+}
+
+
+
+//=========================
+//===== responses =========
+//=========================
+static void close_client(int c) {
+    if (s_clients[c].fd >= 0) {
+        close(s_clients[c].fd);
+        ESP_LOGI(TAG, "client %d disconnected", c);
+    }
+    s_clients[c].fd = -1;
+    s_clients[c].rx_len = 0;
+    s_clients[c].generation++;
+}
+
+
+// send MBAP header + pdu to the client of a request (if it is still connected)
+static void send_pdu(const mbgw_request_t *req, const uint8_t *pdu, uint16_t pdu_len) {
+    mbgw_client_t *client = &s_clients[req->client];
+    if (client->fd < 0 || client->generation != req->generation) {
+        return;
+    }
+
+    uint8_t adu[MB_MAX_ADU_SIZE];
+    adu[0] = req->transaction_id >> 8;
+    adu[1] = req->transaction_id & 0xFF;
+    adu[2] = 0;                         // protocol id
+    adu[3] = 0;
+    adu[4] = (pdu_len + 1) >> 8;        // length: unit + pdu
+    adu[5] = (pdu_len + 1) & 0xFF;
+    adu[6] = req->unit;
+    memcpy(&adu[MBAP_HEADER_SIZE], pdu, pdu_len);
+
+    if (send(client->fd, adu, MBAP_HEADER_SIZE + pdu_len, 0) < 0) {
+        ESP_LOGW(TAG, "send to client %d failed (errno %d)", req->client, errno);
+        close_client(req->client);
+    }
+}
+
+
+static void send_exception(const mbgw_request_t *req, uint8_t code) {
+    uint8_t pdu[2] = { req->function | 0x80, code };
+    send_pdu(req, pdu, sizeof(pdu));
+}
+
+
+// respond to a read request with registers starting at first_reg
+static void send_registers(const mbgw_request_t *req, const uint16_t *regs, uint16_t first_reg) {
+    uint8_t pdu[2 + 2 * PZ_MAX_READ_REGISTERS];
+    pdu[0] = req->function;
+    pdu[1] = 2 * req->value;
+    for (uint16_t i = 0; i < req->value; i++) {
+        uint16_t reg = regs[req->addr - first_reg + i];
+        pdu[2 + 2 * i] = reg >> 8;
+        pdu[3 + 2 * i] = reg & 0xFF;
+    }
+    send_pdu(req, pdu, 2 + 2 * req->value);
+}
+
+
+
+//=========================
+//===== requests ==========
+//=========================
+static int sensor_for_unit(uint8_t unit) {
+    for (int i = 0; i < s_cfg.sensor_count; i++) {
+        if (s_cfg.sensors[i].modbus_addr == unit) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// parse one complete ADU of a client, answer directly or queue it
+static void handle_frame(int c, const uint8_t *adu, size_t len) {
+    mbgw_request_t req = {
+        .client = c,
+        .generation = s_clients[c].generation,
+        .transaction_id = (uint16_t)adu[0] << 8 | adu[1],
+        .unit = adu[6],
+        .function = adu[7],
+    };
+    const uint16_t protocol = (uint16_t)adu[2] << 8 | adu[3];
+    if (protocol != 0) {
+        return; // not modbus, ignore
+    }
+    s_stats.requests++;
+
+    req.sensor_index = sensor_for_unit(req.unit);
+    if (req.sensor_index < 0) {
+        send_exception(&req, MB_EX_GATEWAY_PATH);
+        return;
+    }
+    if (req.function != CMD_RIR && req.function != CMD_RHR && req.function != CMD_WSR) {
+        send_exception(&req, MB_EX_ILLEGAL_FUNCTION);
+        return;
+    }
+    if (len != MBAP_HEADER_SIZE + 5) { // function + 2 bytes address + 2 bytes count/value
+        send_exception(&req, MB_EX_ILLEGAL_VALUE);
+        return;
+    }
+    req.addr = (uint16_t)adu[8] << 8 | adu[9];
+    req.value = (uint16_t)adu[10] << 8 | adu[11];
+
+    if (req.function == CMD_WSR) {
+        // only the power alarm threshold, the slave address (WREG_ADDR) would take the module off the bus
+        if (req.addr != WREG_ALARM_THR ||
+            !(common_sensor_profile(&s_cfg.sensors[req.sensor_index])->caps & PZ_CAP_POWER_ALARM)) {
+            send_exception(&req, MB_EX_ILLEGAL_ADDRESS);
+            return;
+        }
+        if (s_write_count >= s_cfg.write_queue_depth) {
+            s_stats.writes_rejected++;
+            send_exception(&req, MB_EX_DEVICE_BUSY);
+            return;
+        }
+        s_write_queue[(s_write_head + s_write_count) % MBGW_MAX_WRITE_QUEUE] = req;
+        s_write_count++;
+        return;
+    }
+
+    if (req.value == 0 || req.value > PZ_MAX_READ_REGISTERS) {
+        send_exception(&req, MB_EX_ILLEGAL_VALUE);
+        return;
+    }
+
+    if (req.function == CMD_RIR) {
+        // input registers of the device type (10 on the PZEM-004T), no need to ask the bus
+        if (req.addr + req.value > common_sensor_profile(&s_cfg.sensors[req.sensor_index])->input_regs) {
+            send_exception(&req, MB_EX_ILLEGAL_ADDRESS);
+            return;
+        }
+        // only from the cache when every requested register is fresh, a fast lane read refreshes
+        // just a few of them
+        pmon_sample_t sample;
+        uint16_t reg_mask = (uint16_t)(((1u << req.value) - 1u) << req.addr);
+        if (common_cache_peek_fresh(req.sensor_index, reg_mask, s_cfg.max_age_ms, &sample)) {
+            s_stats.cache_hits++;
+            send_registers(&req, sample.regs, 0);
+            return;
+        }
+    }
+
+    if (s_pending_count >= MB_MAX_PENDING) {
+        send_exception(&req, MB_EX_DEVICE_BUSY);
+        return;
+    }
+    s_pending[s_pending_count++] = req;
+}
+
+
+// execute collected reads, one bus transaction serves all matching requests
+static void execute_reads(void) {
+    for (int i = 0; i < s_pending_count; i++) {
+        mbgw_request_t *req = &s_pending[i];
+        if (req->done) {
+            continue;
+        }
+
+        const ModbusSensor *sensor = &s_cfg.sensors[req->sensor_index];
+        uint16_t regs[PZ_MAX_READ_REGISTERS];
+        uint16_t first_reg = req->addr;
+        bool ok;
+
+        if (req->function == CMD_RIR) {
+            // input registers: refresh the full sample (shared with other consumers),
+            // which answers every FC04 request for this sensor
+            pmon_sample_t sample;
+            ok = common_cache_get(req->sensor_index, s_cfg.max_age_ms, &sample);
+            if (ok) {
+                memcpy(regs, sample.regs, sizeof(sample.regs));
+            }
+            first_reg = RG_VOLTAGE;
+            s_stats.cache_refreshes++;
+        } else {
+            pzem_setup_t setup;
+            common_bus_acquire(s_cfg.uart_port, sensor, &setup);
+            ok = PzemReadRegisters(&setup, req->function, req->addr, req->value, regs);
+            common_bus_release();
+            s_stats.bus_transactions++;
+        }
+
+        if (!ok) {
+            s_stats.bus_errors++;
+            ESP_LOGW(TAG, "[%s] bus transaction for unit %d failed", sensor->name, req->unit);
+        }
+
+        // answer this and all requests served by the same transaction
+        for (int j = i; j < s_pending_count; j++) {
+            mbgw_request_t *other = &s_pending[j];
+            bool same = !other->done
+                && other->sensor_index == req->sensor_index
+                && other->function == req->function
+                && (req->function == CMD_RIR || (other->addr == req->addr && other->value == req->value));
+            if (!same) {
+                continue;
+            }
+            if (ok) {
+                send_registers(other, regs, first_reg);
+            } else {
+                send_exception(other, MB_EX_GATEWAY_NO_RESPONSE);
+            }
+            if (j != i) {
+                s_stats.coalesced++;
+            }
+            other->done = true;
+        }
+    }
+    s_pending_count = 0;
+}
+
+
+// execute the oldest queued write (one per round so reads are not starved)
+static void execute_write(void) {
+    if (s_write_count == 0) {
+        return;
+    }
+    mbgw_request_t req = s_write_queue[s_write_head];
+    s_write_head = (s_write_head + 1) % MBGW_MAX_WRITE_QUEUE;
+    s_write_count--;
+
+    const ModbusSensor *sensor = &s_cfg.sensors[req.sensor_index];
+    pzem_setup_t setup;
+    common_bus_acquire(s_cfg.uart_port, sensor, &setup);
+    bool ok = PzemSendCmd8(&setup, CMD_WSR, req.addr, req.value, true, 0xFFFF);
+    common_bus_release();
+    s_stats.bus_transactions++;
+
+    if (ok) {
+        s_stats.writes++;
+        ESP_LOGW(TAG, "[%s] register 0x%04X set to 0x%04X via modbus tcp", sensor->name, req.addr, req.value);
+        uint8_t pdu[5] = { req.function, req.addr >> 8, req.addr & 0xFF, req.value >> 8, req.value & 0xFF };
+        send_pdu(&req, pdu, sizeof(pdu));
+    } else {
+        s_stats.bus_errors++;
+        send_exception(&req, MB_EX_GATEWAY_NO_RESPONSE);
+    }
+}
+
+
+
+//=========================
+//===== server task =======
+//=========================
+static void receive_from_client(int c) {
+    mbgw_client_t *client = &s_clients[c];
+    int n = recv(client->fd, client->rx + client->rx_len, sizeof(client->rx) - client->rx_len, 0);
+    if (n <= 0) {
+        close_client(c);
+        return;
+    }
+    client->rx_len += n;
+
+    // process all complete frames in buffer
+    while (client->rx_len >= MBAP_HEADER_SIZE) {
+        uint16_t length = (uint16_t)client->rx[4] << 8 | client->rx[5];
+        size_t frame_len = 6 + length;
+        if (length < 2 || frame_len > sizeof(client->rx)) {
+            ESP_LOGW(TAG, "invalid frame length %d from client %d", length, c);
+            close_client(c);
+            return;
+        }
+        if (client->rx_len < frame_len) {
+            break;
+        }
+        handle_frame(c, client->rx, frame_len);
+        if (client->fd < 0) {
+            return; // closed while answering
+        }
+        memmove(client->rx, client->rx + frame_len, client->rx_len - frame_len);
+        client->rx_len -= frame_len;
+    }
+}
+
+
+static void mbgw_task(void *arg) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_fd < 0) {
+        ESP_LOGE(TAG, "failed to create socket (errno %d)", errno);
+        vTaskDelete(NULL);
+        return;
+    }
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(s_cfg.tcp_port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 2) != 0) {
+        ESP_LOGE(TAG, "failed to listen on port %d (errno %d)", s_cfg.tcp_port, errno);
+        close(listen_fd);
+        vTaskDelete(NULL);
+        return;
+    }
+    ESP_LOGI(TAG, "modbus tcp gateway listening on port %d", s_cfg.tcp_port);
+
+    while (1) {
+        fd_set readfds;
+        FD_ZERO(&readfds);
+        FD_SET(listen_fd, &readfds);
+        int max_fd = listen_fd;
+        for (int c = 0; c < MBGW_MAX_CLIENTS; c++) {
+            if (s_clients[c].fd >= 0) {
+                FD_SET(s_clients[c].fd, &readfds);
+                if (s_clients[c].fd > max_fd) {
+                    max_fd = s_clients[c].fd;
+                }
+            }
+        }
+
+        struct timeval timeout = { .tv_sec = 0, .tv_usec = SELECT_TIMEOUT_MS * 1000 };
+        int ready = select(max_fd + 1, &readfds, NULL, NULL, &timeout);
+        if (ready < 0) {
+            ESP_LOGE(TAG, "select failed (errno %d)", errno);
+            vTaskDelay(pdMS_TO_TICKS(1000));
+            continue;
+        }
+
+        if (ready > 0 && FD_ISSET(listen_fd, &readfds)) {
+            int fd = accept(listen_fd, NULL, NULL);
+            int slot = -1;
+            for (int c = 0; c < MBGW_MAX_CLIENTS && fd >= 0; c++) {
+                if (s_clients[c].fd < 0) {
+                    slot = c;
+                    break;
+                }
+            }
+            if (slot >= 0) {
+                s_clients[slot].fd = fd;
+                s_clients[slot].rx_len = 0;
+                ESP_LOGI(TAG, "client %d connected", slot);
+            } else if (fd >= 0) {
+                ESP_LOGW(TAG, "too many clients, rejecting connection");
+                close(fd);
+            }
+        }
+
+        // collect requests of all clients first, so concurrent reads can be coalesced
+        for (int c = 0; c < MBGW_MAX_CLIENTS && ready > 0; c++) {
+            if (s_clients[c].fd >= 0 && FD_ISSET(s_clients[c].fd, &readfds)) {
+                receive_from_client(c);
+            }
+        }
+
+        execute_reads();
+        execute_write();
+    }
+}
+
+
+void common_mbgw_start(const MbGatewayConfig_t *config) {
+    s_cfg = *config;
+    if (s_cfg.sensor_count > MBGW_MAX_SENSORS) {
+        ESP_LOGE(TAG, "only the first %d sensors are accessible via modbus tcp", MBGW_MAX_SENSORS);
+        s_cfg.sensor_count = MBGW_MAX_SENSORS;
+    }
+    if (s_cfg.write_queue_depth < 1 || s_cfg.write_queue_depth > MBGW_MAX_WRITE_QUEUE) {
+        s_cfg.write_queue_depth = MBGW_MAX_WRITE_QUEUE;
+    }
+    for (int c = 0; c < MBGW_MAX_CLIENTS; c++) {
+        s_clients[c].fd = -1;
+    }
+    s_started = true;
+    xTaskCreateStaticPinnedToCore(mbgw_task, "ModbusTCP", MBGW_TASK_STACK, NULL, MBGW_TASK_PRIO,
+                                  s_task_stack, &s_task_buffer, TASK_CORE_NETWORK);
+    common_membudget_register("mbgw", sizeof(s_task_stack) + sizeof(s_task_buffer) + sizeof(s_clients)
+                              + sizeof(s_pending) + sizeof(s_write_queue), 0);
+}
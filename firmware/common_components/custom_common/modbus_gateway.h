@@ -0,0 +1,48 @@
+#pragma once
+#include <stdbool.h>
+#include "config_types.h"
+#include "driver/uart.h"
+
+// Optional Modbus TCP server giving other clients (SCADA, energy manager, ...) access to the
+// configured sensors without multiplying the traffic on the 9600 baud bus:
+//  - the unit id selects the configured sensor with the same modbus_addr
+//  - FC04 (read input registers) is answered from the last sample of the sensor (sample_cache.h)
+//    when the requested registers were read within max_age_ms, otherwise all pending FC04
+//    requests for that sensor are served by a single refresh of the shared sample
+//  - FC03 (read holding registers): identical pending requests share one bus transaction
+//  - FC06 (write single register) is only accepted for the power alarm threshold (WREG_ALARM_THR
+//    of device types with PZ_CAP_POWER_ALARM), other registers are answered with exception 0x02
+//    (illegal data address). Writes are queued, when write_queue_depth requests are already
+//    pending the request is rejected with exception 0x06 (slave device busy)
+
+#define MBGW_MAX_CLIENTS      4
+#define MBGW_MAX_SENSORS      8
+#define MBGW_MAX_WRITE_QUEUE  8
+
+// Config passed to gateway
+typedef struct {
+    const ModbusSensor *sensors;
+    int sensor_count;
+    uart_port_t uart_port;
+    uint16_t tcp_port;              // usually 502
+    int max_age_ms;                 // max age of cached input registers to answer without bus transaction
+    int write_queue_depth;          // max pending write requests (1..MBGW_MAX_WRITE_QUEUE)
+} MbGatewayConfig_t;
+
+// Statistics, e.g. for logging / metrics
+typedef struct {
+    uint32_t requests;              // valid requests received
+    uint32_t cache_hits;            // answered from cache
+    uint32_t coalesced;             // answered by a bus transaction started for another request
+    uint32_t cache_refreshes;       // sample refreshes requested for FC04 reads
+    uint32_t bus_transactions;      // FC03/FC06 bus transactions executed by the gateway
+    uint32_t bus_errors;            // failed bus transactions (answered with exception 0x0B)
+    uint32_t writes;                // executed write requests
+    uint32_t writes_rejected;       // write queue full
+} MbGatewayStats_t;
+
+// Start gateway task (config is copied), bus and sample cache have to be initialized already
+void common_mbgw_start(const MbGatewayConfig_t *config);
+
+// Copy current statistics, returns false if the gateway was not started
+bool common_mbgw_get_stats(MbGatewayStats_t *stats);
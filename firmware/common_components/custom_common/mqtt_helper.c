@@ -1,8 +1,150 @@
 #include "mqtt_helper.h"
+#include "memory_budget.h"
+#include "history_buffer.h"
+#include "wifi_helper.h"
+#include "powermon_task.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
 
 static const char *TAG = "common_mqtt";
 
+typedef struct {
+    int msg_id;                     // 0 = free
+    int64_t start_us;               // publish call, or ack time while acked_early
+    bool acked_early;               // ack was handled before the publishing task recorded the msg_id
+} inflight_t;
+
+static inflight_t s_inflight[MQTT_INFLIGHT_SLOTS];
+static mqtt_publish_stats_t s_stats;
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static const int s_ack_bounds_ms[MQTT_ACK_BUCKETS] = { MQTT_ACK_BOUNDS_MS };
+static volatile bool s_connected = false;
+static volatile uint32_t s_connections = 0;
+
+
+
+//=====================================================================
+// Publish round trip (call with s_stats_lock held)
+
+static void record_ack(int64_t latency_us) {
+    if (latency_us < 0) {
+        latency_us = 0;
+    }
+    int bucket = 0;
+    while (bucket < MQTT_ACK_BUCKETS && latency_us > s_ack_bounds_ms[bucket] * 1000LL) {
+        bucket++;
+    }
+    uint32_t us = latency_us > UINT32_MAX ? UINT32_MAX : (uint32_t)latency_us;
+    s_stats.acked++;
+    s_stats.sum_us += us;
+    if (us > s_stats.max_us) {
+        s_stats.max_us = us;
+    }
+    s_stats.buckets[bucket]++;
+}
+
+
+static void expire_inflight(int64_t now_us) {
+    for (int i = 0; i < MQTT_INFLIGHT_SLOTS; i++) {
+        if (s_inflight[i].msg_id != 0 && now_us - s_inflight[i].start_us > MQTT_ACK_TIMEOUT_MS * 1000LL) {
+            if (!s_inflight[i].acked_early) {
+                s_stats.lost++;
+                s_stats.in_flight--;
+            }
+            s_inflight[i].msg_id = 0;
+        }
+    }
+}
+
+
+static inflight_t *find_inflight(int msg_id) {
+    for (int i = 0; i < MQTT_INFLIGHT_SLOTS; i++) {
+        if (s_inflight[i].msg_id == msg_id) {
+            return &s_inflight[i];
+        }
+    }
+    return NULL;
+}
+
+
+static void handle_published(int msg_id) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_stats_lock);
+    inflight_t *slot = find_inflight(msg_id);
+    if (slot != NULL && !slot->acked_early) {
+        record_ack(now - slot->start_us);
+        s_stats.in_flight--;
+        slot->msg_id = 0;
+    } else if (slot == NULL && (slot = find_inflight(0)) != NULL) {
+        // the publishing task has not recorded the msg_id yet
+        slot->msg_id = msg_id;
+        slot->start_us = now;
+        slot->acked_early = true;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+
+int common_mqtt_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain) {
+    int64_t start = esp_timer_get_time();
+    int msg_id = esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&s_stats_lock);
+    if (msg_id < 0) {
+        s_stats.failed++;
+    } else {
+        s_stats.published++;
+    }
+    if (msg_id > 0) {
+        expire_inflight(now);
+        inflight_t *slot = find_inflight(msg_id);
+        if (slot != NULL && slot->acked_early) {
+            record_ack(slot->start_us - start);
+            slot->msg_id = 0;
+        } else if (slot != NULL || (slot = find_inflight(0)) != NULL) {
+            // an old entry with the same msg_id (16 bit wrap) is replaced, counted as lost
+            if (slot->msg_id != 0) {
+                s_stats.lost++;
+            } else {
+                s_stats.in_flight++;
+            }
+            slot->msg_id = msg_id;
+            slot->start_us = start;
+            slot->acked_early = false;
+        } else {
+            s_stats.untracked++;
+        }
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+    return msg_id;
+}
+
+
+bool common_mqtt_connected(void) {
+    return s_connected;
+}
+
+
+uint32_t common_mqtt_connection_count(void) {
+    return s_connections;
+}
+
+
+void common_mqtt_get_publish_stats(mqtt_publish_stats_t *stats) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_stats_lock);
+    expire_inflight(now);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+
+
+//=====================================================================
+// Client
+
 
 static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data) {
     esp_mqtt_event_handle_t event = event_data;
@@ -10,6 +152,11 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     switch ((esp_mqtt_event_id_t)event_id) {
         case MQTT_EVENT_CONNECTED:
             ESP_LOGI(TAG, "MQTT connected");
+            s_connected = true;
+            s_connections++;
+            common_wifi_mqtt_connected();
+            common_history_subscribe(event->client);
+            common_pmon_wake();
             //ESP_LOGI(TAG, "MQTT connected, subscribing to 'button'");
             //esp_mqtt_client_subscribe(event->client, "button", mqtt_current_qos_level);
             //esp_mqtt_client_subscribe(event->client, "qos-level", 2);
@@ -17,11 +164,15 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
         case MQTT_EVENT_DISCONNECTED:
             //TODO need to handle reconnect manually?
             ESP_LOGW(TAG, "MQTT disconnected");
+            s_connected = false;
             break;
         case MQTT_EVENT_DATA:
             ESP_LOGI(TAG, "Received topic: %.*s | data: %.*s",
                      event->topic_len, event->topic,
                      event->data_len, event->data);
+            if (common_history_handle_request(event->topic, event->topic_len, event->data, event->data_len)) {
+                common_pmon_wake(); // the publish task sends the answer
+            }
             //if (strncmp(event->topic, "button", event->topic_len) == 0) {
             //    buzzer_beep();
             //    ESP_LOGI(TAG, "button topic received!");
@@ -37,6 +188,7 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
         case MQTT_EVENT_PUBLISHED:
             ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            handle_published(event->msg_id);
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGE(TAG, "MQTT error");
@@ -51,13 +203,22 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
 
 esp_mqtt_client_handle_t common_mqtt_start(const char *broker_uri) {
+    size_t heap_mark = common_membudget_heap_mark();
     esp_mqtt_client_config_t cfg = {
         .broker.address.uri = broker_uri,
-        .network.reconnect_timeout_ms = 2000
+        .network.reconnect_timeout_ms = 2000,
+#if STATIC_MEMORY_MODE
+        // buffers allocated once by esp_mqtt_client_init, outbox (QoS1 until PUBACK) bounded,
+        // publishes beyond the limit fail instead of growing the heap while the broker is away
+        .buffer.size = MQTT_BUFFER_SIZE,
+        .buffer.out_size = MQTT_BUFFER_SIZE,
+        .outbox.limit = MQTT_OUTBOX_LIMIT_BYTES,
+#endif
     };
 
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&cfg);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     esp_mqtt_client_start(client);
+    common_membudget_register("mqtt", sizeof(s_inflight) + sizeof(s_stats), heap_mark);
     return client;
 }
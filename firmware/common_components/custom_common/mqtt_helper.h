@@ -1,5 +1,40 @@
 #pragma once
 #include "mqtt_client.h"
 
+#include <stdint.h>
+#include <stdbool.h>
+
+// Publish round trip: QoS 1/2 publishes are tracked by msg_id from common_mqtt_publish until the
+// MQTT_EVENT_PUBLISHED of the broker ack. A publish without ack after MQTT_ACK_TIMEOUT_MS (esp-mqtt
+// drops it from the outbox then) is counted as lost, also when the table was full.
+#define MQTT_INFLIGHT_SLOTS      32
+#define MQTT_ACK_TIMEOUT_MS      30000    // CONFIG_MQTT_OUTBOX_EXPIRED_TIMEOUT_MS
+#define MQTT_ACK_BOUNDS_MS       5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+#define MQTT_ACK_BUCKETS         10
+
+typedef struct {
+    uint32_t published;             // accepted by esp-mqtt (all QoS)
+    uint32_t failed;                // rejected by esp-mqtt (not connected with QoS 0, outbox full)
+    uint32_t acked;
+    uint32_t lost;                  // no ack within MQTT_ACK_TIMEOUT_MS
+    uint32_t untracked;             // table full, latency not measured
+    uint32_t in_flight;
+    uint64_t sum_us;
+    uint32_t max_us;
+    uint32_t buckets[MQTT_ACK_BUCKETS + 1];   // per bound of MQTT_ACK_BOUNDS_MS (not cumulative), last: above
+} mqtt_publish_stats_t;
+
 // Initializes and starts MQTT client, returns mqtt client handle
 esp_mqtt_client_handle_t common_mqtt_start(const char *broker_uri);
+
+// Connected to the broker
+bool common_mqtt_connected(void);
+
+// Number of connects since boot, a change tells a consumer that the client has reconnected
+uint32_t common_mqtt_connection_count(void);
+
+// esp_mqtt_client_publish with round trip tracking, same arguments and result (msg_id, -1 on error)
+int common_mqtt_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain);
+
+// Copy the publish statistics, ages out unacked publishes first
+void common_mqtt_get_publish_stats(mqtt_publish_stats_t *stats);
@@ -0,0 +1,73 @@
+#include "mqtt_payload.h"
+#include <stdio.h>
+
+
+
+static const struct {
+    const char *name;
+    pzem_field_t source;
+    const char *format;
+} s_fields[PAYLOAD_FIELD_COUNT] = {
+    [PAYLOAD_FIELD_VOLTAGE]   = { "voltage",   PZ_FIELD_VOLTAGE,   "%.1f" },
+    [PAYLOAD_FIELD_CURRENT]   = { "current",   PZ_FIELD_CURRENT,   "%.3f" },
+    [PAYLOAD_FIELD_POWER]     = { "power",     PZ_FIELD_POWER,     "%.1f" },
+    [PAYLOAD_FIELD_ENERGY]    = { "energy",    PZ_FIELD_ENERGY,    "%.2f" },
+    [PAYLOAD_FIELD_FREQUENCY] = { "frequency", PZ_FIELD_FREQUENCY, "%.1f" },
+    [PAYLOAD_FIELD_PF]        = { "pf",        PZ_FIELD_PF,        "%.2f" },
+};
+
+
+const char *common_payload_field_name(payload_field_t field) {
+    return field < PAYLOAD_FIELD_COUNT ? s_fields[field].name : "unknown";
+}
+
+
+pzem_field_t common_payload_field_source(payload_field_t field) {
+    return field < PAYLOAD_FIELD_COUNT ? s_fields[field].source : PZ_FIELD_COUNT;
+}
+
+
+int common_payload_topic(char *buf, size_t size, const char *prefix, const char *suffix) {
+    return snprintf(buf, size, "%s/%s", prefix, suffix);
+}
+
+
+static float field_value(payload_field_t field, const _current_values_t *values) {
+    switch (field) {
+        case PAYLOAD_FIELD_VOLTAGE:   return values->voltage;
+        case PAYLOAD_FIELD_CURRENT:   return values->current;
+        case PAYLOAD_FIELD_POWER:     return values->power;
+        case PAYLOAD_FIELD_ENERGY:    return values->energy;
+        case PAYLOAD_FIELD_FREQUENCY: return values->frequency;
+        case PAYLOAD_FIELD_PF:        return values->pf;
+        default:                      return 0;
+    }
+}
+
+
+int common_payload_value(char *buf, size_t size, payload_field_t field, const _current_values_t *values) {
+    if (field >= PAYLOAD_FIELD_COUNT) {
+        return snprintf(buf, size, "0");
+    }
+    return snprintf(buf, size, s_fields[field].format, field_value(field, values));
+}
+
+
+int common_payload_last(char *buf, size_t size, const _current_values_t *values, int64_t time_ms) {
+    return snprintf(buf, size,
+                    "{\"uptime_ms\":%lld,\"voltage\":%.1f,\"current\":%.3f,\"power\":%.1f,\"energy\":%.2f,\"frequency\":%.1f,\"pf\":%.2f}",
+                    (long long)time_ms, values->voltage, values->current, values->power,
+                    values->energy, values->frequency, values->pf);
+}
+
+
+int common_payload_energy_total(char *buf, size_t size, uint64_t total_wh) {
+    return snprintf(buf, size, "%llu", (unsigned long long)total_wh);
+}
+
+
+int common_payload_energy_interval(char *buf, size_t size, const energy_interval_t *interval) {
+    return snprintf(buf, size, "{\"start_ms\":%lld,\"end_ms\":%lld,\"wh\":%.1f,\"total_wh\":%.1f,\"complete\":%s}",
+                    (long long)interval->start_ms, (long long)interval->end_ms, interval->wh,
+                    interval->total_wh, interval->complete ? "true" : "false");
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "pzem004tv3.h"
+#include "pzem_profile.h"
+#include "energy_counter.h"
+
+// Topics and payloads of the published sensor values, shared by the firmware and the host tools
+// (tools/fleet-load) so load tests produce exactly what the nodes send:
+//   <prefix>/voltage, /current, /power, /energy, /frequency, /pf   one value as text, not retained
+//   <prefix>/last                                                    all values as JSON, retained
+//   <prefix>/energy_total                                            monotonic counter in Wh, retained
+//   <prefix>/energy_interval                                         energy of a billing interval as JSON
+// No platform dependencies.
+
+#define PAYLOAD_TOPIC_MAX   128
+#define PAYLOAD_VALUE_MAX   16
+#define PAYLOAD_LAST_MAX    160
+#define PAYLOAD_ENERGY_MAX  160
+
+typedef enum {
+    PAYLOAD_FIELD_VOLTAGE = 0,
+    PAYLOAD_FIELD_CURRENT,
+    PAYLOAD_FIELD_POWER,
+    PAYLOAD_FIELD_ENERGY,
+    PAYLOAD_FIELD_FREQUENCY,
+    PAYLOAD_FIELD_PF,
+    PAYLOAD_FIELD_COUNT
+} payload_field_t;
+
+// Topic suffix of a field, e.g. "power"
+const char *common_payload_field_name(payload_field_t field);
+
+// Measured value a field is published from (PZ_FIELD_COUNT for an invalid field)
+pzem_field_t common_payload_field_source(payload_field_t field);
+
+// "<prefix>/<suffix>", returns the length like snprintf
+int common_payload_topic(char *buf, size_t size, const char *prefix, const char *suffix);
+
+// Value of a field as published, e.g. "231.4"
+int common_payload_value(char *buf, size_t size, payload_field_t field, const _current_values_t *values);
+
+// Retained last known value: {"uptime_ms":..,"voltage":..,...}, uptime_ms is negative for a sample
+// taken before a warm restart (warm_restart.h)
+int common_payload_last(char *buf, size_t size, const _current_values_t *values, int64_t time_ms);
+
+// Monotonic energy counter (energy_counter.h) in Wh, e.g. "1234567"
+int common_payload_energy_total(char *buf, size_t size, uint64_t total_wh);
+
+// Closed billing interval: {"start_ms":..,"end_ms":..,"wh":..,"total_wh":..,"complete":true}, times
+// are Unix time in ms (intervals are only tracked once SNTP set the clock, time_sync.h),
+// complete is false for an interval that was only tracked from within (first sync, time jump)
+int common_payload_energy_interval(char *buf, size_t size, const energy_interval_t *interval);
@@ -0,0 +1,162 @@
+#include "power_alarm.h"
+#include <stdio.h>
+#include "pzem_bus.h"
+#include "sample_cache.h"
+#include "task_layout.h"
+#include "memory_budget.h"
+#include "mqtt_helper.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define TAG "common_alarm"
+
+
+typedef struct {
+    bool programmed;                // threshold written and verified
+    int64_t next_program_ms;        // next attempt to program the threshold
+    int state;                      // last published state, -1 = not published yet
+    bool enabled;                   // threshold configured and supported by the device type
+    pzem_plan_t plan;               // read of the alarm register, compiled once
+} alarm_entry_t;
+
+static AlarmConfig_t s_cfg;
+static alarm_entry_t s_entries[ALARM_MAX_SENSORS];
+static StackType_t s_task_stack[ALARM_TASK_STACK];
+static StaticTask_t s_task_buffer;
+
+
+
+// write threshold and verify by reading it back
+static bool program_threshold(const ModbusSensor *sensor) {
+    pzem_setup_t config;
+    uint16_t readback = 0;
+
+    common_bus_acquire(s_cfg.uart_port, sensor, &config);
+    bool ok = PzSetAlarmThreshold(&config, sensor->alarm_threshold_w) &&
+              PzGetAlarmThreshold(&config, &readback) &&
+              readback == sensor->alarm_threshold_w;
+    common_bus_release();
+    return ok;
+}
+
+
+// current alarm state, from the last sample when the alarm register was read within the check
+// interval (a fast lane read without it leaves the register of the last full read)
+static bool read_alarm(int index, bool *alarm) {
+    pmon_sample_t sample;
+    if (common_cache_peek_fresh(index, s_entries[index].plan.reg_mask, s_cfg.check_interval_ms, &sample)) {
+        *alarm = PzemFieldRaw(s_entries[index].plan.profile, sample.regs, PZ_FIELD_ALARM) != 0;
+        return true;
+    }
+
+    // no alarm reads of a dead sensor, the regular reads probe it
+    pmon_health_t health;
+    common_cache_get_health(index, &health);
+    if (health.breaker_state != BREAKER_CLOSED || health.next_attempt_ms > esp_timer_get_time() / 1000) {
+        return false;
+    }
+
+    pzem_setup_t config;
+    uint16_t regs[PZ_REGISTER_COUNT];
+    common_bus_acquire(s_cfg.uart_port, &s_cfg.sensors[index], &config);
+    bool ok = PzemPlanRead(&config, &s_entries[index].plan, regs);
+    common_bus_release();
+    if (ok) {
+        *alarm = PzemFieldRaw(s_entries[index].plan.profile, regs, PZ_FIELD_ALARM) != 0;
+    }
+    return ok;
+}
+
+
+static bool publish_state(const ModbusSensor *sensor, int state) {
+    char topic[128];
+    snprintf(topic, sizeof(topic), "%s/alarm", sensor->mqtt_topic_prefix);
+    return common_mqtt_publish(s_cfg.mqtt_client, topic, state ? "1" : "0", 0, 1, 1) >= 0;
+}
+
+
+static void alarm_task(void *arg) {
+    TickType_t last_wake = xTaskGetTickCount();
+
+    while (1) {
+        int64_t now = esp_timer_get_time() / 1000;
+
+        for (int i = 0; i < s_cfg.sensor_count; i++) {
+            const ModbusSensor *sensor = &s_cfg.sensors[i];
+            alarm_entry_t *entry = &s_entries[i];
+            if (!entry->enabled) {
+                continue;
+            }
+
+            if (!entry->programmed) {
+                if (now < entry->next_program_ms) {
+                    continue;
+                }
+                entry->programmed = program_threshold(sensor);
+                if (!entry->programmed) {
+                    ESP_LOGE(TAG, "[%s] Failed to program alarm threshold %u W, retrying later", sensor->name, sensor->alarm_threshold_w);
+                    entry->next_program_ms = now + ALARM_PROGRAM_RETRY_MS;
+                    continue;
+                }
+                ESP_LOGI(TAG, "[%s] Alarm threshold set to %u W", sensor->name, sensor->alarm_threshold_w);
+            }
+
+            bool alarm;
+            if (!read_alarm(i, &alarm)) {
+                continue; // read errors are counted by the regular reads, keep last state
+            }
+            if ((int)alarm != entry->state) {
+                if (alarm) {
+                    ESP_LOGW(TAG, "[%s] Power above %u W", sensor->name, sensor->alarm_threshold_w);
+                } else {
+                    ESP_LOGI(TAG, "[%s] Power back below %u W", sensor->name, sensor->alarm_threshold_w);
+                }
+                if (publish_state(sensor, alarm)) {
+                    entry->state = alarm; // otherwise retried with the next check
+                }
+            }
+        }
+
+        vTaskDelayUntil(&last_wake, pdMS_TO_TICKS(s_cfg.check_interval_ms));
+    }
+}
+
+
+
+void common_alarm_start(const AlarmConfig_t *config) {
+    s_cfg = *config;
+    if (s_cfg.sensor_count > ALARM_MAX_SENSORS) {
+        ESP_LOGE(TAG, "alarm only supported for the first %d sensors", ALARM_MAX_SENSORS);
+        s_cfg.sensor_count = ALARM_MAX_SENSORS;
+    }
+
+    int used = 0;
+    for (int i = 0; i < s_cfg.sensor_count; i++) {
+        s_entries[i].programmed = false;
+        s_entries[i].next_program_ms = 0;
+        s_entries[i].state = -1;
+        s_entries[i].enabled = false;
+        if (s_cfg.sensors[i].alarm_threshold_w == 0) {
+            continue;
+        }
+        const pzem_profile_t *profile = common_sensor_profile(&s_cfg.sensors[i]);
+        if (!(profile->caps & PZ_CAP_POWER_ALARM) ||
+            !PzemCompilePlan(profile, PZ_FIELD_BIT(PZ_FIELD_ALARM), s_cfg.sensors[i].modbus_addr, &s_entries[i].plan)) {
+            ESP_LOGE(TAG, "[%s] %s has no power alarm, threshold ignored", s_cfg.sensors[i].name, profile->name);
+            continue;
+        }
+        s_entries[i].enabled = true;
+        used++;
+    }
+    if (used == 0) {
+        ESP_LOGI(TAG, "no alarm thresholds configured");
+        return;
+    }
+
+    // above the publish task, an alarm must not wait for a slow publish cycle
+    xTaskCreateStaticPinnedToCore(alarm_task, "PowerAlarm", ALARM_TASK_STACK, NULL, ALARM_TASK_PRIO,
+                                  s_task_stack, &s_task_buffer, TASK_CORE_MEASUREMENT);
+    common_membudget_register("alarm", sizeof(s_task_stack) + sizeof(s_task_buffer) + sizeof(s_entries), 0);
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "config_types.h"
+#include "driver/uart.h"
+#include "mqtt_client.h"
+
+// Power alarm of the PZEM modules:
+//  - the alarm_threshold_w of every sensor is written to the module (WREG_ALARM_THR) and read back,
+//    a module that does not answer is retried every ALARM_PROGRAM_RETRY_MS
+//  - every check_interval_ms the alarm register of those sensors is read (a single register,
+//    or the last sample when it is fresh enough) and every change is published at once
+//    to "<topic prefix>/alarm" (retained, "1" = power above threshold, "0" = below)
+// Sensors with alarm_threshold_w 0 are ignored.
+
+#define ALARM_MAX_SENSORS       8
+#define ALARM_PROGRAM_RETRY_MS  30000
+
+// Config passed to alarm task
+typedef struct {
+    const ModbusSensor *sensors;
+    int sensor_count;
+    uart_port_t uart_port;
+    esp_mqtt_client_handle_t mqtt_client;
+    int check_interval_ms;
+} AlarmConfig_t;
+
+// Start alarm task (config is copied), bus and sample cache have to be initialized already
+void common_alarm_start(const AlarmConfig_t *config);
@@ -0,0 +1,107 @@
+#include "power_save.h"
+#include "memory_budget.h"
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#if CONFIG_PM_ENABLE
+#include "esp_pm.h"
+#endif
+
+#define TAG "common_power"
+
+static bool s_enabled = false;
+static power_stats_t s_stats;
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t s_bus_no_sleep = NULL;
+static esp_pm_lock_handle_t s_bus_apb_max = NULL;
+static bool s_bus_held = false;         // only changed by the bus lock holder
+#endif
+
+
+
+#if CONFIG_PM_ENABLE && CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+// called by the idle task with interrupts disabled, sleep_time_us is the time actually slept
+static IRAM_ATTR esp_err_t light_sleep_exit_cb(int64_t sleep_time_us, void *arg) {
+    portENTER_CRITICAL_SAFE(&s_stats_lock);
+    s_stats.light_sleeps++;
+    s_stats.light_sleep_us += sleep_time_us;
+    portEXIT_CRITICAL_SAFE(&s_stats_lock);
+    return ESP_OK;
+}
+#endif
+
+
+bool common_power_start(void) {
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "pzem_bus", &s_bus_no_sleep);
+    esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "pzem_bus", &s_bus_apb_max);
+
+    const esp_pm_config_t config = {
+        .max_freq_mhz = POWER_SAVE_MAX_CPU_FREQ_MHZ,
+        .min_freq_mhz = POWER_SAVE_MIN_CPU_FREQ_MHZ,
+        .light_sleep_enable = true
+    };
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Enabling light sleep failed: %s", esp_err_to_name(err));
+        return false;
+    }
+
+#if CONFIG_PM_LIGHT_SLEEP_CALLBACKS
+    esp_pm_sleep_cbs_register_config_t cbs = {
+        .exit_cb = light_sleep_exit_cb,
+    };
+    esp_pm_light_sleep_register_cbs(&cbs);
+#endif
+
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.enabled = true;
+    s_stats.cpu_freq_max_mhz = POWER_SAVE_MAX_CPU_FREQ_MHZ;
+    s_stats.cpu_freq_min_mhz = POWER_SAVE_MIN_CPU_FREQ_MHZ;
+    portEXIT_CRITICAL(&s_stats_lock);
+    s_enabled = true;
+    ESP_LOGI(TAG, "Power save: %d..%d MHz, automatic light sleep", POWER_SAVE_MIN_CPU_FREQ_MHZ, POWER_SAVE_MAX_CPU_FREQ_MHZ);
+    common_membudget_register("power", sizeof(s_stats), 0);
+    return true;
+#else
+    ESP_LOGE(TAG, "Power save needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE, staying awake");
+    return false;
+#endif
+}
+
+
+bool common_power_enabled(void) {
+    return s_enabled;
+}
+
+
+void common_power_bus_begin(void) {
+#if CONFIG_PM_ENABLE
+    s_bus_held = s_enabled;
+    if (s_bus_held) {
+        esp_pm_lock_acquire(s_bus_apb_max);
+        esp_pm_lock_acquire(s_bus_no_sleep);
+    }
+#endif
+}
+
+
+void common_power_bus_end(void) {
+#if CONFIG_PM_ENABLE
+    if (s_bus_held) {
+        esp_pm_lock_release(s_bus_no_sleep);
+        esp_pm_lock_release(s_bus_apb_max);
+        s_bus_held = false;
+    }
+#endif
+}
+
+
+void common_power_get_stats(power_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Power save mode (POWER_SAVE_ENABLED in app_main.c) for battery backed sites. The node mostly
+// waits for the next poll, so the CPU clock is scaled down and the chip enters light sleep
+// automatically whenever all tasks are blocked (tickless idle). The wakeup is the earliest
+// deadline of any task, for the publish task that is the due time of the next read (it sleeps up
+// to SCHEDULER_POWER_SAVE_MAX_SLEEP_MS in powermon_task.c, the MQTT reconnect wakes it early).
+// WiFi stays associated in max modem sleep (wifi_settings_t.power_save), incoming packets wake
+// the chip.
+//
+// A bus transaction (pzem_bus.h) holds the node awake at full APB clock, so the UART neither loses
+// received bytes in light sleep nor changes its baudrate. Other periodic wakeups cost sleep time:
+// the alarm check (ALARM_CHECK_INTERVAL_MS), live viewers and the bus sniffer (GPIO interrupts do
+// not run in light sleep, so power save and the sniffer exclude each other).
+// Needs CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE (sdkconfig.defaults).
+
+#define POWER_SAVE_MAX_CPU_FREQ_MHZ     240
+#define POWER_SAVE_MIN_CPU_FREQ_MHZ     40      // XTAL
+
+typedef struct {
+    bool enabled;                       // light sleep configured
+    int cpu_freq_max_mhz;
+    int cpu_freq_min_mhz;
+    uint32_t light_sleeps;              // light sleep entered (CONFIG_PM_LIGHT_SLEEP_CALLBACKS)
+    uint64_t light_sleep_us;            // time spent in light sleep
+} power_stats_t;
+
+// Enable frequency scaling and automatic light sleep, call once from app_main after WiFi was
+// started with power_save. Returns false (node stays awake) if not supported by the sdkconfig
+bool common_power_start(void);
+
+// Power save active
+bool common_power_enabled(void);
+
+// Keep the node awake and at full clock for a bus transaction, called by pzem_bus.c with the bus
+// lock held (no-op without power save)
+void common_power_bus_begin(void);
+void common_power_bus_end(void);
+
+void common_power_get_stats(power_stats_t *stats);
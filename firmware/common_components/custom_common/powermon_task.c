@@ -1,13 +1,651 @@
 #include "powermon_task.h"
 #include "pzem004tv3.h"
+#include "history_buffer.h"
+#include "sample_cache.h"
+#include "task_layout.h"
+#include "memory_budget.h"
+#include "mqtt_helper.h"
+#include "mqtt_payload.h"
+#include "warm_restart.h"
+#include "energy_store.h"
+#include "power_save.h"
+#include <string.h>
+#include <sys/time.h>
 #include "esp_log.h"
 
 // instead of publishing sensors, reset energy values of all configured devices, then stop
 #define RESET_ENERGY_OF_ALL_MODULES 0
 
+// a sample read by another consumer (e.g. modbus tcp) within this time is published instead of reading again
+#define PUBLISH_MAX_SAMPLE_AGE_MS 1000
+
+// longest sleep of the scheduler when no sensor is due, with power save only the next deadline or
+// the MQTT reconnect (common_pmon_wake) wake it
+#define SCHEDULER_MAX_SLEEP_MS 500
+#define SCHEDULER_POWER_SAVE_MAX_SLEEP_MS 10000
+
 #define TAG "common_PMon"
 
 
+// schedule of a sensor
+typedef struct {
+    int64_t next_due;
+    uint32_t last_published_seq;
+    int configured_interval_ms;     // publish_interval_ms of the sensor
+    int admitted_interval_ms;       // after bus admission control, slow floor of the adaptive interval
+    int current_interval_ms;        // last scheduled interval
+    uint32_t modeled_read_us;
+    adaptive_state_t adaptive;
+    int availability;               // last published availability, -1 = not published yet
+    int64_t next_fast_due;          // fast lane (partial read), INT64_MAX = none
+    int fast_interval_ms;
+    uint32_t last_fast_seq;
+    uint32_t modeled_fast_read_us;
+    int64_t deferred_since_ms;      // first sample not published while MQTT was down, INT64_MAX = none
+    bool backlog_active;            // samples of an outage still to send
+    int64_t backlog_from_ms;
+    int64_t backlog_to_ms;
+    history_cursor_t backlog;
+    bool restored;                  // last sample of the previous run, published retained on the first connect
+} pmon_sched_t;
+
+static pmon_sched_t s_sched[PMON_MAX_SENSORS];
+static int s_sched_count = 0;
+static bus_admission_t s_admission = BUS_ADMIT_OK;
+static float s_planned_utilization = 0;
+
+static adaptive_config_t s_adaptive;
+static adaptive_budget_t s_budget;
+
+static pmon_lateness_t s_lateness;
+static portMUX_TYPE s_lateness_lock = portMUX_INITIALIZER_UNLOCKED;
+static const int s_lateness_bounds_ms[PMON_LATENESS_BUCKETS] = { PMON_LATENESS_BOUNDS_MS };
+
+static uint32_t s_mqtt_connections = 0;     // connection count seen by the task
+static int64_t s_next_backlog_ms = 0;
+static int s_backlog_sensor = 0;            // round robin between sensors with backlog
+static pmon_backlog_stats_t s_backlog_stats;
+
+static PMonTaskConfig_t s_cfg;
+static StackType_t s_task_stack[PMON_TASK_STACK];
+static StaticTask_t s_task_buffer;
+static TaskHandle_t s_task = NULL;
+
+
+
+bool common_pmon_get_schedule(int sensor_index, pmon_schedule_info_t *info) {
+    if (sensor_index < 0 || sensor_index >= s_sched_count) {
+        return false;
+    }
+    info->configured_interval_ms = s_sched[sensor_index].configured_interval_ms;
+    info->admitted_interval_ms = s_sched[sensor_index].admitted_interval_ms;
+    info->current_interval_ms = s_sched[sensor_index].current_interval_ms;
+    info->modeled_read_us = s_sched[sensor_index].modeled_read_us;
+    info->fast_interval_ms = s_sched[sensor_index].fast_interval_ms;
+    info->modeled_fast_read_us = s_sched[sensor_index].modeled_fast_read_us;
+    return true;
+}
+
+
+bus_admission_t common_pmon_get_admission(float *planned_utilization) {
+    if (planned_utilization != NULL) {
+        *planned_utilization = s_planned_utilization;
+    }
+    return s_admission;
+}
+
+
+void common_pmon_get_lateness(pmon_lateness_t *lateness) {
+    portENTER_CRITICAL(&s_lateness_lock);
+    *lateness = s_lateness;
+    portEXIT_CRITICAL(&s_lateness_lock);
+}
+
+
+static void record_lateness(int64_t lateness_us) {
+    if (lateness_us < 0) {
+        lateness_us = 0;
+    }
+    int bucket = 0;
+    while (bucket < PMON_LATENESS_BUCKETS && lateness_us > s_lateness_bounds_ms[bucket] * 1000LL) {
+        bucket++;
+    }
+    uint32_t us = lateness_us > UINT32_MAX ? UINT32_MAX : (uint32_t)lateness_us;
+
+    portENTER_CRITICAL(&s_lateness_lock);
+    s_lateness.count++;
+    s_lateness.sum_us += us;
+    if (us > s_lateness.max_us) {
+        s_lateness.max_us = us;
+    }
+    s_lateness.buckets[bucket]++;
+    portEXIT_CRITICAL(&s_lateness_lock);
+}
+
+
+
+// warm restart: resume the schedule phase of the previous run and seed the cache with its last sample
+static void restore_sensor(const ModbusSensor *sensor, int i, int64_t now) {
+    pmon_sched_t *sched = &s_sched[i];
+    warm_sensor_t warm;
+    int64_t elapsed;
+    if (!common_warm_restore(i, sensor, &warm, &elapsed)) {
+        return;
+    }
+    const pmon_health_t counters = {
+        .reads_ok = warm.reads_ok,
+        .reads_failed = warm.reads_failed,
+        .reads_zero = warm.reads_zero,
+        .reads_skipped = warm.reads_skipped,
+        .reads_partial = warm.reads_partial,
+        .breaker_trips = warm.breaker_trips,
+    };
+
+    if (elapsed < 0) {
+        // time since the checkpoint unknown (power cycle): keep the phase relative to the other sensors,
+        // the sample is of unknown age and not used
+        common_cache_restore(i, NULL, 0, &counters);
+        sched->next_due = now + (warm.due_in_ms > 0 ? warm.due_in_ms % sched->admitted_interval_ms : 0);
+        ESP_LOGI(TAG, "[%s] Restored statistics and schedule phase, next read in %lld ms", sensor->name,
+                 (long long)(sched->next_due - now));
+        return;
+    }
+
+    // due as if there had been no reset, what became due meanwhile is read now
+    sched->next_due = now + (warm.due_in_ms > elapsed ? warm.due_in_ms - elapsed : 0);
+    if (sched->fast_interval_ms > 0 && warm.fast_due_in_ms >= 0) {
+        sched->next_fast_due = now + (warm.fast_due_in_ms > elapsed ? warm.fast_due_in_ms - elapsed : 0);
+    }
+    if (warm.adaptive.initialized && warm.current_interval_ms <= sched->admitted_interval_ms) {
+        sched->adaptive = warm.adaptive;
+        sched->current_interval_ms = warm.current_interval_ms;
+    }
+    if (warm.sample_age_ms >= 0) {
+        common_cache_restore(i, warm.regs, now - elapsed - warm.sample_age_ms, &counters);
+        pmon_sample_t sample;
+        if (common_cache_peek(i, &sample)) {
+            sched->last_published_seq = sample.seq; // published before the reset
+            sched->restored = true;
+        }
+    } else {
+        common_cache_restore(i, NULL, 0, &counters);
+    }
+    ESP_LOGI(TAG, "[%s] Resumed after %lld ms, next read in %lld ms", sensor->name, (long long)elapsed,
+             (long long)(sched->next_due - now));
+}
+
+
+// state of a sensor for a warm restart, after every read
+static void checkpoint_sensor(const PMonTaskConfig_t *cfg, int i) {
+    const pmon_sched_t *sched = &s_sched[i];
+    const int64_t now = esp_timer_get_time() / 1000;
+    warm_sensor_t warm = {
+        .due_in_ms = sched->next_due > now ? sched->next_due - now : 0,
+        .fast_due_in_ms = sched->next_fast_due == INT64_MAX ? -1 : sched->next_fast_due > now ? sched->next_fast_due - now : 0,
+        .current_interval_ms = sched->current_interval_ms,
+        .adaptive = sched->adaptive,
+        .sample_age_ms = -1,
+    };
+    pmon_sample_t sample;
+    if (common_cache_peek(i, &sample)) {
+        warm.sample_age_ms = now - sample.full_time_ms; // a fast lane read leaves most registers of the full read
+        memcpy(warm.regs, sample.regs, sizeof(warm.regs));
+    }
+    pmon_health_t health;
+    common_cache_get_health(i, &health);
+    warm.reads_ok = health.reads_ok;
+    warm.reads_failed = health.reads_failed;
+    warm.reads_zero = health.reads_zero;
+    warm.reads_skipped = health.reads_skipped;
+    warm.reads_partial = health.reads_partial;
+    warm.breaker_trips = health.breaker_trips;
+    common_warm_checkpoint(i, &cfg->sensors[i], &warm);
+}
+
+
+// apply bus admission control and set up adaptive intervals
+static void init_schedule(const PMonTaskConfig_t *cfg) {
+    const ModbusSensor *sensors = cfg->sensors;
+    int intervals[PMON_MAX_SENSORS];
+    uint32_t base_reads_per_day = 0;
+
+    for (int i = 0; i < s_sched_count; i++) {
+        intervals[i] = sensors[i].publish_interval_ms;
+        if (intervals[i] <= 0) {
+            // the schedule, the bus model and the read budget divide by the interval
+            ESP_LOGE(TAG, "[%s] Invalid interval %d ms, using %d ms", sensors[i].name, intervals[i], PMON_FALLBACK_INTERVAL_MS);
+            intervals[i] = PMON_FALLBACK_INTERVAL_MS;
+        }
+        base_reads_per_day += 86400000 / intervals[i];
+    }
+
+    // reads of the adaptive mode on top of the fixed schedule, the alarm checks, the live view and
+    // the gateway are a fixed share of the bus
+    bus_fixed_demand_t demand = {
+        .alarm_interval_ms = cfg->alarm_check_interval_ms,
+        .live_interval_ms = cfg->live_interval_ms,
+        .gateway_max_age_ms = cfg->gateway_max_age_ms,
+    };
+    if (cfg->adaptive.min_interval_ms > 0 && cfg->adaptive.reads_per_day > base_reads_per_day) {
+        demand.extra_reads_per_day = cfg->adaptive.reads_per_day - base_reads_per_day;
+    }
+    float max_utilization = cfg->max_bus_utilization > 0 ? cfg->max_bus_utilization : BUS_DEFAULT_MAX_UTILIZATION;
+    float fixed_utilization = 0;
+    s_admission = common_busmodel_admit(sensors, s_sched_count, intervals, max_utilization, &demand,
+                                        &s_planned_utilization, &fixed_utilization);
+
+    if (s_admission == BUS_ADMIT_REJECTED) {
+        ESP_LOGE(TAG, "Bus oversubscribed by high priority sensors, configuration rejected - running with stretched intervals");
+    } else if (s_admission == BUS_ADMIT_DEGRADED) {
+        ESP_LOGW(TAG, "Bus oversubscribed, intervals of lower priority sensors stretched");
+    }
+    ESP_LOGI(TAG, "Planned bus utilization %.0f%% (limit %.0f%%), %.0f%% fixed (fast lanes, adaptive, alarm, live view, gateway)",
+             s_planned_utilization * 100, max_utilization * 100, fixed_utilization * 100);
+
+    bool reconfig = common_busmodel_needs_reconfig(sensors, s_sched_count);
+    base_reads_per_day = 0;
+    for (int i = 0; i < s_sched_count; i++) {
+        pmon_sched_t *sched = &s_sched[i];
+        memset(sched, 0, sizeof(*sched));
+        sched->configured_interval_ms = sensors[i].publish_interval_ms;
+        sched->admitted_interval_ms = intervals[i];
+        sched->current_interval_ms = intervals[i];
+        sched->modeled_read_us = common_busmodel_plan_us(&sensors[i], PZ_ALL_FIELDS, reconfig);
+        sched->availability = -1;
+        sched->next_fast_due = INT64_MAX;
+        sched->deferred_since_ms = INT64_MAX;
+        // the cache compiled the fast plan, a rejected plan leaves the fast lane unscheduled
+        const uint16_t fast_fields = common_cache_fast_fields(i);
+        if (fast_fields != 0) {
+            sched->fast_interval_ms = sensors[i].fast_interval_ms;
+            sched->next_fast_due = 0;
+            sched->modeled_fast_read_us = common_busmodel_plan_us(&sensors[i], fast_fields, reconfig);
+            ESP_LOGI(TAG, "[%s] Fast lane: values 0x%02X every %d ms (%lu us on the bus)", sensors[i].name, fast_fields,
+                     sched->fast_interval_ms, (unsigned long)sched->modeled_fast_read_us);
+        }
+        common_adaptive_state_init(&sched->adaptive, intervals[i]);
+        restore_sensor(&sensors[i], i, esp_timer_get_time() / 1000);
+        common_energy_store_init(i, &sensors[i], cfg->energy_interval_ms);
+        base_reads_per_day += 86400000 / intervals[i];
+        if (intervals[i] != sensors[i].publish_interval_ms) {
+            ESP_LOGW(TAG, "[%s] Interval %d ms -> %d ms", sensors[i].name, sensors[i].publish_interval_ms, intervals[i]);
+        }
+    }
+
+    // adaptive interval: faster while the power changes, within the read budget
+    s_adaptive = cfg->adaptive;
+    if (common_adaptive_init(&s_adaptive, &s_budget, base_reads_per_day, esp_timer_get_time() / 1000)) {
+        ESP_LOGI(TAG, "Adaptive interval enabled: min %d ms, budget %lu reads/day (fixed schedule %lu)",
+                 s_adaptive.min_interval_ms, (unsigned long)s_adaptive.reads_per_day, (unsigned long)base_reads_per_day);
+    } else if (cfg->adaptive.min_interval_ms > 0) {
+        ESP_LOGE(TAG, "Adaptive interval disabled: budget %lu reads/day does not exceed fixed schedule (%lu)",
+                 (unsigned long)cfg->adaptive.reads_per_day, (unsigned long)base_reads_per_day);
+    }
+}
+
+
+// next due read of a sensor, full or fast lane
+static int64_t due_time(const pmon_sched_t *sched) {
+    return sched->next_fast_due < sched->next_due ? sched->next_fast_due : sched->next_due;
+}
+
+
+// due sensor with the highest priority (earliest due within a class), -1 if none is due
+static int pick_due(const ModbusSensor *sensors, int64_t now) {
+    int best = -1;
+    for (int i = 0; i < s_sched_count; i++) {
+        if (due_time(&s_sched[i]) > now) {
+            continue;
+        }
+        if (best < 0 ||
+            sensors[i].priority > sensors[best].priority ||
+            (sensors[i].priority == sensors[best].priority && due_time(&s_sched[i]) < due_time(&s_sched[best]))) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+
+// time until the next sensor (or backlog / history message) is due
+static int ms_until_next_due(int64_t now) {
+    int64_t wait = common_power_enabled() ? SCHEDULER_POWER_SAVE_MAX_SLEEP_MS : SCHEDULER_MAX_SLEEP_MS;
+    for (int i = 0; i < s_sched_count; i++) {
+        if (due_time(&s_sched[i]) - now < wait) {
+            wait = due_time(&s_sched[i]) - now;
+        }
+        if (s_sched[i].backlog_active && s_next_backlog_ms - now < wait) {
+            wait = s_next_backlog_ms - now;
+        }
+    }
+    if (common_history_request_pending() && s_next_backlog_ms - now < wait) {
+        wait = s_next_backlog_ms - now;
+    }
+    return wait < 1 ? 1 : (int)wait;
+}
+
+
+// sleep at least until the given time has passed (pdMS_TO_TICKS rounds down, 0 ticks would not block)
+// or common_pmon_wake is called
+static void sleep_ms(int ms) {
+    TickType_t ticks = (ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+    ulTaskNotifyTake(pdTRUE, ticks > 0 ? ticks : 1);
+}
+
+
+// publish "online" / "offline" (retained) on <prefix>/availability when the breaker state changes
+static void update_availability(const PMonTaskConfig_t *cfg) {
+    if (!common_mqtt_connected()) {
+        return; // would only pile up in the outbox, everything is republished after the reconnect
+    }
+    for (int i = 0; i < s_sched_count; i++) {
+        pmon_health_t health;
+        common_cache_get_health(i, &health);
+        int available;
+        if (health.breaker_state != BREAKER_CLOSED) {
+            available = 0;
+        } else if (health.last_ok_ms != 0) {
+            available = 1;
+        } else {
+            continue; // not read yet
+        }
+        if (available == s_sched[i].availability) {
+            continue;
+        }
+
+        char topic[128];
+        snprintf(topic, sizeof(topic), "%s/availability", cfg->sensors[i].mqtt_topic_prefix);
+        if (common_mqtt_publish(cfg->mqtt_client, topic, available ? "online" : "offline", 0, 1, 1) >= 0) {
+            s_sched[i].availability = available; // otherwise retried with the next round
+        }
+    }
+}
+
+
+// publish the retained last known value on <prefix>/last, see mqtt_payload.h
+static void publish_last(const PMonTaskConfig_t *cfg, int i, const pmon_sample_t *sample) {
+    char topic[PAYLOAD_TOPIC_MAX];
+    char payload[PAYLOAD_LAST_MAX];
+    common_payload_topic(topic, sizeof(topic), cfg->sensors[i].mqtt_topic_prefix, "last");
+    common_payload_last(payload, sizeof(payload), &sample->values, sample->time_ms);
+    common_mqtt_publish(cfg->mqtt_client, topic, payload, 0, 1, 1);
+}
+
+
+// publish all values of a sample to the corresponding topics (with prefix of sensor) and
+// the retained last known value
+static void publish_values(const PMonTaskConfig_t *cfg, int i, const pmon_sample_t *sample) {
+    const ModbusSensor *sensor = &cfg->sensors[i];
+    const uint16_t measured = PzemProfileFields(common_sensor_profile(sensor));
+    char topic[PAYLOAD_TOPIC_MAX];
+    char payload[PAYLOAD_VALUE_MAX];
+
+    for (payload_field_t f = 0; f < PAYLOAD_FIELD_COUNT; f++) {
+        if (!(measured & PZ_FIELD_BIT(common_payload_field_source(f)))) {
+            continue; // e.g. frequency and power factor of a DC module
+        }
+        common_payload_topic(topic, sizeof(topic), sensor->mqtt_topic_prefix, common_payload_field_name(f));
+        common_payload_value(payload, sizeof(payload), f, &sample->values);
+        common_mqtt_publish(cfg->mqtt_client, topic, payload, 0, 1, 0);
+    }
+    publish_last(cfg, i, sample);
+}
+
+
+// system time (ms) of an uptime, the time base of the billing intervals
+static int64_t system_time_ms(int64_t uptime_ms) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000 - (esp_timer_get_time() / 1000 - uptime_ms);
+}
+
+
+// publish the closed billing intervals waiting in the energy store and the retained counter
+static void publish_energy(const PMonTaskConfig_t *cfg, int i) {
+    char topic[PAYLOAD_TOPIC_MAX];
+    char payload[PAYLOAD_ENERGY_MAX];
+    energy_interval_t interval;
+    common_payload_topic(topic, sizeof(topic), cfg->sensors[i].mqtt_topic_prefix, "energy_interval");
+    while (common_mqtt_connected() && common_energy_store_peek(i, &interval)) {
+        common_payload_energy_interval(payload, sizeof(payload), &interval);
+        if (common_mqtt_publish(cfg->mqtt_client, topic, payload, 0, 1, 0) < 0) {
+            return; // kept for the next attempt
+        }
+        common_energy_store_pop(i);
+    }
+
+    energy_info_t info;
+    if (common_mqtt_connected() && common_energy_store_get(i, &info) && info.counter.have_raw) {
+        common_payload_topic(topic, sizeof(topic), cfg->sensors[i].mqtt_topic_prefix, "energy_total");
+        common_payload_energy_total(payload, sizeof(payload), info.counter.total_wh);
+        common_mqtt_publish(cfg->mqtt_client, topic, payload, 0, 1, 1);
+    }
+}
+
+
+// count the energy register of a full read in the monotonic counter
+static void count_energy(const ModbusSensor *sensor, int i, const pmon_sample_t *sample) {
+    const pzem_profile_t *profile = common_sensor_profile(sensor);
+    if (!(PzemProfileFields(profile) & PZ_FIELD_BIT(PZ_FIELD_ENERGY))) {
+        return;
+    }
+    energy_event_t event = common_energy_store_update(i, PzemFieldRaw(profile, sample->regs, PZ_FIELD_ENERGY),
+                                                      system_time_ms(sample->full_time_ms));
+    if (event == ENERGY_ROLLOVER || event == ENERGY_RESET || event == ENERGY_REJECTED) {
+        energy_info_t info;
+        common_energy_store_get(i, &info);
+        ESP_LOGW(TAG, "[%s] Energy register %s (now %lu Wh), counter continues at %llu Wh", sensor->name,
+                 common_energy_event_str(event), (unsigned long)info.counter.last_raw_wh,
+                 (unsigned long long)info.counter.total_wh);
+    }
+}
+
+
+// get sample and publish it, updates schedule of the sensor
+static void publish_sensor(const PMonTaskConfig_t *cfg, int i, int64_t now) {
+    const ModbusSensor *sensor = &cfg->sensors[i];
+    pmon_sched_t *sched = &s_sched[i];
+    _current_values_t pzValues; // store module readout
+
+    ESP_LOGI(TAG, "[%s] Due for publish. Init sensor addr=0x%02X TX=%d RX=%d RS485-MODE=%d",
+             sensor->name,
+             sensor->modbus_addr,
+             sensor->tx_pin,
+             sensor->rx_pin,
+             sensor->use_rs485);
+
+    // get sample (only reads the sensor when no other consumer read it just now)
+    pmon_sample_t sample;
+    if (!common_cache_get(i, PUBLISH_MAX_SAMPLE_AGE_MS, &sample)) {
+        // read failed (or all values zero) or refused by the circuit breaker:
+        // retry when the breaker allows (backoff with jitter, or probe of an open breaker)
+        pmon_health_t health;
+        common_cache_get_health(i, &health);
+        sched->next_due = health.next_attempt_ms > now ? health.next_attempt_ms : now + cfg->retry_interval_on_fail_ms;
+        ESP_LOGW(TAG, "[%s] No sample (breaker %s), next attempt in %lld ms", sensor->name,
+                 common_breaker_state_str(health.breaker_state), (long long)(sched->next_due - now));
+        printf("\n");
+        return;
+    }
+    if (sample.seq == sched->last_published_seq) {
+        // never publish the same sample twice
+        ESP_LOGW(TAG, "[%s] No new sample since last publish, skipping", sensor->name);
+        sched->next_due = now + cfg->retry_interval_on_fail_ms;
+        printf("\n");
+        return;
+    }
+
+    pzValues = sample.values;
+    ESP_LOGI(TAG, "[%s] Read OK", sensor->name);
+    printf("[%s] Vrms: %.1fV - Irms: %.3fA - P: %.1fW - E: %.2fWh\n", sensor->name, pzValues.voltage, pzValues.current, pzValues.power, pzValues.energy);
+    printf("[%s] Freq: %.1fHz - PF: %.2f\n", sensor->name, pzValues.frequency, pzValues.pf);
+
+    // keep sample in local history (can be requested via mqtt after gaps)
+    common_history_append(i, sample.time_ms, &pzValues, sample.regs);
+    count_energy(sensor, i, &sample);
+
+    if (common_mqtt_connected()) {
+        publish_values(cfg, i, &sample);
+        publish_energy(cfg, i);
+    } else {
+        // kept in the history, sent as backlog after the reconnect
+        if (sched->deferred_since_ms == INT64_MAX) {
+            sched->deferred_since_ms = sample.time_ms;
+        }
+        s_backlog_stats.deferred++;
+        ESP_LOGW(TAG, "[%s] MQTT not connected, sample deferred to the backlog", sensor->name);
+    }
+
+    // success, set next read to admitted (or adaptive) interval
+    int interval = common_adaptive_next_interval(&s_adaptive, &sched->adaptive, &s_budget,
+                                                 sched->admitted_interval_ms, pzValues.power, now);
+    if (interval != sched->admitted_interval_ms) {
+        ESP_LOGI(TAG, "[%s] Adaptive interval, next read in %d ms", sensor->name, interval);
+    }
+    // keep the phase of the schedule unless the sensor is late by more than an interval
+    int64_t next = sched->next_due + interval;
+    sched->next_due = next > now ? next : now + interval;
+    sched->current_interval_ms = interval;
+    sched->last_published_seq = sample.seq;
+    if (sched->fast_interval_ms > 0) {
+        sched->next_fast_due = now + sched->fast_interval_ms; // the full read covers the fast lane
+    }
+    printf("\n");
+}
+
+
+// fast lane: partial read, publishes only the values of the read plan
+static void publish_fast(const PMonTaskConfig_t *cfg, int i, int64_t now) {
+    const ModbusSensor *sensor = &cfg->sensors[i];
+    pmon_sched_t *sched = &s_sched[i];
+    const uint16_t plan = common_cache_fast_fields(i);
+
+    pmon_sample_t sample;
+    uint32_t max_age = sched->fast_interval_ms / 2 < PUBLISH_MAX_SAMPLE_AGE_MS ? sched->fast_interval_ms / 2 : PUBLISH_MAX_SAMPLE_AGE_MS;
+    if (!common_cache_get_fast(i, max_age, &sample) || sample.seq == sched->last_fast_seq) {
+        pmon_health_t health;
+        common_cache_get_health(i, &health);
+        sched->next_fast_due = health.next_attempt_ms > now ? health.next_attempt_ms : now + sched->fast_interval_ms;
+        return;
+    }
+
+    char topic[PAYLOAD_TOPIC_MAX];
+    char payload[PAYLOAD_VALUE_MAX];
+    for (payload_field_t f = 0; f < PAYLOAD_FIELD_COUNT && common_mqtt_connected(); f++) {
+        if (!(plan & PZ_FIELD_BIT(common_payload_field_source(f)))) {
+            continue;
+        }
+        common_payload_topic(topic, sizeof(topic), sensor->mqtt_topic_prefix, common_payload_field_name(f));
+        common_payload_value(payload, sizeof(payload), f, &sample.values);
+        common_mqtt_publish(cfg->mqtt_client, topic, payload, 0, 1, 0);
+    }
+
+    // keep the phase unless late by more than an interval
+    int64_t next = sched->next_fast_due + sched->fast_interval_ms;
+    sched->next_fast_due = next > now ? next : now + sched->fast_interval_ms;
+    sched->last_fast_seq = sample.seq;
+    ESP_LOGD(TAG, "[%s] Fast lane published, P: %.1fW", sensor->name, sample.values.power);
+}
+
+
+
+// after a (re)connect: the latest values of all sensors first, the availability follows with the next
+// update_availability, the samples missed meanwhile are sent as rate limited backlog
+static void flush_on_reconnect(const PMonTaskConfig_t *cfg) {
+    uint32_t connections = common_mqtt_connection_count();
+    if (connections == s_mqtt_connections || !common_mqtt_connected()) {
+        return;
+    }
+    bool reconnect = s_mqtt_connections != 0;
+    s_mqtt_connections = connections;
+    int64_t now = esp_timer_get_time() / 1000;
+
+    for (int i = 0; i < s_sched_count; i++) {
+        pmon_sched_t *sched = &s_sched[i];
+        sched->availability = -1;
+        pmon_sample_t sample;
+        if (reconnect && common_cache_peek(i, &sample)) {
+            publish_values(cfg, i, &sample);
+            publish_energy(cfg, i);
+        } else if (sched->restored && common_cache_peek(i, &sample)) {
+            publish_last(cfg, i, &sample); // warm restart: last known value at once, values follow with the schedule
+        }
+        sched->restored = false;
+        if (sched->deferred_since_ms != INT64_MAX) {
+            // a backlog interrupted by this outage starts again, covering both
+            if (!sched->backlog_active || sched->deferred_since_ms < sched->backlog_from_ms) {
+                sched->backlog_from_ms = sched->deferred_since_ms;
+            }
+            sched->backlog_to_ms = now;
+            memset(&sched->backlog, 0, sizeof(sched->backlog));
+            sched->backlog_active = true;
+            sched->deferred_since_ms = INT64_MAX;
+            ESP_LOGI(TAG, "[%s] Backlog of %lld s queued", cfg->sensors[i].name,
+                     (long long)(now - sched->backlog_from_ms) / 1000);
+        }
+    }
+    if (reconnect) {
+        s_backlog_stats.reconnects++;
+    }
+    s_next_backlog_ms = now + PMON_BACKLOG_INTERVAL_MS;
+}
+
+
+typedef struct {
+    esp_mqtt_client_handle_t client;
+    const char *topic;
+} backlog_ctx_t;
+
+static bool publish_backlog_message(const uint8_t *msg, size_t len, void *arg) {
+    backlog_ctx_t *ctx = (backlog_ctx_t *)arg;
+    return common_mqtt_publish(ctx->client, ctx->topic, (const char *)msg, len, 1, 0) >= 0;
+}
+
+
+// send the next message of a history request (someone waits for it) or else of the backlog,
+// round robin between the sensors
+static void send_backlog(const PMonTaskConfig_t *cfg, int64_t now) {
+    if (now < s_next_backlog_ms || !common_mqtt_connected()) {
+        return;
+    }
+    if (common_history_send_next(cfg->mqtt_client)) {
+        s_next_backlog_ms = now + PMON_BACKLOG_INTERVAL_MS;
+        return;
+    }
+    for (int n = 0; n < s_sched_count; n++) {
+        int i = (s_backlog_sensor + n) % s_sched_count;
+        pmon_sched_t *sched = &s_sched[i];
+        if (!sched->backlog_active) {
+            continue;
+        }
+        char topic[128];
+        snprintf(topic, sizeof(topic), "%s/history/backlog", cfg->sensors[i].mqtt_topic_prefix);
+        backlog_ctx_t ctx = { .client = cfg->mqtt_client, .topic = topic };
+        int result = common_history_dump_next(i, sched->backlog_from_ms, sched->backlog_to_ms, &sched->backlog,
+                                              publish_backlog_message, &ctx);
+        if (result >= 0) {
+            s_backlog_stats.backlog_messages++;
+        }
+        if (result == 0) {
+            sched->backlog_active = false;
+            ESP_LOGI(TAG, "[%s] Backlog sent in %u messages", cfg->sensors[i].name, sched->backlog.index);
+        }
+        s_backlog_sensor = i + 1;
+        break;
+    }
+    s_next_backlog_ms = now + PMON_BACKLOG_INTERVAL_MS;
+}
+
+
+void common_pmon_get_backlog_stats(pmon_backlog_stats_t *stats) {
+    *stats = s_backlog_stats;
+    stats->backlog_pending = 0;
+    for (int i = 0; i < s_sched_count; i++) {
+        stats->backlog_pending += s_sched[i].backlog_active;
+    }
+}
+
+
 // repeatedly read and publish all data of multiple sensors
 // where the UART interface is re-initialized for each sensor to 
 // allow individual uart pin configuration for each sensor
@@ -17,28 +655,32 @@ void common_PMonTask(void *arg) {
     PMonTaskConfig_t *cfg = (PMonTaskConfig_t *)arg;
     const ModbusSensor *sensors = cfg->sensors;
     const int sensor_count = cfg->sensor_count;
-    const uart_port_t uart_port = cfg->uart_port;
-    const esp_mqtt_client_handle_t mqtt_client = cfg->mqtt_client;
-    const int retry_interval_ms = cfg->retry_interval_on_fail_ms;
 
-    // variables
-    int64_t last_publish_time[sensor_count];
-    memset(last_publish_time, 0, sizeof(last_publish_time));
-    _current_values_t pzValues; // store module readout
+    s_sched_count = sensor_count;
+    if (s_sched_count > PMON_MAX_SENSORS) {
+        ESP_LOGE(TAG, "%d sensors configured but only %d supported, ignoring the rest", sensor_count, PMON_MAX_SENSORS);
+        s_sched_count = PMON_MAX_SENSORS;
+    }
 
 
 #if RESET_ENERGY_OF_ALL_MODULES
+        _current_values_t pzValues; // store module readout
         // Reset energy value of all configured sensors
         // loop through all configured sensors
         for (int i = 0; i < sensor_count; i++) {
+                if (!(common_sensor_profile(&sensors[i])->caps & PZ_CAP_RESET_ENERGY)) {
+                    ESP_LOGW(TAG, "[%s] %s has no energy reset, skipped", sensors[i].name, common_sensor_profile(&sensors[i])->name);
+                    continue;
+                }
                 // Create new uart config for this sensor
                 pzem_setup_t config = {
-                    .pzem_uart   = uart_port,
+                    .pzem_uart   = cfg->uart_port,
                     .pzem_rx_pin = sensors[i].rx_pin,
                     .pzem_tx_pin = sensors[i].tx_pin,
                     .pzem_addr   = sensors[i].modbus_addr,
                     .use_rs485   = sensors[i].use_rs485,
-                    .rs485_dir_pin = sensors[i].rs485_dir_pin
+                    .rs485_dir_pin = sensors[i].rs485_dir_pin,
+                    .stop_bits   = common_sensor_profile(&sensors[i])->stop_bits
                 };
 
                 // Initialize pins/config
@@ -66,104 +708,49 @@ void common_PMonTask(void *arg) {
         vTaskDelay(portMAX_DELAY);
         while(1);
 
+
 #else
 
-    // repeatedly readout and publish modules in their interval
+    init_schedule(cfg);
+
+    // repeatedly readout and publish the due sensor with the highest priority
     while (1) {
+        flush_on_reconnect(cfg);
+        update_availability(cfg);
         int64_t now = esp_timer_get_time() / 1000;
+        int i = pick_due(sensors, now);
+        if (i < 0) {
+            send_backlog(cfg, now);
+            sleep_ms(ms_until_next_due(now));
+            continue;
+        }
+        record_lateness(esp_timer_get_time() - due_time(&s_sched[i]) * 1000);
+        if (s_sched[i].next_due <= now) {
+            publish_sensor(cfg, i, now);
+        } else {
+            publish_fast(cfg, i, now);
+        }
+        checkpoint_sensor(cfg, i);
+    } // end while(1)
 
-        // loop through all configured sensors
-        for (int i = 0; i < sensor_count; i++) {
-            if ((now - last_publish_time[i]) >= sensors[i].publish_interval_ms) {
-
-                ESP_LOGI(TAG, "[%s] Due for publish. Init sensor addr=0x%02X TX=%d RX=%d RS485-MODE=%d",
-                         sensors[i].name,
-                         sensors[i].modbus_addr,
-                         sensors[i].tx_pin,
-                         sensors[i].rx_pin,
-                         sensors[i].use_rs485);
-
-                // Create new uart config for this sensor
-                pzem_setup_t config = {
-                    .pzem_uart   = uart_port,
-                    .pzem_rx_pin = sensors[i].rx_pin,
-                    .pzem_tx_pin = sensors[i].tx_pin,
-                    .pzem_addr   = sensors[i].modbus_addr,
-                    .use_rs485   = sensors[i].use_rs485,
-                    .rs485_dir_pin = sensors[i].rs485_dir_pin
-                };
-
-                // Initialize pins/config
-                PzemInit(&config);
-
+#endif
 
-                // Log before read
-                ESP_LOGI(TAG, "[%s] Starting read from sensor addr=0x%02X", sensors[i].name, sensors[i].modbus_addr);
-
-                // read
-                if (PzemGetValues(&config, &pzValues)) {
-                    bool allZero = (pzValues.voltage == 0.0f &&
-                                    pzValues.current == 0.0f &&
-                                    pzValues.power == 0.0f &&
-                                    pzValues.energy == 0.0f &&
-                                    pzValues.frequency == 0.0f &&
-                                    pzValues.pf == 0.0f);
-
-                    if (allZero) {
-                        ESP_LOGE(TAG, "[%s] Read succeeded but all values zero – treating as failed", sensors[i].name);
-                        last_publish_time[i] += retry_interval_ms; // when failed set next retry to faster interval
-                    } else {
-                        ESP_LOGI(TAG, "[%s] Read OK", sensors[i].name);
-                        printf("[%s] Vrms: %.1fV - Irms: %.3fA - P: %.1fW - E: %.2fWh\n", sensors[i].name, pzValues.voltage, pzValues.current, pzValues.power, pzValues.energy);
-                        printf("[%s] Freq: %.1fHz - PF: %.2f\n", sensors[i].name, pzValues.frequency, pzValues.pf);
-
-                        // publish all received values to the corresponding topics (with prefix of sensor)
-                        char topic[128];
-                        char payload[64];
-
-                        snprintf(topic, sizeof(topic), "%s/voltage", sensors[i].mqtt_topic_prefix);
-                        snprintf(payload, sizeof(payload), "%.1f", pzValues.voltage);
-                        esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 0);
-
-                        snprintf(topic, sizeof(topic), "%s/current", sensors[i].mqtt_topic_prefix);
-                        snprintf(payload, sizeof(payload), "%.3f", pzValues.current);
-                        esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 0);
-
-                        snprintf(topic, sizeof(topic), "%s/power", sensors[i].mqtt_topic_prefix);
-                        snprintf(payload, sizeof(payload), "%.1f", pzValues.power);
-                        esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 0);
-
-                        snprintf(topic, sizeof(topic), "%s/energy", sensors[i].mqtt_topic_prefix);
-                        snprintf(payload, sizeof(payload), "%.2f", pzValues.energy);
-                        esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 0);
-
-                        snprintf(topic, sizeof(topic), "%s/frequency", sensors[i].mqtt_topic_prefix);
-                        snprintf(payload, sizeof(payload), "%.1f", pzValues.frequency);
-                        esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 0);
-
-                        snprintf(topic, sizeof(topic), "%s/pf", sensors[i].mqtt_topic_prefix);
-                        snprintf(payload, sizeof(payload), "%.2f", pzValues.pf);
-                        esp_mqtt_client_publish(mqtt_client, topic, payload, 0, 1, 0);
-
-                        last_publish_time[i] = now; // success, set next read to configured interval
-                    } // endif - data is valid
-                } else { // else - read successfull -> read failed
-                    ESP_LOGE(TAG, "[%s] Failed to read sensor at addr=0x%02X", sensors[i].name, sensors[i].modbus_addr);
-                    last_publish_time[i] += retry_interval_ms; // when failed set next retry to faster interval
-                }
+    vTaskDelete(NULL); // not really needed but formal
+}
 
-                // ensure there is a small delay between sensor readouts (prevents wrong sensor answering or all data 0)
-                if (sensors[i].use_rs485)
-                    vTaskDelay(pdMS_TO_TICKS(200));
 
-                printf("\n");
-            }// endif - is due for publishing
-        } // endfor - each configured sensor
 
-        vTaskDelay(pdMS_TO_TICKS(500));
-    } // end while(1)
+void common_pmon_start(const PMonTaskConfig_t *config) {
+    s_cfg = *config;
+    s_task = xTaskCreateStaticPinnedToCore(common_PMonTask, "PowerMonitor", PMON_TASK_STACK, &s_cfg, PMON_TASK_PRIO,
+                                  s_task_stack, &s_task_buffer, TASK_CORE_MEASUREMENT);
+    common_membudget_register("pmon", sizeof(s_task_stack) + sizeof(s_task_buffer) + sizeof(s_sched) + sizeof(s_cfg)
+                              + common_energy_store_static_bytes(), 0);
+}
 
-#endif
 
-    vTaskDelete(NULL); // not really needed but formal
+void common_pmon_wake(void) {
+    if (s_task != NULL) {
+        xTaskNotifyGive(s_task);
+    }
 }
@@ -2,21 +2,85 @@
 #include "config_types.h"
 #include "mqtt_client.h"
 #include "driver/uart.h"
+#include "adaptive_poll.h"
+#include "bus_model.h"
 
+#define PMON_MAX_SENSORS 8
+#define BUS_DEFAULT_MAX_UTILIZATION 0.7f   // leaves room for retries and the warm up of the modules
+#define PMON_FALLBACK_INTERVAL_MS 30000    // used for sensors configured with publish_interval_ms <= 0
 
-// Struct to pass to the task
+// histogram of the poll start lateness (start of a read - time it was due), upper bounds in ms
+#define PMON_LATENESS_BOUNDS_MS 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000
+#define PMON_LATENESS_BUCKETS 10
+
+// after an MQTT outage the samples missed meanwhile are sent from the history, one message (history
+// block of one sensor) at most this often and only while no sensor is due. Answers to history
+// requests share this rate and go first
+#define PMON_BACKLOG_INTERVAL_MS 200
+
+
+// Config of the task, copied by common_pmon_start
 typedef struct {
     const ModbusSensor *sensors;
-    const int sensor_count;
-    const uart_port_t uart_port;
-    const esp_mqtt_client_handle_t mqtt_client;
-    const int retry_interval_on_fail_ms;
+    int sensor_count;
+    uart_port_t uart_port;
+    esp_mqtt_client_handle_t mqtt_client;
+    int retry_interval_on_fail_ms;              // retry when no new sample was available (failed reads back off, see circuit_breaker.h)
+    adaptive_config_t adaptive;                 // adaptive interval (publish_interval_ms is the slow floor), see adaptive_poll.h
+    float max_bus_utilization;                  // admission limit of the planned bus time (0..1), 0 = BUS_DEFAULT_MAX_UTILIZATION
+    int energy_interval_ms;                     // billing interval of the energy counters (energy_store.h), 0 = counter only
+    int alarm_check_interval_ms;                // power_alarm.h check interval, planned as fixed bus demand, 0 = no alarm task
+    int live_interval_ms;                       // live_stream.h sampling interval, planned as fixed bus demand, 0 = no live view
+    int gateway_max_age_ms;                     // modbus_gateway.h max_age_ms, planned as fixed bus demand, 0 = no gateway
 } PMonTaskConfig_t;
 
+// Schedule of a sensor, e.g. for metrics
+typedef struct {
+    int configured_interval_ms;                 // publish_interval_ms of the sensor
+    int admitted_interval_ms;                   // after bus admission control
+    int current_interval_ms;                    // currently used (adaptive interval)
+    uint32_t modeled_read_us;                   // bus time of one read according to bus_model.h
+    int fast_interval_ms;                       // fast lane (partial reads), 0 = none
+    uint32_t modeled_fast_read_us;              // bus time of one partial read
+} pmon_schedule_info_t;
+
+// Poll start lateness of all sensors since boot
+typedef struct {
+    uint32_t count;
+    uint64_t sum_us;
+    uint32_t max_us;
+    uint32_t buckets[PMON_LATENESS_BUCKETS + 1];   // per bound of PMON_LATENESS_BOUNDS_MS (not cumulative), last: above
+} pmon_lateness_t;
+
+// Publishing across MQTT outages
+typedef struct {
+    uint32_t deferred;                          // samples not published while MQTT was down (kept in the history)
+    uint32_t reconnects;                        // reconnects with publish of the latest values
+    uint32_t backlog_messages;                  // history messages sent as backlog
+    int backlog_pending;                        // sensors with backlog still to send
+} pmon_backlog_stats_t;
 
 
-// Starts the background task that periodically reads + publishes sensor data
-// repeatedly read and publish all data of multiple sensors
+
+// Starts the background task that periodically reads + publishes sensor data (pinned to the
+// measurement core, see task_layout.h), the config is copied
+void common_pmon_start(const PMonTaskConfig_t *config);
+
+// Wake the task before its next deadline (e.g. MQTT connected: flush after the reconnect)
+void common_pmon_wake(void);
+
+// The task itself: repeatedly read and publish all data of multiple sensors
 // where the UART interface is re-initialized for each sensor to 
 // allow individual uart pin configuration for each sensor
 void common_PMonTask(void * PMonTaskConfig_t);
+
+// Copy schedule of a sensor, returns false for an invalid index or before the task started
+bool common_pmon_get_schedule(int sensor_index, pmon_schedule_info_t *info);
+
+// Result of the bus admission control and the planned bus utilization (may be NULL)
+bus_admission_t common_pmon_get_admission(float *planned_utilization);
+
+// Copy the poll start lateness histogram
+void common_pmon_get_lateness(pmon_lateness_t *lateness);
+
+void common_pmon_get_backlog_stats(pmon_backlog_stats_t *stats);
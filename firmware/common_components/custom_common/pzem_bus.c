@@ -0,0 +1,122 @@
+#include "pzem_bus.h"
+#include "memory_budget.h"
+#include "power_save.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define TAG "common_bus"
+
+static SemaphoreHandle_t s_bus_lock = NULL;
+static StaticSemaphore_t s_bus_lock_buffer;
+
+// UART configuration currently applied
+static bool s_configured = false;
+static pzem_setup_t s_current;
+static int64_t s_last_release_ms = 0;
+
+// usage statistics, s_acquired_us is only accessed by the lock holder
+static int64_t s_acquired_us = 0;
+static bus_stats_t s_stats;
+static int64_t s_window_start_us = 0;
+static int64_t s_window_busy_us = 0;
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+void common_bus_init(void) {
+    if (s_bus_lock == NULL) {
+        s_bus_lock = xSemaphoreCreateMutexStatic(&s_bus_lock_buffer);
+    }
+}
+
+
+void common_bus_acquire(uart_port_t uart_port, const ModbusSensor *sensor, pzem_setup_t *setup) {
+    int64_t wait_start = esp_timer_get_time();
+    xSemaphoreTake(s_bus_lock, portMAX_DELAY);
+    common_power_bus_begin();
+    s_acquired_us = esp_timer_get_time();
+
+    int64_t waited = s_acquired_us - wait_start;
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.wait_us += waited;
+    if (waited > s_stats.max_wait_us) {
+        s_stats.max_wait_us = waited;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    // Create new uart config for this sensor
+    *setup = (pzem_setup_t){
+        .pzem_uart   = uart_port,
+        .pzem_rx_pin = sensor->rx_pin,
+        .pzem_tx_pin = sensor->tx_pin,
+        .pzem_addr   = sensor->modbus_addr,
+        .use_rs485   = sensor->use_rs485,
+        .rs485_dir_pin = sensor->rs485_dir_pin,
+        .stop_bits   = common_sensor_profile(sensor)->stop_bits
+    };
+
+    // sensors sharing pins (e.g. RS485 bus) do not need the driver to be re-installed
+    bool same_config = s_configured
+        && s_current.pzem_uart == setup->pzem_uart
+        && s_current.pzem_rx_pin == setup->pzem_rx_pin
+        && s_current.pzem_tx_pin == setup->pzem_tx_pin
+        && s_current.use_rs485 == setup->use_rs485
+        && s_current.rs485_dir_pin == setup->rs485_dir_pin
+        && s_current.stop_bits == setup->stop_bits;
+
+    if (!same_config) {
+        ESP_LOGD(TAG, "[%s] re-configuring UART TX=%d RX=%d RS485-MODE=%d", sensor->name, sensor->tx_pin, sensor->rx_pin, sensor->use_rs485);
+        // the driver is installed with the first configuration only (see PzemInit)
+        size_t heap_mark = s_configured ? 0 : common_membudget_heap_mark();
+        PzemInit(setup);
+        if (heap_mark > 0) {
+            common_membudget_register("uart", 0, heap_mark);
+        }
+        s_current = *setup;
+        s_configured = true;
+    }
+
+    if (setup->use_rs485) {
+        int64_t since_last = esp_timer_get_time() / 1000 - s_last_release_ms;
+        if (since_last < RS485_GAP_MS) {
+            // nothing is sent or expected during the gap, power save may sleep through it
+            common_power_bus_end();
+            vTaskDelay(pdMS_TO_TICKS(RS485_GAP_MS - since_last));
+            common_power_bus_begin();
+        }
+    }
+}
+
+
+void common_bus_release(void) {
+    int64_t now = esp_timer_get_time();
+    s_last_release_ms = now / 1000;
+
+    portENTER_CRITICAL(&s_stats_lock);
+    s_stats.transactions++;
+    s_stats.busy_us += now - s_acquired_us;
+    s_window_busy_us += now - s_acquired_us;
+    if (now - s_window_start_us >= BUS_UTILIZATION_WINDOW_MS * 1000LL) {
+        s_stats.utilization = (float)s_window_busy_us / (now - s_window_start_us);
+        s_window_start_us = now;
+        s_window_busy_us = 0;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+
+    common_power_bus_end();
+    xSemaphoreGive(s_bus_lock);
+}
+
+
+void common_bus_get_stats(bus_stats_t *stats) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats;
+    // window without any transaction (bus idle)
+    if (now - s_window_start_us >= 2 * BUS_UTILIZATION_WINDOW_MS * 1000LL) {
+        stats->utilization = (float)s_window_busy_us / (now - s_window_start_us);
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "config_types.h"
+#include "pzem004tv3.h"
+
+// Exclusive access to the UART shared by all sensors.
+// The UART pins are configured per sensor, so every task talking to a sensor
+// (poll task, modbus gateway, ...) has to acquire the bus first.
+// While the bus is held the node does not enter light sleep (power_save.h).
+
+// ensure there is a small delay between sensor readouts on RS485 (prevents wrong sensor answering or all data 0)
+#define RS485_GAP_MS 200
+// measured utilization is reported over windows of this length
+#define BUS_UTILIZATION_WINDOW_MS 10000
+
+// Bus usage (time between acquire returning the lock and release, incl. re-configuration and RS485 gap)
+typedef struct {
+    uint32_t transactions;          // acquire/release pairs
+    int64_t busy_us;                // total time the bus was held
+    int64_t wait_us;                // total time spent waiting for the lock
+    int64_t max_wait_us;            // longest wait for the lock
+    float utilization;              // busy share of the last complete window (0..1)
+} bus_stats_t;
+
+// Create bus lock, call once from app_main before any task using the bus is started
+void common_bus_init(void);
+
+// Lock bus and configure UART for this sensor (UART is only re-initialized when pins/mode differ
+// from the previous user), setup is filled with the driver config for the sensor.
+// On RS485 a minimum gap to the previous transaction is ensured before returning.
+void common_bus_acquire(uart_port_t uart_port, const ModbusSensor *sensor, pzem_setup_t *setup);
+
+// Unlock bus
+void common_bus_release(void);
+
+// Copy bus usage statistics
+void common_bus_get_stats(bus_stats_t *stats);
@@ -0,0 +1,313 @@
+#include "sample_cache.h"
+#include "memory_budget.h"
+#include "pzem_bus.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_log.h"
+
+#define TAG "common_cache"
+
+
+typedef struct {
+    const ModbusSensor *sensor;
+    pzem_plan_t plan;                       // all values of the device profile, compiled once
+    pzem_plan_t fast_plan;                  // values of the fast lane, read_count 0 = none
+    pmon_sample_t sample;
+    pmon_health_t health;
+    breaker_t breaker;                      // protected by s_data_lock
+    SemaphoreHandle_t refresh_lock;         // serializes reads of this sensor
+    StaticSemaphore_t refresh_lock_buffer;
+} cache_entry_t;
+
+
+static cache_entry_t s_entries[CACHE_MAX_SENSORS];
+static int s_sensor_count = 0;
+static uart_port_t s_uart_port;
+static breaker_config_t s_breaker_cfg;
+// protects sample + health of all entries (only held while copying)
+static portMUX_TYPE s_data_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+void common_cache_init(const ModbusSensor *sensors, int sensor_count, uart_port_t uart_port) {
+    if (sensor_count > CACHE_MAX_SENSORS) {
+        ESP_LOGE(TAG, "%d sensors configured but cache supports only %d, ignoring the rest", sensor_count, CACHE_MAX_SENSORS);
+        sensor_count = CACHE_MAX_SENSORS;
+    }
+    common_breaker_default_config(&s_breaker_cfg);
+    for (int i = 0; i < sensor_count; i++) {
+        memset(&s_entries[i], 0, sizeof(s_entries[i]));
+        s_entries[i].sensor = &sensors[i];
+        if (PzemProfile(sensors[i].profile) == NULL) {
+            ESP_LOGE(TAG, "[%s] unknown device profile %d, using %s", sensors[i].name, sensors[i].profile,
+                     common_sensor_profile(&sensors[i])->name);
+        }
+        const pzem_profile_t *profile = common_sensor_profile(&sensors[i]);
+        PzemCompilePlan(profile, PZ_ALL_FIELDS, sensors[i].modbus_addr, &s_entries[i].plan);
+        if (sensors[i].fast_interval_ms > 0 && sensors[i].fast_plan.fields != 0) {
+            if (!PzemCompilePlan(profile, sensors[i].fast_plan.fields, sensors[i].modbus_addr, &s_entries[i].fast_plan)) {
+                memset(&s_entries[i].fast_plan, 0, sizeof(s_entries[i].fast_plan));
+                ESP_LOGE(TAG, "[%s] fast plan has no value measured by the %s, fast lane disabled", sensors[i].name, profile->name);
+            }
+        }
+        ESP_LOGI(TAG, "[%s] %s: full read %d registers in %d transaction(s)", sensors[i].name, profile->name,
+                 __builtin_popcount(s_entries[i].plan.reg_mask), s_entries[i].plan.read_count);
+        common_breaker_init(&s_entries[i].breaker, &s_breaker_cfg);
+        s_entries[i].refresh_lock = xSemaphoreCreateMutexStatic(&s_entries[i].refresh_lock_buffer);
+    }
+    s_uart_port = uart_port;
+    s_sensor_count = sensor_count;
+    common_membudget_register("cache", sizeof(s_entries), 0);
+}
+
+
+int common_cache_sensor_count(void) {
+    return s_sensor_count;
+}
+
+
+const ModbusSensor *common_cache_get_sensor(int sensor_index) {
+    if (sensor_index < 0 || sensor_index >= s_sensor_count) {
+        return NULL;
+    }
+    return s_entries[sensor_index].sensor;
+}
+
+
+// copy sample if the registers in mask were read within max_age_ms
+static bool copy_if_fresh(cache_entry_t *entry, uint16_t mask, uint32_t max_age_ms, pmon_sample_t *out) {
+    int64_t now = esp_timer_get_time() / 1000;
+    bool fresh;
+    portENTER_CRITICAL(&s_data_lock);
+    const pmon_sample_t *s = &entry->sample;
+    fresh = s->seq != 0 &&
+            ((now - s->full_time_ms) <= (int64_t)max_age_ms ||
+             ((s->fresh_mask & mask) == mask && (now - s->time_ms) <= (int64_t)max_age_ms));
+    if (fresh) {
+        *out = entry->sample;
+    }
+    portEXIT_CRITICAL(&s_data_lock);
+    return fresh;
+}
+
+
+// read sensor via bus (all registers or the fast lane) and store result, called with refresh_lock held
+static bool refresh(cache_entry_t *entry, bool partial) {
+    const ModbusSensor *sensor = entry->sensor;
+    const pzem_plan_t *plan = partial ? &entry->fast_plan : &entry->plan;
+    uint16_t regs[PZ_REGISTER_COUNT] = {0};
+    pzem_setup_t config;
+
+    common_bus_acquire(s_uart_port, sensor, &config);
+    int64_t start = esp_timer_get_time();
+    bool ok = PzemPlanRead(&config, plan, regs);
+    int64_t end = esp_timer_get_time();
+    common_bus_release();
+
+    _current_values_t values;
+    PzemZeroValues(&values);
+    bool allZero = false;
+    if (ok && partial) {
+        // merge into the last full read, only the read values are decoded
+        portENTER_CRITICAL(&s_data_lock);
+        values = entry->sample.values;
+        for (int r = 0; r < PZ_REGISTER_COUNT; r++) {
+            if (!(plan->reg_mask & (1u << r))) {
+                regs[r] = entry->sample.regs[r];
+            }
+        }
+        portEXIT_CRITICAL(&s_data_lock);
+        PzemPlanDecode(plan, regs, &values);
+    } else if (ok) {
+        PzemPlanDecode(plan, regs, &values);
+        allZero = (values.voltage == 0.0f &&
+                   values.current == 0.0f &&
+                   values.power == 0.0f &&
+                   values.energy == 0.0f &&
+                   values.frequency == 0.0f &&
+                   values.pf == 0.0f);
+    }
+
+    uint32_t random = esp_random();
+    portENTER_CRITICAL(&s_data_lock);
+    breaker_state_t old_state = entry->breaker.state;
+    entry->health.last_duration_us = end - start;
+    if (!ok || allZero) {
+        common_breaker_failure(&entry->breaker, &s_breaker_cfg, end / 1000, random);
+    } else {
+        common_breaker_success(&entry->breaker, &s_breaker_cfg);
+    }
+    breaker_state_t new_state = entry->breaker.state;
+    if (!ok) {
+        entry->health.reads_failed++;
+        entry->health.consecutive_failures++;
+    } else if (allZero) {
+        entry->health.reads_zero++;
+        entry->health.consecutive_failures++;
+    } else {
+        entry->health.reads_ok++;
+        entry->health.consecutive_failures = 0;
+        entry->health.last_ok_ms = end / 1000;
+        entry->sample.values = values;
+        memcpy(entry->sample.regs, regs, sizeof(regs));
+        entry->sample.time_ms = end / 1000;
+        if (partial) {
+            entry->health.reads_partial++;
+            entry->sample.fresh_mask = plan->reg_mask;
+        } else {
+            entry->sample.full_time_ms = end / 1000;
+            entry->sample.fresh_mask = plan->reg_mask;
+        }
+        entry->sample.seq++;
+    }
+    portEXIT_CRITICAL(&s_data_lock);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "[%s] Failed to read sensor at addr=0x%02X", sensor->name, sensor->modbus_addr);
+    } else if (allZero) {
+        ESP_LOGE(TAG, "[%s] Read succeeded but all values zero – treating as failed", sensor->name);
+    }
+    if (new_state != old_state) {
+        ESP_LOGW(TAG, "[%s] Circuit breaker %s -> %s", sensor->name,
+                 common_breaker_state_str(old_state), common_breaker_state_str(new_state));
+    }
+    return ok && !allZero;
+}
+
+
+// check breaker before a read, called with refresh_lock held
+static bool breaker_allows(cache_entry_t *entry) {
+    int64_t now = esp_timer_get_time() / 1000;
+    bool allowed;
+    portENTER_CRITICAL(&s_data_lock);
+    allowed = common_breaker_allow(&entry->breaker, now);
+    if (!allowed) {
+        entry->health.reads_skipped++;
+    }
+    portEXIT_CRITICAL(&s_data_lock);
+    return allowed;
+}
+
+
+// fast: only the registers of the fast lane have to be fresh and are refreshed with a partial read
+static bool get_sample(int sensor_index, bool fast, uint32_t max_age_ms, pmon_sample_t *out) {
+    if (sensor_index < 0 || sensor_index >= s_sensor_count) {
+        return false;
+    }
+    cache_entry_t *entry = &s_entries[sensor_index];
+    if (fast && entry->fast_plan.read_count == 0) {
+        return false; // no fast lane, full reads are up to the caller
+    }
+    const uint16_t mask = fast ? entry->fast_plan.reg_mask : entry->plan.reg_mask;
+
+    if (copy_if_fresh(entry, mask, max_age_ms, out)) {
+        return true;
+    }
+
+    xSemaphoreTake(entry->refresh_lock, portMAX_DELAY);
+    // another consumer may have refreshed while we were waiting for the lock
+    bool ok = copy_if_fresh(entry, mask, max_age_ms, out);
+    if (!ok && !breaker_allows(entry)) {
+        xSemaphoreGive(entry->refresh_lock);
+        return false;
+    }
+    // partial reads need a full read to merge into
+    bool partial = mask != entry->plan.reg_mask && entry->sample.full_time_ms != 0;
+    if (!ok && refresh(entry, partial)) {
+        portENTER_CRITICAL(&s_data_lock);
+        *out = entry->sample;
+        portEXIT_CRITICAL(&s_data_lock);
+        ok = true;
+    }
+    xSemaphoreGive(entry->refresh_lock);
+    return ok;
+}
+
+
+bool common_cache_get(int sensor_index, uint32_t max_age_ms, pmon_sample_t *out) {
+    return get_sample(sensor_index, false, max_age_ms, out);
+}
+
+
+bool common_cache_get_fast(int sensor_index, uint32_t max_age_ms, pmon_sample_t *out) {
+    return get_sample(sensor_index, true, max_age_ms, out);
+}
+
+
+uint16_t common_cache_fast_fields(int sensor_index) {
+    if (sensor_index < 0 || sensor_index >= s_sensor_count) {
+        return 0;
+    }
+    return s_entries[sensor_index].fast_plan.read_count > 0 ? s_entries[sensor_index].fast_plan.fields : 0;
+}
+
+
+void common_cache_restore(int sensor_index, const uint16_t *regs, int64_t time_ms, const pmon_health_t *counters) {
+    if (sensor_index < 0 || sensor_index >= s_sensor_count) {
+        return;
+    }
+    cache_entry_t *entry = &s_entries[sensor_index];
+    _current_values_t values;
+    PzemZeroValues(&values);
+    if (regs != NULL) {
+        PzemPlanDecode(&entry->plan, regs, &values);
+    }
+
+    portENTER_CRITICAL(&s_data_lock);
+    if (regs != NULL && entry->sample.seq == 0) {
+        entry->sample.values = values;
+        memcpy(entry->sample.regs, regs, sizeof(entry->sample.regs));
+        entry->sample.time_ms = time_ms;
+        entry->sample.full_time_ms = time_ms;
+        entry->sample.fresh_mask = entry->plan.reg_mask;
+        entry->sample.seq = 1;
+        entry->health.last_ok_ms = time_ms != 0 ? time_ms : -1; // 0 = never read
+    }
+    entry->health.reads_ok += counters->reads_ok;
+    entry->health.reads_failed += counters->reads_failed;
+    entry->health.reads_zero += counters->reads_zero;
+    entry->health.reads_skipped += counters->reads_skipped;
+    entry->health.reads_partial += counters->reads_partial;
+    entry->breaker.trips += counters->breaker_trips;
+    portEXIT_CRITICAL(&s_data_lock);
+}
+
+
+bool common_cache_peek(int sensor_index, pmon_sample_t *out) {
+    if (sensor_index < 0 || sensor_index >= s_sensor_count) {
+        return false;
+    }
+    bool valid;
+    portENTER_CRITICAL(&s_data_lock);
+    valid = s_entries[sensor_index].sample.seq != 0;
+    if (valid) {
+        *out = s_entries[sensor_index].sample;
+    }
+    portEXIT_CRITICAL(&s_data_lock);
+    return valid;
+}
+
+
+bool common_cache_peek_fresh(int sensor_index, uint16_t reg_mask, uint32_t max_age_ms, pmon_sample_t *out) {
+    if (sensor_index < 0 || sensor_index >= s_sensor_count) {
+        return false;
+    }
+    return copy_if_fresh(&s_entries[sensor_index], reg_mask, max_age_ms, out);
+}
+
+
+void common_cache_get_health(int sensor_index, pmon_health_t *health) {
+    memset(health, 0, sizeof(*health));
+    if (sensor_index < 0 || sensor_index >= s_sensor_count) {
+        return;
+    }
+    portENTER_CRITICAL(&s_data_lock);
+    *health = s_entries[sensor_index].health;
+    health->breaker_state = s_entries[sensor_index].breaker.state;
+    health->breaker_trips = s_entries[sensor_index].breaker.trips;
+    health->next_attempt_ms = s_entries[sensor_index].breaker.next_attempt_ms;
+    portEXIT_CRITICAL(&s_data_lock);
+}
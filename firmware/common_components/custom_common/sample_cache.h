@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "config_types.h"
+#include "pzem004tv3.h"
+#include "circuit_breaker.h"
+
+// Latest sample of every configured sensor, shared by all consumers (MQTT, HTTP, Modbus TCP, ...).
+// common_cache_get() only starts a bus transaction when the cached sample is older than
+// the age the caller accepts, concurrent callers for the same sensor wait for a single read.
+// Reads of a failing sensor are limited by a circuit breaker (circuit_breaker.h): while it backs off
+// or is open common_cache_get() fails at once without touching the bus.
+// Sensors with a fast lane (fast_plan of the sensor) can also be read partially with
+// common_cache_get_fast(), the sample then holds the new registers merged into the last full read.
+
+#define CACHE_MAX_SENSORS 8
+
+// One sample of a sensor
+typedef struct {
+    _current_values_t values;               // decoded values
+    uint16_t regs[PZ_REGISTER_COUNT];       // raw input registers at their index (map of the device profile)
+    int64_t time_ms;                        // capture time of the latest (full or partial) read (esp_timer uptime)
+    int64_t full_time_ms;                   // capture time of the latest full read
+    uint16_t fresh_mask;                    // registers captured at time_ms (bit n = register n), others are from full_time_ms
+    uint32_t seq;                           // incremented with every new sample, 0 = no sample yet
+} pmon_sample_t;
+
+// Read statistics of a sensor
+typedef struct {
+    uint32_t reads_ok;
+    uint32_t reads_failed;                  // no or invalid response (timeout, CRC, wrong address)
+    uint32_t reads_zero;                    // valid response but all values zero (treated as failed)
+    uint32_t consecutive_failures;          // failed or zero reads since the last successful one
+    int64_t last_ok_ms;                     // uptime of last successful read, 0 = never
+    int64_t last_duration_us;               // duration of last bus transaction
+    uint32_t reads_skipped;                 // refused by the circuit breaker (no bus transaction)
+    uint32_t reads_partial;                 // successful fast lane reads (included in reads_ok)
+    breaker_state_t breaker_state;
+    uint32_t breaker_trips;                 // transitions to open
+    int64_t next_attempt_ms;                // no read before this uptime (backoff / open breaker)
+} pmon_health_t;
+
+// Configure cache for the sensors, call once from app_main after common_bus_init()
+void common_cache_init(const ModbusSensor *sensors, int sensor_count, uart_port_t uart_port);
+
+// Get sample not older than max_age_ms, reads the sensor when cached sample is too old.
+// Returns false when the read failed or the breaker does not allow a read yet (out is not modified)
+bool common_cache_get(int sensor_index, uint32_t max_age_ms, pmon_sample_t *out);
+
+// Like common_cache_get for the fast lane: only the registers of the fast plan have to be younger
+// than max_age_ms, a full read is made when there is no sample yet. Fails without touching the bus
+// for sensors without fast lane (common_cache_fast_fields() 0)
+bool common_cache_get_fast(int sensor_index, uint32_t max_age_ms, pmon_sample_t *out);
+
+// Values (PZ_FIELD_BIT) read by the fast lane of a sensor, 0 = no fast lane: not configured or
+// the fast plan was rejected (no value measured by the device type)
+uint16_t common_cache_fast_fields(int sensor_index);
+
+// Seed a sensor without sample yet with the last known sample of the previous run (warm restart,
+// time_ms may be before boot, regs NULL = no sample) and add its read statistics. The sample keeps
+// its age, common_cache_get() only returns it when max_age_ms covers it
+void common_cache_restore(int sensor_index, const uint16_t *regs, int64_t time_ms, const pmon_health_t *counters);
+
+// Get last sample regardless of age, never touches the bus. Returns false if there is no sample yet
+bool common_cache_peek(int sensor_index, pmon_sample_t *out);
+
+// Get last sample if the registers in reg_mask (bit n = register n) were read within max_age_ms,
+// by a full read or a partial read covering all of them. Never touches the bus
+bool common_cache_peek_fresh(int sensor_index, uint16_t reg_mask, uint32_t max_age_ms, pmon_sample_t *out);
+
+// Copy read statistics of a sensor
+void common_cache_get_health(int sensor_index, pmon_health_t *health);
+
+// Number of sensors managed by the cache
+int common_cache_sensor_count(void);
+
+// Config of a sensor managed by the cache, NULL for an invalid index
+const ModbusSensor *common_cache_get_sensor(int sensor_index);
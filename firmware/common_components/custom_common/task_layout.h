@@ -0,0 +1,36 @@
+#pragma once
+#include "sdkconfig.h"
+
+// Core and priority layout of all tasks of the node, in one place.
+//
+// Networking runs on core 0 (PRO_CPU): the WiFi driver is pinned there by IDF, lwIP (tcpip), esp-mqtt
+// and the http server are pinned there via sdkconfig.defaults / http_helper.c, the modbus tcp server
+// is started there. The measurement tasks (bus access, schedule, alarm) run on core 1 (APP_CPU), so
+// a burst of network traffic does not delay the start of a sensor read.
+// On core 1 the alarm task (one register, must not wait for a publish cycle) is above the publish
+// task, both are above everything else of the application; the bus mutex serializes their reads.
+//
+// Stacks and task control blocks are statically allocated, the tasks exist for the whole runtime.
+
+#if CONFIG_FREERTOS_NUMBER_OF_CORES > 1
+#define TASK_CORE_NETWORK       0
+#define TASK_CORE_MEASUREMENT   1
+#else
+#define TASK_CORE_NETWORK       0
+#define TASK_CORE_MEASUREMENT   0
+#endif
+
+// measurement core
+#define PMON_TASK_PRIO          10
+#define PMON_TASK_STACK         4608   // incl. one history message (backlog after an MQTT outage)
+#define ALARM_TASK_PRIO         11
+#define ALARM_TASK_STACK        3072
+#define LIVE_TASK_PRIO          4      // sampling for viewers is best effort, below the schedule
+#define LIVE_TASK_STACK         3072
+#define SNIFFER_TASK_PRIO       3      // capture is timestamped in the interrupt, the task only decodes and sends
+#define SNIFFER_TASK_STACK      3072
+
+// network core (WiFi 23, lwIP 18, esp-mqtt 5, httpd 5)
+#define MBGW_TASK_PRIO          4
+#define MBGW_TASK_STACK         4096
+#define HTTPD_TASK_PRIO         5
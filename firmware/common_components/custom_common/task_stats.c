@@ -0,0 +1,54 @@
+#include "task_stats.h"
+#include <string.h>
+#include "freertos/task.h"
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+static TaskStatus_t s_status[TASK_STATS_MAX_TASKS];
+#endif
+
+
+
+bool common_task_stats_snapshot(task_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    configRUN_TIME_COUNTER_TYPE total = 0;
+    UBaseType_t count = uxTaskGetSystemState(s_status, TASK_STATS_MAX_TASKS, &total);
+    if (count == 0) {
+        return false; // more tasks than entries, nothing is filled in
+    }
+    stats->total_us = total;
+    stats->count = (int)count;
+
+    TaskHandle_t idle[TASK_STATS_CORES] = { NULL };
+    for (int c = 0; c < TASK_STATS_CORES; c++) {
+        idle[c] = xTaskGetIdleTaskHandleForCore(c);
+    }
+
+    for (int i = 0; i < (int)count; i++) {
+        const TaskStatus_t *st = &s_status[i];
+        for (int c = 0; c < TASK_STATS_CORES; c++) {
+            if (idle[c] != NULL && st->xHandle == idle[c]) {
+                stats->idle_us[c] = st->ulRunTimeCounter;
+            }
+        }
+        task_stat_t *t = &stats->tasks[i];
+        strncpy(t->name, st->pcTaskName, sizeof(t->name) - 1);
+        BaseType_t core = xTaskGetCoreID(st->xHandle);
+        t->core = core == tskNO_AFFINITY ? -1 : (int)core;
+        t->run_time_us = st->ulRunTimeCounter;
+        t->stack_free_bytes = st->usStackHighWaterMark; // bytes on ESP-IDF (stack depth is in bytes)
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+size_t common_task_stats_static_bytes(void) {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    return sizeof(s_status);
+#else
+    return 0;
+#endif
+}
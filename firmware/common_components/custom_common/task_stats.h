@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+
+// CPU time of all FreeRTOS tasks (run time statistics, counted in µs by esp_timer, so they stay
+// correct with dynamic frequency scaling). The idle task of a core runs whenever nothing else
+// does, its run time is the idle time of the core, including the time spent in light sleep.
+// Needs CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS with a
+// 64 bit counter (sdkconfig.defaults), otherwise no snapshot is available.
+
+#define TASK_STATS_MAX_TASKS    24      // the node runs ~18, with more tasks no snapshot is taken
+#define TASK_STATS_CORES        CONFIG_FREERTOS_NUMBER_OF_CORES
+
+typedef struct {
+    char name[configMAX_TASK_NAME_LEN];
+    int core;                           // pinned core, -1 = not pinned
+    uint64_t run_time_us;               // since boot
+    uint32_t stack_free_bytes;          // lowest free stack since start (high water mark)
+} task_stat_t;
+
+typedef struct {
+    int count;
+    uint64_t total_us;                  // run time counter at the snapshot (uptime)
+    uint64_t idle_us[TASK_STATS_CORES]; // run time of the idle task of each core
+    task_stat_t tasks[TASK_STATS_MAX_TASKS];
+} task_stats_t;
+
+// Take a snapshot of all tasks, false when run time statistics are not enabled or there are
+// more than TASK_STATS_MAX_TASKS tasks.
+// Not reentrant (metrics are rendered by a single task)
+bool common_task_stats_snapshot(task_stats_t *stats);
+
+// RAM of the snapshot buffer (memory budget of the http server)
+size_t common_task_stats_static_bytes(void);
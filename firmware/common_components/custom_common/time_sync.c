@@ -0,0 +1,49 @@
+#include "time_sync.h"
+#include <sys/time.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_netif_sntp.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#define TAG "common_time"
+
+static time_stats_t s_stats;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+static void time_synced(struct timeval *tv) {
+    portENTER_CRITICAL(&s_lock);
+    bool first = s_stats.syncs == 0;
+    s_stats.syncs++;
+    s_stats.last_sync_ms = esp_timer_get_time() / 1000;
+    portEXIT_CRITICAL(&s_lock);
+    if (first) {
+        ESP_LOGI(TAG, "System time set by SNTP: %lld", (long long)tv->tv_sec);
+    }
+}
+
+
+void common_time_start(const char *server) {
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(server != NULL ? server : TIME_SYNC_DEFAULT_SERVER);
+    config.sync_cb = time_synced;
+    esp_err_t err = esp_netif_sntp_init(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Starting SNTP failed: %s", esp_err_to_name(err));
+    }
+}
+
+
+bool common_time_valid(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec >= TIME_VALID_AFTER_S;
+}
+
+
+void common_time_get_stats(time_stats_t *stats) {
+    portENTER_CRITICAL(&s_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_lock);
+    stats->valid = common_time_valid();
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// System time from SNTP (UTC). Until the first sync the system time counts from 1970 at power-on,
+// consumers that need the wall clock (billing intervals, energy_store.h) check common_time_valid().
+// The RTC timer keeps the system time across software resets, so after a warm restart the time is
+// valid before the first sync.
+
+#define TIME_SYNC_DEFAULT_SERVER   "pool.ntp.org"
+#define TIME_VALID_AFTER_S         1704067200      // 2024-01-01: anything earlier was never synced
+
+typedef struct {
+    bool valid;
+    uint32_t syncs;                     // SNTP updates since boot
+    int64_t last_sync_ms;               // uptime of the last update, 0 = none
+} time_stats_t;
+
+// Start SNTP (call once after WiFi was started), NULL = TIME_SYNC_DEFAULT_SERVER
+void common_time_start(const char *server);
+
+// System time is the wall clock
+bool common_time_valid(void);
+
+void common_time_get_stats(time_stats_t *stats);
@@ -0,0 +1,174 @@
+#include "warm_restart.h"
+#include <string.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#define TAG "common_warm"
+
+#define NVS_NAMESPACE "warm"
+#define NVS_KEY_STATE "state"
+#define WARM_MAGIC    0x57524D31      // "WRM1"
+
+// same layout in RTC memory and NVS, the snapshot only holds the used slots
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                      // sizeof(warm_store_t), a changed layout is not restored
+    uint32_t restarts;
+    uint32_t count;                     // used slots
+    uint32_t crc;                       // of the used slots
+    warm_sensor_t sensors[WARM_MAX_SENSORS];
+} warm_store_t;
+
+#define STORE_HEADER_SIZE offsetof(warm_store_t, sensors)
+
+RTC_NOINIT_ATTR static warm_store_t s_rtc;
+static warm_store_t s_restore;          // checkpoint of the previous run
+static warm_stats_t s_stats;
+static int64_t s_next_snapshot_ms;
+
+
+
+// kept across resets by the RTC timer (not across a power cycle)
+static int64_t system_time_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+// FNV-1a over what makes the schedule of a sensor, so a changed config starts fresh
+static uint32_t sensor_id(const ModbusSensor *sensor) {
+    uint32_t hash = 2166136261u;
+    const int values[] = { sensor->modbus_addr, sensor->publish_interval_ms, sensor->fast_interval_ms,
+                           sensor->fast_plan.fields, sensor->profile };
+    const uint8_t *p = (const uint8_t *)values;
+    for (size_t i = 0; i < sizeof(values); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    for (const char *c = sensor->mqtt_topic_prefix; c && *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return hash | 1;
+}
+
+
+static uint32_t store_crc(const warm_store_t *store) {
+    return esp_rom_crc32_le(0, (const uint8_t *)store->sensors, store->count * sizeof(warm_sensor_t));
+}
+
+
+static bool store_valid(const warm_store_t *store) {
+    return store->magic == WARM_MAGIC && store->size == sizeof(warm_store_t) &&
+           store->count <= WARM_MAX_SENSORS && store->crc == store_crc(store);
+}
+
+
+static void store_reset(warm_store_t *store) {
+    memset(store, 0, sizeof(*store));
+    store->magic = WARM_MAGIC;
+    store->size = sizeof(warm_store_t);
+    store->crc = store_crc(store);
+}
+
+
+static bool load_snapshot(warm_store_t *store) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return false;
+    }
+    size_t len = sizeof(*store);
+    bool ok = nvs_get_blob(nvs, NVS_KEY_STATE, store, &len) == ESP_OK && len >= STORE_HEADER_SIZE
+              && store->count <= WARM_MAX_SENSORS && len == STORE_HEADER_SIZE + store->count * sizeof(warm_sensor_t)
+              && store_valid(store);
+    nvs_close(nvs);
+    return ok;
+}
+
+
+static void write_snapshot(void) {
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, NVS_KEY_STATE, &s_rtc, STORE_HEADER_SIZE + s_rtc.count * sizeof(warm_sensor_t));
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err == ESP_OK) {
+        s_stats.snapshots++;
+    } else {
+        s_stats.snapshot_errors++;
+        ESP_LOGW(TAG, "NVS snapshot failed: %s", esp_err_to_name(err));
+    }
+}
+
+
+
+warm_source_t common_warm_init(void) {
+    esp_reset_reason_t reason = esp_reset_reason();
+    if (reason != ESP_RST_POWERON && store_valid(&s_rtc)) {
+        s_restore = s_rtc;
+        s_rtc.restarts++;
+        s_stats.source = WARM_SOURCE_RTC;
+    } else if (load_snapshot(&s_restore)) {
+        store_reset(&s_rtc);
+        s_stats.source = WARM_SOURCE_NVS;
+    } else {
+        store_reset(&s_rtc);
+        store_reset(&s_restore);
+        s_stats.source = WARM_SOURCE_NONE;
+    }
+    s_stats.restarts = s_rtc.restarts;
+    s_next_snapshot_ms = esp_timer_get_time() / 1000 + WARM_NVS_SNAPSHOT_MS;
+
+    static const char *const sources[] = { "none (cold start)", "RTC memory", "NVS snapshot" };
+    ESP_LOGW(TAG, "Reset reason %d, checkpoint from %s (%u sensors)", reason, sources[s_stats.source],
+             (unsigned)s_restore.count);
+    return s_stats.source;
+}
+
+
+bool common_warm_restore(int sensor_index, const ModbusSensor *sensor, warm_sensor_t *out, int64_t *elapsed_ms) {
+    if (s_stats.source == WARM_SOURCE_NONE || sensor_index < 0 || sensor_index >= (int)s_restore.count ||
+        s_restore.sensors[sensor_index].sensor_id != sensor_id(sensor)) {
+        return false;
+    }
+    *out = s_restore.sensors[sensor_index];
+    int64_t elapsed = (system_time_us() - out->saved_us) / 1000;
+    *elapsed_ms = elapsed >= 0 && elapsed <= WARM_MAX_ELAPSED_MS ? elapsed : -1;
+    s_stats.restored_sensors++;
+    return true;
+}
+
+
+void common_warm_checkpoint(int sensor_index, const ModbusSensor *sensor, const warm_sensor_t *state) {
+    if (sensor_index < 0 || sensor_index >= WARM_MAX_SENSORS) {
+        return;
+    }
+    warm_sensor_t *slot = &s_rtc.sensors[sensor_index];
+    *slot = *state;
+    slot->sensor_id = sensor_id(sensor);
+    slot->saved_us = system_time_us();
+    if (sensor_index >= (int)s_rtc.count) {
+        s_rtc.count = sensor_index + 1;
+    }
+    s_rtc.crc = store_crc(&s_rtc);
+
+    int64_t now = esp_timer_get_time() / 1000;
+    if (now >= s_next_snapshot_ms) {
+        write_snapshot();
+        s_next_snapshot_ms = now + WARM_NVS_SNAPSHOT_MS;
+    }
+}
+
+
+void common_warm_get_stats(warm_stats_t *stats) {
+    *stats = s_stats;
+}
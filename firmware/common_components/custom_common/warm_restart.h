@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "config_types.h"
+#include "adaptive_poll.h"
+#include "pzem004tv3.h"
+
+// Warm restart: the schedule phase, the last good sample and the read statistics of every sensor
+// are checkpointed by the publish task into RTC slow memory (RTC_NOINIT, kept across software
+// resets, panics, watchdog and brownout resets, not across a power cycle) and every
+// WARM_NVS_SNAPSHOT_MS as a compact snapshot into NVS. At boot the RTC checkpoint is used when its
+// CRC is valid, otherwise the NVS snapshot.
+// The time since a checkpoint comes from the system time, which the RTC timer keeps across all
+// resets but the power-on reset. When it is not known (power cycle) the relative phase of the
+// sensors is kept, but the samples are only used as last known values.
+// A slot is only restored for the same sensor (address, topic prefix, intervals).
+
+#define WARM_MAX_SENSORS        8
+#define WARM_NVS_SNAPSHOT_MS    (15 * 60 * 1000)    // flash wear: ~100 writes of < 1 KB per day
+#define WARM_MAX_ELAPSED_MS     (60 * 60 * 1000)    // older checkpoints do not resume the schedule
+
+// Checkpoint of one sensor, times relative to saved_us
+typedef struct {
+    uint32_t sensor_id;                     // 0 = empty slot
+    int64_t saved_us;                       // system time of the checkpoint
+    int32_t due_in_ms;                      // next full read
+    int32_t fast_due_in_ms;                 // next fast lane read, -1 = none
+    int32_t current_interval_ms;
+    adaptive_state_t adaptive;
+    int32_t sample_age_ms;                  // age of the last full read of the sample, -1 = no sample
+    uint16_t regs[PZ_REGISTER_COUNT];       // last good sample (raw input registers)
+    uint32_t reads_ok;
+    uint32_t reads_failed;
+    uint32_t reads_zero;
+    uint32_t reads_skipped;
+    uint32_t reads_partial;
+    uint32_t breaker_trips;
+} warm_sensor_t;
+
+typedef enum {
+    WARM_SOURCE_NONE = 0,                   // cold start
+    WARM_SOURCE_RTC,
+    WARM_SOURCE_NVS,
+} warm_source_t;
+
+typedef struct {
+    warm_source_t source;
+    uint32_t restarts;                      // resets with a valid RTC checkpoint in a row (since the last power cycle)
+    int restored_sensors;
+    uint32_t snapshots;                     // NVS snapshots written since boot
+    uint32_t snapshot_errors;
+} warm_stats_t;
+
+// Validates the RTC checkpoint or loads the NVS snapshot, call once after nvs_flash_init() and
+// before the tasks start
+warm_source_t common_warm_init(void);
+
+// Checkpoint of a sensor from the previous run, false when there is none for this sensor.
+// elapsed_ms: time since the checkpoint, -1 = not known
+bool common_warm_restore(int sensor_index, const ModbusSensor *sensor, warm_sensor_t *out, int64_t *elapsed_ms);
+
+// Store the state of a sensor (publish task), writes the NVS snapshot when due
+void common_warm_checkpoint(int sensor_index, const ModbusSensor *sensor, const warm_sensor_t *state);
+
+void common_warm_get_stats(warm_stats_t *stats);
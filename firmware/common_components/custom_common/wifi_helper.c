@@ -1,8 +1,13 @@
 #include "wifi_helper.h"
+#include "memory_budget.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
+#include "esp_mac.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
 #include <string.h>
 #include <arpa/inet.h>
 
@@ -10,28 +15,197 @@
 
 
 
+#define NVS_NAMESPACE "wifi"
+#define NVS_KEY_AP    "ap"
+
+// AP of the last connection, kept in NVS
+typedef struct {
+    uint8_t bssid[6];
+    uint8_t channel;
+} cached_ap_t;
+
+static wifi_config_t s_config;
+static cached_ap_t s_cached_ap;
+static bool s_have_cached_ap = false;
+static int s_attempt = 0;               // connect attempts since the disconnect, 0 = connected
+static esp_timer_handle_t s_retry_timer;
+static int64_t s_down_since_us;         // WiFi disconnect that started the outage
+static bool s_ip_pending = false;       // outage not yet ended by got IP
+static bool s_mqtt_pending = false;     // outage not yet ended by MQTT connect
+static wifi_stats_t s_stats;
+static portMUX_TYPE s_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+
+//=====================================================================
+// Cached AP
+
+static void load_cached_ap(void) {
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        return;
+    }
+    size_t len = sizeof(s_cached_ap);
+    s_have_cached_ap = nvs_get_blob(nvs, NVS_KEY_AP, &s_cached_ap, &len) == ESP_OK
+                       && len == sizeof(s_cached_ap) && s_cached_ap.channel != 0;
+    nvs_close(nvs);
+}
+
+
+static void store_cached_ap(const uint8_t *bssid, uint8_t channel) {
+    if (s_have_cached_ap && s_cached_ap.channel == channel && memcmp(s_cached_ap.bssid, bssid, 6) == 0) {
+        return; // unchanged, spare the flash
+    }
+    memcpy(s_cached_ap.bssid, bssid, 6);
+    s_cached_ap.channel = channel;
+    s_have_cached_ap = true;
+
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+        return;
+    }
+    if (nvs_set_blob(nvs, NVS_KEY_AP, &s_cached_ap, sizeof(s_cached_ap)) == ESP_OK) {
+        nvs_commit(nvs);
+    }
+    nvs_close(nvs);
+    ESP_LOGI(TAG, "Cached AP " MACSTR " on channel %u", MAC2STR(bssid), channel);
+}
+
+
+
+//=====================================================================
+// Reconnect
+
+// first attempt goes to the cached AP, all later ones scan all channels
+static void start_connect(void) {
+    bool fast = s_attempt == 0 && s_have_cached_ap;
+    s_config.sta.bssid_set = fast;
+    s_config.sta.channel = fast ? s_cached_ap.channel : 0;
+    s_config.sta.scan_method = fast ? WIFI_FAST_SCAN : WIFI_ALL_CHANNEL_SCAN;
+    s_config.sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+    if (fast) {
+        memcpy(s_config.sta.bssid, s_cached_ap.bssid, 6);
+    } else {
+        portENTER_CRITICAL(&s_stats_lock);
+        s_stats.full_scans++;
+        portEXIT_CRITICAL(&s_stats_lock);
+    }
+    esp_wifi_set_config(WIFI_IF_STA, &s_config);
+    esp_wifi_connect();
+    s_attempt++;
+}
+
+
+static void retry_timer_cb(void *arg) {
+    start_connect();
+}
+
+
+static void schedule_reconnect(void) {
+    if (s_attempt == 0 || (s_attempt == 1 && s_have_cached_ap)) {
+        start_connect(); // cached AP, or full scan right after it failed
+        return;
+    }
+    int shift = s_attempt - (s_have_cached_ap ? 2 : 1);
+    int delay_ms = WIFI_BACKOFF_BASE_MS << (shift < 6 ? shift : 6);
+    if (delay_ms > WIFI_BACKOFF_MAX_MS) {
+        delay_ms = WIFI_BACKOFF_MAX_MS;
+    }
+    ESP_LOGW(TAG, "Reconnect attempt %d in %d ms", s_attempt + 1, delay_ms);
+    esp_timer_start_once(s_retry_timer, delay_ms * 1000ULL);
+}
+
+
+
+//=====================================================================
+// Outage statistics (call with s_stats_lock held)
+
+static void record_outage(wifi_outage_t *outage, int64_t now_us) {
+    int64_t ms = (now_us - s_down_since_us) / 1000;
+    uint32_t v = ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+    outage->count++;
+    outage->sum_ms += v;
+    outage->last_ms = v;
+    if (v > outage->max_ms) {
+        outage->max_ms = v;
+    }
+}
+
+
+void common_wifi_mqtt_connected(void) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&s_stats_lock);
+    if (s_mqtt_pending) {
+        record_outage(&s_stats.to_mqtt, now);
+        s_mqtt_pending = false;
+    }
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+
+void common_wifi_get_stats(wifi_stats_t *stats) {
+    portENTER_CRITICAL(&s_stats_lock);
+    *stats = s_stats;
+    portEXIT_CRITICAL(&s_stats_lock);
+}
+
+
+
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                int32_t event_id, void* event_data) {
+    int64_t now = esp_timer_get_time();
     if (event_base == WIFI_EVENT) {
         switch (event_id) {
             case WIFI_EVENT_STA_START:
                 ESP_LOGW("WiFi", "Connecting to WiFi...");
-                esp_wifi_connect();
+                start_connect();
                 break;
-            case WIFI_EVENT_STA_DISCONNECTED:
-                ESP_LOGE("WiFi", "Disconnected. Reconnecting...");
-                esp_wifi_connect();
+            case WIFI_EVENT_STA_CONNECTED: {
+                wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *)event_data;
+                portENTER_CRITICAL(&s_stats_lock);
+                if (s_config.sta.bssid_set) {
+                    s_stats.fast_connects++;
+                }
+                portEXIT_CRITICAL(&s_stats_lock);
+                s_attempt = 0;
+                store_cached_ap(event->bssid, event->channel);
                 break;
+            }
+            case WIFI_EVENT_STA_DISCONNECTED: {
+                wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *)event_data;
+                portENTER_CRITICAL(&s_stats_lock);
+                if (!s_ip_pending) {
+                    // first disconnect of this outage, failed attempts do not restart it
+                    s_down_since_us = now;
+                    s_ip_pending = true;
+                    s_mqtt_pending = true;
+                    s_stats.disconnects++;
+                }
+                s_stats.last_reason = event->reason;
+                s_stats.connected = false;
+                portEXIT_CRITICAL(&s_stats_lock);
+                ESP_LOGE("WiFi", "Disconnected (reason %u). Reconnecting...", event->reason);
+                schedule_reconnect();
+                break;
+            }
         }
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI("WiFi", "Got IP: " IPSTR, IP2STR(&event->ip_info.ip));
+        portENTER_CRITICAL(&s_stats_lock);
+        if (s_ip_pending) {
+            record_outage(&s_stats.to_ip, now);
+            s_ip_pending = false;
+        }
+        s_stats.connected = true;
+        portEXIT_CRITICAL(&s_stats_lock);
     }
 }
 
 
 
 void common_wifi_start(wifi_settings_t *settings) {
+    size_t heap_mark = common_membudget_heap_mark();
     esp_netif_init();
     esp_event_loop_create_default();
 
@@ -56,19 +230,32 @@ void common_wifi_start(wifi_settings_t *settings) {
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     esp_wifi_init(&cfg);
 
-    wifi_config_t wifi_config = {0};
-    strncpy((char *)wifi_config.sta.ssid, settings->ssid, sizeof(wifi_config.sta.ssid));
+    strncpy((char *)s_config.sta.ssid, settings->ssid, sizeof(s_config.sta.ssid));
 
     if (settings->password) {
-        strncpy((char *)wifi_config.sta.password, settings->password, sizeof(wifi_config.sta.password));
+        strncpy((char *)s_config.sta.password, settings->password, sizeof(s_config.sta.password));
+    }
+    if (settings->power_save) {
+        s_config.sta.listen_interval = WIFI_PS_LISTEN_INTERVAL;
     }
+    load_cached_ap();
 
-    esp_wifi_set_mode(WIFI_MODE_STA);
-    esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
-    esp_wifi_start();
-    esp_wifi_connect();
+    const esp_timer_create_args_t timer_args = {
+        .callback = retry_timer_cb,
+        .name = "wifi_retry",
+    };
+    esp_timer_create(&timer_args, &s_retry_timer);
 
-    // register event handler to automatically reconnect when connection lost
+    // register event handler to connect at start and automatically reconnect when connection lost
     esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &wifi_event_handler, NULL, NULL);
     esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &wifi_event_handler, NULL, NULL);
+
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    esp_wifi_set_config(WIFI_IF_STA, &s_config);
+    esp_wifi_start();
+    if (settings->power_save) {
+        // modem sleep is required for light sleep while connected (power_save.h)
+        esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+    }
+    common_membudget_register("wifi", sizeof(s_config) + sizeof(s_stats), heap_mark);
 }
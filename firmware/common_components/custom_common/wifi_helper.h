@@ -1,4 +1,33 @@
 #pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// Reconnect: the BSSID and channel of the last AP are kept in NVS, after a disconnect (and at
+// boot) that AP is tried first without a scan. If that fails a full scan of all channels follows,
+// repeated with exponential backoff from WIFI_BACKOFF_BASE_MS up to WIFI_BACKOFF_MAX_MS.
+#define WIFI_BACKOFF_BASE_MS     500
+#define WIFI_BACKOFF_MAX_MS      30000
+// Power save: the radio only wakes for every n-th beacon (~100 ms each), incoming packets
+// (MQTT, http, modbus tcp) wait up to this long
+#define WIFI_PS_LISTEN_INTERVAL  3
+
+// Outage durations, measured from the WiFi disconnect
+typedef struct {
+    uint32_t count;
+    uint64_t sum_ms;
+    uint32_t max_ms;
+    uint32_t last_ms;
+} wifi_outage_t;
+
+typedef struct {
+    uint32_t disconnects;
+    uint32_t fast_connects;           // connected to the cached AP without scan
+    uint32_t full_scans;              // connect attempts with full scan
+    uint8_t last_reason;              // wifi_err_reason_t of the last disconnect
+    bool connected;                   // has IP
+    wifi_outage_t to_ip;              // disconnect -> got IP
+    wifi_outage_t to_mqtt;            // disconnect -> MQTT connected
+} wifi_stats_t;
 
 // WiFi connection settings
 typedef struct {
@@ -8,7 +37,13 @@ typedef struct {
     const char *ip;
     const char *netmask;
     const char *gateway;
+    bool power_save;      // max modem sleep (WIFI_PS_LISTEN_INTERVAL), default: min modem sleep (every DTIM)
 } wifi_settings_t;
 
 // Connects to WiFi (DHCP or static) using provided settings
 void common_wifi_start(wifi_settings_t *settings);
+
+// Called by the MQTT client when connected, ends the outage of a preceding WiFi disconnect
+void common_wifi_mqtt_connected(void);
+
+void common_wifi_get_stats(wifi_stats_t *stats);
@@ -1,2 +1,4 @@
 COMPONENT_ADD_INCLUDEDIRS = .
-COMPONENT_DEPENDS = log driver freertos
\ No newline at end of file
+COMPONENT_DEPENDS = log driver freertos
+# host-only serial backend (tools/)
+COMPONENT_OBJEXCLUDE := pzem_transport_linux.o
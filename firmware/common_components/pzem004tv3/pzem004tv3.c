@@ -8,76 +8,14 @@
 /* Declare static func in .c file (linker warnings) */
 static uint16_t crc16(const uint8_t *data, uint16_t len);
 
-uint16_t _lastRead = 0; /* Last time values were updated */
-
 /**
- * @brief Initialize the UART, configured via struct pzemSetup_t
+ * @brief Transport used for a module, firmware default is the ESP32 UART driver
  * @param pzSetup
+ * @return const pzem_transport_t*
  */
-void PzemInit( pzem_setup_t *pzSetup )
+static inline const pzem_transport_t *PzTransport( const pzem_setup_t *pzSetup )
 {
-    static const char *LOG_TAG = "PZ_INIT";
-
-    ESP_LOGI( LOG_TAG, "Initializing UART" );
-
-    const uart_port_t _uart_num = pzSetup->pzem_uart;
-    const int uart_buffer_size = ( 1024 * 2 );
-
-    /* Configure parameters of an UART driver,
-     * communication pins and install the driver */
-    uart_config_t uart_config = {
-        .baud_rate  = PZ_BAUD_RATE,
-        .data_bits  = UART_DATA_8_BITS,
-        .parity     = UART_PARITY_DISABLE,
-        .stop_bits  = UART_STOP_BITS_1,
-        .flow_ctrl  = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_APB,
-    };
-
-    // Try deleting the driver first (no-op if not installed) useful in case sensor/uart gets re-initialized with different config
-    uart_driver_delete(_uart_num);
-
-    int intr_alloc_flags = 0;
-
-#if CONFIG_UART_ISR_IN_IRAM
-    intr_alloc_flags = ESP_INTR_FLAG_IRAM;
-#endif
-#if CONFIG_UART_MORE_PRIO
-    intr_alloc_flags = ESP_INTR_FLAG_LEVEL3;
-#endif
-
-    ESP_LOGI( LOG_TAG, "UART set pins, mode and install driver." );
-
-    /* Install UART driver using an event queue here */
-    ESP_ERROR_CHECK( uart_driver_install( _uart_num, uart_buffer_size, 0, 0, NULL, intr_alloc_flags ) );
-
-    /* Configure UART parameters */
-    ESP_ERROR_CHECK( uart_param_config( _uart_num, &uart_config ) );
-
-    /* Set UART pins(TX: , RX: , RTS: -1, CTS: -1) */
-    if (pzSetup->use_rs485) {
-        // RS485 mode additionally requires RTS pin
-        ESP_LOGI(LOG_TAG, "Configuring RS485 half-duplex mode with RTS on GPIO %d", pzSetup->rs485_dir_pin);
-        ESP_ERROR_CHECK(uart_set_pin(
-            _uart_num,
-            pzSetup->pzem_tx_pin,
-            pzSetup->pzem_rx_pin,
-            pzSetup->rs485_dir_pin,  // RTS = DE/RE control
-            UART_PIN_NO_CHANGE
-        ));
-        // enable half duplex mode so RTS pin is actually controlled
-        ESP_ERROR_CHECK(uart_set_mode(_uart_num, UART_MODE_RS485_HALF_DUPLEX));
-
-    } else {
-        // TTL mode does not require DIR/RTS pin
-        ESP_ERROR_CHECK(uart_set_pin(
-            _uart_num,
-            pzSetup->pzem_tx_pin,
-            pzSetup->pzem_rx_pin,
-            UART_PIN_NO_CHANGE,
-            UART_PIN_NO_CHANGE
-        ));
-    }
+    return pzSetup->transport ? pzSetup->transport : PZEM_DEFAULT_TRANSPORT;
 }
 
 
@@ -92,12 +30,13 @@ uint16_t PzemReceive( pzem_setup_t *pzSetup, uint8_t *resp, uint16_t len )
 {
     static const char *LOG_TAG = "PZ_RECEIVE";
 
-    /* Configure a temporary buffer for the incoming data */
-    uint16_t rxBytes = uart_read_bytes( pzSetup->pzem_uart, resp, len, pdMS_TO_TICKS( PZ_READ_TIMEOUT ) );
+    int rxBytes = PzTransport( pzSetup )->read( pzSetup, resp, len, PZ_READ_TIMEOUT );
 
+    if ( rxBytes < 0 ) {
+        return 0;
+    }
     if ( rxBytes > 0 ) {
-        resp[ rxBytes ] = 0;
-        ESP_LOGV( LOG_TAG, "Read %d  bytes: '%s'", rxBytes, resp );
+        ESP_LOGV( LOG_TAG, "Read %d bytes", rxBytes );
         ESP_LOG_BUFFER_HEXDUMP( LOG_TAG, resp, rxBytes, ESP_LOG_VERBOSE );
     }
 
@@ -161,6 +100,35 @@ bool PzSetAddress(pzem_setup_t *pzSetup, uint8_t new_addr)
     return true;
 }
 
+/**
+ * @brief Set power alarm threshold, the module sets RG_ALARM while active power is above it
+ * @param pzSetup
+ * @param watts     threshold in 1W
+ * @return  true if the module acknowledged the write
+ */
+bool PzSetAlarmThreshold( pzem_setup_t *pzSetup, uint16_t watts )
+{
+    static const char *LOG_TAG = "PZ_SET_ALARM";
+
+    if ( !PzemSendCmd8( pzSetup, CMD_WSR, WREG_ALARM_THR, watts, true, 0xFFFF ) ) {
+        ESP_LOGE( LOG_TAG, "Failed to set alarm threshold of 0x%02X", pzSetup->pzem_addr );
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Read power alarm threshold
+ * @param pzSetup
+ * @param watts     receives threshold in 1W
+ * @return  true if succeeded
+ */
+bool PzGetAlarmThreshold( pzem_setup_t *pzSetup, uint16_t *watts )
+{
+    return PzemReadRegisters( pzSetup, CMD_RHR, WREG_ALARM_THR, 1, watts );
+}
+
 /**
  * @brief Energy counter does not reset af restart, this function can reset the counter
  * @param pzSetup
@@ -179,12 +147,12 @@ bool PzSetAddress(pzem_setup_t *pzSetup, uint8_t new_addr)
 
     PzemSetCRC(buffer, 4);           // CRC over first 2 bytes, write into buffer[2], buffer[3]
 
-    if (uart_write_bytes(pzSetup->pzem_uart, buffer, 4) == -1) {
+    if (PzTransport(pzSetup)->write(pzSetup, buffer, 4) == -1) {
         ESP_LOGE(LOG_TAG, "Failed to write to sensor/UART !!");
         return false;
     }
 
-    vTaskDelay(pdMS_TO_TICKS(100));  // wait a little, just like Python version
+    PzTransport(pzSetup)->delay_ms(pzSetup, 100);  // wait a little, just like Python version
 
     // Read optional reply (usually nothing or echo)
     uint16_t length = PzemReceive(pzSetup, reply, sizeof(reply));
@@ -210,14 +178,11 @@ bool PzemSendCmd8( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t regAddr, uint16_
     static const char *LOG_TAG = "PZ_SEND8";
 
     // flush RX buffer before sending any new request
-    uart_flush_input(pzSetup->pzem_uart);
+    PzTransport(pzSetup)->flush_input(pzSetup);
 
     /* send and receive buffers memory allocation */
-    uint8_t txdata[TX_BUF_SIZE] = {0};
-    uint8_t rxdata[RX_BUF_SIZE] = {0};
-
-    memset(txdata, 0, sizeof(txdata));
-    memset(rxdata, 0, sizeof(rxdata));
+    uint8_t txdata[TX_BUF_SIZE];
+    uint8_t rxdata[RX_BUF_SIZE];
 
     if ( ( slave_addr == 0xFFFF ) ||
             ( slave_addr < 0x01 ) ||
@@ -235,18 +200,23 @@ bool PzemSendCmd8( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t regAddr, uint16_
     /* Add CRC to array */
     (void)PzemSetCRC( txdata, TX_BUF_SIZE );
 
-    const int txBytes = uart_write_bytes( pzSetup->pzem_uart, txdata, TX_BUF_SIZE );
+    const int txBytes = PzTransport( pzSetup )->write( pzSetup, txdata, TX_BUF_SIZE );
 
     ESP_LOGV( LOG_TAG, "Wrote %d bytes", txBytes );
-    ESP_LOG_BUFFER_HEXDUMP( LOG_TAG, txdata, txBytes, ESP_LOG_VERBOSE );
+    ESP_LOG_BUFFER_HEXDUMP( LOG_TAG, txdata, TX_BUF_SIZE, ESP_LOG_VERBOSE );
+
+    if ( txBytes != TX_BUF_SIZE ) {
+        return false;
+    }
 
     if ( check ) {
-        if ( !PzemReceive( pzSetup, rxdata, RX_BUF_SIZE ) ) { /* if check enabled, read the response */
+        /* if check enabled, read the response, a truncated echo is a failure (rxdata is not initialized) */
+        if ( PzemReceive( pzSetup, rxdata, RX_BUF_SIZE ) != RX_BUF_SIZE ) {
             return false;
         }
 
         /* Check if response is same as send */
-        for (uint8_t i = 0; i < 8; i++) {
+        for (uint8_t i = 0; i < RX_BUF_SIZE; i++) {
             if ( txdata[ i ] != rxdata[ i ] ) {
                 return false;
             }
@@ -266,63 +236,139 @@ bool PzemSendCmd8( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t regAddr, uint16_
 bool PzemGetValues( pzem_setup_t *pzSetup, _current_values_t *pmonValues )
 {
     static const char *LOG_TAG = "PZ_GETVALUES";
-    if ( ( unsigned long ) ( millis() - _lastRead ) > UPDATE_TIME ) {
-        _lastRead = millis();
-    } else {
-        return true;
-    }
+
+    uint16_t regs[ PZ_REGISTER_COUNT ] = {0};
 
     /* Zero all values */
     (void)PzemZeroValues( ( _current_values_t * ) pmonValues );
 
-    uint8_t respbuff[RESP_BUF_SIZE] = {0};
-    memset(respbuff, 0, sizeof(respbuff));
+    /* Tell the sensor to Read 10 Registers from 0x00 to 0x0A (all values) */
+    if ( !PzemReadRegisters( pzSetup, CMD_RIR, RG_VOLTAGE, PZ_REGISTER_COUNT, regs ) ) {
+        ESP_LOGV( LOG_TAG, "Reading registers failed" );
+        return false;
+    }
+
+    PzemDecodeValues( regs, pmonValues );
+
+    return true;
+}
 
 
-    /* Tell the sensor to Read 10 Registers from 0x00 to 0x0A (all values) */
-    if (PzemSendCmd8( pzSetup, CMD_RIR, 0x00, 0x0A, false, 0xFFFF ) == false) {
-        ESP_LOGE(LOG_TAG, "Error writing to registers !!");
+/**
+ * @brief Read a range of registers, response is validated (CRC, slave address, function code, length)
+ * @param pzSetup
+ * @param cmd       CMD_RIR (input registers) or CMD_RHR (holding registers)
+ * @param regAddr   first register
+ * @param count     number of registers, max PZ_MAX_READ_REGISTERS
+ * @param regs      receives count register values
+ * @return bool
+ */
+bool PzemReadRegisters( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t regAddr, uint16_t count, uint16_t *regs )
+{
+    pzem_request_t req;
+
+    PzemPrepareRead( &req, pzSetup->pzem_addr, cmd, regAddr, count );
+    return PzemReadPrepared( pzSetup, &req, regs );
+}
+
+
+/**
+ * @brief Build a read request frame (incl. CRC) once, to be sent with PzemReadPrepared
+ * @param req
+ * @param slave_addr
+ * @param cmd       CMD_RIR (input registers) or CMD_RHR (holding registers)
+ * @param regAddr   first register
+ * @param count     number of registers, max PZ_MAX_READ_REGISTERS
+ */
+void PzemPrepareRead( pzem_request_t *req, uint8_t slave_addr, uint8_t cmd, uint16_t regAddr, uint16_t count )
+{
+    req->frame[ 0 ] = slave_addr;
+    req->frame[ 1 ] = cmd;
+    req->frame[ 2 ] = ( regAddr >> 8 ) & 0xFF;
+    req->frame[ 3 ] = ( regAddr ) & 0xFF;
+    req->frame[ 4 ] = ( count >> 8 ) & 0xFF;
+    req->frame[ 5 ] = ( count ) & 0xFF;
+    PzemSetCRC( req->frame, TX_BUF_SIZE );
+    req->count = count;
+}
+
+
+/**
+ * @brief Send a prepared read request and validate the response (CRC, slave address, function code, length)
+ * @param pzSetup
+ * @param req       built by PzemPrepareRead
+ * @param regs      receives req->count register values
+ * @return bool
+ */
+bool PzemReadPrepared( pzem_setup_t *pzSetup, const pzem_request_t *req, uint16_t *regs )
+{
+    static const char *LOG_TAG = "PZ_READREGS";
+
+    if ( req->count == 0 || req->count > PZ_MAX_READ_REGISTERS ) { /* sanity check */
+        return false;
     }
 
-    /* Read response from the sensor, if everything goes well we retreived 25 Bytes */
-    if ( PzemReceive( pzSetup, respbuff, RESP_BUF_SIZE ) != RESP_BUF_SIZE ) { /* Something went wrong */
+    /* address + function code + byte count + 2 bytes per register + CRC */
+    const uint16_t respLen = 3 + 2 * req->count + 2;
+    uint8_t respbuff[ 3 + 2 * PZ_MAX_READ_REGISTERS + 2 ];
+
+    /* flush RX buffer before sending the request */
+    PzTransport( pzSetup )->flush_input( pzSetup );
+
+    if ( PzTransport( pzSetup )->write( pzSetup, req->frame, TX_BUF_SIZE ) != TX_BUF_SIZE ) {
+        ESP_LOGE( LOG_TAG, "Error writing to registers !!" );
+        return false;
+    }
+
+    /* Read response from the sensor, e.g. 25 Bytes for all 10 input registers */
+    if ( PzemReceive( pzSetup, respbuff, respLen ) != respLen ) { /* Something went wrong */
         return false;
     }
 
-    if ( !PzemCheckCRC( respbuff, RESP_BUF_SIZE ) ) {
+    if ( !PzemCheckCRC( respbuff, respLen ) ) {
         ESP_LOGV( LOG_TAG, "Retreived buffer CRC check failed" );
         return false;
-    } else {
-        ESP_LOGI( LOG_TAG, "CRC check OK for GetValues()" );
     }
 
-    pmonValues->voltage = ( ( uint32_t ) respbuff[ 3 ] << 8 | /* Raw voltage in 0.1V */
-                            ( uint32_t ) respbuff[ 4 ] ) / 10.0;
+    /* a valid frame of another module (or an exception) must not be taken as ours */
+    if ( respbuff[ 0 ] != req->frame[ 0 ] || respbuff[ 1 ] != req->frame[ 1 ] || respbuff[ 2 ] != 2 * req->count ) {
+        ESP_LOGW( LOG_TAG, "Unexpected response header %02X %02X %02X", respbuff[ 0 ], respbuff[ 1 ], respbuff[ 2 ] );
+        return false;
+    }
+    ESP_LOGD( LOG_TAG, "CRC check OK" );
+
+    for ( uint16_t i = 0; i < req->count; i++ ) {
+        regs[ i ] = ( uint16_t ) respbuff[ 3 + 2 * i ] << 8 | respbuff[ 4 + 2 * i ];
+    }
+
+    return true;
+}
+
+
+/**
+ * @brief Convert all 10 input registers to measured values
+ * @param regs
+ * @param pmonValues
+ */
+void PzemDecodeValues( const uint16_t *regs, _current_values_t *pmonValues )
+{
+    pmonValues->voltage = regs[ RG_VOLTAGE ] / 10.0;                                  /* Raw voltage in 0.1V */
 
-    pmonValues->current = ( ( uint32_t ) respbuff[ 5 ] << 8 | /* Raw current in 0.001A */
-                            ( uint32_t ) respbuff[ 6 ] |
-                            ( uint32_t ) respbuff[ 7 ] << 24 |
-                            ( uint32_t ) respbuff[ 8 ] << 16 ) / 1000.0;
+    pmonValues->current = ( ( uint32_t ) regs[ RG_CURRENT_L ] |                     /* Raw current in 0.001A */
+                            ( uint32_t ) regs[ RG_CURRENT_H ] << 16 ) / 1000.0;
 
-    pmonValues->power = ( ( uint32_t ) respbuff[ 9 ] << 8 | /* Raw power in 0.1W */
-                          ( uint32_t ) respbuff[ 10 ] |
-                          ( uint32_t ) respbuff[ 11 ] << 24 |
-                          ( uint32_t ) respbuff[ 12 ] << 16 ) / 10.0;
+    pmonValues->power = ( ( uint32_t ) regs[ RG_POWER_L ] |                         /* Raw power in 0.1W */
+                          ( uint32_t ) regs[ RG_POWER_H ] << 16 ) / 10.0;
 
-    pmonValues->energy = ( ( uint32_t ) respbuff[ 13 ] << 8 | /* Raw Energy in 1Wh */
-                           ( uint32_t ) respbuff[ 14 ] |
-                           ( uint32_t ) respbuff[ 15 ] << 24 |
-                           ( uint32_t ) respbuff[ 16 ] << 16 ) / 1000.0;
+    pmonValues->energy = ( ( uint32_t ) regs[ RG_ENERGY_L ] |                       /* Raw Energy in 1Wh */
+                           ( uint32_t ) regs[ RG_ENERGY_H ] << 16 ) / 1000.0;
 
-    pmonValues->frequency = ( ( uint32_t ) respbuff[ 17 ] << 8 | /* Raw Frequency in 0.1Hz */
-                              ( uint32_t ) respbuff[ 18 ] ) / 10.0;
+    pmonValues->frequency = regs[ RG_FREQUENCY ] / 10.0;                            /* Raw Frequency in 0.1Hz */
 
-    pmonValues->pf = ( ( uint32_t ) respbuff[ 19 ] << 8 | /* Raw pf in 0.01 */
-                       ( uint32_t ) respbuff[ 20 ] ) / 100.0;
+    pmonValues->pf = regs[ RG_PF ] / 100.0;                                         /* Raw pf in 0.01 */
 
-    /* Currently we don't set alarams yet, not implemented */
-    pmonValues->alarms = ( ( uint32_t ) respbuff[ 21 ] << 8 | /* Raw alarm value */
-                           ( uint32_t ) respbuff[ 22 ] );
+    /* 0xFFFF while the power is above the threshold set with PzSetAlarmThreshold, else 0 */
+    pmonValues->alarms = regs[ RG_ALARM ];                                          /* Raw alarm value */
 
     /* Extra values calculated because not produced by sensor */
     /* Apparent Power*/
@@ -337,8 +383,60 @@ bool PzemGetValues( pzem_setup_t *pzSetup, _current_values_t *pmonValues )
      * Reactive Power (Q, VAr): also known as phantom power, dissipated power resulting from inductive and capacitive load measured in VAr.
     */
     pmonValues->reactive_power = pmonValues->apparent_power * sinf(pmonValues->fi);         // replacd sin() with sinf() as we mainly use floats instead of double
+}
 
-    return true;
+/**
+ * @brief Decode only the values contained in a partial read of input registers first..first+count-1,
+ * all other values are left unchanged (derived values need voltage, current and pf)
+ * @param regs          all input registers, only the read range has to be valid
+ * @param first
+ * @param count
+ * @param pmonValues
+ * @return uint16_t     mask of the registers read (bit n = register n), see PZ_REGISTER_MASK
+ */
+uint16_t PzemDecodeRange( const uint16_t *regs, uint16_t first, uint16_t count, _current_values_t *pmonValues )
+{
+    if ( first >= PZ_REGISTER_COUNT || count == 0 ) {
+        return 0;
+    }
+    if ( first + count > PZ_REGISTER_COUNT ) {
+        count = PZ_REGISTER_COUNT - first;
+    }
+    const uint16_t mask = PZ_REGISTER_MASK( first, count );
+
+    _current_values_t all;
+    PzemDecodeValues( regs, &all );
+
+#define PZ_READ( reg )    ( mask & ( 1u << ( reg ) ) )
+    if ( PZ_READ( RG_VOLTAGE ) ) {
+        pmonValues->voltage = all.voltage;
+    }
+    if ( PZ_READ( RG_CURRENT_L ) && PZ_READ( RG_CURRENT_H ) ) {
+        pmonValues->current = all.current;
+    }
+    if ( PZ_READ( RG_POWER_L ) && PZ_READ( RG_POWER_H ) ) {
+        pmonValues->power = all.power;
+    }
+    if ( PZ_READ( RG_ENERGY_L ) && PZ_READ( RG_ENERGY_H ) ) {
+        pmonValues->energy = all.energy;
+    }
+    if ( PZ_READ( RG_FREQUENCY ) ) {
+        pmonValues->frequency = all.frequency;
+    }
+    if ( PZ_READ( RG_PF ) ) {
+        pmonValues->pf = all.pf;
+    }
+    if ( PZ_READ( RG_ALARM ) ) {
+        pmonValues->alarms = all.alarms;
+    }
+    if ( PZ_READ( RG_VOLTAGE ) && PZ_READ( RG_CURRENT_L ) && PZ_READ( RG_CURRENT_H ) && PZ_READ( RG_PF ) ) {
+        pmonValues->apparent_power = all.apparent_power;
+        pmonValues->fi = all.fi;
+        pmonValues->reactive_power = all.reactive_power;
+    }
+#undef PZ_READ
+
+    return mask;
 }
 
 /**
@@ -362,7 +460,7 @@ void PzemSetCRC( uint8_t *buf, uint16_t len )
     buf[ len - 1 ] = ( crc >> 8 ) & 0xFF; /* High byte second */
 
     uint64_t stop = esp_timer_get_time();
-    ESP_LOGV(TAG, "Routine crc16() took %llu microseconds", (stop - start));
+    ESP_LOGV(TAG, "Routine crc16() took %llu microseconds", (unsigned long long)(stop - start));
 }
 
 /**
@@ -382,7 +480,7 @@ bool PzemCheckCRC( const uint8_t *buf, uint16_t len )
     uint16_t crc = crc16( buf, len - 2 ); /* Compute CRC of data */
 
     uint64_t stop = esp_timer_get_time();
-    ESP_LOGV(TAG, "Routine crc16() took %llu microseconds", (stop - start));
+    ESP_LOGV(TAG, "Routine crc16() took %llu microseconds", (unsigned long long)(stop - start));
 
     return ( ( uint16_t ) buf[ len - 2 ] | ( uint16_t ) buf[ len - 1 ] << 8 ) == crc;
 }
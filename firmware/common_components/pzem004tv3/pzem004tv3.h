@@ -2,12 +2,8 @@
 
 #include <math.h>
 #include <string.h>
-#include "driver/uart.h"
-#include "driver/gpio.h"
-#include "hal/gpio_hal.h"
-#include "hal/uart_ll.h"
-#include "esp_timer.h"
-#include "esp_log.h"
+#include "pzem_port.h"
+#include "pzem_transport.h"
 
 
 #ifdef __cplusplus
@@ -17,7 +13,6 @@ extern "C" {
 #define RX_BUF_SIZE      8
 #define TX_BUF_SIZE      8
 #define RESP_BUF_SIZE    25
-#define UPDATE_TIME      200
 
 typedef struct pz_conf_t {
     uart_port_t pzem_uart;
@@ -26,6 +21,9 @@ typedef struct pz_conf_t {
     uint8_t pzem_addr;
     bool use_rs485;           // true: RS485, also requires DIR-pin, false: TTL mode
     gpio_num_t rs485_dir_pin; // only used when use_rs485 == true
+    uint8_t stop_bits;        // 2 for 8N2 modules (PZEM-017), otherwise 1 (see pzem_profile.h)
+    const pzem_transport_t *transport; // NULL: PZEM_DEFAULT_TRANSPORT (ESP32 UART driver on pzem_uart)
+    void *transport_ctx;               // backend specific, e.g. file descriptor of a linux serial port
 } pzem_setup_t;
 
 /***
@@ -44,16 +42,33 @@ typedef struct _current_values {
     uint16_t alarms;
 } _current_values_t;         /* Measured values */
 
+#define PZ_REGISTER_COUNT     10  /* input registers 0x0000..0x0009 */
+#define PZ_ALL_REGISTERS      ( ( 1u << PZ_REGISTER_COUNT ) - 1 )
+#define PZ_REGISTER_MASK( first, count )    ( ( ( 1u << ( count ) ) - 1 ) << ( first ) )
+
+/* Read request prepared once (e.g. per sensor at startup): frame incl. CRC is sent as is */
+typedef struct {
+    uint8_t frame[ TX_BUF_SIZE ];
+    uint16_t count;           /* number of registers requested */
+} pzem_request_t;
+
 void PzemInit( pzem_setup_t *pzSetup );
 bool PzemCheckCRC( const uint8_t *buf, uint16_t len );
 uint16_t PzemReceive( pzem_setup_t *pzSetup, uint8_t *resp, uint16_t len );
 bool PzemSendCmd8( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t rAddr, uint16_t val, bool check, uint16_t slave_addr );
 void PzemSetCRC( uint8_t *buf, uint16_t len );
 bool PzemGetValues( pzem_setup_t *pzSetup, _current_values_t *pmonValues );
+bool PzemReadRegisters( pzem_setup_t *pzSetup, uint8_t cmd, uint16_t regAddr, uint16_t count, uint16_t *regs );
+void PzemPrepareRead( pzem_request_t *req, uint8_t slave_addr, uint8_t cmd, uint16_t regAddr, uint16_t count );
+bool PzemReadPrepared( pzem_setup_t *pzSetup, const pzem_request_t *req, uint16_t *regs );
+void PzemDecodeValues( const uint16_t *regs, _current_values_t *pmonValues );
+uint16_t PzemDecodeRange( const uint16_t *regs, uint16_t first, uint16_t count, _current_values_t *pmonValues );
 uint8_t PzReadAddress( pzem_setup_t *pzSetup);
 bool PzResetEnergy( pzem_setup_t *pzSetup );
 void PzemZeroValues( _current_values_t *currentValues );
 bool PzSetAddress(pzem_setup_t *pzSetup, uint8_t new_addr);
+bool PzSetAlarmThreshold( pzem_setup_t *pzSetup, uint16_t watts );
+bool PzGetAlarmThreshold( pzem_setup_t *pzSetup, uint16_t *watts );
 
 #define millis( x )              ( esp_timer_get_time( x ) / 1000 )
 //#define UART_LL_GET_HW( num )    ( ( ( num ) == 0 ) ? ( &UART0 ) : ( ( ( num ) == 1 ) ? ( &UART1 ) : ( &UART2 ) ) )
@@ -62,6 +77,7 @@ bool PzSetAddress(pzem_setup_t *pzSetup, uint8_t new_addr);
 #define PZ_DEFAULT_ADDRESS    0xF8
 #define PZ_BAUD_RATE          9600
 #define PZ_READ_TIMEOUT       100
+#define PZ_MAX_READ_REGISTERS 16
 
 /*
  * REGISTERS
@@ -0,0 +1,50 @@
+#pragma once
+/**
+ * Platform glue for the PZEM driver.
+ * On the ESP32 (ESP-IDF defines ESP_PLATFORM) the IDF headers are used directly,
+ * on the host (tools/) the few used IDF types and log macros are mapped to libc.
+ */
+
+#ifdef ESP_PLATFORM
+
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "hal/gpio_hal.h"
+#include "hal/uart_ll.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#else // host build
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef int uart_port_t;
+typedef int gpio_num_t;
+#define GPIO_NUM_NC    ( -1 )
+#define DRAM_ATTR      /* empty */
+
+/* 0: none, 1: error, 2: warning, 3: info, 4: debug, 5: verbose (default: warning) */
+extern int pzem_port_log_level;
+
+#define PZEM_PORT_LOG( level, letter, tag, format, ... ) \
+    do { if ( pzem_port_log_level >= ( level ) ) fprintf( stderr, letter " (%s) " format "\n", tag, ##__VA_ARGS__ ); } while ( 0 )
+
+#define ESP_LOGE( tag, format, ... )    PZEM_PORT_LOG( 1, "E", tag, format, ##__VA_ARGS__ )
+#define ESP_LOGW( tag, format, ... )    PZEM_PORT_LOG( 2, "W", tag, format, ##__VA_ARGS__ )
+#define ESP_LOGI( tag, format, ... )    PZEM_PORT_LOG( 3, "I", tag, format, ##__VA_ARGS__ )
+#define ESP_LOGD( tag, format, ... )    PZEM_PORT_LOG( 4, "D", tag, format, ##__VA_ARGS__ )
+#define ESP_LOGV( tag, format, ... )    PZEM_PORT_LOG( 5, "V", tag, format, ##__VA_ARGS__ )
+#define ESP_LOG_BUFFER_HEXDUMP( tag, buffer, len, level ) \
+    do { (void)( tag ); (void)( buffer ); (void)( len ); } while ( 0 )
+
+static inline int64_t esp_timer_get_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( int64_t ) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -0,0 +1,300 @@
+/**
+ * Device profiles of the PZEM types and the read plan compiler, see pzem_profile.h
+ */
+#include "pzem_profile.h"
+
+static const pzem_profile_t s_profiles[ PZEM_PROFILE_COUNT ] = {
+    [ PZEM_PROFILE_004T ] = {
+        .name       = "PZEM-004T",
+        .input_regs = 10,
+        .stop_bits  = 1,
+        .caps       = PZ_CAP_RESET_ENERGY | PZ_CAP_POWER_ALARM | PZ_CAP_SET_ADDRESS | PZ_CAP_CALIBRATE,
+        .max_power_w = 26000,   /* 100 A * 260 V */
+        .fields     = {
+            [ PZ_FIELD_VOLTAGE ]   = { RG_VOLTAGE,   1, PZ_LOW_WORD_FIRST, 10 },     /* 0.1 V */
+            [ PZ_FIELD_CURRENT ]   = { RG_CURRENT_L, 2, PZ_LOW_WORD_FIRST, 1000 },   /* 1 mA */
+            [ PZ_FIELD_POWER ]     = { RG_POWER_L,   2, PZ_LOW_WORD_FIRST, 10 },     /* 0.1 W */
+            [ PZ_FIELD_ENERGY ]    = { RG_ENERGY_L,  2, PZ_LOW_WORD_FIRST, 1000 },   /* 1 Wh */
+            [ PZ_FIELD_FREQUENCY ] = { RG_FREQUENCY, 1, PZ_LOW_WORD_FIRST, 10 },     /* 0.1 Hz */
+            [ PZ_FIELD_PF ]        = { RG_PF,        1, PZ_LOW_WORD_FIRST, 100 },    /* 0.01 */
+            [ PZ_FIELD_ALARM ]     = { RG_ALARM,     1, PZ_LOW_WORD_FIRST, 0 },      /* 0xFFFF = above threshold */
+        },
+        .decode_all = PzemDecodeValues,
+    },
+    [ PZEM_PROFILE_016 ] = {
+        .name       = "PZEM-016",
+        .input_regs = 10,
+        .stop_bits  = 1,
+        .caps       = PZ_CAP_RESET_ENERGY | PZ_CAP_POWER_ALARM | PZ_CAP_SET_ADDRESS | PZ_CAP_CALIBRATE,
+        .max_power_w = 26000,
+        .fields     = {
+            [ PZ_FIELD_VOLTAGE ]   = { RG_VOLTAGE,   1, PZ_LOW_WORD_FIRST, 10 },
+            [ PZ_FIELD_CURRENT ]   = { RG_CURRENT_L, 2, PZ_LOW_WORD_FIRST, 1000 },
+            [ PZ_FIELD_POWER ]     = { RG_POWER_L,   2, PZ_LOW_WORD_FIRST, 10 },
+            [ PZ_FIELD_ENERGY ]    = { RG_ENERGY_L,  2, PZ_LOW_WORD_FIRST, 1000 },
+            [ PZ_FIELD_FREQUENCY ] = { RG_FREQUENCY, 1, PZ_LOW_WORD_FIRST, 10 },
+            [ PZ_FIELD_PF ]        = { RG_PF,        1, PZ_LOW_WORD_FIRST, 100 },
+            [ PZ_FIELD_ALARM ]     = { RG_ALARM,     1, PZ_LOW_WORD_FIRST, 0 },
+        },
+        .decode_all = PzemDecodeValues,
+    },
+    [ PZEM_PROFILE_017 ] = {
+        .name       = "PZEM-017",
+        .input_regs = 8,
+        .stop_bits  = 2,
+        .caps       = PZ_CAP_RESET_ENERGY | PZ_CAP_SET_ADDRESS | PZ_CAP_CALIBRATE,
+        .max_power_w = 90000,   /* 300 V * 300 A shunt */
+        .fields     = {
+            [ PZ_FIELD_VOLTAGE ]   = { 0x0000, 1, PZ_LOW_WORD_FIRST, 100 },      /* 0.01 V */
+            [ PZ_FIELD_CURRENT ]   = { 0x0001, 1, PZ_LOW_WORD_FIRST, 100 },      /* 0.01 A */
+            [ PZ_FIELD_POWER ]     = { 0x0002, 2, PZ_LOW_WORD_FIRST, 10 },       /* 0.1 W */
+            [ PZ_FIELD_ENERGY ]    = { 0x0004, 2, PZ_LOW_WORD_FIRST, 1000 },     /* 1 Wh */
+            [ PZ_FIELD_ALARM ]     = { 0x0006, 2, PZ_LOW_WORD_FIRST, 0 },        /* high / low voltage alarm */
+        },
+        .decode_all = PzemDecodeValuesDC,
+    },
+};
+
+
+/**
+ * @brief Profile of a device type
+ * @param id
+ * @return const pzem_profile_t*   NULL for an unknown type
+ */
+const pzem_profile_t *PzemProfile( pzem_profile_id_t id )
+{
+    return ( unsigned ) id < PZEM_PROFILE_COUNT ? &s_profiles[ id ] : NULL;
+}
+
+
+/**
+ * @brief Values measured by a device type
+ * @param profile
+ * @return uint16_t     PZ_FIELD_BIT() of the values
+ */
+uint16_t PzemProfileFields( const pzem_profile_t *profile )
+{
+    uint16_t fields = 0;
+    for ( int f = 0; f < PZ_FIELD_COUNT; f++ ) {
+        if ( profile->fields[ f ].words > 0 ) {
+            fields |= PZ_FIELD_BIT( f );
+        }
+    }
+    return fields;
+}
+
+
+/**
+ * @brief Input registers a value is decoded from
+ * @param profile
+ * @param field
+ * @return uint16_t     mask (bit n = register n), 0 if the type does not measure it
+ */
+uint16_t PzemFieldRegs( const pzem_profile_t *profile, pzem_field_t field )
+{
+    if ( field >= PZ_FIELD_COUNT || profile->fields[ field ].words == 0 ) {
+        return 0;
+    }
+    return PZ_REGISTER_MASK( profile->fields[ field ].reg, profile->fields[ field ].words );
+}
+
+
+static uint32_t PzRaw( const uint16_t *regs, uint8_t reg, uint8_t words, uint8_t order )
+{
+    if ( words < 2 ) {
+        return regs[ reg ];
+    }
+    if ( order == PZ_HIGH_WORD_FIRST ) {
+        return ( uint32_t ) regs[ reg ] << 16 | regs[ reg + 1 ];
+    }
+    return ( uint32_t ) regs[ reg ] | ( uint32_t ) regs[ reg + 1 ] << 16;
+}
+
+
+/**
+ * @brief Raw (unscaled) value, e.g. the energy in Wh
+ * @param profile
+ * @param regs      input registers at their register index
+ * @param field
+ * @return uint32_t     0 if the type does not measure it
+ */
+uint32_t PzemFieldRaw( const pzem_profile_t *profile, const uint16_t *regs, pzem_field_t field )
+{
+    if ( field >= PZ_FIELD_COUNT || profile->fields[ field ].words == 0 ) {
+        return 0;
+    }
+    const pzem_field_map_t *map = &profile->fields[ field ];
+    return PzRaw( regs, map->reg, map->words, map->order );
+}
+
+
+/**
+ * @brief Scaled value in double precision (flags: 0 / 1)
+ * @param profile
+ * @param regs
+ * @param field
+ * @return double
+ */
+double PzemFieldValue( const pzem_profile_t *profile, const uint16_t *regs, pzem_field_t field )
+{
+    if ( field >= PZ_FIELD_COUNT || profile->fields[ field ].words == 0 ) {
+        return 0;
+    }
+    uint32_t raw = PzemFieldRaw( profile, regs, field );
+    const uint16_t divisor = profile->fields[ field ].divisor;
+    return divisor ? ( double ) raw / divisor : raw != 0;
+}
+
+
+/**
+ * @brief Compile the read plan of a module for a set of values: contiguous reads (gaps up to
+ * PZ_PLAN_MERGE_GAP registers are read along) with prepared requests and the decode steps
+ * @param profile
+ * @param fields        PZ_FIELD_BIT() of the wanted values, values the type does not measure are ignored
+ * @param slave_addr
+ * @param plan
+ * @return bool     false if none of the values is measured by the type
+ */
+bool PzemCompilePlan( const pzem_profile_t *profile, uint16_t fields, uint8_t slave_addr, pzem_plan_t *plan )
+{
+    memset( plan, 0, sizeof( *plan ) );
+    plan->profile = profile;
+    if ( profile == NULL || profile->input_regs > PZ_REGISTER_COUNT ) {
+        return false;
+    }
+
+    uint16_t needed = 0;
+    for ( int f = 0; f < PZ_FIELD_COUNT; f++ ) {
+        const pzem_field_map_t *map = &profile->fields[ f ];
+        if ( !( fields & PZ_FIELD_BIT( f ) ) || map->words == 0 ) {
+            continue;
+        }
+        plan->steps[ plan->step_count++ ] = ( pzem_decode_step_t ) {
+            .field = f, .reg = map->reg, .words = map->words, .order = map->order, .divisor = map->divisor
+        };
+        plan->fields |= PZ_FIELD_BIT( f );
+        needed |= PZ_REGISTER_MASK( map->reg, map->words );
+    }
+    if ( needed == 0 ) {
+        return false;
+    }
+
+    /* ranges over the needed registers, short gaps are read along */
+    int first = -1;
+    int last = -1;
+    for ( int r = 0; r <= profile->input_regs; r++ ) {
+        bool used = r < profile->input_regs && ( needed & ( 1u << r ) );
+        if ( used && first >= 0 && r - last - 1 <= PZ_PLAN_MERGE_GAP ) {
+            last = r;
+            continue;
+        }
+        if ( first >= 0 && ( used || r == profile->input_regs ) ) {
+            if ( plan->read_count == PZ_PLAN_MAX_READS ) {
+                return false;
+            }
+            pzem_read_range_t *range = &plan->reads[ plan->read_count ];
+            range->first = first;
+            range->count = last - first + 1;
+            PzemPrepareRead( &plan->requests[ plan->read_count ], slave_addr, CMD_RIR, range->first, range->count );
+            plan->reg_mask |= PZ_REGISTER_MASK( range->first, range->count );
+            plan->read_count++;
+            first = -1;
+        }
+        if ( used ) {
+            first = last = r;
+        }
+    }
+
+    plan->all = plan->fields == PzemProfileFields( profile ) && profile->decode_all != NULL;
+    return true;
+}
+
+
+/**
+ * @brief Send the prepared reads of a plan
+ * @param pzSetup
+ * @param plan
+ * @param regs      receives the registers at their register index (PZ_REGISTER_COUNT)
+ * @return bool     false if any read failed
+ */
+bool PzemPlanRead( pzem_setup_t *pzSetup, const pzem_plan_t *plan, uint16_t *regs )
+{
+    if ( plan->read_count == 0 ) {
+        return false;
+    }
+    for ( int i = 0; i < plan->read_count; i++ ) {
+        if ( !PzemReadPrepared( pzSetup, &plan->requests[ i ], &regs[ plan->reads[ i ].first ] ) ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * @brief Decode the values of a plan, all other values are left unchanged (apparent power needs
+ * voltage and current, phase angle and reactive power also the power factor)
+ * @param plan
+ * @param regs      input registers at their register index, the registers of the plan have to be valid
+ * @param values
+ */
+void PzemPlanDecode( const pzem_plan_t *plan, const uint16_t *regs, _current_values_t *values )
+{
+    if ( plan->all ) {
+        plan->profile->decode_all( regs, values );
+        return;
+    }
+
+    for ( int i = 0; i < plan->step_count; i++ ) {
+        const pzem_decode_step_t *step = &plan->steps[ i ];
+        uint32_t raw = PzRaw( regs, step->reg, step->words, step->order );
+        float value = step->divisor ? ( float ) ( raw / ( double ) step->divisor ) : 0.0f;
+        switch ( step->field ) {
+            case PZ_FIELD_VOLTAGE:   values->voltage = value; break;
+            case PZ_FIELD_CURRENT:   values->current = value; break;
+            case PZ_FIELD_POWER:     values->power = value; break;
+            case PZ_FIELD_ENERGY:    values->energy = value; break;
+            case PZ_FIELD_FREQUENCY: values->frequency = value; break;
+            case PZ_FIELD_PF:        values->pf = value; break;
+            case PZ_FIELD_ALARM:     values->alarms = ( uint16_t ) ( raw | raw >> 16 ); break;
+            default: break;
+        }
+    }
+
+    const uint16_t vi = PZ_FIELD_BIT( PZ_FIELD_VOLTAGE ) | PZ_FIELD_BIT( PZ_FIELD_CURRENT );
+    if ( ( plan->fields & vi ) == vi ) {
+        values->apparent_power = values->voltage * values->current;
+        if ( plan->fields & PZ_FIELD_BIT( PZ_FIELD_PF ) ) {
+            values->fi = 360.0F * ( acosf( values->pf ) / ( 2.0F * 3.14159265F ) );
+            values->reactive_power = values->apparent_power * sinf( values->fi );
+        }
+    }
+}
+
+
+/**
+ * @brief Convert the 8 input registers of a DC module (PZEM-017) to measured values
+ * @param regs
+ * @param pmonValues
+ */
+void PzemDecodeValuesDC( const uint16_t *regs, _current_values_t *pmonValues )
+{
+    pmonValues->voltage = regs[ 0 ] / 100.0;                                          /* Raw voltage in 0.01V */
+
+    pmonValues->current = regs[ 1 ] / 100.0;                                          /* Raw current in 0.01A */
+
+    pmonValues->power = ( ( uint32_t ) regs[ 2 ] |                                    /* Raw power in 0.1W */
+                          ( uint32_t ) regs[ 3 ] << 16 ) / 10.0;
+
+    pmonValues->energy = ( ( uint32_t ) regs[ 4 ] |                                   /* Raw Energy in 1Wh */
+                           ( uint32_t ) regs[ 5 ] << 16 ) / 1000.0;
+
+    pmonValues->frequency = 0.0f;                                                   /* DC: no frequency, pf, phase */
+    pmonValues->pf = 0.0f;
+    pmonValues->fi = 0.0f;
+    pmonValues->reactive_power = 0.0f;
+
+    pmonValues->alarms = regs[ 6 ] | regs[ 7 ];                                      /* High / low voltage alarm */
+
+    pmonValues->apparent_power = pmonValues->voltage * pmonValues->current;
+}
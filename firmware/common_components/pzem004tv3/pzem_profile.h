@@ -0,0 +1,110 @@
+#pragma once
+/**
+ * Device profiles: register map, scaling, word order, serial framing and supported commands of
+ * each PZEM type. A profile is compiled once (at config time) into a read plan for a set of
+ * values: the fewest contiguous input register reads covering them (a gap of unused registers
+ * is read along when that is cheaper than another transaction) and a decoder for exactly those
+ * values. A plan of all values of a device uses the hand written decoder of its type.
+ * Register values are kept at their register index, so all types fit PZ_REGISTER_COUNT.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pzem004tv3.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PZEM_PROFILE_004T = 0,      /* PZEM-004T v3.0, AC 100 A, TTL (default) */
+    PZEM_PROFILE_016,           /* PZEM-016, AC 100 A, RS485, register map of the 004T */
+    PZEM_PROFILE_017,           /* PZEM-017, DC 0..300 V with external shunt, RS485, 8N2 */
+    PZEM_PROFILE_COUNT
+} pzem_profile_id_t;
+
+/* measured values, order of _current_values_t */
+typedef enum {
+    PZ_FIELD_VOLTAGE = 0,
+    PZ_FIELD_CURRENT,
+    PZ_FIELD_POWER,
+    PZ_FIELD_ENERGY,
+    PZ_FIELD_FREQUENCY,
+    PZ_FIELD_PF,
+    PZ_FIELD_ALARM,
+    PZ_FIELD_COUNT
+} pzem_field_t;
+
+#define PZ_FIELD_BIT( field )     ( 1u << ( field ) )
+#define PZ_ALL_FIELDS             ( PZ_FIELD_BIT( PZ_FIELD_COUNT ) - 1 )
+
+#define PZ_LOW_WORD_FIRST         0
+#define PZ_HIGH_WORD_FIRST        1
+
+/* supported commands */
+#define PZ_CAP_RESET_ENERGY       0x01  /* CMD_REST */
+#define PZ_CAP_POWER_ALARM        0x02  /* power alarm threshold (W) in WREG_ALARM_THR */
+#define PZ_CAP_SET_ADDRESS        0x04  /* WREG_ADDR */
+#define PZ_CAP_CALIBRATE          0x08  /* CMD_CAL */
+
+/* registers read along instead of a separate transaction: 2 bytes each, a transaction costs
+ * 13 bytes, 7 silent characters and the module turnaround (10-20 ms) */
+#define PZ_PLAN_MERGE_GAP         8
+#define PZ_PLAN_MAX_READS         4
+
+typedef struct {
+    uint8_t reg;                /* first input register */
+    uint8_t words;              /* 1, 2 (32 bit), 0 = not measured by this type */
+    uint8_t order;              /* PZ_LOW_WORD_FIRST / PZ_HIGH_WORD_FIRST */
+    uint16_t divisor;           /* value = raw / divisor (V, A, W, kWh, Hz, 1), 0 = flag (any bit set) */
+} pzem_field_map_t;
+
+typedef struct {
+    const char *name;
+    uint8_t input_regs;         /* input registers 0x0000.. (max PZ_REGISTER_COUNT) */
+    uint8_t stop_bits;          /* 9600 baud 8N1 / 8N2 */
+    uint8_t caps;               /* PZ_CAP_* */
+    uint32_t max_power_w;       /* highest active power the type can measure (plausibility of energy steps) */
+    pzem_field_map_t fields[ PZ_FIELD_COUNT ];
+    void ( *decode_all )( const uint16_t *regs, _current_values_t *values );   /* all input registers */
+} pzem_profile_t;
+
+typedef struct {
+    uint8_t first;
+    uint8_t count;
+} pzem_read_range_t;
+
+typedef struct {
+    uint8_t field;              /* pzem_field_t */
+    uint8_t reg;
+    uint8_t words;
+    uint8_t order;
+    uint16_t divisor;
+} pzem_decode_step_t;
+
+/* Compiled read plan of a module for a set of values, requests are built once */
+typedef struct {
+    const pzem_profile_t *profile;
+    uint16_t fields;            /* values decoded: requested and measured by the type */
+    uint16_t reg_mask;          /* registers read, incl. gaps read along (bit n = register n) */
+    uint8_t read_count;
+    pzem_read_range_t reads[ PZ_PLAN_MAX_READS ];
+    pzem_request_t requests[ PZ_PLAN_MAX_READS ];
+    uint8_t step_count;
+    pzem_decode_step_t steps[ PZ_FIELD_COUNT ];
+    bool all;                   /* all values of the type: decode_all */
+} pzem_plan_t;
+
+const pzem_profile_t *PzemProfile( pzem_profile_id_t id );
+uint16_t PzemProfileFields( const pzem_profile_t *profile );
+uint16_t PzemFieldRegs( const pzem_profile_t *profile, pzem_field_t field );
+uint32_t PzemFieldRaw( const pzem_profile_t *profile, const uint16_t *regs, pzem_field_t field );
+double PzemFieldValue( const pzem_profile_t *profile, const uint16_t *regs, pzem_field_t field );
+bool PzemCompilePlan( const pzem_profile_t *profile, uint16_t fields, uint8_t slave_addr, pzem_plan_t *plan );
+void PzemPlanDecode( const pzem_plan_t *plan, const uint16_t *regs, _current_values_t *values );
+bool PzemPlanRead( pzem_setup_t *pzSetup, const pzem_plan_t *plan, uint16_t *regs );
+void PzemDecodeValuesDC( const uint16_t *regs, _current_values_t *pmonValues );
+
+#ifdef __cplusplus
+}
+#endif
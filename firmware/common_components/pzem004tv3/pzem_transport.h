@@ -0,0 +1,38 @@
+#pragma once
+/**
+ * Byte transport used by the PZEM driver to talk to the modules.
+ * The frame building, CRC and decoding in pzem004tv3.c only uses these calls,
+ * so the same code runs on the ESP32 UART driver and on a Linux serial port.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pz_conf_t;
+
+typedef struct pzem_transport {
+    /* write len bytes, returns number of bytes written or -1 */
+    int ( *write )( const struct pz_conf_t *pzSetup, const uint8_t *data, uint16_t len );
+    /* read up to len bytes, waits until len bytes arrived or timeout, returns number of bytes read */
+    int ( *read )( const struct pz_conf_t *pzSetup, uint8_t *data, uint16_t len, uint32_t timeout_ms );
+    /* discard everything received so far */
+    void ( *flush_input )( const struct pz_conf_t *pzSetup );
+    void ( *delay_ms )( const struct pz_conf_t *pzSetup, uint32_t ms );
+} pzem_transport_t;
+
+#ifdef ESP_PLATFORM
+/* UART driver of ESP-IDF, uses pzem_uart (see pzem_uart_esp32.c) */
+extern const pzem_transport_t pzem_esp32_uart_transport;
+#define PZEM_DEFAULT_TRANSPORT    ( &pzem_esp32_uart_transport )
+#else
+/* termios serial port, transport_ctx is the file descriptor (see pzem_transport_linux.c) */
+extern const pzem_transport_t pzem_linux_transport;
+#define PZEM_DEFAULT_TRANSPORT    ( &pzem_linux_transport )
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,154 @@
+/**
+ * Linux backend of the PZEM driver (host tools only, not part of the firmware build).
+ * Uses a termios serial port, e.g. a USB-TTL or USB-RS485 adapter (the adapter switches direction itself).
+ * transport_ctx of pzem_setup_t holds the file descriptor returned by PzLinuxOpen().
+ */
+#include "pzem004tv3.h"
+#include "pzem_transport_linux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <termios.h>
+#include <unistd.h>
+
+int pzem_port_log_level = 2;
+
+#define FD_OF( pzSetup )    ( ( int )( intptr_t )( pzSetup )->transport_ctx )
+
+
+/**
+ * @brief Open and configure serial port for 9600 8N1 / 8N2 raw mode
+ * @param device    e.g. /dev/ttyUSB0
+ * @param stop_bits 2 for 8N2 modules (stop_bits of the device profile), otherwise 1
+ * @return file descriptor or -1
+ */
+int PzLinuxOpen( const char *device, uint8_t stop_bits )
+{
+    static const char *LOG_TAG = "PZ_LINUX";
+
+    int fd = open( device, O_RDWR | O_NOCTTY | O_CLOEXEC );
+    if ( fd < 0 ) {
+        ESP_LOGE( LOG_TAG, "Failed to open %s: %s", device, strerror( errno ) );
+        return -1;
+    }
+
+    struct termios tio;
+    if ( tcgetattr( fd, &tio ) != 0 ) {
+        ESP_LOGE( LOG_TAG, "%s is not a serial port: %s", device, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+
+    cfmakeraw( &tio );
+    cfsetispeed( &tio, B9600 );
+    cfsetospeed( &tio, B9600 );
+    tio.c_cflag &= ~( CSTOPB | PARENB | CRTSCTS );
+    tio.c_cflag |= CLOCAL | CREAD | CS8;
+    if ( stop_bits == 2 ) {
+        tio.c_cflag |= CSTOPB;
+    }
+    /* non blocking reads, timeouts are handled with poll() */
+    tio.c_cc[ VMIN ]  = 0;
+    tio.c_cc[ VTIME ] = 0;
+
+    if ( tcsetattr( fd, TCSANOW, &tio ) != 0 ) {
+        ESP_LOGE( LOG_TAG, "Failed to configure %s: %s", device, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+    tcflush( fd, TCIOFLUSH );
+
+    return fd;
+}
+
+void PzLinuxClose( int fd )
+{
+    if ( fd >= 0 ) {
+        close( fd );
+    }
+}
+
+
+/*
+ * termios transport
+ */
+static int PzLinuxWrite( const pzem_setup_t *pzSetup, const uint8_t *data, uint16_t len )
+{
+    const int fd = FD_OF( pzSetup );
+    uint16_t done = 0;
+
+    while ( done < len ) {
+        ssize_t n = write( fd, data + done, len - done );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+
+    /* return once the frame is on the wire, like uart_write_bytes + RS485 mode does */
+    tcdrain( fd );
+    return done;
+}
+
+static int PzLinuxRead( const pzem_setup_t *pzSetup, uint8_t *data, uint16_t len, uint32_t timeout_ms )
+{
+    const int fd = FD_OF( pzSetup );
+    const int64_t deadline = esp_timer_get_time() + ( int64_t ) timeout_ms * 1000;
+    uint16_t done = 0;
+
+    /* same semantics as uart_read_bytes: wait until len bytes or timeout */
+    while ( done < len ) {
+        int64_t left_us = deadline - esp_timer_get_time();
+        if ( left_us <= 0 ) {
+            break;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ret = poll( &pfd, 1, ( int )( ( left_us + 999 ) / 1000 ) );
+        if ( ret < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        if ( ret == 0 ) {
+            break;
+        }
+
+        ssize_t n = read( fd, data + done, len - done );
+        if ( n < 0 ) {
+            if ( errno == EINTR || errno == EAGAIN ) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+static void PzLinuxFlushInput( const pzem_setup_t *pzSetup )
+{
+    tcflush( FD_OF( pzSetup ), TCIFLUSH );
+}
+
+static void PzLinuxDelay( const pzem_setup_t *pzSetup, uint32_t ms )
+{
+    (void)pzSetup;
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = ( long )( ms % 1000 ) * 1000000L };
+    while ( nanosleep( &ts, &ts ) != 0 && errno == EINTR ) {
+    }
+}
+
+const pzem_transport_t pzem_linux_transport = {
+    .write       = PzLinuxWrite,
+    .read        = PzLinuxRead,
+    .flush_input = PzLinuxFlushInput,
+    .delay_ms    = PzLinuxDelay,
+};
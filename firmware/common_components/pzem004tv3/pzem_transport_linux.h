@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int PzLinuxOpen( const char *device, uint8_t stop_bits );
+void PzLinuxClose( int fd );
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,121 @@
+/**
+ * ESP32 backend of the PZEM driver: UART driver setup and the transport
+ * used by pzem004tv3.c when pzem_setup_t.transport is not set.
+ */
+#include "pzem004tv3.h"
+
+/* RX ring buffer of the driver: must be larger than the hardware FIFO, holds one reply
+ * (RESP_BUF_SIZE, the largest frame) plus a stale one that is flushed before each request */
+#define PZ_UART_RX_BUF_SIZE    ( UART_HW_FIFO_LEN( _uart_num ) + 2 * RESP_BUF_SIZE )
+
+/**
+ * @brief Initialize the UART, configured via struct pzemSetup_t
+ * The driver is installed once, calling it again (other sensor pins) only re-routes the pins,
+ * so switching between sensors does not allocate memory
+ * @param pzSetup
+ */
+void PzemInit( pzem_setup_t *pzSetup )
+{
+    static const char *LOG_TAG = "PZ_INIT";
+
+    ESP_LOGI( LOG_TAG, "Initializing UART" );
+
+    const uart_port_t _uart_num = pzSetup->pzem_uart;
+
+    /* Configure parameters of an UART driver,
+     * communication pins and install the driver */
+    uart_config_t uart_config = {
+        .baud_rate  = PZ_BAUD_RATE,
+        .data_bits  = UART_DATA_8_BITS,
+        .parity     = UART_PARITY_DISABLE,
+        .stop_bits  = UART_STOP_BITS_1,
+        .flow_ctrl  = UART_HW_FLOWCTRL_DISABLE,
+        .source_clk = UART_SCLK_APB,
+    };
+
+    if ( !uart_is_driver_installed( _uart_num ) ) {
+        int intr_alloc_flags = 0;
+
+#if CONFIG_UART_ISR_IN_IRAM
+        intr_alloc_flags = ESP_INTR_FLAG_IRAM;
+#endif
+#if CONFIG_UART_MORE_PRIO
+        intr_alloc_flags = ESP_INTR_FLAG_LEVEL3;
+#endif
+
+        ESP_LOGI( LOG_TAG, "UART install driver, rx buffer %d bytes", PZ_UART_RX_BUF_SIZE );
+
+        /* Install UART driver without event queue and tx buffer (writes block until sent) */
+        ESP_ERROR_CHECK( uart_driver_install( _uart_num, PZ_UART_RX_BUF_SIZE, 0, 0, NULL, intr_alloc_flags ) );
+
+        /* Configure UART parameters */
+        ESP_ERROR_CHECK( uart_param_config( _uart_num, &uart_config ) );
+    }
+
+    ESP_LOGI( LOG_TAG, "UART set pins and mode." );
+
+    /* Set UART pins(TX: , RX: , RTS: -1, CTS: -1) */
+    if (pzSetup->use_rs485) {
+        // RS485 mode additionally requires RTS pin
+        ESP_LOGI(LOG_TAG, "Configuring RS485 half-duplex mode with RTS on GPIO %d", pzSetup->rs485_dir_pin);
+        ESP_ERROR_CHECK(uart_set_pin(
+            _uart_num,
+            pzSetup->pzem_tx_pin,
+            pzSetup->pzem_rx_pin,
+            pzSetup->rs485_dir_pin,  // RTS = DE/RE control
+            UART_PIN_NO_CHANGE
+        ));
+        // enable half duplex mode so RTS pin is actually controlled
+        ESP_ERROR_CHECK(uart_set_mode(_uart_num, UART_MODE_RS485_HALF_DUPLEX));
+
+    } else {
+        // TTL mode does not require DIR/RTS pin
+        ESP_ERROR_CHECK(uart_set_pin(
+            _uart_num,
+            pzSetup->pzem_tx_pin,
+            pzSetup->pzem_rx_pin,
+            UART_PIN_NO_CHANGE,
+            UART_PIN_NO_CHANGE
+        ));
+        // the driver is kept, a previous sensor may have switched it to RS485
+        ESP_ERROR_CHECK(uart_set_mode(_uart_num, UART_MODE_UART));
+    }
+
+    /* framing of the module type (see pzem_profile.h), cheap enough to set with every switch */
+    ESP_ERROR_CHECK( uart_set_stop_bits( _uart_num, pzSetup->stop_bits == 2 ? UART_STOP_BITS_2 : UART_STOP_BITS_1 ) );
+
+    // drop anything received on the previous pins
+    uart_flush_input(_uart_num);
+}
+
+
+/*
+ * UART driver transport
+ */
+static int PzUartWrite( const pzem_setup_t *pzSetup, const uint8_t *data, uint16_t len )
+{
+    return uart_write_bytes( pzSetup->pzem_uart, data, len );
+}
+
+static int PzUartRead( const pzem_setup_t *pzSetup, uint8_t *data, uint16_t len, uint32_t timeout_ms )
+{
+    return uart_read_bytes( pzSetup->pzem_uart, data, len, pdMS_TO_TICKS( timeout_ms ) );
+}
+
+static void PzUartFlushInput( const pzem_setup_t *pzSetup )
+{
+    uart_flush_input( pzSetup->pzem_uart );
+}
+
+static void PzUartDelay( const pzem_setup_t *pzSetup, uint32_t ms )
+{
+    (void)pzSetup;
+    vTaskDelay( pdMS_TO_TICKS( ms ) );
+}
+
+const pzem_transport_t pzem_esp32_uart_transport = {
+    .write       = PzUartWrite,
+    .read        = PzUartRead,
+    .flush_input = PzUartFlushInput,
+    .delay_ms    = PzUartDelay,
+};
@@ -2,6 +2,18 @@
 #include "../custom_common/mqtt_helper.h"
 #include "../custom_common/powermon_task.h"
 #include "../custom_common/config_types.h"
+#include "../custom_common/history_buffer.h"
+#include "../custom_common/pzem_bus.h"
+#include "../custom_common/sample_cache.h"
+#include "../custom_common/modbus_gateway.h"
+#include "../custom_common/http_helper.h"
+#include "../custom_common/live_stream.h"
+#include "../custom_common/power_alarm.h"
+#include "../custom_common/memory_budget.h"
+#include "../custom_common/bus_sniffer.h"
+#include "../custom_common/warm_restart.h"
+#include "../custom_common/power_save.h"
+#include "../custom_common/time_sync.h"
 
 #include "nvs_flash.h"
 #include "esp_log.h"
@@ -20,11 +32,41 @@
 #define UART_PORT UART_NUM_2
 #define MQTT_BROKER_URI "mqtt://10.0.0.102"
 
+// Modbus TCP gateway: other clients (SCADA, energy manager) can read the sensors through this node
+#define MODBUS_TCP_GATEWAY_ENABLED 0
+#define MODBUS_TCP_PORT 502
+#define MODBUS_TCP_MAX_AGE_MS 5000 // input registers younger than this are answered from last sample
+#define MODBUS_TCP_WRITE_QUEUE_DEPTH 4
+
+// HTTP server: GET /metrics in Prometheus text format, served from the latest samples
+#define HTTP_SERVER_ENABLED 1
+#define HTTP_SERVER_PORT 80
+// WebSocket live view ws://<node>/live, sensors are only sampled at this rate while a viewer is connected
+#define LIVE_STREAM_ENABLED 1
+#define LIVE_STREAM_INTERVAL_MS 1000
+// Passive bus capture (debugging only): edges of TX and RX are timestamped and streamed to tcp://<node>:7021
+#define BUS_SNIFFER_ENABLED 0
+#define BUS_SNIFFER_TX_PIN GPIO_NUM_18 // channel 0, requests
+#define BUS_SNIFFER_RX_PIN GPIO_NUM_19 // channel 1, responses
+// Power save for battery backed sites: frequency scaling, WiFi max modem sleep and automatic light
+// sleep between polls (see power_save.h), incoming packets wait up to ~300 ms
+#define POWER_SAVE_ENABLED 0
+#if POWER_SAVE_ENABLED && BUS_SNIFFER_ENABLED
+#error "the bus sniffer needs the CPU awake, disable POWER_SAVE_ENABLED while capturing"
+#endif
+
 
 // Local config for this ESP32 instance
 // configure all connected PZEM-004T sensors
 #define PUBLISH_INTERVAL_MS 60000 // interval all sensor data is read and published for each sensor
 #define RETRY_INTERVAL_WHEN_READ_FAILED_MS 2000 //retry earlier than next interval when read failed
+#define ALARM_THRESHOLD_W 0 // power alarm (programmed into the modules) published at once on "<prefix>/alarm", 0 = off
+#define ALARM_CHECK_INTERVAL_MS 1000 // alarm register of sensors with threshold is checked this often
+#define ADAPTIVE_MIN_INTERVAL_MS 0 // read faster (down to this, e.g. 5000) while power changes, 0 = always PUBLISH_INTERVAL_MS
+#define ADAPTIVE_READS_PER_DAY 10000 // budget of reads (= publishes) per day of all sensors incl. the fixed schedule
+#define BUS_MAX_UTILIZATION 0.7f // admission limit of planned bus time, lower priority sensors are slowed down above
+#define ENERGY_INTERVAL_MS (15 * 60 * 1000) // energy per billing interval on <prefix>/energy_interval, 0 = only the total on <prefix>/energy_total
+#define NTP_SERVER "pool.ntp.org" // billing intervals are aligned to this clock, not tracked before the first sync
 const ModbusSensor sensors[] = {
     // Note about connection: multiple sensors are connected to shared TX pin (master) 
     //   but each has its own RX pin to send to the master
@@ -40,6 +82,8 @@ const ModbusSensor sensors[] = {
         .rs485_dir_pin = GPIO_NUM_NC,
         .mqtt_topic_prefix = "Sensordaten/PV/Hobelboden/sunnyboy",
         .publish_interval_ms = PUBLISH_INTERVAL_MS,
+        .alarm_threshold_w = ALARM_THRESHOLD_W,
+        .priority = SENSOR_PRIO_LOW,
     }
 };
 
@@ -52,6 +96,9 @@ const ModbusSensor sensors[] = {
 void app_main(void) {
     ESP_LOGI(TAG, "[APP] Startup..");
     nvs_flash_init();
+    // after a reset the schedule resumes from the checkpoint, the publish task copes with WiFi / MQTT
+    // still connecting, so the boot delays are only kept for a cold start
+    const bool warm = common_warm_init() == WARM_SOURCE_RTC;
 
     wifi_settings_t wifi = {
         .ssid = WIFI_SSID,
@@ -59,16 +106,28 @@ void app_main(void) {
         .use_static_ip = WIFI_USE_STATIC_IP,
         .ip = WIFI_STATIC_IP_ADDR,
         .netmask = WIFI_STATIC_NETMASK_ADDR,
-        .gateway = WIFI_STATIC_GW_ADDR
+        .gateway = WIFI_STATIC_GW_ADDR,
+        .power_save = POWER_SAVE_ENABLED
     };
     ESP_LOGW(TAG, "Starting wifi...");
     common_wifi_start(&wifi);
-    vTaskDelay(pdMS_TO_TICKS(4000));
+#if POWER_SAVE_ENABLED
+    common_power_start();
+#endif
+    common_time_start(NTP_SERVER);
+    if (!warm) {
+        vTaskDelay(pdMS_TO_TICKS(4000));
+    }
+
 
+    // history has to be ready before mqtt connects (subscribes request topics)
+    common_history_init(sensors, sizeof(sensors) / sizeof(sensors[0]));
 
     ESP_LOGW(TAG, "Starting mqtt...");
     esp_mqtt_client_handle_t mqtt_client = common_mqtt_start(MQTT_BROKER_URI);
-    vTaskDelay(pdMS_TO_TICKS(2000));
+    if (!warm) {
+        vTaskDelay(pdMS_TO_TICKS(2000));
+    }
 
 
     PMonTaskConfig_t powerMonitor_TaskCfg = {
@@ -76,9 +135,66 @@ void app_main(void) {
         .sensor_count = sizeof(sensors) / sizeof(sensors[0]),
         .uart_port = UART_PORT,
         .mqtt_client = mqtt_client,
-        .retry_interval_on_fail_ms = RETRY_INTERVAL_WHEN_READ_FAILED_MS
+        .retry_interval_on_fail_ms = RETRY_INTERVAL_WHEN_READ_FAILED_MS,
+        .adaptive = {
+            .min_interval_ms = ADAPTIVE_MIN_INTERVAL_MS,
+            .reads_per_day = ADAPTIVE_READS_PER_DAY,
+        },
+        .max_bus_utilization = BUS_MAX_UTILIZATION,
+        .energy_interval_ms = ENERGY_INTERVAL_MS,
+        .alarm_check_interval_ms = ALARM_CHECK_INTERVAL_MS,
+#if HTTP_SERVER_ENABLED && LIVE_STREAM_ENABLED
+        .live_interval_ms = LIVE_STREAM_INTERVAL_MS,
+#endif
+#if MODBUS_TCP_GATEWAY_ENABLED
+        .gateway_max_age_ms = MODBUS_TCP_MAX_AGE_MS,
+#endif
     };
 
+    common_bus_init();
+    common_cache_init(sensors, sizeof(sensors) / sizeof(sensors[0]), UART_PORT);
+
     ESP_LOGW(TAG, "Starting publish task...");
-    xTaskCreate((TaskFunction_t) common_PMonTask, "PowerMonitor", 4096, (void*) &powerMonitor_TaskCfg, 5, NULL);
+    common_pmon_start(&powerMonitor_TaskCfg);
+
+    AlarmConfig_t alarm_cfg = {
+        .sensors = sensors,
+        .sensor_count = sizeof(sensors) / sizeof(sensors[0]),
+        .uart_port = UART_PORT,
+        .mqtt_client = mqtt_client,
+        .check_interval_ms = ALARM_CHECK_INTERVAL_MS
+    };
+    common_alarm_start(&alarm_cfg);
+
+#if MODBUS_TCP_GATEWAY_ENABLED
+    MbGatewayConfig_t gateway_cfg = {
+        .sensors = sensors,
+        .sensor_count = sizeof(sensors) / sizeof(sensors[0]),
+        .uart_port = UART_PORT,
+        .tcp_port = MODBUS_TCP_PORT,
+        .max_age_ms = MODBUS_TCP_MAX_AGE_MS,
+        .write_queue_depth = MODBUS_TCP_WRITE_QUEUE_DEPTH
+    };
+    ESP_LOGW(TAG, "Starting modbus tcp gateway...");
+    common_mbgw_start(&gateway_cfg);
+#endif
+
+#if HTTP_SERVER_ENABLED
+    ESP_LOGW(TAG, "Starting http server...");
+    httpd_handle_t http_server = common_http_start(HTTP_SERVER_PORT);
+#if LIVE_STREAM_ENABLED
+    common_live_start(http_server, LIVE_STREAM_INTERVAL_MS);
+#endif
+#endif
+
+#if BUS_SNIFFER_ENABLED
+    sniffer_config_t sniffer_cfg = {
+        .pins = { BUS_SNIFFER_TX_PIN, BUS_SNIFFER_RX_PIN },
+    };
+    ESP_LOGW(TAG, "Starting bus sniffer...");
+    common_sniffer_start(&sniffer_cfg);
+#endif
+
+    // everything is started: log memory budget, free heap from now on is the baseline
+    common_membudget_seal();
 }
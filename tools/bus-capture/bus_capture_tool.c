@@ -0,0 +1,346 @@
+// Records and decodes captures of the bus sniffer (bus_sniffer.h, format in bus_capture.h).
+//
+// usage: bus-capture -c NODE[:PORT] [-w FILE] [-t SECONDS] [-q]    record from a node (default port 7021)
+//        bus-capture -r FILE [-q]                                  decode a recorded file
+//
+//   -w FILE     write the raw stream to FILE while decoding (replay later with -r)
+//   -t SECONDS  stop recording after SECONDS (default: until ctrl-c / node closes)
+//   -q          no line per frame, summary only
+//
+// Every frame is printed with its time, channel, bytes, CRC check and Modbus address/function.
+// A frame on channel 1 (RX) after one on channel 0 (TX) shows the turnaround: end of the stop bit
+// of the request to the start bit of the response. The summary has turnaround min/avg/max, the
+// longest gap inside frames, CRC and framing errors, overlapping frames of both channels
+// (collisions) and lost edges.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "bus_capture.h"
+#include "pzem004tv3.h"
+
+#define CHANNELS 2                  // SNIFFER_MAX_CHANNELS
+
+typedef struct {
+    long frames;
+    long bytes;
+    long crc_errors;
+    long framing_errors;
+} channel_stats_t;
+
+typedef struct {
+    bool quiet;
+    uint32_t baud;
+    uint32_t gap_us;
+    bool have_header;
+    int64_t first_us;
+
+    uint8_t buf[CAPTURE_MAX_RECORD_SIZE];
+    size_t fill;
+    capture_frame_t frame;
+
+    channel_stats_t ch[CHANNELS];
+    long lost_records;
+    long lost_edges;
+    long overlaps;
+    long truncated;
+    int64_t last_end_us[CHANNELS];
+    bool request_pending;           // TX frame without response yet
+    long turnarounds;
+    int64_t turnaround_min;
+    int64_t turnaround_max;
+    int64_t turnaround_sum;
+    uint32_t max_inner_gap_us;
+} decoder_t;
+
+static volatile sig_atomic_t s_stop = 0;
+
+
+
+static void on_signal(int sig) {
+    (void)sig;
+    s_stop = 1;
+}
+
+
+static int64_t frame_end_us(const decoder_t *d, const capture_frame_t *f) {
+    const int64_t char_us = 10 * 1000000LL / d->baud;
+    return f->start_us + f->bytes[f->count - 1].offset_us + char_us;
+}
+
+
+static void on_frame(decoder_t *d, const capture_frame_t *f) {
+    const int ch = f->channel < CHANNELS ? f->channel : CHANNELS - 1;
+    const int64_t char_us = 10 * 1000000LL / d->baud;
+    if (!d->first_us) {
+        d->first_us = f->start_us;
+    }
+    channel_stats_t *st = &d->ch[ch];
+    st->frames++;
+    st->bytes += f->count;
+
+    int framing = 0;
+    for (int i = 0; i < f->count; i++) {
+        framing += (f->bytes[i].flags & CAPTURE_BYTE_FRAMING_ERROR) != 0;
+        if (i > 0) {
+            int64_t gap = (int64_t)f->bytes[i].offset_us - f->bytes[i - 1].offset_us - char_us;
+            if (gap > (int64_t)d->max_inner_gap_us) {
+                d->max_inner_gap_us = gap;
+            }
+        }
+    }
+    st->framing_errors += framing;
+    uint8_t raw[CAPTURE_MAX_FRAME];
+    for (int i = 0; i < f->count; i++) {
+        raw[i] = f->bytes[i].value;
+    }
+    bool crc_ok = f->count >= 4 && PzemCheckCRC(raw, f->count);
+    if (!crc_ok) {
+        st->crc_errors++;
+    }
+    if (f->flags & CAPTURE_FRAME_TRUNCATED) {
+        d->truncated++;
+    }
+
+    // other channel still sending when this frame started: both drove the bus
+    const int other = ch ^ 1;
+    bool overlap = d->last_end_us[other] > f->start_us;
+    d->overlaps += overlap;
+
+    int64_t turnaround = -1;
+    if (ch == 0) {
+        d->request_pending = true;
+    } else if (d->request_pending && d->last_end_us[0] > 0) {
+        turnaround = f->start_us - d->last_end_us[0];
+        d->request_pending = false;
+        if (d->turnarounds == 0 || turnaround < d->turnaround_min) {
+            d->turnaround_min = turnaround;
+        }
+        if (turnaround > d->turnaround_max) {
+            d->turnaround_max = turnaround;
+        }
+        d->turnaround_sum += turnaround;
+        d->turnarounds++;
+    }
+    d->last_end_us[ch] = frame_end_us(d, f);
+
+    if (d->quiet) {
+        return;
+    }
+    printf("%12.6f ch%d %3d bytes ", (f->start_us - d->first_us) / 1e6, f->channel, f->count);
+    for (int i = 0; i < f->count && i < 16; i++) {
+        printf(" %02X%s", raw[i], (f->bytes[i].flags & CAPTURE_BYTE_FRAMING_ERROR) ? "!" : "");
+    }
+    printf("%s  %s", f->count > 16 ? " .." : "", crc_ok ? "crc ok" : "CRC ERROR");
+    if (f->count >= 2) {
+        printf("  addr %u fc 0x%02X", raw[0], raw[1]);
+    }
+    if (turnaround >= 0) {
+        printf("  turnaround %lld us", (long long)turnaround);
+    }
+    if (framing) {
+        printf("  %d framing errors", framing);
+    }
+    if (overlap) {
+        printf("  OVERLAP");
+    }
+    if (f->flags & CAPTURE_FRAME_AFTER_LOSS) {
+        printf("  after loss");
+    }
+    if (f->flags & CAPTURE_FRAME_TRUNCATED) {
+        printf("  truncated");
+    }
+    printf("\n");
+}
+
+
+// stream parser, returns false on a corrupt stream
+static bool feed(decoder_t *d, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t need = !d->have_header ? CAPTURE_HEADER_SIZE
+                    : d->fill < CAPTURE_RECORD_HEADER_SIZE ? CAPTURE_RECORD_HEADER_SIZE
+                    : common_capture_record_size(d->buf);
+        if (need == 0 || need > sizeof(d->buf)) {
+            fprintf(stderr, "corrupt record (type %u)\n", d->buf[0]);
+            return false;
+        }
+        size_t n = need - d->fill < len ? need - d->fill : len;
+        memcpy(&d->buf[d->fill], data, n);
+        d->fill += n;
+        data += n;
+        len -= n;
+        if (d->fill < need) {
+            continue;
+        }
+
+        if (!d->have_header) {
+            if (!common_capture_parse_header(d->buf, &d->baud, &d->gap_us)) {
+                fprintf(stderr, "not a bus capture\n");
+                return false;
+            }
+            d->have_header = true;
+            d->fill = 0;
+            printf("capture: %u baud, frame gap %u us\n", (unsigned)d->baud, (unsigned)d->gap_us);
+            continue;
+        }
+        if (d->fill < common_capture_record_size(d->buf)) {
+            continue;   // record header complete, bytes follow
+        }
+        int type = common_capture_parse_record(d->buf, d->fill, &d->frame);
+        d->fill = 0;
+        if (type == CAPTURE_RECORD_FRAME && d->frame.count > 0) {
+            on_frame(d, &d->frame);
+        } else if (type == CAPTURE_RECORD_LOST) {
+            d->lost_records++;
+            d->lost_edges += d->frame.count;
+            d->request_pending = false;
+            if (!d->quiet) {
+                printf("%12.6f ch%d LOST %u edges\n", d->first_us ? (d->frame.start_us - d->first_us) / 1e6 : 0.0,
+                       d->frame.channel, d->frame.count);
+            }
+        } else if (type == 0) {
+            fprintf(stderr, "corrupt record\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+static void print_summary(const decoder_t *d) {
+    printf("\n");
+    for (int c = 0; c < CHANNELS; c++) {
+        const channel_stats_t *st = &d->ch[c];
+        printf("ch%d: %ld frames, %ld bytes, %ld crc errors, %ld framing errors\n",
+               c, st->frames, st->bytes, st->crc_errors, st->framing_errors);
+    }
+    if (d->turnarounds > 0) {
+        printf("turnaround: %ld responses, min %lld us, avg %lld us, max %lld us\n", d->turnarounds,
+               (long long)d->turnaround_min, (long long)(d->turnaround_sum / d->turnarounds), (long long)d->turnaround_max);
+    }
+    printf("longest gap inside a frame: %u us (frame gap %u us)\n", (unsigned)d->max_inner_gap_us, (unsigned)d->gap_us);
+    printf("overlapping frames: %ld, truncated frames: %ld, lost: %ld records / %ld edges\n",
+           d->overlaps, d->truncated, d->lost_records, d->lost_edges);
+}
+
+
+static int connect_to(const char *target) {
+    char host[256];
+    const char *port = "7021";
+    snprintf(host, sizeof(host), "%s", target);
+    char *colon = strrchr(host, ':');
+    if (colon) {
+        *colon = 0;
+        port = colon + 1;
+    }
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: bus-capture -c NODE[:PORT] [-w FILE] [-t SECONDS] [-q]\n"
+        "       bus-capture -r FILE [-q]\n");
+}
+
+
+int main(int argc, char **argv) {
+    const char *node = NULL;
+    const char *out_path = NULL;
+    const char *in_path = NULL;
+    int duration_s = 0;
+    static decoder_t d;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:w:r:t:q")) != -1) {
+        switch (c) {
+            case 'c': node = optarg; break;
+            case 'w': out_path = optarg; break;
+            case 'r': in_path = optarg; break;
+            case 't': duration_s = atoi(optarg); break;
+            case 'q': d.quiet = true; break;
+            default: usage(); return 2;
+        }
+    }
+    if (!node == !in_path) {
+        usage();
+        return 2;
+    }
+
+    uint8_t chunk[4096];
+    bool ok = true;
+    if (in_path) {
+        FILE *in = fopen(in_path, "rb");
+        if (!in) {
+            perror(in_path);
+            return 1;
+        }
+        size_t n;
+        while (ok && (n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+            ok = feed(&d, chunk, n);
+        }
+        fclose(in);
+    } else {
+        int fd = connect_to(node);
+        if (fd < 0) {
+            fprintf(stderr, "cannot connect to %s\n", node);
+            return 1;
+        }
+        FILE *out = NULL;
+        if (out_path && !(out = fopen(out_path, "wb"))) {
+            perror(out_path);
+            close(fd);
+            return 1;
+        }
+        signal(SIGINT, on_signal);
+        signal(SIGTERM, on_signal);
+        // the receive timeout lets the loop check the duration and ctrl-c
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 200000 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        time_t end = duration_s > 0 ? time(NULL) + duration_s : 0;
+        while (ok && !s_stop && (!end || time(NULL) < end)) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n == 0) {
+                fprintf(stderr, "node closed the capture\n");
+                break;
+            }
+            if (n < 0) {
+                continue;   // timeout or signal
+            }
+            if (out) {
+                fwrite(chunk, 1, n, out);
+            }
+            ok = feed(&d, chunk, n);
+            fflush(stdout);
+        }
+        close(fd);
+        if (out) {
+            fclose(out);
+        }
+    }
+    print_summary(&d);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,961 @@
+// Load generator for the broker and the ingestion path: simulates a fleet of powermon nodes, each
+// with its own MQTT connection (minimal MQTT 3.1.1 client, QoS 0/1), publishing the topics and
+// payloads of the firmware (mqtt_payload.c) with the firmware's reconnect behaviour: latest values,
+// retained availability and last known value first, the samples missed meanwhile as rate limited
+// backlog messages.
+//
+// usage: fleet-load [options] [BROKER]        (default 127.0.0.1)
+//
+// options:
+//   -p PORT        broker port (default 1883)
+//   -n NODES       virtual nodes (default 100)
+//   -s SENSORS     sensors per node (default 3)
+//   -i MS          publish interval of every sensor (default 30000)
+//   -f MS          fast lane interval (power only), 0 = off (default 0)
+//   -m MODE        full: values + retained last + energy (firmware), values: value topics only, last: retained last only
+//   -e MS          billing interval (ENERGY_INTERVAL_MS), aligned to the wall clock, 0 = only energy_total (default 900000)
+//   -q QOS         0 or 1 (default 1)
+//   -t SECONDS     duration (default 60)
+//   -o PERIOD:LEN  outage pattern: every node loses its connection for LEN s every PERIOD s (random phase)
+//   -r ROOT        topic root (default Sensordaten/loadtest), topics <ROOT>/node<N>/L<S>/<field>
+//   -w THREADS     worker threads (default 4)
+//   -W WINDOW      QoS 1 publishes in flight per node, more are dropped like by the bounded outbox
+//                  of the firmware (default 100, about MQTT_OUTBOX_LIMIT_BYTES)
+//
+// Reports messages/s (offered, sent, acked), the publish -> PUBACK latency percentiles and drops
+// (window or socket buffer full, no ack until the end, unacked at a disconnect).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "mqtt_payload.h"
+
+#define MAX_SENSORS       8
+#define MAX_WINDOW        1024
+#define OUT_BUF_SIZE      (64 * 1024)
+#define IN_BUF_SIZE       4096
+#define KEEPALIVE_S       60
+#define RECONNECT_S       1.0       // after a lost connection (not a simulated outage)
+#define DRAIN_S           5.0       // wait for outstanding acks at the end
+
+// backlog after an outage, see history_buffer.h and PMON_BACKLOG_INTERVAL_MS in powermon_task.h
+#define HISTORY_BLOCK_SIZE       512
+#define HISTORY_MSG_HEADER_SIZE  24
+#define HISTORY_SAMPLE_BYTES     10     // typical delta encoded sample
+#define BACKLOG_INTERVAL_S       0.2
+
+// closed billing intervals kept during an outage, see ENERGY_PENDING_MAX in energy_store.h
+#define ENERGY_PENDING_MAX       8
+
+typedef enum { MODE_FULL, MODE_VALUES, MODE_LAST } payload_mode_t;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int nodes;
+    int sensors;
+    int interval_ms;
+    int fast_ms;
+    int energy_interval_ms;
+    payload_mode_t mode;
+    int qos;
+    int duration_s;
+    int outage_period_s;
+    int outage_len_s;
+    const char *root;
+    int workers;
+    int window;
+} options_t;
+
+typedef struct {
+    long offered;                   // messages the nodes wanted to publish (incl. deferred samples, reconnect and backlog)
+    long sent;                      // written to the socket
+    long acked;
+    long dropped_full;              // window or socket buffer full
+    long unacked_disconnect;        // in flight when the connection was closed
+    long deferred;                  // samples during outages (sent as backlog later)
+    long backlog_msgs;
+    long energy_intervals;          // closed billing intervals (sent now or after the reconnect)
+    long energy_dropped;            // more than ENERGY_PENDING_MAX closed during an outage
+    long connects;
+    long connect_failures;
+    long connections_lost;
+    float *latency_ms;              // per acked publish
+    size_t latency_count;
+    size_t latency_cap;
+} stats_t;
+
+typedef struct {
+    int id;
+    int fd;                         // -1 = not connected
+    bool online;                    // CONNACK received
+    bool in_outage;
+    double phase_s;                 // outage pattern offset
+    double reconnect_at;
+    double last_tx;
+    uint16_t next_packet_id;
+    double inflight_t[MAX_WINDOW];  // send time by packet id % window, 0 = free
+    int inflight;
+    uint8_t out[OUT_BUF_SIZE];
+    size_t out_len;
+    uint8_t in[IN_BUF_SIZE];
+    size_t in_len;
+    double next_due[MAX_SENSORS];
+    double next_fast[MAX_SENSORS];
+    _current_values_t values[MAX_SENSORS];
+    int deferred[MAX_SENSORS];      // samples during the outage
+    int backlog_left[MAX_SENSORS];  // backlog messages still to send
+    int backlog_bytes[MAX_SENSORS];
+    energy_interval_t interval[MAX_SENSORS];                        // open billing interval, end_ms 0 = none
+    energy_interval_t pending[MAX_SENSORS][ENERGY_PENDING_MAX];     // closed, not yet published
+    int pending_count[MAX_SENSORS];
+    double next_backlog;
+    unsigned int seed;
+} node_t;
+
+typedef struct {
+    const options_t *opt;
+    node_t *nodes;
+    int count;
+    stats_t stats;
+    pthread_mutex_t lock;           // stats, for the progress report
+} worker_t;
+
+static volatile bool s_stop = false;
+static double s_start;
+
+
+
+//===============================
+//===== helpers =================
+//===============================
+static void usage(void) {
+    fprintf(stderr,
+        "usage: fleet-load [-p PORT] [-n NODES] [-s SENSORS] [-i MS] [-f MS] [-m full|values|last] [-e MS] [-q QOS]\n"
+        "                  [-t SECONDS] [-o PERIOD:LEN] [-r ROOT] [-w THREADS] [-W WINDOW] [BROKER]\n"
+        "  -p PORT        broker port (default 1883)\n"
+        "  -n NODES       virtual nodes (default 100)\n"
+        "  -s SENSORS     sensors per node (default 3, max %d)\n"
+        "  -i MS          publish interval of every sensor (default 30000)\n"
+        "  -f MS          fast lane interval (power only), 0 = off (default 0)\n"
+        "  -m MODE        full (values + retained last + energy), values, last (default full)\n"
+        "  -e MS          billing interval on energy_interval, 0 = off (default 900000)\n"
+        "  -q QOS         0 or 1 (default 1)\n"
+        "  -t SECONDS     duration (default 60)\n"
+        "  -o PERIOD:LEN  every node is offline for LEN s every PERIOD s\n"
+        "  -r ROOT        topic root (default Sensordaten/loadtest)\n"
+        "  -w THREADS     worker threads (default 4)\n"
+        "  -W WINDOW      QoS 1 publishes in flight per node (default 100, max %d)\n",
+        MAX_SENSORS, MAX_WINDOW);
+}
+
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+// system time in ms, billing intervals are aligned to it like on the node (SNTP)
+static int64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static double rand_unit(unsigned int *seed) {
+    return rand_r(seed) / (RAND_MAX + 1.0);
+}
+
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return fd;
+}
+
+
+static void record_latency(stats_t *st, double ms) {
+    if (st->latency_count == st->latency_cap) {
+        size_t cap = st->latency_cap ? st->latency_cap * 2 : 4096;
+        float *p = realloc(st->latency_ms, cap * sizeof(float));
+        if (p == NULL) {
+            return;
+        }
+        st->latency_ms = p;
+        st->latency_cap = cap;
+    }
+    st->latency_ms[st->latency_count++] = (float)ms;
+}
+
+
+
+//===============================
+//===== MQTT 3.1.1 ==============
+//===============================
+static size_t put_remaining_length(uint8_t *buf, size_t len) {
+    size_t n = 0;
+    do {
+        uint8_t b = len % 128;
+        len /= 128;
+        buf[n++] = b | (len > 0 ? 0x80 : 0);
+    } while (len > 0);
+    return n;
+}
+
+
+static size_t put_string(uint8_t *buf, const char *s, size_t len) {
+    buf[0] = len >> 8;
+    buf[1] = len & 0xFF;
+    memcpy(&buf[2], s, len);
+    return 2 + len;
+}
+
+
+// append a packet to the output buffer, false if it does not fit
+static bool queue_packet(node_t *node, uint8_t type, const uint8_t *body, size_t body_len) {
+    uint8_t header[5];
+    header[0] = type;
+    size_t hlen = 1 + put_remaining_length(&header[1], body_len);
+    if (node->out_len + hlen + body_len > OUT_BUF_SIZE) {
+        return false;
+    }
+    memcpy(&node->out[node->out_len], header, hlen);
+    memcpy(&node->out[node->out_len + hlen], body, body_len);
+    node->out_len += hlen + body_len;
+    return true;
+}
+
+
+static void send_connect(node_t *node) {
+    uint8_t body[64];
+    char client_id[32];
+    size_t n = 0;
+    n += put_string(&body[n], "MQTT", 4);
+    body[n++] = 4;                  // protocol level 3.1.1
+    body[n++] = 0x02;               // clean session
+    body[n++] = KEEPALIVE_S >> 8;
+    body[n++] = KEEPALIVE_S & 0xFF;
+    int len = snprintf(client_id, sizeof(client_id), "fleet-load-%d", node->id);
+    n += put_string(&body[n], client_id, len);
+    queue_packet(node, 0x10, body, n);
+}
+
+
+static void close_node(node_t *node, stats_t *st) {
+    if (node->fd >= 0) {
+        close(node->fd);
+    }
+    node->fd = -1;
+    node->online = false;
+    node->out_len = 0;
+    node->in_len = 0;
+    st->unacked_disconnect += node->inflight;
+    memset(node->inflight_t, 0, sizeof(node->inflight_t));
+    node->inflight = 0;
+}
+
+
+// QoS 1 publishes are tracked by packet id % window, a busy slot means the window is full
+static bool publish(node_t *node, worker_t *w, const char *topic, const void *payload, size_t len, bool retain) {
+    const options_t *opt = w->opt;
+    stats_t *st = &w->stats;
+    static __thread uint8_t body[PAYLOAD_TOPIC_MAX + HISTORY_MSG_HEADER_SIZE + HISTORY_BLOCK_SIZE + 8];
+    size_t topic_len = strlen(topic);
+    if (topic_len + len + 4 > sizeof(body)) {
+        return false;
+    }
+
+    uint16_t packet_id = 0;
+    int slot = 0;
+    if (opt->qos > 0) {
+        if (++node->next_packet_id == 0) {
+            node->next_packet_id = 1;
+        }
+        packet_id = node->next_packet_id;
+        slot = packet_id % opt->window;
+        if (node->inflight_t[slot] != 0) {
+            st->dropped_full++;
+            node->next_packet_id--;
+            return false;
+        }
+    }
+
+    size_t n = put_string(body, topic, topic_len);
+    if (opt->qos > 0) {
+        body[n++] = packet_id >> 8;
+        body[n++] = packet_id & 0xFF;
+    }
+    memcpy(&body[n], payload, len);
+    n += len;
+    if (!queue_packet(node, 0x30 | (opt->qos << 1) | (retain ? 1 : 0), body, n)) {
+        st->dropped_full++;
+        if (opt->qos > 0) {
+            node->next_packet_id--;
+        }
+        return false;
+    }
+    if (opt->qos > 0) {
+        node->inflight_t[slot] = now_s();
+        node->inflight++;
+    }
+    st->sent++;
+    return true;
+}
+
+
+static void handle_packet(node_t *node, worker_t *w, uint8_t type, const uint8_t *body, size_t len) {
+    stats_t *st = &w->stats;
+    switch (type >> 4) {
+        case 2: // CONNACK
+            if (len >= 2 && body[1] == 0) {
+                node->online = true;
+                st->connects++;
+            } else {
+                st->connect_failures++;
+                close_node(node, st);
+                node->reconnect_at = now_s() + RECONNECT_S;
+            }
+            break;
+        case 4: // PUBACK
+            if (len >= 2) {
+                uint16_t packet_id = (body[0] << 8) | body[1];
+                int slot = packet_id % w->opt->window;
+                if (node->inflight_t[slot] != 0) {
+                    record_latency(st, (now_s() - node->inflight_t[slot]) * 1000);
+                    node->inflight_t[slot] = 0;
+                    node->inflight--;
+                    st->acked++;
+                }
+            }
+            break;
+        default: // PINGRESP and anything else
+            break;
+    }
+}
+
+
+// parse complete packets from the input buffer
+static void process_input(node_t *node, worker_t *w) {
+    size_t pos = 0;
+    while (node->fd >= 0 && node->in_len - pos >= 2) {
+        size_t len = 0;
+        int shift = 0;
+        size_t i = pos + 1;
+        bool complete = false;
+        while (i < node->in_len && i < pos + 5) {
+            len |= (size_t)(node->in[i] & 0x7F) << shift;
+            shift += 7;
+            if ((node->in[i++] & 0x80) == 0) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete || node->in_len - i < len) {
+            break;
+        }
+        handle_packet(node, w, node->in[pos], &node->in[i], len);
+        pos = i + len;
+    }
+    if (node->fd >= 0 && pos > 0) {
+        memmove(node->in, &node->in[pos], node->in_len - pos);
+        node->in_len -= pos;
+    }
+}
+
+
+
+//===============================
+//===== virtual node ============
+//===============================
+static void sensor_prefix(char *buf, size_t size, const options_t *opt, const node_t *node, int s) {
+    snprintf(buf, size, "%s/node%03d/L%d", opt->root, node->id, s + 1);
+}
+
+
+// random walk around a typical household phase
+static void next_values(node_t *node, int s, double dt_s) {
+    _current_values_t *v = &node->values[s];
+    if (v->voltage == 0) {
+        v->voltage = 230;
+        v->power = 200 + 2000 * rand_unit(&node->seed);
+        v->energy = 100000 * rand_unit(&node->seed);
+        v->frequency = 50;
+    }
+    v->voltage += (rand_unit(&node->seed) - 0.5) * 0.6;
+    if (v->voltage < 220 || v->voltage > 240) {
+        v->voltage = 230;
+    }
+    v->power += (rand_unit(&node->seed) - 0.5) * 100;
+    if (v->power < 0) {
+        v->power = 0;
+    }
+    v->pf = 0.8 + 0.2 * rand_unit(&node->seed);
+    v->current = v->power / (v->voltage * v->pf);
+    v->energy += v->power * dt_s / 3600;
+    v->frequency = 49.95 + 0.1 * rand_unit(&node->seed);
+}
+
+
+// values, last and energy_total (closed billing intervals are counted when they are queued)
+static int messages_per_sample(const options_t *opt) {
+    return (opt->mode == MODE_FULL ? PAYLOAD_FIELD_COUNT + 2 : opt->mode == MODE_VALUES ? PAYLOAD_FIELD_COUNT : 1);
+}
+
+
+// billing interval of energy_counter.c after a full read: closes with the first read after the
+// aligned boundary (not interpolated) and is queued (oldest dropped when full) until it is
+// published, the first interval after the start is incomplete
+static void count_energy(node_t *node, worker_t *w, int s) {
+    const int64_t interval_ms = w->opt->energy_interval_ms;
+    if (w->opt->mode != MODE_FULL || interval_ms <= 0) {
+        return;
+    }
+    const int64_t now = wall_ms();
+    const double total_wh = node->values[s].energy;
+    energy_interval_t *open = &node->interval[s];
+    if (open->end_ms != 0) {
+        open->wh += total_wh - open->total_wh;
+        open->total_wh = total_wh;
+    }
+    if (open->end_ms != 0 && now >= open->end_ms) {
+        if (node->pending_count[s] == ENERGY_PENDING_MAX) {
+            memmove(&node->pending[s][0], &node->pending[s][1], (ENERGY_PENDING_MAX - 1) * sizeof(energy_interval_t));
+            node->pending_count[s]--;
+            w->stats.energy_dropped++;
+        }
+        node->pending[s][node->pending_count[s]++] = *open;
+        w->stats.energy_intervals++;
+        w->stats.offered++;
+        open->end_ms = 0;
+        open->complete = true;
+    }
+    if (open->end_ms == 0) {
+        open->start_ms = now - now % interval_ms;
+        open->end_ms = open->start_ms + interval_ms;
+        open->wh = 0;
+        open->total_wh = total_wh;
+    }
+}
+
+
+// same topics and payloads as publish_energy() of the firmware
+static void publish_energy(node_t *node, worker_t *w, int s) {
+    if (w->opt->mode != MODE_FULL) {
+        return;
+    }
+    char prefix[PAYLOAD_TOPIC_MAX];
+    char topic[PAYLOAD_TOPIC_MAX];
+    char payload[PAYLOAD_ENERGY_MAX];
+    sensor_prefix(prefix, sizeof(prefix), w->opt, node, s);
+
+    common_payload_topic(topic, sizeof(topic), prefix, "energy_interval");
+    int sent = 0;
+    while (sent < node->pending_count[s]) {
+        int len = common_payload_energy_interval(payload, sizeof(payload), &node->pending[s][sent]);
+        if (!publish(node, w, topic, payload, len, false)) {
+            break; // kept for the next attempt
+        }
+        sent++;
+    }
+    node->pending_count[s] -= sent;
+    memmove(&node->pending[s][0], &node->pending[s][sent], node->pending_count[s] * sizeof(energy_interval_t));
+
+    common_payload_topic(topic, sizeof(topic), prefix, "energy_total");
+    int len = common_payload_energy_total(payload, sizeof(payload), (uint64_t)node->values[s].energy);
+    publish(node, w, topic, payload, len, true);
+}
+
+
+// same topics and payloads as publish_values() of the firmware
+static void publish_values(node_t *node, worker_t *w, int s) {
+    const options_t *opt = w->opt;
+    char prefix[PAYLOAD_TOPIC_MAX];
+    char topic[PAYLOAD_TOPIC_MAX];
+    char payload[PAYLOAD_LAST_MAX];
+    sensor_prefix(prefix, sizeof(prefix), opt, node, s);
+
+    if (opt->mode != MODE_LAST) {
+        for (payload_field_t f = 0; f < PAYLOAD_FIELD_COUNT; f++) {
+            common_payload_topic(topic, sizeof(topic), prefix, common_payload_field_name(f));
+            int len = common_payload_value(payload, sizeof(payload), f, &node->values[s]);
+            publish(node, w, topic, payload, len, false);
+        }
+    }
+    if (opt->mode != MODE_VALUES) {
+        common_payload_topic(topic, sizeof(topic), prefix, "last");
+        int len = common_payload_last(payload, sizeof(payload), &node->values[s], (int64_t)((now_s() - s_start) * 1000));
+        publish(node, w, topic, payload, len, true);
+    }
+}
+
+
+// reconnect of the firmware: availability and latest values first, then the backlog
+static void on_online(node_t *node, worker_t *w, double now) {
+    char prefix[PAYLOAD_TOPIC_MAX];
+    char topic[PAYLOAD_TOPIC_MAX];
+    for (int s = 0; s < w->opt->sensors; s++) {
+        sensor_prefix(prefix, sizeof(prefix), w->opt, node, s);
+        common_payload_topic(topic, sizeof(topic), prefix, "availability");
+        publish(node, w, topic, "online", 6, true);
+        w->stats.offered++;
+        if (node->values[s].voltage != 0) {
+            publish_values(node, w, s);
+            publish_energy(node, w, s);
+            w->stats.offered += messages_per_sample(w->opt);
+        }
+        if (node->deferred[s] > 0) {
+            node->backlog_bytes[s] = node->deferred[s] * HISTORY_SAMPLE_BYTES;
+            node->backlog_left[s] = (node->backlog_bytes[s] + HISTORY_BLOCK_SIZE - 1) / HISTORY_BLOCK_SIZE + 1;
+            node->deferred[s] = 0;
+        }
+    }
+    node->next_backlog = now + BACKLOG_INTERVAL_S;
+}
+
+
+static void send_backlog(node_t *node, worker_t *w, double now) {
+    if (now < node->next_backlog) {
+        return;
+    }
+    for (int s = 0; s < w->opt->sensors; s++) {
+        if (node->backlog_left[s] == 0) {
+            continue;
+        }
+        uint8_t msg[HISTORY_MSG_HEADER_SIZE + HISTORY_BLOCK_SIZE] = { 1 };
+        int data = node->backlog_bytes[s] < HISTORY_BLOCK_SIZE ? node->backlog_bytes[s] : HISTORY_BLOCK_SIZE;
+        char prefix[PAYLOAD_TOPIC_MAX];
+        char topic[PAYLOAD_TOPIC_MAX];
+        sensor_prefix(prefix, sizeof(prefix), w->opt, node, s);
+        common_payload_topic(topic, sizeof(topic), prefix, "history/backlog");
+        w->stats.offered++;
+        if (publish(node, w, topic, msg, HISTORY_MSG_HEADER_SIZE + data, false)) {
+            node->backlog_bytes[s] -= data;
+            node->backlog_left[s]--;
+            w->stats.backlog_msgs++;
+        }
+        break;
+    }
+    node->next_backlog = now + BACKLOG_INTERVAL_S;
+}
+
+
+static bool outage_now(const options_t *opt, const node_t *node, double t) {
+    if (opt->outage_period_s <= 0) {
+        return false;
+    }
+    double pos = fmod(t + node->phase_s, opt->outage_period_s);
+    return pos < opt->outage_len_s;
+}
+
+
+static void step_node(node_t *node, worker_t *w, double now) {
+    const options_t *opt = w->opt;
+    stats_t *st = &w->stats;
+    double t = now - s_start;
+
+    // simulated outage: connection dropped without DISCONNECT, like a WiFi loss
+    bool outage = outage_now(opt, node, t);
+    if (outage && !node->in_outage) {
+        close_node(node, st);
+    }
+    node->in_outage = outage;
+
+    if (node->fd < 0 && !outage && now >= node->reconnect_at) {
+        node->fd = connect_to(opt->host, opt->port);
+        if (node->fd < 0) {
+            st->connect_failures++;
+            node->reconnect_at = now + RECONNECT_S;
+        } else {
+            send_connect(node);
+        }
+    }
+
+    for (int s = 0; s < opt->sensors; s++) {
+        if (now >= node->next_due[s]) {
+            next_values(node, s, opt->interval_ms / 1000.0);
+            count_energy(node, w, s);
+            st->offered += messages_per_sample(opt);
+            if (node->online) {
+                publish_values(node, w, s);
+                publish_energy(node, w, s);
+            } else {
+                node->deferred[s]++;
+                st->deferred++;
+            }
+            node->next_due[s] += opt->interval_ms / 1000.0;
+        }
+        if (opt->fast_ms > 0 && now >= node->next_fast[s]) {
+            st->offered++;
+            if (node->online) {
+                char prefix[PAYLOAD_TOPIC_MAX];
+                char topic[PAYLOAD_TOPIC_MAX];
+                char payload[PAYLOAD_VALUE_MAX];
+                sensor_prefix(prefix, sizeof(prefix), opt, node, s);
+                common_payload_topic(topic, sizeof(topic), prefix, common_payload_field_name(PAYLOAD_FIELD_POWER));
+                int len = common_payload_value(payload, sizeof(payload), PAYLOAD_FIELD_POWER, &node->values[s]);
+                publish(node, w, topic, payload, len, false);
+            }
+            node->next_fast[s] += opt->fast_ms / 1000.0;
+        }
+    }
+    if (node->online) {
+        send_backlog(node, w, now);
+    }
+
+    if (node->online && now - node->last_tx > KEEPALIVE_S / 2) {
+        queue_packet(node, 0xC0, NULL, 0);
+    }
+}
+
+
+static void flush_output(node_t *node, stats_t *st) {
+    if (node->fd < 0 || node->out_len == 0) {
+        return;
+    }
+    ssize_t n = send(node->fd, node->out, node->out_len, MSG_NOSIGNAL);
+    if (n > 0) {
+        memmove(node->out, &node->out[n], node->out_len - n);
+        node->out_len -= n;
+        node->last_tx = now_s();
+    } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        st->connections_lost++;
+        close_node(node, st);
+        node->reconnect_at = now_s() + RECONNECT_S;
+    }
+}
+
+
+static void read_input(node_t *node, worker_t *w, double now) {
+    ssize_t n = recv(node->fd, &node->in[node->in_len], IN_BUF_SIZE - node->in_len, 0);
+    if (n > 0) {
+        node->in_len += n;
+        bool was_online = node->online;
+        process_input(node, w);
+        if (!was_online && node->online) {
+            on_online(node, w, now);
+        }
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        w->stats.connections_lost++;
+        close_node(node, &w->stats);
+        node->reconnect_at = now + RECONNECT_S;
+    }
+}
+
+
+static void *worker_main(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    struct pollfd *fds = calloc(w->count, sizeof(struct pollfd));
+    int *index = calloc(w->count, sizeof(int));
+
+    while (!s_stop) {
+        double now = now_s();
+        pthread_mutex_lock(&w->lock);
+        for (int i = 0; i < w->count; i++) {
+            step_node(&w->nodes[i], w, now);
+            flush_output(&w->nodes[i], &w->stats);
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        int nfds = 0;
+        for (int i = 0; i < w->count; i++) {
+            if (w->nodes[i].fd >= 0) {
+                fds[nfds].fd = w->nodes[i].fd;
+                fds[nfds].events = POLLIN | (w->nodes[i].out_len > 0 ? POLLOUT : 0);
+                index[nfds++] = i;
+            }
+        }
+        if (poll(fds, nfds, 5) <= 0) {
+            continue;
+        }
+        now = now_s();
+        pthread_mutex_lock(&w->lock);
+        for (int k = 0; k < nfds; k++) {
+            node_t *node = &w->nodes[index[k]];
+            if (node->fd != fds[k].fd) {
+                continue;
+            }
+            if (fds[k].revents & (POLLIN | POLLERR | POLLHUP)) {
+                read_input(node, w, now);
+            }
+            if (fds[k].revents & POLLOUT) {
+                flush_output(node, &w->stats);
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    free(fds);
+    free(index);
+    return NULL;
+}
+
+
+// wait for the outstanding acks, then disconnect cleanly
+static void drain(worker_t *w) {
+    double end = now_s() + DRAIN_S;
+    while (now_s() < end) {
+        int pending = 0;
+        for (int i = 0; i < w->count; i++) {
+            node_t *node = &w->nodes[i];
+            if (node->fd < 0) {
+                continue;
+            }
+            pending += node->inflight;
+            flush_output(node, &w->stats);
+            if (node->fd >= 0) {
+                read_input(node, w, now_s());
+            }
+        }
+        if (pending == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    for (int i = 0; i < w->count; i++) {
+        node_t *node = &w->nodes[i];
+        if (node->fd >= 0) {
+            queue_packet(node, 0xE0, NULL, 0);
+            flush_output(node, &w->stats);
+        }
+    }
+}
+
+
+
+//===============================
+//===== report ==================
+//===============================
+static int compare_float(const void *a, const void *b) {
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+
+static void sum_stats(worker_t *workers, int count, stats_t *total) {
+    memset(total, 0, sizeof(*total));
+    for (int k = 0; k < count; k++) {
+        pthread_mutex_lock(&workers[k].lock);
+        const stats_t *st = &workers[k].stats;
+        total->offered += st->offered;
+        total->sent += st->sent;
+        total->acked += st->acked;
+        total->dropped_full += st->dropped_full;
+        total->unacked_disconnect += st->unacked_disconnect;
+        total->deferred += st->deferred;
+        total->backlog_msgs += st->backlog_msgs;
+        total->energy_intervals += st->energy_intervals;
+        total->energy_dropped += st->energy_dropped;
+        total->connects += st->connects;
+        total->connect_failures += st->connect_failures;
+        total->connections_lost += st->connections_lost;
+        total->latency_count += st->latency_count;
+        pthread_mutex_unlock(&workers[k].lock);
+    }
+}
+
+
+static double percentile(const float *sorted, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+
+static bool parse_options(int argc, char **argv, options_t *opt) {
+    *opt = (options_t){
+        .host = "127.0.0.1", .port = "1883", .nodes = 100, .sensors = 3, .interval_ms = 30000, .energy_interval_ms = 900000,
+        .mode = MODE_FULL, .qos = 1, .duration_s = 60, .root = "Sensordaten/loadtest", .workers = 4, .window = 100,
+    };
+    int c;
+    while ((c = getopt(argc, argv, "p:n:s:i:f:m:e:q:t:o:r:w:W:")) != -1) {
+        switch (c) {
+            case 'p': opt->port = optarg; break;
+            case 'n': opt->nodes = atoi(optarg); break;
+            case 's': opt->sensors = atoi(optarg); break;
+            case 'i': opt->interval_ms = atoi(optarg); break;
+            case 'f': opt->fast_ms = atoi(optarg); break;
+            case 'm':
+                if (strcmp(optarg, "full") == 0) {
+                    opt->mode = MODE_FULL;
+                } else if (strcmp(optarg, "values") == 0) {
+                    opt->mode = MODE_VALUES;
+                } else if (strcmp(optarg, "last") == 0) {
+                    opt->mode = MODE_LAST;
+                } else {
+                    return false;
+                }
+                break;
+            case 'e': opt->energy_interval_ms = atoi(optarg); break;
+            case 'q': opt->qos = atoi(optarg); break;
+            case 't': opt->duration_s = atoi(optarg); break;
+            case 'o':
+                if (sscanf(optarg, "%d:%d", &opt->outage_period_s, &opt->outage_len_s) != 2
+                    || opt->outage_len_s >= opt->outage_period_s) {
+                    return false;
+                }
+                break;
+            case 'r': opt->root = optarg; break;
+            case 'w': opt->workers = atoi(optarg); break;
+            case 'W': opt->window = atoi(optarg); break;
+            default: return false;
+        }
+    }
+    if (optind < argc) {
+        opt->host = argv[optind];
+    }
+    return opt->nodes > 0 && opt->sensors > 0 && opt->sensors <= MAX_SENSORS && opt->interval_ms > 0
+        && opt->fast_ms >= 0 && opt->energy_interval_ms >= 0 && (opt->qos == 0 || opt->qos == 1) && opt->duration_s > 0
+        && opt->workers > 0 && opt->window > 0 && opt->window <= MAX_WINDOW;
+}
+
+
+int main(int argc, char **argv) {
+    options_t opt;
+    if (!parse_options(argc, argv, &opt)) {
+        usage();
+        return 2;
+    }
+    if (opt.workers > opt.nodes) {
+        opt.workers = opt.nodes;
+    }
+
+    double offered_rate = opt.nodes * opt.sensors * (messages_per_sample(&opt) * 1000.0 / opt.interval_ms
+                                                     + (opt.fast_ms > 0 ? 1000.0 / opt.fast_ms : 0)
+                                                     + (opt.mode == MODE_FULL && opt.energy_interval_ms > 0 ? 1000.0 / opt.energy_interval_ms : 0));
+    printf("fleet-load: %d nodes x %d sensors against %s:%s, interval %d ms, fast lane %d ms, qos %d, offered %.1f msg/s\n",
+           opt.nodes, opt.sensors, opt.host, opt.port, opt.interval_ms, opt.fast_ms, opt.qos, offered_rate);
+    if (opt.outage_period_s > 0) {
+        printf("outages: %d s every %d s per node\n", opt.outage_len_s, opt.outage_period_s);
+    }
+
+    node_t *nodes = calloc(opt.nodes, sizeof(node_t));
+    worker_t *workers = calloc(opt.workers, sizeof(worker_t));
+    if (nodes == NULL || workers == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    s_start = now_s();
+    for (int i = 0; i < opt.nodes; i++) {
+        node_t *node = &nodes[i];
+        node->id = i + 1;
+        node->fd = -1;
+        node->seed = 12345u + i;
+        node->phase_s = rand_unit(&node->seed) * (opt.outage_period_s > 0 ? opt.outage_period_s : 1);
+        // spread the schedule like nodes booted at different times
+        for (int s = 0; s < opt.sensors; s++) {
+            node->next_due[s] = s_start + rand_unit(&node->seed) * opt.interval_ms / 1000.0;
+            node->next_fast[s] = s_start + rand_unit(&node->seed) * opt.fast_ms / 1000.0;
+        }
+    }
+    int per_worker = (opt.nodes + opt.workers - 1) / opt.workers;
+    for (int k = 0; k < opt.workers; k++) {
+        workers[k].opt = &opt;
+        workers[k].nodes = &nodes[k * per_worker];
+        workers[k].count = k * per_worker + per_worker <= opt.nodes ? per_worker : opt.nodes - k * per_worker;
+        pthread_mutex_init(&workers[k].lock, NULL);
+    }
+    pthread_t threads[opt.workers];
+    for (int k = 0; k < opt.workers; k++) {
+        pthread_create(&threads[k], NULL, worker_main, &workers[k]);
+    }
+
+    // progress every 5 s
+    stats_t total, prev = { 0 };
+    double last = s_start;
+    while (now_s() - s_start < opt.duration_s) {
+        usleep(100000);
+        double now = now_s();
+        if (now - last >= 5 || now - s_start >= opt.duration_s) {
+            sum_stats(workers, opt.workers, &total);
+            printf("%6.0f s  sent %8.1f msg/s  acked %8.1f msg/s  drops %ld  deferred %ld  connects %ld\n",
+                   now - s_start, (total.sent - prev.sent) / (now - last), (total.acked - prev.acked) / (now - last),
+                   total.dropped_full, total.deferred, total.connects);
+            prev = total;
+            last = now;
+        }
+    }
+    s_stop = true;
+    for (int k = 0; k < opt.workers; k++) {
+        pthread_join(threads[k], NULL);
+    }
+    double elapsed = now_s() - s_start;
+    for (int k = 0; k < opt.workers; k++) {
+        drain(&workers[k]);
+    }
+
+    sum_stats(workers, opt.workers, &total);
+    long unacked = 0;
+    for (int i = 0; i < opt.nodes; i++) {
+        unacked += nodes[i].inflight;
+    }
+    float *latency = malloc((total.latency_count + 1) * sizeof(float));
+    size_t n = 0;
+    for (int k = 0; k < opt.workers; k++) {
+        memcpy(&latency[n], workers[k].stats.latency_ms, workers[k].stats.latency_count * sizeof(float));
+        n += workers[k].stats.latency_count;
+    }
+    qsort(latency, n, sizeof(float), compare_float);
+
+    printf("\nresult after %.1f s:\n", elapsed);
+    printf("  offered   %10ld msgs  %8.1f msg/s (planned %.1f)\n", total.offered, total.offered / elapsed, offered_rate);
+    printf("  sent      %10ld msgs  %8.1f msg/s\n", total.sent, total.sent / elapsed);
+    if (opt.qos > 0) {
+        printf("  acked     %10ld msgs  %8.1f msg/s\n", total.acked, total.acked / elapsed);
+        printf("  latency   p50 %.2f ms  p90 %.2f ms  p99 %.2f ms  p99.9 %.2f ms  max %.2f ms\n",
+               percentile(latency, n, 0.5), percentile(latency, n, 0.9), percentile(latency, n, 0.99),
+               percentile(latency, n, 0.999), n > 0 ? latency[n - 1] : 0);
+    }
+    printf("  drops     %ld window/buffer full, %ld never acked, %ld unacked at disconnect\n",
+           total.dropped_full, unacked, total.unacked_disconnect);
+    printf("  outages   %ld samples deferred, %ld backlog messages sent\n", total.deferred, total.backlog_msgs);
+    printf("  energy    %ld billing intervals closed, %ld dropped (queue full during an outage)\n",
+           total.energy_intervals, total.energy_dropped);
+    printf("  connects  %ld ok, %ld failed, %ld connections lost\n", total.connects, total.connect_failures, total.connections_lost);
+
+    free(latency);
+    for (int k = 0; k < opt.workers; k++) {
+        free(workers[k].stats.latency_ms);
+    }
+    free(workers);
+    free(nodes);
+    return 0;
+}
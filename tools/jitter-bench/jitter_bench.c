@@ -0,0 +1,356 @@
+// Benchmark of the poll start jitter of a node under network load.
+// Reads the histogram powermon_poll_start_lateness_seconds from GET /metrics of the node, first
+// while idle, then while the node is flooded with http requests and udp datagrams, and compares
+// both phases (only the reads within each phase are counted).
+//
+// usage: jitter-bench [options] HOST
+//
+// options:
+//   -p PORT       http port of the node (default 80)
+//   -t SECONDS    duration of each phase (default 120), long enough for several reads per sensor
+//   -c CONNS      parallel http clients requesting /metrics in the load phase (default 4)
+//   -u PPS        udp datagrams per second (1400 bytes, discard port 9) in the load phase (default 1000, 0 = off)
+//   -s            skip the idle phase
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define METRIC "powermon_poll_start_lateness_seconds"
+#define MAX_BUCKETS 16
+#define RESPONSE_MAX (256 * 1024)
+#define UDP_PAYLOAD 1400
+
+
+typedef struct {
+    int count;                      // number of buckets without +Inf
+    double le[MAX_BUCKETS];
+    double cumulative[MAX_BUCKETS];
+    double total;                   // _count
+    double sum;                     // _sum
+    double max;                     // ..._max_seconds (since boot)
+} histogram_t;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int udp_pps;
+    volatile bool stop;
+    pthread_mutex_t lock;
+    long requests;
+    long failed;
+    long datagrams;
+} bench_ctx_t;
+
+
+
+//===============================
+//===== helpers ===============
+//===============================
+static void usage(void) {
+    fprintf(stderr,
+        "usage: jitter-bench [-p PORT] [-t SECONDS] [-c CONNS] [-u PPS] [-s] HOST\n"
+        "  -p PORT       http port of the node (default 80)\n"
+        "  -t SECONDS    duration of each phase (default 120)\n"
+        "  -c CONNS      parallel http clients in the load phase (default 4)\n"
+        "  -u PPS        udp datagrams per second in the load phase (default 1000, 0 = off)\n"
+        "  -s            skip the idle phase\n");
+}
+
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int connect_to(const char *host, const char *port, int type) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = type };
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0) {
+        struct timeval tv = { .tv_sec = 5 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+
+// decode a chunked body in place, returns new length
+static size_t dechunk(char *body, size_t len) {
+    size_t in = 0, out = 0;
+    while (in < len) {
+        char *end;
+        unsigned long size = strtoul(body + in, &end, 16);
+        char *line_end = strstr(body + in, "\r\n");
+        if (line_end == NULL || size == 0) {
+            break;
+        }
+        in = (line_end - body) + 2;
+        if (in + size > len) {
+            size = len - in;
+        }
+        memmove(body + out, body + in, size);
+        out += size;
+        in += size + 2;
+    }
+    body[out] = '\0';
+    return out;
+}
+
+
+// GET path, body is stored in buf (zero terminated), returns body length or -1
+static long http_get(const char *host, const char *port, const char *path, char *buf, size_t size) {
+    int fd = connect_to(host, port, SOCK_STREAM);
+    if (fd < 0) {
+        return -1;
+    }
+    char request[256];
+    int n = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", path, host);
+    if (send(fd, request, n, 0) != n) {
+        close(fd);
+        return -1;
+    }
+
+    size_t len = 0;
+    ssize_t r;
+    while (len < size - 1 && (r = recv(fd, buf + len, size - 1 - len, 0)) > 0) {
+        len += r;
+    }
+    close(fd);
+    buf[len] = '\0';
+
+    char *body = strstr(buf, "\r\n\r\n");
+    if (strncmp(buf, "HTTP/1.1 200", 12) != 0 || body == NULL) {
+        return -1;
+    }
+    *body = '\0';
+    bool chunked = strstr(buf, "chunked") != NULL;
+    body += 4;
+    len -= body - buf;
+    memmove(buf, body, len + 1);
+    return chunked ? (long)dechunk(buf, len) : (long)len;
+}
+
+
+static bool scrape(const bench_ctx_t *ctx, histogram_t *h) {
+    static char buf[RESPONSE_MAX];
+    for (int attempt = 0; attempt < 5; attempt++) {
+        if (http_get(ctx->host, ctx->port, "/metrics", buf, sizeof(buf)) < 0) {
+            sleep(1);
+            continue;
+        }
+        memset(h, 0, sizeof(*h));
+        for (char *line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+            double le, value;
+            if (sscanf(line, METRIC "_bucket{le=\"%lf\"} %lf", &le, &value) == 2 && h->count < MAX_BUCKETS) {
+                h->le[h->count] = le;
+                h->cumulative[h->count] = value;
+                h->count++;
+            } else if (sscanf(line, METRIC "_count %lf", &value) == 1) {
+                h->total = value;
+            } else if (sscanf(line, METRIC "_sum %lf", &value) == 1) {
+                h->sum = value;
+            } else if (sscanf(line, "powermon_poll_start_lateness_max_seconds %lf", &value) == 1) {
+                h->max = value;
+            }
+        }
+        if (h->count == 0) {
+            fprintf(stderr, "no %s histogram in /metrics, firmware too old?\n", METRIC);
+            return false;
+        }
+        return true;
+    }
+    fprintf(stderr, "failed to read http://%s:%s/metrics\n", ctx->host, ctx->port);
+    return false;
+}
+
+
+// upper bound of the bucket containing quantile q of the reads between a and b, -1 above the last bound
+static double quantile(const histogram_t *a, const histogram_t *b, double q) {
+    double total = b->total - a->total;
+    for (int i = 0; i < b->count; i++) {
+        if (b->cumulative[i] - a->cumulative[i] >= q * total) {
+            return b->le[i];
+        }
+    }
+    return -1;
+}
+
+
+static void print_quantile(const char *name, double bound, const histogram_t *h) {
+    if (bound < 0) {
+        printf("  %-6s > %.0f ms\n", name, h->le[h->count - 1] * 1e3);
+    } else {
+        printf("  %-6s <= %.0f ms\n", name, bound * 1e3);
+    }
+}
+
+
+static void report(const char *phase, const histogram_t *a, const histogram_t *b, double seconds) {
+    double reads = b->total - a->total;
+    printf("%s: %.0f reads in %.0f s\n", phase, reads, seconds);
+    if (reads <= 0) {
+        printf("  no reads, increase -t\n");
+        return;
+    }
+    printf("  mean   %.1f ms\n", (b->sum - a->sum) / reads * 1e3);
+    print_quantile("p50", quantile(a, b, 0.5), b);
+    print_quantile("p90", quantile(a, b, 0.9), b);
+    print_quantile("p99", quantile(a, b, 0.99), b);
+    print_quantile("max", quantile(a, b, 1.0), b);
+    printf("  histogram (reads per bucket):");
+    double prev = 0;
+    for (int i = 0; i < b->count; i++) {
+        double in_bucket = (b->cumulative[i] - a->cumulative[i]) - prev;
+        prev += in_bucket;
+        if (in_bucket > 0) {
+            printf(" <=%gms:%.0f", b->le[i] * 1e3, in_bucket);
+        }
+    }
+    if (reads - prev > 0) {
+        printf(" above:%.0f", reads - prev);
+    }
+    printf("\n");
+}
+
+
+
+//===============================
+//===== load generators =======
+//===============================
+static void *http_load(void *arg) {
+    bench_ctx_t *ctx = arg;
+    char *buf = malloc(RESPONSE_MAX);
+    while (!ctx->stop) {
+        bool ok = http_get(ctx->host, ctx->port, "/metrics", buf, RESPONSE_MAX) >= 0;
+        pthread_mutex_lock(&ctx->lock);
+        if (ok) {
+            ctx->requests++;
+        } else {
+            ctx->failed++;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+        if (!ok) {
+            usleep(100000); // server busy (max sockets), retry shortly
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+
+static void *udp_load(void *arg) {
+    bench_ctx_t *ctx = arg;
+    int fd = connect_to(ctx->host, "9", SOCK_DGRAM);
+    if (fd < 0) {
+        return NULL;
+    }
+    char payload[UDP_PAYLOAD];
+    memset(payload, 0x55, sizeof(payload));
+    double start = now_s();
+    long sent = 0;
+    while (!ctx->stop) {
+        // send in bursts of 10 ms worth of datagrams
+        long due = (long)((now_s() - start) * ctx->udp_pps);
+        while (sent < due) {
+            send(fd, payload, sizeof(payload), 0);
+            sent++;
+        }
+        usleep(10000);
+    }
+    close(fd);
+    pthread_mutex_lock(&ctx->lock);
+    ctx->datagrams = sent;
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+
+
+//===============================
+//===== main ==================
+//===============================
+int main(int argc, char **argv) {
+    bench_ctx_t ctx = { .port = "80", .udp_pps = 1000, .lock = PTHREAD_MUTEX_INITIALIZER };
+    int seconds = 120;
+    int conns = 4;
+    bool skip_idle = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:c:u:sh")) != -1) {
+        switch (opt) {
+            case 'p': ctx.port = optarg; break;
+            case 't': seconds = atoi(optarg); break;
+            case 'c': conns = atoi(optarg); break;
+            case 'u': ctx.udp_pps = atoi(optarg); break;
+            case 's': skip_idle = true; break;
+            default: usage(); return 2;
+        }
+    }
+    if (optind != argc - 1 || seconds <= 0 || conns < 0 || conns > 64 || ctx.udp_pps < 0) {
+        usage();
+        return 2;
+    }
+    ctx.host = argv[optind];
+
+    histogram_t a, b;
+    if (!skip_idle) {
+        printf("idle phase, %d s...\n", seconds);
+        if (!scrape(&ctx, &a)) {
+            return 1;
+        }
+        sleep(seconds);
+        if (!scrape(&ctx, &b)) {
+            return 1;
+        }
+        report("idle", &a, &b, seconds);
+    }
+
+    printf("load phase, %d s: %d http clients, %d udp datagrams/s...\n", seconds, conns, ctx.udp_pps);
+    if (!scrape(&ctx, &a)) {
+        return 1;
+    }
+    pthread_t threads[65];
+    int started = 0;
+    for (int c = 0; c < conns; c++) {
+        pthread_create(&threads[started++], NULL, http_load, &ctx);
+    }
+    if (ctx.udp_pps > 0) {
+        pthread_create(&threads[started++], NULL, udp_load, &ctx);
+    }
+    double start = now_s();
+    sleep(seconds);
+    bool ok = scrape(&ctx, &b);
+    double elapsed = now_s() - start;
+    ctx.stop = true;
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (!ok) {
+        return 1;
+    }
+    report("load", &a, &b, elapsed);
+    printf("  load: %ld http requests (%.1f/s), %ld failed, %ld udp datagrams\n",
+           ctx.requests, ctx.requests / elapsed, ctx.failed, ctx.datagrams);
+    printf("max lateness since boot: %.1f ms\n", b.max * 1e3);
+    return 0;
+}
@@ -0,0 +1,419 @@
+// Soak test of the heap use of the portable firmware code: the PZEM driver (read plans of the
+// device profile, frames, CRC, decoding), the per-sensor circuit breaker, the adaptive interval,
+// the history encoder, the energy counter with billing intervals and the MQTT payloads run for a
+// long simulated time against emulated modules on an in-memory bus, with timeouts, corrupted
+// frames and dead modules. The sample cache is not part of it (FreeRTOS locks and the bus driver).
+// After a warm-up the heap in use must stay constant and the tested code must not allocate at all
+// (malloc/calloc/realloc of these objects are wrapped and counted). Exit code 1 otherwise.
+//
+// usage: memory-soak [-n READS] [-s SEED] [-v]
+//   -n READS      simulated sensor reads (default 2000000)
+//   -s SEED       seed of the fault injection (default 1)
+//   -v            print statistics of the simulation
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include "pzem004tv3.h"
+#include "pzem_profile.h"
+#include "circuit_breaker.h"
+#include "adaptive_poll.h"
+#include "history_codec.h"
+#include "energy_counter.h"
+#include "mqtt_payload.h"
+
+#define SENSORS             4
+#define WARMUP_READS        10000
+#define INTERVAL_MS         30000
+#define TIMEOUT_PERMILLE    20      // no reply
+#define CORRUPT_PERMILLE    10      // reply with bad CRC
+#define DEAD_PERMILLE       1       // chance per request that a module dies for a while
+#define DEAD_MS             600000  // time a dead module stays silent
+#define HISTORY_BLOCKS      8       // per sensor
+#define HISTORY_DUMP_READS  500     // a history request is answered this often
+#define ENERGY_INTERVAL_MS  (15 * 60 * 1000)
+
+
+//===============================
+//===== allocation counting ===
+//===============================
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static unsigned long s_allocations = 0;
+
+void *__wrap_malloc(size_t size) {
+    s_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    s_allocations++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    s_allocations++;
+    return __real_realloc(ptr, size);
+}
+
+
+static size_t heap_in_use(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+
+
+//===============================
+//===== emulated bus ==========
+//===============================
+typedef struct {
+    uint8_t addr;
+    uint16_t input[PZ_REGISTER_COUNT];
+    uint16_t alarm_threshold;
+    int64_t dead_until_ms;          // module does not answer before
+} emu_module_t;
+
+typedef struct {
+    emu_module_t modules[SENSORS];
+    uint8_t reply[32];
+    uint16_t reply_len;
+    uint16_t reply_pos;
+    uint32_t random;
+    int64_t now_ms;                 // simulated time
+    unsigned long timeouts;
+    unsigned long corrupted;
+} emu_bus_t;
+
+
+static uint32_t next_random(emu_bus_t *bus) {
+    bus->random = bus->random * 1664525u + 1013904223u;
+    return bus->random >> 8;
+}
+
+
+static void emu_answer(emu_bus_t *bus, emu_module_t *m, const uint8_t *req) {
+    uint8_t cmd = req[1];
+    uint16_t reg = req[2] << 8 | req[3];
+    uint16_t val = req[4] << 8 | req[5];
+    uint8_t *r = bus->reply;
+
+    if (cmd == 0x04 || cmd == 0x03) {
+        if (val == 0 || val > PZ_REGISTER_COUNT) {
+            return;
+        }
+        r[0] = m->addr;
+        r[1] = cmd;
+        r[2] = 2 * val;
+        for (uint16_t i = 0; i < val; i++) {
+            uint16_t v = cmd == 0x04 ? m->input[(reg + i) % PZ_REGISTER_COUNT] : (reg + i == 1 ? m->alarm_threshold : m->addr);
+            r[3 + 2 * i] = v >> 8;
+            r[4 + 2 * i] = v & 0xFF;
+        }
+        bus->reply_len = 5 + 2 * val;
+    } else if (cmd == 0x06) {
+        if (reg == 1) {
+            m->alarm_threshold = val;
+        }
+        memcpy(r, req, 8);
+        bus->reply_len = 8;
+    } else {
+        return;
+    }
+    PzemSetCRC(r, bus->reply_len);
+}
+
+
+static int emu_write(const pzem_setup_t *setup, const uint8_t *data, uint16_t len) {
+    emu_bus_t *bus = setup->transport_ctx;
+    bus->reply_len = 0;
+    bus->reply_pos = 0;
+    if (len != 8 || !PzemCheckCRC(data, len)) {
+        return len;
+    }
+
+    for (int i = 0; i < SENSORS; i++) {
+        emu_module_t *m = &bus->modules[i];
+        if (m->addr != data[0]) {
+            continue;
+        }
+        if (bus->now_ms < m->dead_until_ms) {
+            bus->timeouts++;
+        } else if (next_random(bus) % 1000 < DEAD_PERMILLE) {
+            m->dead_until_ms = bus->now_ms + DEAD_MS;
+            bus->timeouts++;
+        } else if (next_random(bus) % 1000 < TIMEOUT_PERMILLE) {
+            bus->timeouts++;
+        } else {
+            emu_answer(bus, m, data);
+            if (bus->reply_len > 0 && next_random(bus) % 1000 < CORRUPT_PERMILLE) {
+                bus->reply[next_random(bus) % bus->reply_len] ^= 0x5A;
+                bus->corrupted++;
+            }
+        }
+    }
+    return len;
+}
+
+
+static int emu_read(const pzem_setup_t *setup, uint8_t *data, uint16_t len, uint32_t timeout_ms) {
+    (void)timeout_ms;
+    emu_bus_t *bus = setup->transport_ctx;
+    uint16_t n = bus->reply_len - bus->reply_pos;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(data, bus->reply + bus->reply_pos, n);
+    bus->reply_pos += n;
+    return n;
+}
+
+
+static void emu_flush_input(const pzem_setup_t *setup) {
+    emu_bus_t *bus = setup->transport_ctx;
+    bus->reply_len = 0;
+    bus->reply_pos = 0;
+}
+
+
+static void emu_delay_ms(const pzem_setup_t *setup, uint32_t ms) {
+    (void)setup;
+    (void)ms; // simulated time
+}
+
+
+static const pzem_transport_t emu_transport = {
+    .write       = emu_write,
+    .read        = emu_read,
+    .flush_input = emu_flush_input,
+    .delay_ms    = emu_delay_ms,
+};
+
+
+// slowly varying load with occasional steps, so the adaptive interval sees change points
+static void emu_update_values(emu_bus_t *bus, int64_t now_ms) {
+    for (int i = 0; i < SENSORS; i++) {
+        emu_module_t *m = &bus->modules[i];
+        uint32_t power = 500 + (uint32_t)(now_ms / 1000 + i * 977) % 3000;
+        if (next_random(bus) % 100 < 5) {
+            power += 20000; // step of 2000 W (0.1 W units)
+        }
+        m->input[0] = 2300 + next_random(bus) % 50;                 // voltage 0.1 V
+        m->input[1] = power * 10 / 230;                               // current 1 mA (low word)
+        m->input[3] = power & 0xFFFF;                                 // power 0.1 W (low word)
+        m->input[4] = power >> 16;
+        uint32_t energy = (uint32_t)(now_ms / 3600) + i * 1000;         // energy 1 Wh (1 kW average)
+        m->input[5] = energy & 0xFFFF;
+        m->input[6] = energy >> 16;
+        m->input[7] = 500;                                            // frequency 0.1 Hz
+        m->input[8] = 95;                                             // pf 0.01
+    }
+}
+
+
+
+//===============================
+//===== consumers =============
+//===============================
+// what the publish task does with a full read: history, energy counter and the MQTT payloads,
+// returns the payload bytes
+static unsigned long publish_sample(history_ring_t *history, energy_counter_t *energy, const pzem_profile_t *profile,
+                                    const uint16_t *regs, const _current_values_t *values, int64_t now_ms,
+                                    unsigned long *intervals) {
+    history_sample_t sample = { .timestamp_ms = now_ms };
+    sample.values[HISTORY_FIELD_VOLTAGE] = PzemFieldRaw(profile, regs, PZ_FIELD_VOLTAGE);
+    sample.values[HISTORY_FIELD_CURRENT] = PzemFieldRaw(profile, regs, PZ_FIELD_CURRENT);
+    sample.values[HISTORY_FIELD_POWER] = PzemFieldRaw(profile, regs, PZ_FIELD_POWER);
+    sample.values[HISTORY_FIELD_ENERGY] = PzemFieldRaw(profile, regs, PZ_FIELD_ENERGY);
+    sample.values[HISTORY_FIELD_FREQUENCY] = PzemFieldRaw(profile, regs, PZ_FIELD_FREQUENCY);
+    sample.values[HISTORY_FIELD_PF] = PzemFieldRaw(profile, regs, PZ_FIELD_PF);
+    common_history_ring_append(history, &sample);
+
+    char topic[PAYLOAD_TOPIC_MAX];
+    char payload[PAYLOAD_ENERGY_MAX];
+    unsigned long bytes = 0;
+    for (payload_field_t f = 0; f < PAYLOAD_FIELD_COUNT; f++) {
+        bytes += common_payload_topic(topic, sizeof(topic), "Sensordaten/soak", common_payload_field_name(f));
+        bytes += common_payload_value(payload, sizeof(payload), f, values);
+    }
+    bytes += common_payload_last(payload, sizeof(payload), values, now_ms);
+
+    common_energy_update(energy, PzemFieldRaw(profile, regs, PZ_FIELD_ENERGY), now_ms, true);
+    energy_interval_t interval;
+    while (common_energy_next_interval(energy, &interval)) {
+        bytes += common_payload_energy_interval(payload, sizeof(payload), &interval);
+        (*intervals)++;
+    }
+    bytes += common_payload_energy_total(payload, sizeof(payload), energy->total_wh);
+    return bytes;
+}
+
+
+// answer a history request with all blocks, returns the messages
+static unsigned long dump_history(const history_ring_t *history, int64_t now_ms) {
+    static uint8_t msg[HISTORY_MSG_HEADER_SIZE + HISTORY_BLOCK_SIZE];
+    uint32_t seq = 0;
+    uint16_t index = 0;
+    while (common_history_ring_message(history, INT64_MIN, INT64_MAX, seq, index, now_ms, msg, &seq) > 0) {
+        index++;
+    }
+    common_history_final_message(index, now_ms, msg);
+    return index + 1;
+}
+
+
+
+//===============================
+//===== main ==================
+//===============================
+int main(int argc, char **argv) {
+    long reads = 2000000;
+    uint32_t seed = 1;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:v")) != -1) {
+        switch (opt) {
+            case 'n': reads = atol(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: memory-soak [-n READS] [-s SEED] [-v]\n");
+                return 2;
+        }
+    }
+    if (reads <= WARMUP_READS) {
+        fprintf(stderr, "READS must be larger than the warm-up (%d)\n", WARMUP_READS);
+        return 2;
+    }
+
+    pzem_port_log_level = verbose ? 1 : 0; // injected faults are logged as errors by the driver
+
+    static emu_bus_t bus;
+    bus.random = seed;
+    for (int i = 0; i < SENSORS; i++) {
+        bus.modules[i].addr = i + 1;
+    }
+
+    pzem_setup_t setup = { .transport = &emu_transport, .transport_ctx = &bus };
+
+    breaker_config_t breaker_cfg;
+    common_breaker_default_config(&breaker_cfg);
+    breaker_t breakers[SENSORS];
+    adaptive_config_t adaptive_cfg = { .min_interval_ms = 5000, .reads_per_day = 30000 };
+    adaptive_budget_t budget;
+    adaptive_state_t adaptive[SENSORS];
+    int64_t next_due[SENSORS];
+    common_adaptive_init(&adaptive_cfg, &budget, SENSORS * 86400000 / INTERVAL_MS, 0);
+    for (int i = 0; i < SENSORS; i++) {
+        common_breaker_init(&breakers[i], &breaker_cfg);
+        common_adaptive_state_init(&adaptive[i], INTERVAL_MS);
+        next_due[i] = 0;
+    }
+
+    const pzem_profile_t *profile = PzemProfile(PZEM_PROFILE_004T);
+    static pzem_plan_t plans[SENSORS];
+    static history_block_t history_blocks[SENSORS][HISTORY_BLOCKS];
+    static history_ring_t history[SENSORS];
+    static energy_counter_t energy[SENSORS];
+    for (int i = 0; i < SENSORS; i++) {
+        PzemCompilePlan(profile, PZ_ALL_FIELDS, i + 1, &plans[i]);
+        common_history_ring_init(&history[i], history_blocks[i], HISTORY_BLOCKS);
+        common_energy_init(&energy[i], profile->max_power_w, ENERGY_INTERVAL_MS);
+    }
+
+    unsigned long ok = 0, failed = 0, skipped = 0, alarm_writes = 0;
+    unsigned long history_msgs = 0, intervals = 0, payload_bytes = 0;
+    unsigned long allocations_at_warmup = 0;
+    size_t heap_at_warmup = 0;
+    int64_t now_ms = 0;
+
+    for (long n = 0; n < reads; n++) {
+        if (n == WARMUP_READS) {
+            heap_at_warmup = heap_in_use();
+            allocations_at_warmup = s_allocations;
+        }
+
+        // earliest due sensor, simulated time jumps there
+        int i = 0;
+        for (int k = 1; k < SENSORS; k++) {
+            if (next_due[k] < next_due[i]) {
+                i = k;
+            }
+        }
+        if (next_due[i] > now_ms) {
+            now_ms = next_due[i];
+        }
+        bus.now_ms = now_ms;
+        emu_update_values(&bus, now_ms);
+
+        if (!common_breaker_allow(&breakers[i], now_ms)) {
+            skipped++;
+            next_due[i] = breakers[i].next_attempt_ms;
+            continue;
+        }
+
+        setup.pzem_addr = i + 1;
+        uint16_t regs[PZ_REGISTER_COUNT];
+        _current_values_t values;
+        if (PzemPlanRead(&setup, &plans[i], regs)) {
+            ok++;
+            PzemPlanDecode(&plans[i], regs, &values);
+            common_breaker_success(&breakers[i], &breaker_cfg);
+            next_due[i] = now_ms + common_adaptive_next_interval(&adaptive_cfg, &adaptive[i], &budget,
+                                                                 INTERVAL_MS, values.power, now_ms);
+            payload_bytes += publish_sample(&history[i], &energy[i], profile, regs, &values, now_ms, &intervals);
+        } else {
+            failed++;
+            common_breaker_failure(&breakers[i], &breaker_cfg, now_ms, next_random(&bus));
+            next_due[i] = breakers[i].next_attempt_ms;
+        }
+
+        // history request of one sensor: all blocks and the final message
+        if (n % HISTORY_DUMP_READS == 0) {
+            history_msgs += dump_history(&history[n / HISTORY_DUMP_READS % SENSORS], now_ms);
+        }
+
+        // alarm threshold programming as done at startup and after module restarts
+        if (n % 1000 == 0) {
+            uint16_t threshold;
+            if (PzSetAlarmThreshold(&setup, 7000 + n % 100) && PzGetAlarmThreshold(&setup, &threshold)) {
+                alarm_writes++;
+            }
+        }
+    }
+
+    size_t heap_end = heap_in_use();
+    unsigned long allocations = s_allocations - allocations_at_warmup;
+
+    if (verbose) {
+        printf("simulated %.1f days: %lu ok, %lu failed, %lu skipped by breaker, %lu alarm writes\n",
+               now_ms / 86400000.0, ok, failed, skipped, alarm_writes);
+        printf("injected: %lu timeouts, %lu corrupted frames, adaptive budget denied %lu\n",
+               bus.timeouts, bus.corrupted, (unsigned long)budget.denied);
+        printf("published: %lu payload bytes, %lu billing intervals, %lu history messages\n",
+               payload_bytes, intervals, history_msgs);
+        for (int i = 0; i < SENSORS; i++) {
+            printf("sensor %d: breaker %s, %u trips, energy %llu Wh\n", i + 1, common_breaker_state_str(breakers[i].state),
+                   breakers[i].trips, (unsigned long long)energy[i].total_wh);
+        }
+    }
+    printf("heap in use after warm-up %zu bytes, at end %zu bytes, allocations %lu\n", heap_at_warmup, heap_end, allocations);
+
+    if (heap_end != heap_at_warmup || allocations != 0) {
+        printf("FAIL: heap use not constant\n");
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,389 @@
+// Commissioning tool for PZEM-004T / PZEM-016 / PZEM-017 modules via USB-TTL or USB-RS485 adapter.
+// Uses the same driver (frames, CRC, decoding) as the firmware, see firmware/common_components/pzem004tv3
+//
+// usage: pzem-cli [options] <command> [args...]
+//   scan [ADDRS]              probe addresses (default 1-247) and list responding modules
+//   read ADDRS                read and print all values of each module
+//   readdress OLD:NEW ...     change module address, verified by reading back from NEW
+//   reset ADDRS               reset energy counter, verified by reading back
+//   alarm ADDRS [WATTS]       print or set power alarm threshold
+//   getaddr                   read address of the single connected module (general address 0xF8)
+// ADDRS: comma separated list of addresses or ranges, e.g. "1,5,0xA5,10-20"
+//
+// options:
+//   -d DEVICE     serial port (default /dev/ttyUSB0)
+//   -t TYPE       device type (profile): 004T, 016 or 017 (8N2 framing), default 004T
+//   -r RETRIES    retries per module when a transaction fails (default 2)
+//   -g GAP_MS     gap between transactions, needed on a shared RS485 bus (default 50)
+//   -v            verbose driver log (repeat for more)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "pzem004tv3.h"
+#include "pzem_profile.h"
+#include "pzem_transport_linux.h"
+
+#define MAX_ADDRESSES 247
+
+
+typedef struct {
+    pzem_setup_t setup;
+    const pzem_profile_t *profile;
+    int retries;
+    int gap_ms;
+} cli_ctx_t;
+
+
+
+//===============================
+//===== helpers ===============
+//===============================
+static void usage(void) {
+    fprintf(stderr,
+        "usage: pzem-cli [-d DEVICE] [-t 004T|016|017] [-r RETRIES] [-g GAP_MS] [-v] <command> [args...]\n"
+        "  scan [ADDRS]              probe addresses (default 1-247)\n"
+        "  read ADDRS                read all values\n"
+        "  readdress OLD:NEW ...     change module address\n"
+        "  reset ADDRS               reset energy counter\n"
+        "  alarm ADDRS [WATTS]       print or set power alarm threshold\n"
+        "  getaddr                   read address of single connected module\n"
+        "ADDRS: comma separated list of addresses or ranges, e.g. \"1,5,0xA5,10-20\"\n");
+}
+
+
+// device type by name, e.g. "017" or "PZEM-017", NULL if unknown
+static const pzem_profile_t *parse_profile(const char *name) {
+    for (int id = 0; id < PZEM_PROFILE_COUNT; id++) {
+        const pzem_profile_t *profile = PzemProfile((pzem_profile_id_t)id);
+        const char *suffix = strchr(profile->name, '-');
+        if (strcasecmp(name, profile->name) == 0 || (suffix != NULL && strcasecmp(name, suffix + 1) == 0)) {
+            return profile;
+        }
+    }
+    fprintf(stderr, "unknown device type '%s' (valid: 004T, 016, 017)\n", name);
+    return NULL;
+}
+
+
+// parse address list like "1,5,0xA5,10-20" into addrs, returns count or -1 on error
+static int parse_addresses(const char *spec, uint8_t *addrs, int max) {
+    int count = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    for (char *tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        char *end;
+        long first = strtol(tok, &end, 0);
+        long last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 0);
+        }
+        if (*end != '\0' || first < 0x01 || last > 0xF7 || first > last) {
+            fprintf(stderr, "invalid address or range '%s' (valid: 1-247)\n", tok);
+            return -1;
+        }
+        for (long a = first; a <= last && count < max; a++) {
+            addrs[count++] = (uint8_t)a;
+        }
+    }
+    return count;
+}
+
+
+static void gap(cli_ctx_t *ctx) {
+    ctx->setup.transport->delay_ms(&ctx->setup, ctx->gap_ms);
+}
+
+
+// read all input registers of a module, with retries
+static bool read_module(cli_ctx_t *ctx, uint8_t addr, uint16_t *regs) {
+    ctx->setup.pzem_addr = addr;
+    for (int attempt = 0; attempt <= ctx->retries; attempt++) {
+        if (attempt > 0) {
+            gap(ctx);
+        }
+        if (PzemReadRegisters(&ctx->setup, CMD_RIR, RG_VOLTAGE, ctx->profile->input_regs, regs)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void print_values(const pzem_profile_t *profile, uint8_t addr, const uint16_t *regs) {
+    _current_values_t v;
+    PzemZeroValues(&v);
+    profile->decode_all(regs, &v);
+    if (PzemProfileFields(profile) & PZ_FIELD_BIT(PZ_FIELD_FREQUENCY)) {
+        printf("0x%02X (%3d): %6.1f V  %8.3f A  %8.1f W  %10.3f kWh  %4.1f Hz  PF %.2f  alarm %s\n",
+               addr, addr, v.voltage, v.current, v.power, v.energy, v.frequency, v.pf,
+               v.alarms ? "ON" : "off");
+    } else {
+        printf("0x%02X (%3d): %6.2f V  %8.2f A  %8.1f W  %10.3f kWh  DC  alarm %s\n",
+               addr, addr, v.voltage, v.current, v.power, v.energy, v.alarms ? "ON" : "off");
+    }
+}
+
+
+
+//==============================
+//===== commands ===============
+//==============================
+static int cmd_scan(cli_ctx_t *ctx, int argc, char **argv) {
+    uint8_t addrs[MAX_ADDRESSES];
+    int count = parse_addresses(argc > 0 ? argv[0] : "1-247", addrs, MAX_ADDRESSES);
+    if (count < 0) {
+        return 2;
+    }
+
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        uint16_t regs[PZ_REGISTER_COUNT] = {0};
+        ctx->setup.pzem_addr = addrs[i];
+        // a single register is enough to detect a module, keeps the scan fast
+        if (PzemReadRegisters(&ctx->setup, CMD_RIR, RG_VOLTAGE, 1, regs)) {
+            printf("found module at 0x%02X (%d), voltage %.2f V\n", addrs[i], addrs[i],
+                   PzemFieldValue(ctx->profile, regs, PZ_FIELD_VOLTAGE));
+            found++;
+        }
+        gap(ctx);
+    }
+    printf("%d of %d addresses responded\n", found, count);
+    return found > 0 ? 0 : 1;
+}
+
+
+static int cmd_read(cli_ctx_t *ctx, int argc, char **argv) {
+    if (argc < 1) {
+        usage();
+        return 2;
+    }
+    uint8_t addrs[MAX_ADDRESSES];
+    int count = parse_addresses(argv[0], addrs, MAX_ADDRESSES);
+    if (count < 0) {
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        uint16_t regs[PZ_REGISTER_COUNT];
+        if (read_module(ctx, addrs[i], regs)) {
+            print_values(ctx->profile, addrs[i], regs);
+        } else {
+            printf("0x%02X (%3d): no valid response\n", addrs[i], addrs[i]);
+            failed++;
+        }
+        gap(ctx);
+    }
+    return failed ? 1 : 0;
+}
+
+
+static int cmd_readdress(cli_ctx_t *ctx, int argc, char **argv) {
+    if (argc < 1) {
+        usage();
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < argc; i++) {
+        unsigned long old_addr, new_addr;
+        char *end;
+        old_addr = strtoul(argv[i], &end, 0);
+        if (*end != ':' || old_addr < 0x01 || old_addr > 0xF7) {
+            fprintf(stderr, "invalid pair '%s', expected OLD:NEW\n", argv[i]);
+            return 2;
+        }
+        new_addr = strtoul(end + 1, &end, 0);
+        if (*end != '\0') {
+            fprintf(stderr, "invalid pair '%s', expected OLD:NEW\n", argv[i]);
+            return 2;
+        }
+
+        ctx->setup.pzem_addr = (uint8_t)old_addr;
+        bool ok = false;
+        for (int attempt = 0; attempt <= ctx->retries && !ok; attempt++) {
+            ok = PzSetAddress(&ctx->setup, (uint8_t)new_addr);
+            gap(ctx);
+        }
+
+        uint16_t regs[PZ_REGISTER_COUNT];
+        if (ok && read_module(ctx, (uint8_t)new_addr, regs)) {
+            printf("0x%02X -> 0x%02X: ok\n", (unsigned)old_addr, (unsigned)new_addr);
+        } else {
+            printf("0x%02X -> 0x%02X: FAILED\n", (unsigned)old_addr, (unsigned)new_addr);
+            failed++;
+        }
+        gap(ctx);
+    }
+    return failed ? 1 : 0;
+}
+
+
+static int cmd_reset(cli_ctx_t *ctx, int argc, char **argv) {
+    if (argc < 1) {
+        usage();
+        return 2;
+    }
+    uint8_t addrs[MAX_ADDRESSES];
+    int count = parse_addresses(argv[0], addrs, MAX_ADDRESSES);
+    if (count < 0) {
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        uint16_t regs[PZ_REGISTER_COUNT];
+        ctx->setup.pzem_addr = addrs[i];
+        PzResetEnergy(&ctx->setup);
+        gap(ctx);
+
+        // the reset command has no reliable reply, verify energy register instead
+        if (read_module(ctx, addrs[i], regs) && PzemFieldRaw(ctx->profile, regs, PZ_FIELD_ENERGY) == 0) {
+            printf("0x%02X (%3d): energy reset\n", addrs[i], addrs[i]);
+        } else {
+            printf("0x%02X (%3d): reset FAILED\n", addrs[i], addrs[i]);
+            failed++;
+        }
+        gap(ctx);
+    }
+    return failed ? 1 : 0;
+}
+
+
+static int cmd_alarm(cli_ctx_t *ctx, int argc, char **argv) {
+    if (argc < 1) {
+        usage();
+        return 2;
+    }
+    if (!(ctx->profile->caps & PZ_CAP_POWER_ALARM)) {
+        fprintf(stderr, "the %s has no power alarm\n", ctx->profile->name);
+        return 2;
+    }
+    uint8_t addrs[MAX_ADDRESSES];
+    int count = parse_addresses(argv[0], addrs, MAX_ADDRESSES);
+    if (count < 0) {
+        return 2;
+    }
+    long watts = -1;
+    if (argc > 1) {
+        char *end;
+        watts = strtol(argv[1], &end, 0);
+        if (*end != '\0' || watts < 0 || watts > 0xFFFF) {
+            fprintf(stderr, "invalid threshold '%s' (valid: 0-65535 W)\n", argv[1]);
+            return 2;
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        ctx->setup.pzem_addr = addrs[i];
+        bool ok = true;
+        if (watts >= 0) {
+            ok = false;
+            for (int attempt = 0; attempt <= ctx->retries && !ok; attempt++) {
+                ok = PzSetAlarmThreshold(&ctx->setup, (uint16_t)watts);
+                gap(ctx);
+            }
+        }
+
+        uint16_t threshold;
+        if (ok && PzGetAlarmThreshold(&ctx->setup, &threshold) && (watts < 0 || threshold == watts)) {
+            printf("0x%02X (%3d): alarm threshold %u W\n", addrs[i], addrs[i], threshold);
+        } else {
+            printf("0x%02X (%3d): alarm threshold FAILED\n", addrs[i], addrs[i]);
+            failed++;
+        }
+        gap(ctx);
+    }
+    return failed ? 1 : 0;
+}
+
+
+static int cmd_getaddr(cli_ctx_t *ctx) {
+    ctx->setup.pzem_addr = PZ_DEFAULT_ADDRESS;
+    uint8_t addr = PzReadAddress(&ctx->setup);
+    if (addr == INVALID_ADDRESS) {
+        printf("no response (only one module may be connected for this command)\n");
+        return 1;
+    }
+    printf("module address: 0x%02X (%d)\n", addr, addr);
+    return 0;
+}
+
+
+
+//====================
+//===== main =========
+//====================
+int main(int argc, char **argv) {
+    const char *device = "/dev/ttyUSB0";
+    cli_ctx_t ctx = {
+        .setup = {
+            .transport = &pzem_linux_transport,
+            .rs485_dir_pin = GPIO_NUM_NC,
+        },
+        .profile = PzemProfile(PZEM_PROFILE_004T),
+        .retries = 2,
+        .gap_ms = 50,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:t:r:g:vh")) != -1) {
+        switch (opt) {
+            case 'd': device = optarg; break;
+            case 't':
+                ctx.profile = parse_profile(optarg);
+                if (ctx.profile == NULL) {
+                    return 2;
+                }
+                break;
+            case 'r': ctx.retries = atoi(optarg); break;
+            case 'g': ctx.gap_ms = atoi(optarg); break;
+            case 'v': pzem_port_log_level++; break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 2;
+    }
+
+    ctx.setup.stop_bits = ctx.profile->stop_bits;
+    int fd = PzLinuxOpen(device, ctx.profile->stop_bits);
+    if (fd < 0) {
+        return 1;
+    }
+    ctx.setup.transport_ctx = (void *)(intptr_t)fd;
+
+    const char *cmd = argv[optind];
+    int cmd_argc = argc - optind - 1;
+    char **cmd_argv = &argv[optind + 1];
+    int ret;
+
+    if (strcmp(cmd, "scan") == 0) {
+        ret = cmd_scan(&ctx, cmd_argc, cmd_argv);
+    } else if (strcmp(cmd, "read") == 0) {
+        ret = cmd_read(&ctx, cmd_argc, cmd_argv);
+    } else if (strcmp(cmd, "readdress") == 0) {
+        ret = cmd_readdress(&ctx, cmd_argc, cmd_argv);
+    } else if (strcmp(cmd, "reset") == 0) {
+        ret = cmd_reset(&ctx, cmd_argc, cmd_argv);
+    } else if (strcmp(cmd, "alarm") == 0) {
+        ret = cmd_alarm(&ctx, cmd_argc, cmd_argv);
+    } else if (strcmp(cmd, "getaddr") == 0) {
+        ret = cmd_getaddr(&ctx);
+    } else {
+        usage();
+        ret = 2;
+    }
+
+    PzLinuxClose(fd);
+    return ret;
+}
@@ -0,0 +1,509 @@
+// Deterministic replay of recorded bus traffic into the receive path of the PZEM driver.
+// The trace is a capture of the bus sniffer (tools/bus-capture, format in bus_capture.h): every
+// request on channel 0 (TX) is issued again through the driver (PzemReadRegisters, PzemSendCmd8)
+// on a replay transport, which delivers the bytes recorded on channel 1 (RX) with their original
+// timing on a virtual clock: a byte is available at the end of its stop bit, a read waits for
+// its bytes until the timeout of the driver like uart_read_bytes. Partial frames, late replies
+// and CRC errors of the field thus hit the driver exactly as they did on the node.
+//
+// Every transaction is classified from the trace alone (ok, no reply, partial, late, crc, header)
+// and the result of the driver has to match that classification (a reply that was complete,
+// valid and in time must be accepted, everything else rejected). With -o the results are saved,
+// with -e a later driver version is compared against them (result and virtual latency).
+//
+// usage: pzem-replay [options] CAPTURE
+//
+// options:
+//   -o FILE     write the results (one line per transaction) to FILE
+//   -e FILE     compare with results written by -o, differences are regressions
+//   -T US       tolerance of the virtual latency against -e (default 1000)
+//   -b N        benchmark: replay the trace N times and report the host time per transaction
+//   -q          no line per transaction, summary only
+//   -v          log of the driver
+//
+// Exit code 0 when every transaction passes and nothing regressed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include "bus_capture.h"
+#include "pzem004tv3.h"
+
+#define MAX_TRANSACTIONS  100000
+#define MAX_RX_BYTES      (4 * MAX_TRANSACTIONS)
+
+typedef enum { CLASS_OK, CLASS_NO_REPLY, CLASS_PARTIAL, CLASS_LATE, CLASS_CRC, CLASS_HEADER, CLASS_COUNT } reply_class_t;
+
+static const char *const CLASS_NAMES[CLASS_COUNT] = { "ok", "no_reply", "partial", "late", "crc", "header" };
+
+typedef struct {
+    int64_t t_us;                   // end of the stop bit: byte is in the UART
+    uint8_t value;
+} rx_byte_t;
+
+typedef struct {
+    uint8_t request[TX_BUF_SIZE];
+    int64_t start_us;               // start bit of the request
+    int64_t end_us;                 // end of the request
+    int rx_first;                   // bytes of channel 1 from the request start until the next request
+    int rx_count;
+    bool lost;                      // edges were lost around this transaction
+    reply_class_t expected;
+    int expected_len;
+} transaction_t;
+
+typedef struct {
+    uint32_t baud;
+    int64_t char_us;
+    transaction_t *tx;
+    int tx_count;
+    rx_byte_t *rx;
+    int rx_count;
+} trace_t;
+
+// replay transport state
+typedef struct {
+    const trace_t *trace;
+    const transaction_t *current;
+    int64_t now_us;                 // virtual clock
+    int pos;                        // next byte of the trace
+    bool request_matches;
+} replay_t;
+
+typedef struct {
+    int index;
+    bool ok;                        // result of the driver
+    int64_t latency_us;             // virtual time from the end of the request to the return
+} result_t;
+
+
+
+//=====================================================================
+// Trace
+
+static int cmp_rx(const void *a, const void *b) {
+    const rx_byte_t *x = a, *y = b;
+    return x->t_us < y->t_us ? -1 : x->t_us > y->t_us;
+}
+
+
+static int cmp_tx(const void *a, const void *b) {
+    const transaction_t *x = a, *y = b;
+    return x->start_us < y->start_us ? -1 : x->start_us > y->start_us;
+}
+
+
+static uint8_t *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(*len > 0 ? *len : 1);
+    if (!data || fread(data, 1, *len, f) != *len) {
+        fprintf(stderr, "%s: read failed\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+
+// reply length of a request, 0 = not replayed
+static int reply_len(const uint8_t *req) {
+    const uint16_t count = req[4] << 8 | req[5];
+    switch (req[1]) {
+        case CMD_RIR:
+        case CMD_RHR: return count > 0 && count <= PZ_MAX_READ_REGISTERS ? 5 + 2 * count : 0;
+        case CMD_WSR: return TX_BUF_SIZE;   // echo
+        default:      return 0;
+    }
+}
+
+
+// classification from the trace: what a correct driver has to do with this reply
+static void classify(const trace_t *trace, transaction_t *t) {
+    const uint8_t *req = t->request;
+    const int64_t deadline = t->end_us + PZ_READ_TIMEOUT * 1000LL;
+    const rx_byte_t *rx = &trace->rx[t->rx_first];
+    uint8_t reply[5 + 2 * PZ_MAX_READ_REGISTERS];
+
+    t->expected_len = reply_len(req);
+    int in_time = 0;
+    while (in_time < t->rx_count && rx[in_time].t_us <= deadline) {
+        in_time++;
+    }
+    if (t->rx_count == 0) {
+        t->expected = CLASS_NO_REPLY;
+    } else if (t->rx_count < t->expected_len) {
+        t->expected = CLASS_PARTIAL;
+    } else if (in_time < t->expected_len) {
+        t->expected = CLASS_LATE;
+    } else {
+        for (int i = 0; i < t->expected_len; i++) {
+            reply[i] = rx[i].value;
+        }
+        if (!PzemCheckCRC(reply, t->expected_len)) {
+            t->expected = CLASS_CRC;
+        } else if (req[1] == CMD_WSR ? memcmp(reply, req, TX_BUF_SIZE) != 0
+                   : reply[0] != req[0] || reply[1] != req[1] || reply[2] != t->expected_len - 5) {
+            t->expected = CLASS_HEADER;
+        } else {
+            t->expected = CLASS_OK;
+        }
+    }
+}
+
+
+static bool load_trace(const char *path, trace_t *trace) {
+    size_t len;
+    uint8_t *data = read_file(path, &len);
+    if (!data) {
+        return false;
+    }
+    uint32_t gap_us;
+    if (len < CAPTURE_HEADER_SIZE || !common_capture_parse_header(data, &trace->baud, &gap_us)) {
+        fprintf(stderr, "%s: not a bus capture\n", path);
+        free(data);
+        return false;
+    }
+    trace->char_us = 10 * 1000000LL / trace->baud;
+    trace->tx = calloc(MAX_TRANSACTIONS, sizeof(transaction_t));
+    trace->rx = calloc(MAX_RX_BYTES, sizeof(rx_byte_t));
+    static capture_frame_t frame;
+    int64_t lost_at[256];
+    int lost_count = 0;
+
+    size_t pos = CAPTURE_HEADER_SIZE;
+    while (pos < len) {
+        int type = common_capture_parse_record(&data[pos], len - pos, &frame);
+        if (type == 0) {
+            fprintf(stderr, "%s: corrupt record at offset %zu, rest ignored\n", path, pos);
+            break;
+        }
+        pos += common_capture_record_size(&data[pos]);
+        if (type == CAPTURE_RECORD_LOST) {
+            if (lost_count < (int)(sizeof(lost_at) / sizeof(lost_at[0]))) {
+                lost_at[lost_count++] = frame.start_us;
+            }
+            continue;
+        }
+        if (frame.channel == 0) {
+            // requests of the driver: complete and valid, everything else is not replayed
+            bool valid = frame.count == TX_BUF_SIZE && trace->tx_count < MAX_TRANSACTIONS;
+            for (int i = 0; valid && i < frame.count; i++) {
+                valid = !(frame.bytes[i].flags & CAPTURE_BYTE_FRAMING_ERROR);
+            }
+            transaction_t *t = &trace->tx[trace->tx_count];
+            for (int i = 0; valid && i < TX_BUF_SIZE; i++) {
+                t->request[i] = frame.bytes[i].value;
+            }
+            if (!valid || !PzemCheckCRC(t->request, TX_BUF_SIZE) || reply_len(t->request) == 0) {
+                continue;
+            }
+            t->start_us = frame.start_us;
+            t->end_us = frame.start_us + frame.bytes[frame.count - 1].offset_us + trace->char_us;
+            t->lost = (frame.flags & CAPTURE_FRAME_AFTER_LOSS) != 0;
+            trace->tx_count++;
+        } else {
+            for (int i = 0; i < frame.count && trace->rx_count < MAX_RX_BYTES; i++) {
+                rx_byte_t *b = &trace->rx[trace->rx_count++];
+                b->t_us = frame.start_us + frame.bytes[i].offset_us + trace->char_us;
+                b->value = frame.bytes[i].value;
+            }
+        }
+    }
+    free(data);
+
+    // records of both channels are written when complete, so they are not in time order
+    qsort(trace->tx, trace->tx_count, sizeof(transaction_t), cmp_tx);
+    qsort(trace->rx, trace->rx_count, sizeof(rx_byte_t), cmp_rx);
+    int r = 0;
+    for (int i = 0; i < trace->tx_count; i++) {
+        transaction_t *t = &trace->tx[i];
+        const int64_t next = i + 1 < trace->tx_count ? trace->tx[i + 1].start_us : INT64_MAX;
+        while (r < trace->rx_count && trace->rx[r].t_us < t->start_us) {
+            r++;
+        }
+        t->rx_first = r;
+        while (r < trace->rx_count && trace->rx[r].t_us < next) {
+            r++;
+        }
+        t->rx_count = r - t->rx_first;
+        for (int l = 0; l < lost_count; l++) {
+            t->lost |= lost_at[l] >= t->start_us && lost_at[l] < next;
+        }
+        classify(trace, t);
+    }
+    return true;
+}
+
+
+
+//=====================================================================
+// Replay transport
+
+static int replay_write(const pzem_setup_t *setup, const uint8_t *data, uint16_t len) {
+    replay_t *rp = setup->transport_ctx;
+    const transaction_t *t = rp->current;
+    rp->request_matches = len == TX_BUF_SIZE && memcmp(data, t->request, TX_BUF_SIZE) == 0;
+    rp->now_us = t->end_us;
+    return len;
+}
+
+
+static int replay_read(const pzem_setup_t *setup, uint8_t *data, uint16_t len, uint32_t timeout_ms) {
+    replay_t *rp = setup->transport_ctx;
+    const transaction_t *t = rp->current;
+    const int end = t->rx_first + t->rx_count;
+    const int64_t deadline = rp->now_us + (int64_t)timeout_ms * 1000;
+
+    // same semantics as uart_read_bytes: wait until len bytes or timeout
+    int n = 0;
+    while (n < len && rp->pos < end && rp->trace->rx[rp->pos].t_us <= deadline) {
+        data[n++] = rp->trace->rx[rp->pos++].value;
+    }
+    if (n == len) {
+        const int64_t arrived = rp->trace->rx[rp->pos - 1].t_us;
+        rp->now_us = arrived > rp->now_us ? arrived : rp->now_us;
+    } else {
+        rp->now_us = deadline;
+    }
+    return n;
+}
+
+
+static void replay_flush_input(const pzem_setup_t *setup) {
+    replay_t *rp = setup->transport_ctx;
+    const int end = rp->current->rx_first + rp->current->rx_count;
+    while (rp->pos < end && rp->trace->rx[rp->pos].t_us <= rp->now_us) {
+        rp->pos++;
+    }
+}
+
+
+static void replay_delay_ms(const pzem_setup_t *setup, uint32_t ms) {
+    replay_t *rp = setup->transport_ctx;
+    rp->now_us += (int64_t)ms * 1000;
+}
+
+
+static const pzem_transport_t replay_transport = {
+    .write       = replay_write,
+    .read        = replay_read,
+    .flush_input = replay_flush_input,
+    .delay_ms    = replay_delay_ms,
+};
+
+
+static bool replay_transaction(replay_t *rp, const transaction_t *t, int64_t *latency_us) {
+    pzem_setup_t setup = { .pzem_addr = t->request[0], .transport = &replay_transport, .transport_ctx = rp };
+    uint16_t regs[PZ_MAX_READ_REGISTERS];
+    const uint16_t reg = t->request[2] << 8 | t->request[3];
+    const uint16_t val = t->request[4] << 8 | t->request[5];
+
+    rp->current = t;
+    rp->pos = t->rx_first;
+    rp->now_us = t->start_us;       // the driver flushes before it writes
+    bool ok = t->request[1] == CMD_WSR ? PzemSendCmd8(&setup, CMD_WSR, reg, val, true, t->request[0])
+                                       : PzemReadRegisters(&setup, t->request[1], reg, val, regs);
+    *latency_us = rp->now_us - t->end_us;
+    return ok;
+}
+
+
+
+//=====================================================================
+// Reports
+
+static int load_results(const char *path, result_t *results, int max) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    int count = 0;
+    char line[128];
+    while (count < max && fgets(line, sizeof(line), f)) {
+        result_t *r = &results[count];
+        char result[16];
+        long long latency;
+        if (line[0] == '#' || sscanf(line, "%d %15s %lld", &r->index, result, &latency) != 3) {
+            continue;
+        }
+        r->ok = strcmp(result, "ok") == 0;
+        r->latency_us = latency;
+        count++;
+    }
+    fclose(f);
+    return count;
+}
+
+
+// results are written in index order, so the entry is at index or before (comment lines)
+static const result_t *find_result(const result_t *results, int count, int index) {
+    for (int k = index < count ? index : count - 1; k >= 0; k--) {
+        if (results[k].index == index) {
+            return &results[k];
+        }
+    }
+    return NULL;
+}
+
+
+static double elapsed_ns(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e9 + (b->tv_nsec - a->tv_nsec);
+}
+
+
+static void usage(void) {
+    fprintf(stderr, "usage: pzem-replay [-o FILE] [-e FILE] [-T US] [-b N] [-q] [-v] CAPTURE\n");
+}
+
+
+int main(int argc, char **argv) {
+    const char *out_path = NULL;
+    const char *expect_path = NULL;
+    long tolerance_us = 1000;
+    int bench = 0;
+    bool quiet = false;
+    pzem_port_log_level = 0;        // rejected replies are expected, the classification reports them
+
+    int c;
+    while ((c = getopt(argc, argv, "o:e:T:b:qv")) != -1) {
+        switch (c) {
+            case 'o': out_path = optarg; break;
+            case 'e': expect_path = optarg; break;
+            case 'T': tolerance_us = atol(optarg); break;
+            case 'b': bench = atoi(optarg); break;
+            case 'q': quiet = true; break;
+            case 'v': pzem_port_log_level = 4; break;
+            default: usage(); return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 2;
+    }
+
+    static trace_t trace;
+    if (!load_trace(argv[optind], &trace)) {
+        return 1;
+    }
+    printf("trace: %u baud, %d transactions, %d reply bytes\n", (unsigned)trace.baud, trace.tx_count, trace.rx_count);
+
+    result_t *results = calloc(trace.tx_count + 1, sizeof(result_t));
+    result_t *expected = NULL;
+    int expected_count = 0;
+    if (expect_path) {
+        expected = calloc(MAX_TRANSACTIONS, sizeof(result_t));
+        if ((expected_count = load_results(expect_path, expected, MAX_TRANSACTIONS)) < 0) {
+            return 1;
+        }
+    }
+    FILE *out = out_path ? fopen(out_path, "w") : NULL;
+    if (out_path && !out) {
+        perror(out_path);
+        return 1;
+    }
+    if (out) {
+        fprintf(out, "# index result latency_us class\n");
+    }
+
+    replay_t rp = { .trace = &trace };
+    int per_class[CLASS_COUNT] = {0};
+    int failed[CLASS_COUNT] = {0};
+    int mismatched_requests = 0, skipped = 0, regressions = 0;
+    int64_t lat_min[2] = { INT64_MAX, INT64_MAX }, lat_max[2] = {0}, lat_sum[2] = {0};
+    int lat_count[2] = {0};
+
+    for (int i = 0; i < trace.tx_count; i++) {
+        const transaction_t *t = &trace.tx[i];
+        result_t *r = &results[i];
+        r->index = i;
+        r->ok = replay_transaction(&rp, t, &r->latency_us);
+
+        const bool pass = r->ok == (t->expected == CLASS_OK);
+        const char *verdict = t->lost ? "SKIP" : pass ? "PASS" : "FAIL";
+        if (t->lost) {
+            skipped++;
+        } else {
+            per_class[t->expected]++;
+            failed[t->expected] += !pass;
+        }
+        mismatched_requests += !rp.request_matches;
+        lat_min[r->ok] = r->latency_us < lat_min[r->ok] ? r->latency_us : lat_min[r->ok];
+        lat_max[r->ok] = r->latency_us > lat_max[r->ok] ? r->latency_us : lat_max[r->ok];
+        lat_sum[r->ok] += r->latency_us;
+        lat_count[r->ok]++;
+
+        const char *regression = "";
+        if (expected) {
+            const result_t *e = find_result(expected, expected_count, i);
+            if (!e) {
+                regression = "  (not in expected results)";
+            } else if (e->ok != r->ok) {
+                regression = "  REGRESSION: result changed";
+            } else if (llabs(e->latency_us - r->latency_us) > tolerance_us) {
+                regression = "  REGRESSION: latency changed";
+            }
+            regressions += regression[0] && e;
+        }
+        if (out) {
+            fprintf(out, "%d %s %lld %s\n", i, r->ok ? "ok" : "fail", (long long)r->latency_us, CLASS_NAMES[t->expected]);
+        }
+        if (!quiet || (!pass && !t->lost) || regression[0]) {
+            printf("%5d %12.6f addr %3u fc 0x%02X  %-8s driver %-4s %7lld us  %s%s%s\n", i,
+                   (t->start_us - trace.tx[0].start_us) / 1e6, t->request[0], t->request[1], CLASS_NAMES[t->expected],
+                   r->ok ? "ok" : "fail", (long long)r->latency_us, verdict, rp.request_matches ? "" : "  request differs", regression);
+        }
+    }
+    if (out) {
+        fclose(out);
+    }
+
+    printf("\nclass      count  failed\n");
+    int total_failed = 0;
+    for (int k = 0; k < CLASS_COUNT; k++) {
+        printf("%-10s %5d  %6d\n", CLASS_NAMES[k], per_class[k], failed[k]);
+        total_failed += failed[k];
+    }
+    for (int ok = 1; ok >= 0; ok--) {
+        if (lat_count[ok] > 0) {
+            printf("driver %-4s %5d  virtual latency min %lld us, avg %lld us, max %lld us\n", ok ? "ok" : "fail", lat_count[ok],
+                   (long long)lat_min[ok], (long long)(lat_sum[ok] / lat_count[ok]), (long long)lat_max[ok]);
+        }
+    }
+    if (skipped || mismatched_requests) {
+        printf("skipped (edges lost): %d, requests differing from the trace: %d\n", skipped, mismatched_requests);
+    }
+    if (expected) {
+        printf("regressions against %s: %d\n", expect_path, regressions);
+    }
+
+    if (bench > 0 && trace.tx_count > 0) {
+        struct timespec a, b;
+        int64_t latency;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        for (int n = 0; n < bench; n++) {
+            for (int i = 0; i < trace.tx_count; i++) {
+                replay_transaction(&rp, &trace.tx[i], &latency);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        printf("benchmark: %d x %d transactions, %.0f ns per transaction\n", bench, trace.tx_count,
+               elapsed_ns(&a, &b) / ((double)bench * trace.tx_count));
+    }
+
+    const bool passed = total_failed == 0 && regressions == 0;
+    printf("%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}